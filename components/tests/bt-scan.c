@@ -1,8 +1,18 @@
 
 
+#include "bt_devtab.h"
+#include "bt_eir.h"
+#include "bt_gap_queue.h"
+#include "bt_scan.h"
+#include "bt_sink.h"
+#include "esp_timer.h"
+#include "heap_track.h"
+#include "metrics.h"
 #include "test.h"
 
-#define MAX_BT_DEVICE 10
+#include <pthread.h>
+
+#define MAX_BT_DEVICE BT_DEVTAB_MAX_DEVICES
 
 int bt_init() {
     esp_err_t err;
@@ -58,126 +68,138 @@ int bt_uninit() {
     return 0;
 }
 
-typedef struct _bt_device_t {
-    esp_bd_addr_t bda;
-    char *bda_str;
-    char *name;
-    int32_t rssi;
-    uint32_t cod;
-} bt_device_t;
-
 typedef struct _bt_scan_ctx_t {
     rc_event stop_event;
-    int stoped;
-    map_t kvdev;
-    bt_device_t devices[MAX_BT_DEVICE];
-    int count;
-    rc_buf_t buff;
-    char pad[1024];
-
+    int stoped;  // reset before every inquiry
+    bt_devtab_t devices;  // under _scan_lock
+
+    // results are handled by gap_worker, off the Bluedroid task
+    bt_gap_queue_t queue;
+    rc_event work_event;
+    int stop_pending;
+    int quit;
+    int exited;
 } bt_scan_ctx_t;
 
 bt_scan_ctx_t *_scan_ctx;
-
-bt_device_t *on_found_device(bt_scan_ctx_t *ctx, esp_bt_gap_cb_param_t *param) {
-    char *p = (char *)param->disc_res.bda;
-    char *uuid = rc_buf_tail_ptr(&ctx->buff);
-    int n = snprintf(uuid, RC_BUF_LEFT_SIZE(&ctx->buff),
-                     "%02x:%02x:%02x:%02x:%02x:%02x", p[0], p[1], p[2], p[3],
-                     p[4], p[5]);
-
-    if (n < 0 || n >= RC_BUF_LEFT_SIZE(&ctx->buff)) {
-        LOGI(BT_TAG, "buffer is too small");
-        return NULL;
+// guards _scan_ctx->devices and the lifetime of _scan_ctx for snapshots
+static pthread_mutex_t _scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bt_devtab_snapshot_t *bt_scan_snapshot(void) {
+    bt_devtab_snapshot_t *snap = NULL;
+    pthread_mutex_lock(&_scan_lock);
+    if (_scan_ctx != NULL) {
+        snap = bt_devtab_snapshot(&_scan_ctx->devices);
     }
+    pthread_mutex_unlock(&_scan_lock);
+    return snap;
+}
 
-    LOGI(BT_TAG, "Device found: %s", uuid);
-
-    any_t dev = NULL;
-    bt_device_t *device = NULL;
-    if (hashmap_get(ctx->kvdev, uuid, &dev) == MAP_OK) {
-        LOGI(BT_TAG, "device(%s) exists", uuid);
-        device = (bt_device_t *)dev;
-    } else if (ctx->count >= MAX_BT_DEVICE) {
+bt_device_t *on_found_device(bt_scan_ctx_t *ctx, bt_gap_disc_t *disc) {
+    int created = 0;
+    bt_device_t *device = bt_devtab_upsert(&ctx->devices, disc->bda, &created);
+    if (device == NULL) {
         LOGI(BT_TAG, "device count is too many");
         return NULL;
+    } else if (created) {
+        LOGI(BT_TAG, "Device found: %s", device->bda_str);
     } else {
-        ctx->buff.length += n + 1;
-        device = &ctx->devices[ctx->count++];
-        device->bda_str = uuid;
-        device->name = "";
-        device->rssi = -129; /* invalid value */
-        memcpy(device->bda, param->disc_res.bda, ESP_BD_ADDR_LEN);
-        hashmap_put(ctx->kvdev, uuid, device);
+        LOGI(BT_TAG, "device(%s) exists", device->bda_str);
     }
 
-    for (int i = 0; i < param->disc_res.num_prop; i++) {
-        esp_bt_gap_dev_prop_t *p = param->disc_res.prop + i;
-        switch (p->type) {
-        case ESP_BT_GAP_DEV_PROP_COD:
-            device->cod = *(uint32_t *)(p->val);
-            LOGI(BT_TAG, "--Class of Device: 0x%x", device->cod);
-            break;
-        case ESP_BT_GAP_DEV_PROP_RSSI:
-            device->rssi = *(int8_t *)(p->val);
-            LOGI(BT_TAG, "--RSSI: %d", device->rssi);
-            break;
-        case ESP_BT_GAP_DEV_PROP_BDNAME: {
-            if (device->name == NULL || strlen(device->name) == 0) {
-                char x = '\0';
-                device->name = rc_buf_tail_ptr(&ctx->buff);
-                rc_buf_append(&ctx->buff, (char *)p->val, p->len);
-                rc_buf_append(&ctx->buff, &x, 1);
-                LOGI(BT_TAG, "--Name: %s", device->name);
-            }
-            break;
+    if (disc->flags & BT_GAP_DISC_COD) {
+        device->cod = disc->cod;
+        LOGI(BT_TAG, "--Class of Device: 0x%x", device->cod);
+    }
+    if (disc->flags & BT_GAP_DISC_RSSI) {
+        device->rssi = disc->rssi;
+        bt_sink_observe_rssi(device, disc->rssi);
+        LOGI(BT_TAG, "--RSSI: %d", device->rssi);
+    }
+    if ((disc->flags & BT_GAP_DISC_NAME) && device->name[0] == '\0') {
+        bt_devtab_set_name(&ctx->devices, device, disc->name, disc->name_len,
+                           bt_eir_name_hash(disc->name, disc->name_len));
+        LOGI(BT_TAG, "--Name: %s", device->name);
+    }
+    if (disc->flags & BT_GAP_DISC_EIR) {
+        // one pass over the copied EIR, the name is only stored if it changed
+        bt_eir_t eir;
+        device->eir = bt_eir_parse(disc->eir, disc->eir_len, &eir);
+        if (eir.present & BT_EIR_HAS_TX_POWER) {
+            device->tx_power = eir.tx_power;
         }
-        case ESP_BT_GAP_DEV_PROP_EIR: {
-            if (p->val == NULL) break;
-            uint8_t *rmt_bdname = NULL;
-            uint8_t rmt_bdname_len = 0;
-
-            rmt_bdname = esp_bt_gap_resolve_eir_data(
-                p->val, ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME, &rmt_bdname_len);
-            if (!rmt_bdname) {
-                rmt_bdname = esp_bt_gap_resolve_eir_data(
-                    p->val, ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME, &rmt_bdname_len);
-            }
+        if ((eir.present & BT_EIR_HAS_NAME) &&
+            eir.name_hash != device->name_hash) {
+            bt_devtab_set_name(&ctx->devices, device, eir.name, eir.name_len,
+                               eir.name_hash);
+            LOGI(BT_TAG, "--Name: %s", device->name);
+        }
+    }
 
-            if (rmt_bdname == NULL) break;
+    return device;
+}
 
-            char x = '\0';
-            device->name = rc_buf_tail_ptr(&ctx->buff);
-            rc_buf_append(&ctx->buff, (char *)rmt_bdname, rmt_bdname_len);
-            rc_buf_append(&ctx->buff, &x, 1);
-            LOGI(BT_TAG, "--Name: %s", device->name);
-            break;
+void *gap_worker(void *params) {
+    bt_scan_ctx_t *ctx = (bt_scan_ctx_t *)params;
+    metrics_register_task();
+
+    while (!__atomic_load_n(&ctx->quit, __ATOMIC_ACQUIRE)) {
+        // read the flag first, results queued before the stop are drained
+        int stop = __atomic_exchange_n(&ctx->stop_pending, 0, __ATOMIC_ACQ_REL);
+
+        pthread_mutex_lock(&_scan_lock);
+        int expired = bt_devtab_expire(&ctx->devices,
+                                       esp_timer_get_time() / 1000000);
+        if (expired > 0) {
+            LOGI(BT_TAG, "%d devices aged out, %d left", expired,
+                 ctx->devices.count);
         }
-        default: break;
+
+        bt_gap_disc_t *disc;
+        while ((disc = bt_gap_queue_peek(&ctx->queue)) != NULL) {
+            bt_device_t *device = on_found_device(ctx, disc);
+            bt_gap_queue_pop(&ctx->queue);
+            // the scan window runs out unless a known sink is good enough
+            if (device != NULL && bt_sink_ends_scan(device)) {
+                LOGI(BT_TAG, "found good known sink: (%s) %s", device->name,
+                     device->bda_str);
+                esp_bt_gap_cancel_discovery();
+            }
+        }
+        pthread_mutex_unlock(&_scan_lock);
+
+        if (stop) {
+            ctx->stoped = 1;
+            rc_event_signal(ctx->stop_event);
         }
+        rc_event_wait(ctx->work_event, 1000);
     }
 
-    return device;
+    metrics_unregister_task();
+    __atomic_store_n(&ctx->exited, 1, __ATOMIC_RELEASE);
+    rc_event_signal(ctx->stop_event);  // bt_scan_test waits for the exit
+    return NULL;
 }
 
 void gap_callback(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param) {
     switch (event) {
     case ESP_BT_GAP_DISC_RES_EVT: {
-        LOGI(BT_TAG, "ESP_BT_GAP_DISC_RES_EVT");
-        bt_device_t *device = on_found_device(_scan_ctx, param);
-        if (device != NULL &&
-            esp_bt_gap_get_cod_srvc(device->cod) & ESP_BT_COD_SRVC_RENDERING) {
-            LOGI(BT_TAG, "found target device: (%s) %s", device->name,
-                 device->bda_str);
-            esp_bt_gap_cancel_discovery();
+        // copy and leave, the radio task must not wait for our processing
+        int64_t begin = esp_timer_get_time();
+        if (bt_gap_queue_push(&_scan_ctx->queue, param->disc_res.bda,
+                              param->disc_res.num_prop,
+                              param->disc_res.prop) == 0) {
+            rc_event_signal(_scan_ctx->work_event);
         }
+        metrics_observe(METRIC_BT_GAP_CALLBACK_US,
+                        esp_timer_get_time() - begin);
         break;
     }
     case ESP_BT_GAP_DISC_STATE_CHANGED_EVT: {
         if (param->disc_st_chg.state == ESP_BT_GAP_DISCOVERY_STOPPED) {
             LOGI(BT_TAG, "Device discovery stopped.");
-            _scan_ctx->stoped = 1;
-            rc_event_signal(_scan_ctx->stop_event);
+            __atomic_store_n(&_scan_ctx->stop_pending, 1, __ATOMIC_RELEASE);
+            rc_event_signal(_scan_ctx->work_event);
         } else if (param->disc_st_chg.state == ESP_BT_GAP_DISCOVERY_STARTED) {
             LOGI(BT_TAG, "Discovery started.");
         }
@@ -231,66 +253,118 @@ void bt_scan_test(void *pvParameters) {
     }
 
     LOGI(BT_TAG, "bt init success");
-    _scan_ctx = (bt_scan_ctx_t *)rc_malloc(sizeof(bt_scan_ctx_t));
-    memset(_scan_ctx, 0, sizeof(bt_scan_ctx_t));
-    _scan_ctx->stop_event = rc_event_init();
-    _scan_ctx->buff = rc_buf_stack();
-    _scan_ctx->buff.total = sizeof(_scan_ctx->pad);
-    _scan_ctx->kvdev = hashmap_new();
+    bt_sink_load();
+    bt_scan_ctx_t *ctx =
+        (bt_scan_ctx_t *)HEAP_MALLOC(BT_SCAN, sizeof(bt_scan_ctx_t));
+    memset(ctx, 0, sizeof(bt_scan_ctx_t));
+    if (bt_devtab_init(&ctx->devices, MAX_BT_DEVICE) != 0) {
+        HEAP_FREE(ctx);
+        return;
+    }
+    bt_devtab_set_ttl(&ctx->devices, BT_SCAN_DEVICE_TTL_S);
+    ctx->stop_event = rc_event_init();
+    bt_gap_queue_init(&ctx->queue);
+    bt_gap_queue_register_metrics(&ctx->queue);
+    ctx->work_event = rc_event_init();
+
+    pthread_mutex_lock(&_scan_lock);
+    _scan_ctx = ctx;
+    pthread_mutex_unlock(&_scan_lock);
+    rc_thread_create(gap_worker, _scan_ctx, NULL);
 
     esp_bt_gap_register_callback(gap_callback);
 
     ESP_ERROR_CHECK(esp_bt_gap_set_scan_mode(ESP_BT_CONNECTABLE,
                                              ESP_BT_GENERAL_DISCOVERABLE));
 
-    while (true) {
+    extern int init_bt_palyer();
+    extern int connect_to_bt_player(esp_bd_addr_t bda);
+    init_bt_palyer();
+
+    // page the sinks that worked before, an inquiry is the fallback
+    int connected = 0;
+    esp_bd_addr_t recent[BT_SINK_MAX_RECENT];
+    int recent_count = bt_sink_recent(recent, BT_SINK_MAX_RECENT);
+    bt_sink_set_path(BT_SINK_PATH_KNOWN);
+    for (int i = 0; i < recent_count && !connected; ++i) {
+        LOGI(BT_TAG, "try known bt device %02x:%02x:%02x:%02x:%02x:%02x",
+             recent[i][0], recent[i][1], recent[i][2], recent[i][3],
+             recent[i][4], recent[i][5]);
+        connected = connect_to_bt_player(recent[i]) == 0;
+    }
+    bt_sink_set_path(BT_SINK_PATH_INQUIRY);
+
+    // devices are not cleared between inquiries, they age out instead
+    int window = BT_SINK_SCAN_WINDOW;
+    while (!connected) {
+        int64_t begin = esp_timer_get_time();
+        _scan_ctx->stoped = 0;
         ESP_ERROR_CHECK(esp_bt_gap_start_discovery(
-            ESP_BT_INQ_MODE_GENERAL_INQUIRY, 0x20, 0));
+            ESP_BT_INQ_MODE_GENERAL_INQUIRY, window, 0));
 
+        // gap_worker reports the stop after the last result is handled
         while (!_scan_ctx->stoped) {
             rc_event_wait(_scan_ctx->stop_event, 10 * 1000);
         }
 
-        rc_sleep(3 * 1000);
+        bt_devtab_snapshot_t *snap = bt_scan_snapshot();
+        if (snap == NULL) {
+            rc_sleep(1000);
+            continue;
+        }
 
-        bt_device_t *player_device = NULL;
         LOGI(BT_TAG, "Found BT Devices....");
-        for (int i = 0; i < _scan_ctx->count; ++i) {
-            bt_device_t *device = &_scan_ctx->devices[i];
-            LOGI(BT_TAG, "BT Device(%s), name(%s), rssi(%d), type(0x%x)",
-                 device->bda_str, device->name, device->rssi, device->cod);
+        for (int i = 0; i < snap->count; ++i) {
+            bt_device_t *device = &snap->devices[i];
+            LOGI(BT_TAG,
+                 "BT Device(%s), name(%s), rssi(%d), type(0x%x), seen %us ago",
+                 device->bda_str, device->name, device->rssi, device->cod,
+                 snap->now - device->last_seen);
             if (esp_bt_gap_is_valid_cod(device->cod)/* ==
                 ESP_BT_COD_MAJOR_DEV_AV*/) {
                 LOGI(BT_TAG, "found ESP_BT_COD_MAJOR_DEV_AV device");
                 esp_bt_gap_get_remote_services(device->bda);
             }
-
-            if (esp_bt_gap_get_cod_srvc(device->cod) &
-                ESP_BT_COD_SRVC_RENDERING) {
-                LOGI(BT_TAG, "found ESP_BT_COD_SRVC_RENDERING device");
-                player_device = device;
-                break;
-            }
         }
 
-        extern int init_bt_palyer();
-        extern int connect_to_bt_player(esp_bd_addr_t bda);
+        const bt_device_t *player_device = bt_sink_pick(snap);
         if (player_device != NULL) {
-            init_bt_palyer();
+            esp_bd_addr_t bda;
+            memcpy(bda, player_device->bda, ESP_BD_ADDR_LEN);
             LOGI(BT_TAG, "try to connect bt device %s", player_device->bda_str);
-            connect_to_bt_player(player_device->bda);
-            break;
+            connected = connect_to_bt_player(bda) == 0;
         }
+        bt_devtab_snapshot_free(snap);
 
-        rc_sleep(10 * 1000);
+        if (!connected) {
+            int64_t idle_ms = BT_SCAN_IDLE_PERIOD_MS -
+                              (esp_timer_get_time() - begin) / 1000;
+            if (idle_ms > 0) {
+                rc_sleep(idle_ms);
+            }
+            window = BT_SCAN_IDLE_WINDOW;
+        }
     }
 
     for (int i = 0; i < 100; ++i) {
         rc_sleep(10 * 1000);
     }
 
-    hashmap_free(_scan_ctx->kvdev);
-    rc_free(_scan_ctx);
+    esp_bt_gap_register_callback(NULL);
+    __atomic_store_n(&_scan_ctx->quit, 1, __ATOMIC_RELEASE);
+    rc_event_signal(_scan_ctx->work_event);
+    while (!__atomic_load_n(&_scan_ctx->exited, __ATOMIC_ACQUIRE)) {
+        rc_event_wait(_scan_ctx->stop_event, 1000);
+    }
+
+    pthread_mutex_lock(&_scan_lock);
+    ctx = _scan_ctx;
+    _scan_ctx = NULL;
+    pthread_mutex_unlock(&_scan_lock);
+
+    rc_event_uninit(ctx->work_event);
+    bt_devtab_uninit(&ctx->devices);
+    HEAP_FREE(ctx);
     LOGI(BT_TAG, "before call bt_uninit");
     bt_uninit();
 }
\ No newline at end of file
@@ -0,0 +1,386 @@
+#include "bt_devtab.h"
+
+#include "heap_track.h"
+#include "quark/quark.h"
+#include "test.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static inline uint64_t bt_devtab_key(const uint8_t *bda) {
+    return ((uint64_t)bda[0] << 40) | ((uint64_t)bda[1] << 32) |
+           ((uint64_t)bda[2] << 24) | ((uint64_t)bda[3] << 16) |
+           ((uint64_t)bda[4] << 8) | bda[5];
+}
+
+// fibonacci hashing, the top bits are the best mixed
+static inline uint32_t bt_devtab_hash(uint64_t key, int bits) {
+    return (key * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+}
+
+static int bt_devtab_alloc_slots(bt_devtab_t *tab, int bits) {
+    uint16_t *slots =
+        (uint16_t *)HEAP_MALLOC(BT_DEVTAB, sizeof(uint16_t) << bits);
+    if (slots == NULL) {
+        return -1;
+    }
+    memset(slots, 0, sizeof(uint16_t) << bits);
+
+    uint32_t mask = (1u << bits) - 1;
+    for (int i = 0; i < tab->count; ++i) {
+        uint32_t s = bt_devtab_hash(tab->keys[i], bits);
+        while (slots[s] != 0) {
+            s = (s + 1) & mask;
+        }
+        slots[s] = i + 1;
+    }
+
+    if (tab->slots) {
+        HEAP_FREE(tab->slots);
+    }
+    tab->slots = slots;
+    tab->slot_bits = bits;
+    return 0;
+}
+
+int bt_devtab_init(bt_devtab_t *tab, int max_devices) {
+    memset(tab, 0, sizeof(bt_devtab_t));
+    if (max_devices > BT_DEVTAB_MAX_DEVICES) {
+        max_devices = BT_DEVTAB_MAX_DEVICES;
+    }
+    tab->max_devices = max_devices;
+
+    tab->keys =
+        (uint64_t *)HEAP_MALLOC(BT_DEVTAB, sizeof(uint64_t) * max_devices);
+    tab->wheel_next =
+        (uint16_t *)HEAP_MALLOC(BT_DEVTAB, sizeof(uint16_t) * max_devices);
+    tab->wheel_prev =
+        (uint16_t *)HEAP_MALLOC(BT_DEVTAB, sizeof(uint16_t) * max_devices);
+    tab->names = (char *)HEAP_MALLOC(BT_DEVTAB, BT_DEVTAB_NAME_ARENA);
+    int bits = 0;
+    while ((1 << bits) < BT_DEVTAB_MIN_SLOTS) {
+        ++bits;
+    }
+    if (tab->keys == NULL || tab->wheel_next == NULL ||
+        tab->wheel_prev == NULL || tab->names == NULL ||
+        bt_devtab_alloc_slots(tab, bits) != 0) {
+        LOGW(BT_TAG, "alloc device table failed");
+        bt_devtab_uninit(tab);
+        return -1;
+    }
+
+    // offset 0 is the shared empty name
+    tab->names[0] = '\0';
+    tab->names_used = 1;
+    return 0;
+}
+
+void bt_devtab_uninit(bt_devtab_t *tab) {
+    for (int i = 0; i < BT_DEVTAB_MAX_DEVICES / BT_DEVTAB_CHUNK; ++i) {
+        if (tab->chunks[i]) {
+            HEAP_FREE(tab->chunks[i]);
+        }
+    }
+    if (tab->keys) HEAP_FREE(tab->keys);
+    if (tab->wheel_next) HEAP_FREE(tab->wheel_next);
+    if (tab->wheel_prev) HEAP_FREE(tab->wheel_prev);
+    if (tab->slots) HEAP_FREE(tab->slots);
+    if (tab->names) HEAP_FREE(tab->names);
+    memset(tab, 0, sizeof(bt_devtab_t));
+}
+
+void bt_devtab_clear(bt_devtab_t *tab) {
+    tab->count = 0;
+    tab->names_used = 1;
+    tab->names_dead = 0;
+    memset(tab->slots, 0, sizeof(uint16_t) << tab->slot_bits);
+    memset(tab->wheel, 0, sizeof(tab->wheel));
+}
+
+void bt_devtab_set_ttl(bt_devtab_t *tab, uint32_t ttl) {
+    if (ttl >= BT_DEVTAB_WHEEL_SLOTS) {
+        ttl = BT_DEVTAB_WHEEL_SLOTS - 1;
+    }
+    tab->ttl = ttl;
+}
+
+static inline uint16_t *bt_devtab_wheel_head(bt_devtab_t *tab, int index) {
+    uint32_t expires = bt_devtab_at(tab, index)->last_seen + tab->ttl;
+    return &tab->wheel[expires & (BT_DEVTAB_WHEEL_SLOTS - 1)];
+}
+
+static void bt_devtab_link(bt_devtab_t *tab, int index) {
+    uint16_t *head = bt_devtab_wheel_head(tab, index);
+    tab->wheel_prev[index] = 0;
+    tab->wheel_next[index] = *head;
+    if (*head != 0) {
+        tab->wheel_prev[*head - 1] = index + 1;
+    }
+    *head = index + 1;
+}
+
+static void bt_devtab_unlink(bt_devtab_t *tab, int index) {
+    uint16_t prev = tab->wheel_prev[index];
+    uint16_t next = tab->wheel_next[index];
+    if (prev != 0) {
+        tab->wheel_next[prev - 1] = next;
+    } else {
+        *bt_devtab_wheel_head(tab, index) = next;
+    }
+    if (next != 0) {
+        tab->wheel_prev[next - 1] = prev;
+    }
+}
+
+static int bt_devtab_lookup(bt_devtab_t *tab, uint64_t key, uint32_t *slot) {
+    uint32_t mask = (1u << tab->slot_bits) - 1;
+    uint32_t s = bt_devtab_hash(key, tab->slot_bits);
+    while (tab->slots[s] != 0) {
+        ++tab->probes;
+        if (tab->keys[tab->slots[s] - 1] == key) {
+            *slot = s;
+            return tab->slots[s] - 1;
+        }
+        s = (s + 1) & mask;
+    }
+    *slot = s;
+    return -1;
+}
+
+// backward shift deletion, keeps every probe chain unbroken
+static void bt_devtab_erase_slot(bt_devtab_t *tab, uint32_t hole) {
+    uint32_t mask = (1u << tab->slot_bits) - 1;
+    uint32_t s = hole;
+    tab->slots[hole] = 0;
+    while (tab->slots[s = (s + 1) & mask] != 0) {
+        uint32_t home = bt_devtab_hash(tab->keys[tab->slots[s] - 1],
+                                       tab->slot_bits);
+        // an entry may fill the hole unless its home lies in (hole, s]
+        if (((s - home) & mask) >= ((s - hole) & mask)) {
+            tab->slots[hole] = tab->slots[s];
+            tab->slots[s] = 0;
+            hole = s;
+        }
+    }
+}
+
+static void bt_devtab_remove(bt_devtab_t *tab, int index) {
+    bt_device_t *device = bt_devtab_at(tab, index);
+    if (device->name[0] != '\0') {
+        tab->names_dead += strlen(device->name) + 1;
+    }
+
+    uint32_t slot;
+    bt_devtab_unlink(tab, index);
+    bt_devtab_lookup(tab, tab->keys[index], &slot);
+    bt_devtab_erase_slot(tab, slot);
+
+    int last = tab->count - 1;
+    if (index != last) {
+        bt_devtab_unlink(tab, last);
+        bt_devtab_lookup(tab, tab->keys[last], &slot);
+        tab->slots[slot] = index + 1;
+        tab->keys[index] = tab->keys[last];
+        *device = *bt_devtab_at(tab, last);
+        bt_devtab_link(tab, index);
+    }
+    --tab->count;
+}
+
+int bt_devtab_expire(bt_devtab_t *tab, uint32_t now) {
+    uint32_t steps = now - tab->now;
+    if (tab->ttl == 0 || tab->count == 0) {
+        tab->now = now;
+        return 0;
+    }
+    if (steps > BT_DEVTAB_WHEEL_SLOTS) {
+        steps = BT_DEVTAB_WHEEL_SLOTS;
+    }
+
+    int removed = 0;
+    for (uint32_t tick = now - steps + 1; steps > 0; ++tick, --steps) {
+        uint16_t *head = &tab->wheel[tick & (BT_DEVTAB_WHEEL_SLOTS - 1)];
+        int index = *head - 1;
+        while (index >= 0) {
+            bt_device_t *device = bt_devtab_at(tab, index);
+            if ((int32_t)(device->last_seen + tab->ttl - now) > 0) {
+                index = tab->wheel_next[index] - 1;  // due in a later round
+                continue;
+            }
+            // removal moves the last entry, start the slot over
+            bt_devtab_remove(tab, index);
+            ++removed;
+            index = *head - 1;
+        }
+    }
+
+    tab->now = now;
+    tab->expired += removed;
+    return removed;
+}
+
+bt_device_t *bt_devtab_find(bt_devtab_t *tab, const uint8_t *bda) {
+    uint32_t slot;
+    int index = bt_devtab_lookup(tab, bt_devtab_key(bda), &slot);
+    return index < 0 ? NULL : bt_devtab_at(tab, index);
+}
+
+bt_device_t *bt_devtab_upsert(bt_devtab_t *tab, const uint8_t *bda,
+                              int *created) {
+    uint64_t key = bt_devtab_key(bda);
+    uint32_t slot;
+    int index = bt_devtab_lookup(tab, key, &slot);
+    *created = 0;
+    if (index >= 0) {
+        bt_device_t *device = bt_devtab_at(tab, index);
+        if (device->last_seen != tab->now) {
+            bt_devtab_unlink(tab, index);
+            device->last_seen = tab->now;
+            bt_devtab_link(tab, index);
+        }
+        return device;
+    }
+
+    if (tab->count >= tab->max_devices) {
+        ++tab->rejected;
+        return NULL;
+    }
+
+    // keep the load factor at or below one half
+    if ((tab->count + 1) * 2 > (1 << tab->slot_bits)) {
+        if (bt_devtab_alloc_slots(tab, tab->slot_bits + 1) != 0) {
+            LOGW(BT_TAG, "grow device index failed");
+            ++tab->rejected;
+            return NULL;
+        }
+        bt_devtab_lookup(tab, key, &slot);
+    }
+
+    index = tab->count;
+    bt_device_t **chunk = &tab->chunks[index / BT_DEVTAB_CHUNK];
+    if (*chunk == NULL) {
+        *chunk = (bt_device_t *)HEAP_MALLOC(
+            BT_DEVTAB, sizeof(bt_device_t) * BT_DEVTAB_CHUNK);
+        if (*chunk == NULL) {
+            LOGW(BT_TAG, "alloc device chunk failed");
+            ++tab->rejected;
+            return NULL;
+        }
+    }
+
+    bt_device_t *device = bt_devtab_at(tab, index);
+    memcpy(device->bda, bda, ESP_BD_ADDR_LEN);
+    snprintf(device->bda_str, sizeof(device->bda_str),
+             "%02x:%02x:%02x:%02x:%02x:%02x", bda[0], bda[1], bda[2], bda[3],
+             bda[4], bda[5]);
+    device->name = tab->names;
+    device->rssi = BT_DEVTAB_RSSI_INVALID;
+    device->rssi_avg = BT_DEVTAB_RSSI_INVALID * 16;
+    device->seen = 0;
+    device->name_hash = 0;
+    device->tx_power = BT_DEVTAB_TX_POWER_UNKNOWN;
+    device->eir = 0;
+    device->cod = 0;
+    device->last_seen = tab->now;
+
+    tab->keys[index] = key;
+    tab->slots[slot] = index + 1;
+    bt_devtab_link(tab, index);
+    ++tab->count;
+    *created = 1;
+    return device;
+}
+
+// rebuild the arena from the names still in use
+static int bt_devtab_compact_names(bt_devtab_t *tab) {
+    char *names = (char *)HEAP_MALLOC(BT_DEVTAB, BT_DEVTAB_NAME_ARENA);
+    if (names == NULL) {
+        return -1;
+    }
+
+    names[0] = '\0';
+    int used = 1;
+    for (int i = 0; i < tab->count; ++i) {
+        bt_device_t *device = bt_devtab_at(tab, i);
+        if (device->name[0] == '\0') {
+            device->name = names;
+            continue;
+        }
+        int len = strlen(device->name) + 1;
+        memcpy(names + used, device->name, len);
+        device->name = names + used;
+        used += len;
+    }
+
+    HEAP_FREE(tab->names);
+    tab->names = names;
+    tab->names_used = used;
+    tab->names_dead = 0;
+    return 0;
+}
+
+const char *bt_devtab_set_name(bt_devtab_t *tab, bt_device_t *device,
+                               const char *name, int len, uint32_t hash) {
+    if (device->name[0] != '\0' && device->name_hash == hash) {
+        return device->name;
+    }
+    if (len > BT_DEVTAB_NAME_MAX) {
+        len = BT_DEVTAB_NAME_MAX;
+    }
+    if (tab->names_used + len + 1 > BT_DEVTAB_NAME_ARENA &&
+        (tab->names_dead == 0 || bt_devtab_compact_names(tab) != 0 ||
+         tab->names_used + len + 1 > BT_DEVTAB_NAME_ARENA)) {
+        return device->name;
+    }
+    if (device->name[0] != '\0') {
+        tab->names_dead += strlen(device->name) + 1;
+    }
+
+    char *p = tab->names + tab->names_used;
+    memcpy(p, name, len);
+    p[len] = '\0';
+    tab->names_used += len + 1;
+    device->name = p;
+    device->name_hash = hash;
+    return p;
+}
+
+bt_devtab_snapshot_t *bt_devtab_snapshot(bt_devtab_t *tab) {
+    size_t names_size = 1;
+    for (int i = 0; i < tab->count; ++i) {
+        const char *name = bt_devtab_at(tab, i)->name;
+        if (name[0] != '\0') {
+            names_size += strlen(name) + 1;
+        }
+    }
+
+    bt_devtab_snapshot_t *snap = (bt_devtab_snapshot_t *)HEAP_MALLOC(
+        BT_DEVTAB,
+        sizeof(bt_devtab_snapshot_t) + sizeof(bt_device_t) * tab->count +
+        names_size);
+    if (snap == NULL) {
+        return NULL;
+    }
+
+    snap->now = tab->now;
+    snap->count = tab->count;
+    snap->devices = (bt_device_t *)(snap + 1);
+    char *names = (char *)(snap->devices + tab->count);
+    names[0] = '\0';
+    int used = 1;
+    for (int i = 0; i < tab->count; ++i) {
+        bt_device_t *device = &snap->devices[i];
+        *device = *bt_devtab_at(tab, i);
+        if (device->name[0] == '\0') {
+            device->name = names;
+            continue;
+        }
+        int len = strlen(device->name) + 1;
+        memcpy(names + used, device->name, len);
+        device->name = names + used;
+        used += len;
+    }
+    return snap;
+}
+
+void bt_devtab_snapshot_free(bt_devtab_snapshot_t *snap) { HEAP_FREE(snap); }
@@ -0,0 +1,93 @@
+#include "bt_eir.h"
+
+#include "esp_gap_bt_api.h"
+
+#include <string.h>
+
+uint32_t bt_eir_name_hash(const char *name, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void bt_eir_uuid16(bt_eir_t *eir, const uint8_t *value, int len) {
+    for (int i = 0; i + 1 < len; i += 2) {
+        uint16_t uuid = value[i] | (value[i + 1] << 8);
+        if (uuid == BT_EIR_UUID_AUDIO_SINK) {
+            eir->present |= BT_EIR_AUDIO_SINK;
+        }
+        if (eir->uuid16_count < BT_EIR_MAX_UUID16) {
+            eir->uuid16[eir->uuid16_count++] = uuid;
+        }
+    }
+}
+
+int bt_eir_parse(const uint8_t *data, int len, bt_eir_t *eir) {
+    memset(eir, 0, sizeof(bt_eir_t));
+
+    int pos = 0;
+    while (pos < len) {
+        int field_len = data[pos];
+        if (field_len == 0) {
+            break;  // the rest is padding
+        }
+        if (pos + 1 + field_len > len) {
+            eir->present |= BT_EIR_MALFORMED;
+            break;
+        }
+
+        uint8_t type = data[pos + 1];
+        const uint8_t *value = &data[pos + 2];
+        int value_len = field_len - 1;
+        pos += 1 + field_len;
+
+        switch (type) {
+        case ESP_BT_EIR_TYPE_FLAGS:
+            if (value_len >= 1) {
+                eir->flags = value[0];
+                eir->present |= BT_EIR_HAS_FLAGS;
+            }
+            break;
+        case ESP_BT_EIR_TYPE_TX_POWER_LEVEL:
+            if (value_len >= 1) {
+                eir->tx_power = (int8_t)value[0];
+                eir->present |= BT_EIR_HAS_TX_POWER;
+            }
+            break;
+        case ESP_BT_EIR_TYPE_INCMPL_16BITS_UUID:
+        case ESP_BT_EIR_TYPE_CMPL_16BITS_UUID:
+            bt_eir_uuid16(eir, value, value_len);
+            break;
+        case ESP_BT_EIR_TYPE_INCMPL_32BITS_UUID:
+        case ESP_BT_EIR_TYPE_CMPL_32BITS_UUID:
+            eir->uuid_other += value_len / 4;
+            break;
+        case ESP_BT_EIR_TYPE_INCMPL_128BITS_UUID:
+        case ESP_BT_EIR_TYPE_CMPL_128BITS_UUID:
+            eir->uuid_other += value_len / 16;
+            break;
+        case ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME:
+        case ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME: {
+            int complete = type == ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME;
+            if (value_len == 0 || (eir->present & BT_EIR_NAME_COMPLETE)) {
+                break;
+            }
+            eir->name = (const char *)value;
+            eir->name_len = value_len;
+            eir->present |= BT_EIR_HAS_NAME;
+            if (complete) {
+                eir->present |= BT_EIR_NAME_COMPLETE;
+            }
+            break;
+        }
+        default: break;
+        }
+    }
+
+    if (eir->present & BT_EIR_HAS_NAME) {
+        eir->name_hash = bt_eir_name_hash(eir->name, eir->name_len);
+    }
+    return eir->present;
+}
@@ -0,0 +1,97 @@
+#include "bt_gap_queue.h"
+
+#include "metrics.h"
+
+#include <string.h>
+
+void bt_gap_queue_init(bt_gap_queue_t *q) {
+    memset(q, 0, sizeof(bt_gap_queue_t));
+}
+
+uint32_t bt_gap_queue_depth(bt_gap_queue_t *q) {
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+int bt_gap_queue_push(bt_gap_queue_t *q, const esp_bd_addr_t bda,
+                      int num_prop, const esp_bt_gap_dev_prop_t *prop) {
+    uint32_t tail = q->tail;
+    uint32_t depth = tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (depth >= BT_GAP_QUEUE_DEPTH) {
+        __atomic_fetch_add(&q->drops, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (depth + 1 > q->peak) {
+        q->peak = depth + 1;
+    }
+
+    bt_gap_disc_t *item = &q->items[tail & (BT_GAP_QUEUE_DEPTH - 1)];
+    memcpy(item->bda, bda, ESP_BD_ADDR_LEN);
+    item->flags = 0;
+    for (int i = 0; i < num_prop; ++i) {
+        const esp_bt_gap_dev_prop_t *p = prop + i;
+        switch (p->type) {
+        case ESP_BT_GAP_DEV_PROP_COD:
+            item->cod = *(uint32_t *)(p->val);
+            item->flags |= BT_GAP_DISC_COD;
+            break;
+        case ESP_BT_GAP_DEV_PROP_RSSI:
+            item->rssi = *(int8_t *)(p->val);
+            item->flags |= BT_GAP_DISC_RSSI;
+            break;
+        case ESP_BT_GAP_DEV_PROP_BDNAME:
+            item->name_len =
+                p->len < BT_DEVTAB_NAME_MAX ? p->len : BT_DEVTAB_NAME_MAX;
+            memcpy(item->name, p->val, item->name_len);
+            item->flags |= BT_GAP_DISC_NAME;
+            break;
+        case ESP_BT_GAP_DEV_PROP_EIR:
+            if (p->val == NULL) break;
+            item->eir_len = p->len < ESP_BT_GAP_EIR_DATA_LEN
+                                ? p->len
+                                : ESP_BT_GAP_EIR_DATA_LEN;
+            memcpy(item->eir, p->val, item->eir_len);
+            item->flags |= BT_GAP_DISC_EIR;
+            break;
+        default: break;
+        }
+    }
+
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+bt_gap_disc_t *bt_gap_queue_peek(bt_gap_queue_t *q) {
+    uint32_t head = q->head;
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &q->items[head & (BT_GAP_QUEUE_DEPTH - 1)];
+}
+
+void bt_gap_queue_pop(bt_gap_queue_t *q) {
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+static double bt_gap_metric_depth(void *arg) {
+    return bt_gap_queue_depth((bt_gap_queue_t *)arg);
+}
+
+static double bt_gap_metric_peak(void *arg) {
+    return ((bt_gap_queue_t *)arg)->peak;
+}
+
+static double bt_gap_metric_drops(void *arg) {
+    return __atomic_load_n(&((bt_gap_queue_t *)arg)->drops, __ATOMIC_RELAXED);
+}
+
+void bt_gap_queue_register_metrics(bt_gap_queue_t *q) {
+    metrics_register_value("bt_gap_queue_depth",
+                           "Discovery results waiting for the worker",
+                           METRIC_TYPE_GAUGE, bt_gap_metric_depth, q);
+    metrics_register_value("bt_gap_queue_peak", "Deepest the queue has been",
+                           METRIC_TYPE_GAUGE, bt_gap_metric_peak, q);
+    metrics_register_value("bt_gap_queue_drops_total",
+                           "Discovery results dropped with the queue full",
+                           METRIC_TYPE_COUNTER, bt_gap_metric_drops, q);
+}
@@ -0,0 +1,347 @@
+#include "bt_sink.h"
+
+#include "bt_eir.h"
+#include "esp_timer.h"
+#include "metrics.h"
+#include "nvs.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct _bt_sink_book_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // signaled when a link comes up
+    bt_sink_stats_t known[BT_SINK_MAX_KNOWN];
+    int count;
+    uint32_t generation;
+
+    esp_bd_addr_t recent[BT_SINK_MAX_RECENT];
+    int recent_count;
+
+    // time since boot of the first connection per path, 0 if none
+    bt_sink_path_t path;
+    int64_t boot_connect_us[BT_SINK_PATH_MAX];
+
+    // sink of the attempt in progress
+    esp_bd_addr_t pending;
+    int has_pending;
+
+    // connected sink, -1 if none
+    int current;
+    int64_t session_us;
+    uint32_t session_underruns;
+} bt_sink_book_t;
+
+static bt_sink_book_t _book = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                               .cond = PTHREAD_COND_INITIALIZER,
+                               .current = -1,
+                               .path = BT_SINK_PATH_INQUIRY};
+
+static const char *_path_names[BT_SINK_PATH_MAX] = {"known sink", "inquiry"};
+
+static void bt_sink_save_locked(int with_recent) {
+    nvs_handle_t nvs;
+    if (nvs_open(BT_SINK_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        LOGW(BT_TAG, "open nvs %s failed", BT_SINK_NVS_NAMESPACE);
+        return;
+    }
+    esp_err_t err = nvs_set_blob(nvs, BT_SINK_NVS_KEY, _book.known,
+                                 sizeof(bt_sink_stats_t) * _book.count);
+    if (err == ESP_OK && with_recent) {
+        err = nvs_set_blob(nvs, BT_SINK_NVS_RECENT_KEY, _book.recent,
+                           sizeof(esp_bd_addr_t) * _book.recent_count);
+    }
+    if (err != ESP_OK || nvs_commit(nvs) != ESP_OK) {
+        LOGW(BT_TAG, "save sink stats failed");
+    }
+    nvs_close(nvs);
+}
+
+static double bt_sink_metric_known_ms(void *arg) {
+    return _book.boot_connect_us[BT_SINK_PATH_KNOWN] / 1000;
+}
+
+static double bt_sink_metric_inquiry_ms(void *arg) {
+    return _book.boot_connect_us[BT_SINK_PATH_INQUIRY] / 1000;
+}
+
+void bt_sink_load(void) {
+    nvs_handle_t nvs;
+    size_t size = sizeof(_book.known);
+    size_t recent_size = sizeof(_book.recent);
+
+    pthread_mutex_lock(&_book.lock);
+    _book.count = 0;
+    _book.recent_count = 0;
+    if (nvs_open(BT_SINK_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        if (nvs_get_blob(nvs, BT_SINK_NVS_KEY, _book.known, &size) == ESP_OK) {
+            _book.count = size / sizeof(bt_sink_stats_t);
+        }
+        if (nvs_get_blob(nvs, BT_SINK_NVS_RECENT_KEY, _book.recent,
+                         &recent_size) == ESP_OK) {
+            _book.recent_count = recent_size / sizeof(esp_bd_addr_t);
+        }
+        nvs_close(nvs);
+    }
+    for (int i = 0; i < _book.count; ++i) {
+        if (_book.known[i].last_used > _book.generation) {
+            _book.generation = _book.known[i].last_used;
+        }
+    }
+    pthread_mutex_unlock(&_book.lock);
+
+    LOGI(BT_TAG, "%d known sinks, %d recent", _book.count,
+         _book.recent_count);
+
+    metrics_register_value("bt_boot_connect_known_ms",
+                           "Boot to A2DP connected without inquiry",
+                           METRIC_TYPE_GAUGE, bt_sink_metric_known_ms, NULL);
+    metrics_register_value("bt_boot_connect_inquiry_ms",
+                           "Boot to A2DP connected after an inquiry",
+                           METRIC_TYPE_GAUGE, bt_sink_metric_inquiry_ms, NULL);
+}
+
+int bt_sink_recent(esp_bd_addr_t *bda, int max) {
+    pthread_mutex_lock(&_book.lock);
+    int count = _book.recent_count < max ? _book.recent_count : max;
+    memcpy(bda, _book.recent, sizeof(esp_bd_addr_t) * count);
+    pthread_mutex_unlock(&_book.lock);
+    return count;
+}
+
+void bt_sink_set_path(bt_sink_path_t path) {
+    pthread_mutex_lock(&_book.lock);
+    _book.path = path;
+    pthread_mutex_unlock(&_book.lock);
+}
+
+static int bt_sink_is_current_locked(const uint8_t *bda) {
+    return _book.current >= 0 &&
+           memcmp(_book.known[_book.current].bda, bda, ESP_BD_ADDR_LEN) == 0;
+}
+
+static int bt_sink_is_pending_locked(const uint8_t *bda) {
+    return _book.has_pending &&
+           memcmp(_book.pending, bda, ESP_BD_ADDR_LEN) == 0;
+}
+
+int bt_sink_wait_connected(const uint8_t *bda, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&_book.lock);
+    while (!bt_sink_is_current_locked(bda)) {
+        if (pthread_cond_timedwait(&_book.cond, &_book.lock, &deadline) != 0) {
+            break;
+        }
+    }
+    int connected = bt_sink_is_current_locked(bda);
+    if (!connected && bt_sink_is_pending_locked(bda)) {
+        // a CONNECTED event after this is a stray one
+        _book.has_pending = 0;
+        bt_sink_save_locked(0);
+    }
+    pthread_mutex_unlock(&_book.lock);
+    return connected ? 0 : -1;
+}
+
+// move bda to the front of the recent list
+static void bt_sink_remember_locked(const uint8_t *bda) {
+    int i = 0;
+    while (i < _book.recent_count &&
+           memcmp(_book.recent[i], bda, ESP_BD_ADDR_LEN) != 0) {
+        ++i;
+    }
+    if (i == _book.recent_count) {
+        if (_book.recent_count < BT_SINK_MAX_RECENT) {
+            ++_book.recent_count;
+        } else {
+            --i;  // full, the oldest one goes
+        }
+    }
+    memmove(_book.recent[1], _book.recent[0], sizeof(esp_bd_addr_t) * i);
+    memcpy(_book.recent[0], bda, ESP_BD_ADDR_LEN);
+}
+
+static int bt_sink_find_locked(const uint8_t *bda) {
+    for (int i = 0; i < _book.count; ++i) {
+        if (memcmp(_book.known[i].bda, bda, ESP_BD_ADDR_LEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// known entry of bda, the least recently used one is reused when full
+static int bt_sink_touch_locked(const uint8_t *bda) {
+    int i = bt_sink_find_locked(bda);
+    if (i < 0) {
+        if (_book.count < BT_SINK_MAX_KNOWN) {
+            i = _book.count++;
+        } else {
+            i = 0;
+            for (int j = 1; j < _book.count; ++j) {
+                if (_book.known[j].last_used < _book.known[i].last_used) {
+                    i = j;
+                }
+            }
+        }
+        memset(&_book.known[i], 0, sizeof(bt_sink_stats_t));
+        memcpy(_book.known[i].bda, bda, ESP_BD_ADDR_LEN);
+    }
+    _book.known[i].last_used = ++_book.generation;
+    return i;
+}
+
+void bt_sink_observe_rssi(bt_device_t *device, int8_t rssi) {
+    if (device->seen++ == 0) {
+        device->rssi_avg = rssi * 16;
+    } else {
+        device->rssi_avg +=
+            (rssi * 16 - device->rssi_avg) >> BT_SINK_RSSI_EWMA_SHIFT;
+    }
+}
+
+int bt_sink_score(const bt_device_t *device) {
+    int rssi = device->seen ? device->rssi_avg / 16 : BT_SINK_RSSI_FLOOR;
+    if (rssi < BT_SINK_RSSI_FLOOR) rssi = BT_SINK_RSSI_FLOOR;
+    if (rssi > BT_SINK_RSSI_CEIL) rssi = BT_SINK_RSSI_CEIL;
+    int rssi_score = (rssi - BT_SINK_RSSI_FLOOR) * 100 /
+                     (BT_SINK_RSSI_CEIL - BT_SINK_RSSI_FLOOR);
+
+    bt_sink_stats_t stats = {0};
+    pthread_mutex_lock(&_book.lock);
+    int i = bt_sink_find_locked(device->bda);
+    if (i >= 0) {
+        stats = _book.known[i];
+    }
+    pthread_mutex_unlock(&_book.lock);
+
+    // an unknown sink starts at 50% success and without penalty
+    int success_score = (stats.successes + 1) * 100 / (stats.attempts + 2);
+    uint32_t penalty = (uint64_t)stats.underruns * 60 *
+                       BT_SINK_UNDERRUN_PENALTY / (stats.play_seconds + 60);
+    if (penalty > 100) penalty = 100;
+
+    return (BT_SINK_WEIGHT_RSSI * rssi_score +
+            BT_SINK_WEIGHT_SUCCESS * success_score +
+            BT_SINK_WEIGHT_UNDERRUN * (100 - (int)penalty)) /
+           100;
+}
+
+int bt_sink_is_candidate(const bt_device_t *device) {
+    return (esp_bt_gap_get_cod_srvc(device->cod) &
+            ESP_BT_COD_SRVC_RENDERING) != 0 ||
+           (device->eir & BT_EIR_AUDIO_SINK) != 0;
+}
+
+int bt_sink_ends_scan(const bt_device_t *device) {
+    if (!bt_sink_is_candidate(device)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&_book.lock);
+    int i = bt_sink_find_locked(device->bda);
+    int known = i >= 0 && _book.known[i].successes > 0;
+    pthread_mutex_unlock(&_book.lock);
+
+    return known && bt_sink_score(device) >= BT_SINK_GOOD_SCORE;
+}
+
+const bt_device_t *bt_sink_pick(const bt_devtab_snapshot_t *snap) {
+    const bt_device_t *best = NULL;
+    int best_score = -1;
+    for (int i = 0; i < snap->count; ++i) {
+        const bt_device_t *device = &snap->devices[i];
+        if (!bt_sink_is_candidate(device)) continue;
+
+        int score = bt_sink_score(device);
+        LOGI(BT_TAG, "sink candidate(%s) %s, rssi avg(%d) score(%d)",
+             device->bda_str, device->name, device->rssi_avg / 16, score);
+        if (score > best_score ||
+            (score == best_score && device->rssi_avg > best->rssi_avg)) {
+            best = device;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+void bt_sink_on_attempt(const uint8_t *bda) {
+    pthread_mutex_lock(&_book.lock);
+    ++_book.known[bt_sink_touch_locked(bda)].attempts;
+    memcpy(_book.pending, bda, ESP_BD_ADDR_LEN);
+    _book.has_pending = 1;
+    pthread_mutex_unlock(&_book.lock);
+}
+
+int bt_sink_on_connected(const uint8_t *bda) {
+    pthread_mutex_lock(&_book.lock);
+    if (!bt_sink_is_pending_locked(bda)) {
+        pthread_mutex_unlock(&_book.lock);
+        LOGW(BT_TAG, "a2dp link that was not attempted, dropping it");
+        return -1;
+    }
+    _book.has_pending = 0;
+    _book.current = bt_sink_touch_locked(bda);
+    ++_book.known[_book.current].successes;
+    _book.session_us = esp_timer_get_time();
+    __atomic_store_n(&_book.session_underruns, 0, __ATOMIC_RELAXED);
+    bt_sink_remember_locked(bda);
+
+    int64_t *boot_us = &_book.boot_connect_us[_book.path];
+    if (*boot_us == 0) {
+        *boot_us = _book.session_us;
+        LOGI(BT_TAG, "boot to a2dp connected %lldms via %s", *boot_us / 1000,
+             _path_names[_book.path]);
+    }
+
+    bt_sink_save_locked(1);
+    pthread_cond_broadcast(&_book.cond);
+    pthread_mutex_unlock(&_book.lock);
+    return 0;
+}
+
+static void bt_sink_flush_session_locked(void) {
+    if (_book.current < 0) {
+        return;
+    }
+
+    bt_sink_stats_t *stats = &_book.known[_book.current];
+    int64_t now = esp_timer_get_time();
+    stats->play_seconds += (now - _book.session_us) / 1000000;
+    stats->underruns +=
+        __atomic_exchange_n(&_book.session_underruns, 0, __ATOMIC_RELAXED);
+    _book.session_us = now;
+}
+
+void bt_sink_on_disconnected(const uint8_t *bda) {
+    pthread_mutex_lock(&_book.lock);
+    if (!bt_sink_is_current_locked(bda)) {
+        pthread_mutex_unlock(&_book.lock);
+        return;  // the stray link that was dropped
+    }
+    bt_sink_flush_session_locked();
+    _book.current = -1;
+    bt_sink_save_locked(0);
+    pthread_mutex_unlock(&_book.lock);
+}
+
+void bt_sink_on_underrun(void) {
+    __atomic_fetch_add(&_book.session_underruns, 1, __ATOMIC_RELAXED);
+}
+
+void bt_sink_checkpoint(void) {
+    pthread_mutex_lock(&_book.lock);
+    bt_sink_flush_session_locked();
+    bt_sink_save_locked(0);
+    pthread_mutex_unlock(&_book.lock);
+}
@@ -0,0 +1,198 @@
+#include "cam_encode.h"
+
+#include "esp_log.h"
+#include "heap_track.h"
+#include "img_converters.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ENCODE_TAG "CAM_ENCODE"
+
+typedef struct _cam_jpg_out_t {
+    cam_jpg_pool_t *pool;
+    cam_jpg_buf_t *out;
+} cam_jpg_out_t;
+
+void cam_jpg_pool_init(cam_jpg_pool_t *pool) {
+    memset(pool, 0, sizeof(cam_jpg_pool_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+}
+
+void cam_jpg_pool_uninit(cam_jpg_pool_t *pool) {
+    for (int i = 0; i < CAM_JPG_POOL_SIZE; ++i) {
+        HEAP_RESIZE(CAM_JPG, pool->bufs[i].cap, 0);
+        free(pool->bufs[i].buf);
+        pool->bufs[i].buf = NULL;
+        pool->bufs[i].cap = 0;
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static int cam_jpg_reserve(cam_jpg_pool_t *pool, cam_jpg_buf_t *out,
+                           size_t size) {
+    if (size <= out->cap) {
+        return 0;
+    }
+
+    // size for the biggest frame seen so far plus a quarter
+    if (size < pool->peak) {
+        size = pool->peak;
+    }
+    size += size / 4;
+    size = (size + CAM_JPG_GROW_ALIGN - 1) & ~(CAM_JPG_GROW_ALIGN - 1);
+
+    uint8_t *buf = (uint8_t *)realloc(out->buf, size);
+    if (buf == NULL) {
+        ESP_LOGE(ENCODE_TAG, "grow jpeg buffer to %u failed", size);
+        return -1;
+    }
+
+    HEAP_RESIZE(CAM_JPG, out->cap, size);
+    out->buf = buf;
+    out->cap = size;
+    __atomic_fetch_add(&pool->allocs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static size_t cam_jpg_write(void *arg, size_t index, const void *data,
+                            size_t len) {
+    cam_jpg_out_t *ctx = (cam_jpg_out_t *)arg;
+    if (!data) {
+        return len;  // flush
+    }
+
+    if (cam_jpg_reserve(ctx->pool, ctx->out, index + len) != 0) {
+        return 0;
+    }
+
+    memcpy(ctx->out->buf + index, data, len);
+    if (index + len > ctx->out->len) {
+        ctx->out->len = index + len;
+    }
+    return len;
+}
+
+cam_jpg_buf_t *cam_jpg_lease(cam_jpg_pool_t *pool, int timeout_ms) {
+    cam_jpg_buf_t *out = NULL;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (out == NULL) {
+        // prefer the biggest free buffer, it will not need to grow
+        for (int i = 0; i < CAM_JPG_POOL_SIZE; ++i) {
+            cam_jpg_buf_t *b = &pool->bufs[i];
+            if (!b->in_use && (out == NULL || b->cap > out->cap)) {
+                out = b;
+            }
+        }
+        if (out == NULL &&
+            pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline) != 0) {
+            break;
+        }
+    }
+    if (out != NULL) {
+        out->in_use = 1;
+        out->len = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (out == NULL) {
+        ESP_LOGW(ENCODE_TAG, "no jpeg buffer free after %dms", timeout_ms);
+    }
+    return out;
+}
+
+static cam_jpg_buf_t *cam_jpg_finish(cam_jpg_pool_t *pool, cam_jpg_out_t *ctx,
+                                     bool ok) {
+    if (!ok) {
+        cam_jpg_release(pool, ctx->out);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (ctx->out->len > pool->peak) {
+        pool->peak = ctx->out->len;
+    }
+    ++pool->encodes;
+    pthread_mutex_unlock(&pool->lock);
+
+    return ctx->out;
+}
+
+cam_jpg_buf_t *cam_jpg_encode_leased(cam_jpg_pool_t *pool, cam_jpg_buf_t *out,
+                                     camera_fb_t *fb, int quality) {
+    cam_jpg_out_t ctx = {.pool = pool, .out = out};
+    return cam_jpg_finish(pool, &ctx,
+                          frame2jpg_cb(fb, quality, cam_jpg_write, &ctx));
+}
+
+cam_jpg_buf_t *cam_jpg_encode(cam_jpg_pool_t *pool, camera_fb_t *fb,
+                              int quality) {
+    cam_jpg_buf_t *out = cam_jpg_lease(pool, CAM_JPG_LEASE_TIMEOUT_MS);
+    return out ? cam_jpg_encode_leased(pool, out, fb, quality) : NULL;
+}
+
+cam_jpg_buf_t *cam_jpg_encode_fmt(cam_jpg_pool_t *pool, uint8_t *src,
+                                  size_t len, uint16_t width, uint16_t height,
+                                  pixformat_t format, int quality) {
+    cam_jpg_out_t ctx = {.pool = pool,
+                         .out = cam_jpg_lease(pool, CAM_JPG_LEASE_TIMEOUT_MS)};
+    if (ctx.out == NULL) {
+        return NULL;
+    }
+    return cam_jpg_finish(pool, &ctx,
+                          fmt2jpg_cb(src, len, width, height, format, quality,
+                                     cam_jpg_write, &ctx));
+}
+
+void cam_jpg_release(cam_jpg_pool_t *pool, cam_jpg_buf_t *buf) {
+    pthread_mutex_lock(&pool->lock);
+    buf->in_use = 0;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static double cam_jpg_metric_allocs(void *arg) {
+    return ((cam_jpg_pool_t *)arg)->allocs;
+}
+
+static double cam_jpg_metric_encodes(void *arg) {
+    return ((cam_jpg_pool_t *)arg)->encodes;
+}
+
+static double cam_jpg_metric_peak(void *arg) {
+    return ((cam_jpg_pool_t *)arg)->peak;
+}
+
+static double cam_jpg_metric_capacity(void *arg) {
+    cam_jpg_pool_t *pool = (cam_jpg_pool_t *)arg;
+    size_t total = 0;
+    for (int i = 0; i < CAM_JPG_POOL_SIZE; ++i) {
+        total += pool->bufs[i].cap;
+    }
+    return total;
+}
+
+void cam_jpg_register_metrics(cam_jpg_pool_t *pool) {
+    metrics_register_value("cam_jpg_allocs_total",
+                           "Encode buffer allocations and grows",
+                           METRIC_TYPE_COUNTER, cam_jpg_metric_allocs, pool);
+    metrics_register_value("cam_jpg_encodes_total", "Raw frames encoded",
+                           METRIC_TYPE_COUNTER, cam_jpg_metric_encodes, pool);
+    metrics_register_value("cam_jpg_peak_bytes", "Biggest encoded frame",
+                           METRIC_TYPE_GAUGE, cam_jpg_metric_peak, pool);
+    metrics_register_value("cam_jpg_pool_bytes", "Memory held by the pool",
+                           METRIC_TYPE_GAUGE, cam_jpg_metric_capacity, pool);
+}
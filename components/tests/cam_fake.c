@@ -0,0 +1,119 @@
+#include "cam_fake.h"
+
+#include "esp_log.h"
+#include "freertos/task.h"
+#include "img_converters.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define FAKE_TAG "CAM_FAKE"
+
+// frame index as 8 black/white squares in the top left corner
+#define FAKE_CODE_BITS 8
+#define FAKE_CODE_SIZE 8
+
+// YUYV, a grey ramp with an orange bar
+static void cam_fake_draw(uint8_t *yuyv, uint16_t width, uint16_t height,
+                          int index) {
+    int bar_w = width / 16;
+    int bar_x = index * (width - bar_w) / (CAM_FAKE_FRAMES - 1);
+
+    for (int y = 0; y < height; ++y) {
+        uint8_t *row = yuyv + y * width * 2;
+        for (int x = 0; x < width; ++x) {
+            int bar = x >= bar_x && x < bar_x + bar_w;
+            int code = y < FAKE_CODE_SIZE &&
+                       x < FAKE_CODE_BITS * FAKE_CODE_SIZE;
+            if (code) {
+                row[x * 2] = (index >> (x / FAKE_CODE_SIZE)) & 1 ? 0xff : 0x00;
+            } else {
+                row[x * 2] = bar ? 0xa0 : (x + y) & 0xff;
+            }
+            // U on even pixels, V on odd ones
+            row[x * 2 + 1] = bar && !code ? (x & 1 ? 0xd0 : 0x50) : 0x80;
+        }
+    }
+}
+
+esp_err_t cam_fake_init(cam_fake_t *fake, framesize_t size, int fps) {
+    memset(fake, 0, sizeof(cam_fake_t));
+    fake->width = resolution[size].width;
+    fake->height = resolution[size].height;
+    fake->period = pdMS_TO_TICKS(1000 / fps);
+    if (fake->period == 0) {
+        fake->period = 1;
+    }
+    fake->free_mask = (1u << (CAM_RING_MAX_DEPTH + 1)) - 1;
+
+    size_t len = (size_t)fake->width * fake->height * 2;
+    uint8_t *yuyv = (uint8_t *)malloc(len);
+    if (yuyv == NULL) {
+        ESP_LOGE(FAKE_TAG, "alloc %ux%u pattern failed", fake->width,
+                 fake->height);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < CAM_FAKE_FRAMES; ++i) {
+        cam_fake_draw(yuyv, fake->width, fake->height, i);
+        if (!fmt2jpg(yuyv, len, fake->width, fake->height, PIXFORMAT_YUV422,
+                     CAM_FAKE_QUALITY, &fake->jpg[i], &fake->len[i])) {
+            ESP_LOGE(FAKE_TAG, "encode fake frame %d failed", i);
+            free(yuyv);
+            cam_fake_uninit(fake);
+            return ESP_FAIL;
+        }
+    }
+    free(yuyv);
+
+    ESP_LOGI(FAKE_TAG, "%d frames %ux%u at %dfps, first %uB", CAM_FAKE_FRAMES,
+             fake->width, fake->height, fps, fake->len[0]);
+    return ESP_OK;
+}
+
+void cam_fake_uninit(cam_fake_t *fake) {
+    for (int i = 0; i < CAM_FAKE_FRAMES; ++i) {
+        free(fake->jpg[i]);
+        fake->jpg[i] = NULL;
+    }
+}
+
+static camera_fb_t *cam_fake_get(void *ctx) {
+    cam_fake_t *fake = (cam_fake_t *)ctx;
+    if (fake->free_mask == 0) {
+        return NULL;
+    }
+
+    // pace like a sensor, but do not burst after the ring was idle
+    TickType_t now = xTaskGetTickCount();
+    if (now - fake->last_wake > fake->period) {
+        fake->last_wake = now;
+    } else {
+        vTaskDelayUntil(&fake->last_wake, fake->period);
+    }
+
+    int slot = __builtin_ctz(fake->free_mask);
+    fake->free_mask &= ~(1u << slot);
+
+    camera_fb_t *fb = &fake->fbs[slot];
+    fb->buf = fake->jpg[fake->next];
+    fb->len = fake->len[fake->next];
+    fb->width = fake->width;
+    fb->height = fake->height;
+    fb->format = PIXFORMAT_JPEG;
+    gettimeofday(&fb->timestamp, NULL);
+    fake->next = (fake->next + 1) % CAM_FAKE_FRAMES;
+    return fb;
+}
+
+static void cam_fake_put(void *ctx, camera_fb_t *fb) {
+    cam_fake_t *fake = (cam_fake_t *)ctx;
+    fake->free_mask |= 1u << (fb - fake->fbs);
+}
+
+void cam_fake_source(cam_fake_t *fake, cam_source_t *source) {
+    source->get = cam_fake_get;
+    source->put = cam_fake_put;
+    source->ctx = fake;
+}
@@ -0,0 +1,144 @@
+#include "cam_motion.h"
+
+#include "esp_jpg_decode.h"
+#include "esp_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MOTION_TAG "CAM_MOTION"
+
+// raw frames are sampled on this pixel pitch
+#define RAW_SAMPLE_STEP 8
+
+typedef struct _cam_motion_jpg_t {
+    cam_motion_gate_t *gate;
+    const uint8_t *buf;
+    size_t len;
+} cam_motion_jpg_t;
+
+void cam_motion_init(cam_motion_gate_t *gate) {
+    memset(gate, 0, sizeof(cam_motion_gate_t));
+}
+
+static void cam_motion_reset(cam_motion_gate_t *gate, uint16_t width,
+                             uint16_t height) {
+    memset(gate->sum, 0, sizeof(gate->sum));
+    memset(gate->count, 0, sizeof(gate->count));
+    gate->width = width;
+    gate->height = height;
+}
+
+static inline void cam_motion_add(cam_motion_gate_t *gate, int x, int y,
+                                  uint8_t luma) {
+    int cell = (y * CAM_MOTION_GRID_H / gate->height) * CAM_MOTION_GRID_W +
+               x * CAM_MOTION_GRID_W / gate->width;
+    gate->sum[cell] += luma;
+    ++gate->count[cell];
+}
+
+static size_t cam_motion_jpg_read(void *arg, size_t index, uint8_t *buf,
+                                  size_t len) {
+    cam_motion_jpg_t *jpg = (cam_motion_jpg_t *)arg;
+    if (index + len > jpg->len) {
+        len = jpg->len - index;
+    }
+    if (buf) {
+        memcpy(buf, jpg->buf + index, len);
+    }
+    return len;
+}
+
+static bool cam_motion_jpg_write(void *arg, uint16_t x, uint16_t y, uint16_t w,
+                                 uint16_t h, uint8_t *data) {
+    cam_motion_gate_t *gate = ((cam_motion_jpg_t *)arg)->gate;
+    if (!data) {
+        if (x == 0 && y == 0) {
+            cam_motion_reset(gate, w, h);  // start, w/h is the scaled size
+        }
+        return true;
+    }
+
+    // at 1/8 scale every pixel is the DC term of one 8x8 block
+    for (int iy = 0; iy < h; ++iy) {
+        for (int ix = 0; ix < w; ++ix, data += 3) {
+            cam_motion_add(gate, x + ix, y + iy,
+                           (data[0] + 2 * data[1] + data[2]) >> 2);
+        }
+    }
+    return true;
+}
+
+static esp_err_t cam_motion_raw(cam_motion_gate_t *gate, camera_fb_t *fb) {
+    cam_motion_reset(gate, fb->width, fb->height);
+
+    for (int y = 0; y < fb->height; y += RAW_SAMPLE_STEP) {
+        for (int x = 0; x < fb->width; x += RAW_SAMPLE_STEP) {
+            size_t i = y * fb->width + x;
+            uint8_t luma;
+            if (fb->format == PIXFORMAT_GRAYSCALE) {
+                luma = fb->buf[i];
+            } else if (fb->format == PIXFORMAT_YUV422) {
+                luma = fb->buf[i * 2];  // YUYV
+            } else {
+                uint16_t p = (fb->buf[i * 2] << 8) | fb->buf[i * 2 + 1];
+                luma = (((p >> 8) & 0xf8) + 2 * ((p >> 3) & 0xfc) +
+                        ((p << 3) & 0xf8)) >>
+                       2;
+            }
+            cam_motion_add(gate, x, y, luma);
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t cam_motion_signature(cam_motion_gate_t *gate, camera_fb_t *fb,
+                               cam_motion_sig_t *sig) {
+    esp_err_t err;
+    if (fb->format == PIXFORMAT_JPEG) {
+        cam_motion_jpg_t jpg = {.gate = gate, .buf = fb->buf, .len = fb->len};
+        gate->width = gate->height = 0;
+        err = esp_jpg_decode(fb->len, JPG_SCALE_8X, cam_motion_jpg_read,
+                             cam_motion_jpg_write, &jpg);
+        if (err == ESP_OK && gate->width == 0) {
+            err = ESP_FAIL;
+        }
+    } else if (fb->format == PIXFORMAT_GRAYSCALE ||
+               fb->format == PIXFORMAT_YUV422 ||
+               fb->format == PIXFORMAT_RGB565) {
+        err = cam_motion_raw(gate, fb);
+    } else {
+        err = ESP_ERR_NOT_SUPPORTED;
+    }
+
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    for (int i = 0; i < CAM_MOTION_CELLS; ++i) {
+        sig->luma[i] = gate->count[i] ? gate->sum[i] / gate->count[i] : 0;
+    }
+    return ESP_OK;
+}
+
+int cam_motion_update(cam_motion_gate_t *gate, const cam_motion_sig_t *sig,
+                      int64_t now) {
+    int changed = 0;
+    if (gate->has_ref &&
+        now - gate->ref_us < CAM_MOTION_KEYFRAME_MS * 1000LL) {
+        for (int i = 0; i < CAM_MOTION_CELLS; ++i) {
+            if (abs(sig->luma[i] - gate->ref.luma[i]) > CAM_MOTION_CELL_DIFF) {
+                ++changed;
+            }
+        }
+        if (changed < CAM_MOTION_MIN_CELLS) {
+            return 0;
+        }
+    }
+
+    memcpy(&gate->ref, sig, sizeof(cam_motion_sig_t));
+    gate->has_ref = 1;
+    gate->ref_us = now;
+    return 1;
+}
@@ -0,0 +1,235 @@
+#include "cam_rate.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "metrics.h"
+
+#include <string.h>
+
+#define RATE_TAG "CAM_RATE"
+
+static const framesize_t _framesize_ladder[] = {
+    FRAMESIZE_QVGA, FRAMESIZE_VGA,  FRAMESIZE_SVGA,
+    FRAMESIZE_XGA,  FRAMESIZE_SXGA, FRAMESIZE_UXGA,
+};
+
+#define LADDER_SIZE (sizeof(_framesize_ladder) / sizeof(_framesize_ladder[0]))
+
+void cam_rate_init(cam_rate_t *ctl, const camera_config_t *config) {
+    memset(ctl, 0, sizeof(cam_rate_t));
+    pthread_mutex_init(&ctl->lock, NULL);
+
+    for (int i = 0; i < LADDER_SIZE; ++i) {
+        if (_framesize_ladder[i] <= config->frame_size) {
+            ctl->max_level = i;
+        }
+    }
+    ctl->level = ctl->max_level;
+
+    ctl->quality = config->jpeg_quality;
+    if (ctl->quality < CAM_RATE_QUALITY_MIN) {
+        ctl->quality = CAM_RATE_QUALITY_MIN;
+    } else if (ctl->quality > CAM_RATE_QUALITY_MAX) {
+        ctl->quality = CAM_RATE_QUALITY_MAX;
+    }
+
+    ctl->mode = CAM_RATE_DEFAULT_MODE;
+    ctl->target = CAM_RATE_DEFAULT_MODE == CAM_RATE_KBPS
+                      ? CAM_RATE_DEFAULT_KBPS
+                      : CAM_RATE_DEFAULT_FPS;
+}
+
+void cam_rate_set_target(cam_rate_t *ctl, int mode, int target) {
+    pthread_mutex_lock(&ctl->lock);
+    ctl->mode = mode;
+    ctl->target = target;
+    ctl->out_of_band = 0;
+    pthread_mutex_unlock(&ctl->lock);
+
+    ESP_LOGI(RATE_TAG, "target mode(%d) value(%d)", mode, target);
+}
+
+void cam_rate_get_target(cam_rate_t *ctl, int *mode, int *target) {
+    pthread_mutex_lock(&ctl->lock);
+    *mode = ctl->mode;
+    *target = ctl->target;
+    pthread_mutex_unlock(&ctl->lock);
+}
+
+framesize_t cam_rate_framesize(cam_rate_t *ctl) {
+    return _framesize_ladder[__atomic_load_n(&ctl->level, __ATOMIC_RELAXED)];
+}
+
+static int cam_rate_step_locked(cam_rate_t *ctl, int decision) {
+    sensor_t *s = esp_camera_sensor_get();
+    if (s == NULL) {
+        return CAM_RATE_DECISION_HOLD;
+    }
+
+    if (decision == CAM_RATE_DECISION_DOWN) {
+        // cheaper quality first, resolution is the last resort
+        if (ctl->quality < CAM_RATE_QUALITY_MAX) {
+            ctl->quality += CAM_RATE_QUALITY_STEP;
+            s->set_quality(s, ctl->quality);
+        } else if (ctl->level > 0) {
+            __atomic_store_n(&ctl->level, ctl->level - 1, __ATOMIC_RELAXED);
+            s->set_framesize(s, _framesize_ladder[ctl->level]);
+        } else {
+            return CAM_RATE_DECISION_HOLD;
+        }
+        ++ctl->steps_down;
+    } else {
+        if (ctl->quality > CAM_RATE_QUALITY_MIN) {
+            ctl->quality -= CAM_RATE_QUALITY_STEP;
+            if (ctl->quality < CAM_RATE_QUALITY_MIN) {
+                ctl->quality = CAM_RATE_QUALITY_MIN;
+            }
+            s->set_quality(s, ctl->quality);
+        } else if (ctl->level < ctl->max_level) {
+            __atomic_store_n(&ctl->level, ctl->level + 1, __ATOMIC_RELAXED);
+            s->set_framesize(s, _framesize_ladder[ctl->level]);
+        } else {
+            return CAM_RATE_DECISION_HOLD;
+        }
+        ++ctl->steps_up;
+    }
+
+    ESP_LOGI(RATE_TAG,
+             "%s: quality(%d) framesize(%d), fps(%.1f) kbps(%.0f) "
+             "send(%.1fms)",
+             decision == CAM_RATE_DECISION_DOWN ? "down" : "up", ctl->quality,
+             _framesize_ladder[ctl->level], ctl->fps, ctl->kbps, ctl->send_ms);
+    return decision;
+}
+
+static void cam_rate_evaluate_locked(cam_rate_t *ctl, int64_t now) {
+    float seconds = (now - ctl->window_begin_us) / 1000000.0f;
+    ctl->fps = ctl->window_frames / seconds;
+    ctl->kbps = ctl->window_bytes * 8 / 1000.0f / seconds;
+    ctl->send_ms = ctl->window_send_us / 1000.0f / ctl->window_frames;
+
+    ctl->last_decision = CAM_RATE_DECISION_HOLD;
+    if (ctl->mode == CAM_RATE_OFF || ctl->window_static) {
+        return;
+    }
+
+    float measured = ctl->mode == CAM_RATE_FPS ? ctl->fps : ctl->kbps;
+    float low = ctl->target * (100 - CAM_RATE_HYSTERESIS) / 100.0f;
+    float high = ctl->target * (100 + CAM_RATE_HYSTERESIS) / 100.0f;
+
+    // fps below target or bitrate above target both ask for cheaper frames
+    int too_low = measured < low, too_high = measured > high;
+    int decision = CAM_RATE_DECISION_HOLD;
+    if (ctl->mode == CAM_RATE_FPS) {
+        decision = too_low    ? CAM_RATE_DECISION_DOWN
+                   : too_high ? CAM_RATE_DECISION_UP
+                              : CAM_RATE_DECISION_HOLD;
+    } else {
+        decision = too_high  ? CAM_RATE_DECISION_DOWN
+                   : too_low ? CAM_RATE_DECISION_UP
+                             : CAM_RATE_DECISION_HOLD;
+    }
+
+    if (decision == CAM_RATE_DECISION_DOWN) {
+        ctl->out_of_band = (ctl->out_of_band < 0 ? ctl->out_of_band : 0) - 1;
+    } else if (decision == CAM_RATE_DECISION_UP) {
+        ctl->out_of_band = (ctl->out_of_band > 0 ? ctl->out_of_band : 0) + 1;
+    } else {
+        ctl->out_of_band = 0;
+    }
+
+    if (ctl->out_of_band <= -CAM_RATE_HOLD_WINDOWS ||
+        ctl->out_of_band >= CAM_RATE_HOLD_WINDOWS) {
+        ctl->last_decision = cam_rate_step_locked(ctl, decision);
+        ctl->out_of_band = 0;
+    }
+}
+
+void cam_rate_on_frame(cam_rate_t *ctl, uint32_t seq, size_t bytes,
+                       int64_t send_us) {
+    int64_t now = esp_timer_get_time();
+
+    pthread_mutex_lock(&ctl->lock);
+    if (ctl->window_frames > 0 && (int32_t)(seq - ctl->last_seq) <= 0) {
+        pthread_mutex_unlock(&ctl->lock);
+        return;
+    }
+    ctl->last_seq = seq;
+
+    if (ctl->window_begin_us == 0 ||
+        now - ctl->window_begin_us > 3 * CAM_RATE_WINDOW_MS * 1000) {
+        // first frame or the stream was idle, start a fresh window
+        ctl->window_begin_us = now;
+        ctl->window_frames = 0;
+        ctl->window_bytes = 0;
+        ctl->window_send_us = 0;
+        ctl->window_static = 0;
+    }
+
+    ++ctl->window_frames;
+    ctl->window_bytes += bytes;
+    ctl->window_send_us += send_us;
+
+    if (now - ctl->window_begin_us >= CAM_RATE_WINDOW_MS * 1000) {
+        cam_rate_evaluate_locked(ctl, now);
+        ctl->window_begin_us = now;
+        ctl->window_frames = 0;
+        ctl->window_bytes = 0;
+        ctl->window_send_us = 0;
+        ctl->window_static = 0;
+    }
+    pthread_mutex_unlock(&ctl->lock);
+}
+
+void cam_rate_on_static(cam_rate_t *ctl) {
+    pthread_mutex_lock(&ctl->lock);
+    ctl->window_static = 1;
+    pthread_mutex_unlock(&ctl->lock);
+}
+
+static double cam_rate_metric_quality(void *arg) {
+    return ((cam_rate_t *)arg)->quality;
+}
+
+static double cam_rate_metric_framesize(void *arg) {
+    return cam_rate_framesize((cam_rate_t *)arg);
+}
+
+static double cam_rate_metric_fps(void *arg) {
+    return ((cam_rate_t *)arg)->fps;
+}
+
+static double cam_rate_metric_kbps(void *arg) {
+    return ((cam_rate_t *)arg)->kbps;
+}
+
+static double cam_rate_metric_decision(void *arg) {
+    return ((cam_rate_t *)arg)->last_decision;
+}
+
+static double cam_rate_metric_steps_up(void *arg) {
+    return ((cam_rate_t *)arg)->steps_up;
+}
+
+static double cam_rate_metric_steps_down(void *arg) {
+    return ((cam_rate_t *)arg)->steps_down;
+}
+
+void cam_rate_register_metrics(cam_rate_t *ctl) {
+    metrics_register_value("cam_rate_quality", "Sensor JPEG quality in use",
+                           METRIC_TYPE_GAUGE, cam_rate_metric_quality, ctl);
+    metrics_register_value("cam_rate_framesize", "Sensor framesize in use",
+                           METRIC_TYPE_GAUGE, cam_rate_metric_framesize, ctl);
+    metrics_register_value("cam_rate_fps", "Frames per second, last window",
+                           METRIC_TYPE_GAUGE, cam_rate_metric_fps, ctl);
+    metrics_register_value("cam_rate_kbps", "Stream kbps, last window",
+                           METRIC_TYPE_GAUGE, cam_rate_metric_kbps, ctl);
+    metrics_register_value("cam_rate_decision",
+                           "Last decision, 0 hold, 1 up, 2 down",
+                           METRIC_TYPE_GAUGE, cam_rate_metric_decision, ctl);
+    metrics_register_value("cam_rate_steps_up_total", "Quality increases",
+                           METRIC_TYPE_COUNTER, cam_rate_metric_steps_up, ctl);
+    metrics_register_value("cam_rate_steps_down_total", "Quality decreases",
+                           METRIC_TYPE_COUNTER, cam_rate_metric_steps_down,
+                           ctl);
+}
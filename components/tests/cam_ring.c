@@ -0,0 +1,344 @@
+#include "cam_ring.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "metrics.h"
+
+#include <string.h>
+#include <time.h>
+
+#define RING_TAG "CAM_RING"
+
+static size_t cam_fb_size(const camera_config_t *config) {
+    size_t pixels = resolution[config->frame_size].width *
+                    resolution[config->frame_size].height;
+
+    switch (config->pixel_format) {
+    case PIXFORMAT_JPEG: return pixels / 5;  // same estimate as the driver
+    case PIXFORMAT_GRAYSCALE: return pixels;
+    case PIXFORMAT_RGB888: return pixels * 3;
+    default: return pixels * 2;
+    }
+}
+
+int cam_ring_plan_fb_count(const camera_config_t *config, int depth) {
+    size_t fb_size = cam_fb_size(config);
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t budget =
+        free_size > CAM_RING_DRAM_RESERVE ? free_size - CAM_RING_DRAM_RESERVE
+                                          : 0;
+
+    int fb_count = depth + 1;
+    if (fb_count > (int)(budget / fb_size)) {
+        fb_count = budget / fb_size;
+    }
+    if (fb_count < 1) {
+        fb_count = 1;
+    }
+
+    ESP_LOGI(RING_TAG,
+             "frame buffer %uKB, free %uKB (largest %uKB), use %d buffers",
+             fb_size / 1024, free_size / 1024,
+             heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / 1024,
+             fb_count);
+    return fb_count;
+}
+
+static camera_fb_t *cam_driver_get(void *ctx) { return esp_camera_fb_get(); }
+
+static void cam_driver_put(void *ctx, camera_fb_t *fb) {
+    esp_camera_fb_return(fb);
+}
+
+esp_err_t cam_ring_init(cam_ring_t *ring, int fb_count) {
+    memset(ring, 0, sizeof(cam_ring_t));
+    if (pthread_mutex_init(&ring->lock, NULL) != 0) {
+        return ESP_FAIL;
+    }
+    if (pthread_cond_init(&ring->cond, NULL) != 0) {
+        pthread_mutex_destroy(&ring->lock);
+        return ESP_FAIL;
+    }
+
+    ring->fb_count = fb_count;
+    ring->depth = fb_count > 1 ? fb_count - 1 : 1;
+    if (ring->depth > CAM_RING_MAX_DEPTH) {
+        ring->depth = CAM_RING_MAX_DEPTH;
+    }
+    ring->running = 1;
+    ring->source.get = cam_driver_get;
+    ring->source.put = cam_driver_put;
+#if CAM_MOTION_GATE
+    cam_motion_init(&ring->motion);
+#endif
+
+    return ESP_OK;
+}
+
+void cam_ring_set_source(cam_ring_t *ring, const cam_source_t *source) {
+    ring->source = *source;
+}
+
+void cam_ring_stop(cam_ring_t *ring) {
+    pthread_mutex_lock(&ring->lock);
+    ring->running = 0;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// give the oldest unreferenced frame back to the source
+static int cam_ring_evict_locked(cam_ring_t *ring) {
+    cam_frame_t *oldest = NULL;
+    for (int i = 0; i < ring->depth; ++i) {
+        cam_frame_t *frame = &ring->slots[i];
+        if (frame->fb == NULL || frame->refs > 0) continue;
+        if (oldest == NULL || (int32_t)(frame->seq - oldest->seq) < 0) {
+            oldest = frame;
+        }
+    }
+
+    if (oldest == NULL) {
+        return 0;
+    }
+
+    ring->source.put(ring->source.ctx, oldest->fb);
+    oldest->fb = NULL;
+    --ring->count;
+    return 1;
+}
+
+static void cam_ring_push_locked(cam_ring_t *ring, camera_fb_t *fb,
+                                 int64_t now, int motion) {
+    if (ring->count >= ring->depth && !cam_ring_evict_locked(ring)) {
+        // every slot is on the wire, the new frame is the only one to drop
+        ring->source.put(ring->source.ctx, fb);
+        ++ring->dropped;
+        ring->motion_lost |= motion;
+        return;
+    }
+
+    cam_frame_t *frame = NULL;
+    for (int i = 0; i < ring->depth; ++i) {
+        if (ring->slots[i].fb == NULL) {
+            frame = &ring->slots[i];
+            break;
+        }
+    }
+
+    frame->fb = fb;
+    frame->seq = ++ring->seq;
+    frame->capture_us = now;
+    // the gate compares with the dropped frame, its change is not lost
+    frame->motion = motion || ring->motion_lost;
+    ring->motion_lost = 0;
+    if (frame->motion) {
+        ring->motion_seq = frame->seq;
+    }
+    frame->motion_seq = ring->motion_seq;
+    frame->refs = 0;
+    ++ring->count;
+    ++ring->captured;
+
+    if (ring->last_capture_us) {
+        ring->capture_interval_us = now - ring->last_capture_us;
+    }
+    ring->last_capture_us = now;
+
+    pthread_cond_broadcast(&ring->cond);
+}
+
+static int cam_ring_should_wait_locked(cam_ring_t *ring) {
+    if (ring->readers == 0 && ring->requests == 0) {
+        return 1;  // nobody streams, keep the sensor idle
+    }
+
+    // the driver needs a free buffer to capture into
+    return ring->count >= ring->fb_count && !cam_ring_evict_locked(ring);
+}
+
+void cam_capture_task(void *params) {
+    cam_ring_t *ring = (cam_ring_t *)params;
+    metrics_register_task();
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->running) {
+        if (cam_ring_should_wait_locked(ring)) {
+            pthread_cond_wait(&ring->cond, &ring->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&ring->lock);
+
+        camera_fb_t *fb = ring->source.get(ring->source.ctx);
+        int64_t now = esp_timer_get_time();
+
+        if (!fb) {
+            ESP_LOGE(RING_TAG, "Camera capture failed");
+            vTaskDelay(pdMS_TO_TICKS(100));
+            pthread_mutex_lock(&ring->lock);
+            continue;
+        }
+
+        int motion = 1;
+#if CAM_MOTION_GATE
+        cam_motion_sig_t sig;
+        if (cam_motion_signature(&ring->motion, fb, &sig) == ESP_OK) {
+            motion = cam_motion_update(&ring->motion, &sig, now);
+        }
+#endif
+
+        pthread_mutex_lock(&ring->lock);
+        cam_ring_push_locked(ring, fb, now, motion);
+    }
+
+    for (int i = 0; i < ring->depth; ++i) {
+        if (ring->slots[i].fb != NULL) {
+            ring->source.put(ring->source.ctx, ring->slots[i].fb);
+            ring->slots[i].fb = NULL;
+        }
+    }
+    ring->count = 0;
+    pthread_mutex_unlock(&ring->lock);
+
+    ESP_LOGI(RING_TAG, "capture task stoped");
+    metrics_unregister_task();
+    vTaskDelete(NULL);
+}
+
+void cam_ring_attach(cam_ring_t *ring) {
+    pthread_mutex_lock(&ring->lock);
+    ++ring->readers;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void cam_ring_detach(cam_ring_t *ring) {
+    pthread_mutex_lock(&ring->lock);
+    --ring->readers;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+uint32_t cam_ring_latest_seq(cam_ring_t *ring) {
+    pthread_mutex_lock(&ring->lock);
+    uint32_t seq = ring->seq;
+    pthread_mutex_unlock(&ring->lock);
+    return seq;
+}
+
+static cam_frame_t *cam_ring_find_locked(cam_ring_t *ring,
+                                         uint32_t after_seq) {
+    cam_frame_t *found = NULL;
+    for (int i = 0; i < ring->depth; ++i) {
+        cam_frame_t *frame = &ring->slots[i];
+        if (frame->fb == NULL || (int32_t)(frame->seq - after_seq) <= 0) {
+            continue;
+        }
+        if (found == NULL || (int32_t)(frame->seq - found->seq) < 0) {
+            found = frame;
+        }
+    }
+    return found;
+}
+
+static void cam_ring_deadline(struct timespec *deadline, int timeout_ms) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static cam_frame_t *cam_ring_wait_locked(cam_ring_t *ring, uint32_t after_seq,
+                                         int timeout_ms) {
+    struct timespec deadline;
+    cam_ring_deadline(&deadline, timeout_ms);
+
+    cam_frame_t *frame = NULL;
+    while ((frame = cam_ring_find_locked(ring, after_seq)) == NULL) {
+        if (!ring->running ||
+            pthread_cond_timedwait(&ring->cond, &ring->lock, &deadline) != 0) {
+            break;
+        }
+    }
+    if (frame != NULL) {
+        ++frame->refs;
+    }
+    return frame;
+}
+
+cam_frame_t *cam_ring_acquire(cam_ring_t *ring, uint32_t after_seq,
+                              int timeout_ms) {
+    pthread_mutex_lock(&ring->lock);
+    cam_frame_t *frame = cam_ring_wait_locked(ring, after_seq, timeout_ms);
+    pthread_mutex_unlock(&ring->lock);
+
+    return frame;
+}
+
+cam_frame_t *cam_ring_acquire_latest(cam_ring_t *ring, int max_age_ms,
+                                     int timeout_ms) {
+    int64_t now = esp_timer_get_time();
+
+    pthread_mutex_lock(&ring->lock);
+    cam_frame_t *frame = NULL;
+    for (int i = 0; i < ring->depth; ++i) {
+        cam_frame_t *f = &ring->slots[i];
+        if (f->fb != NULL && f->seq == ring->seq) {
+            frame = f;
+            break;
+        }
+    }
+
+    if (frame != NULL && now - frame->capture_us <= max_age_ms * 1000LL) {
+        ++frame->refs;
+    } else {
+        // stale or empty, one capture serves every waiting reader
+        ++ring->requests;
+        pthread_cond_broadcast(&ring->cond);
+        frame = cam_ring_wait_locked(ring, ring->seq, timeout_ms);
+        --ring->requests;
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    return frame;
+}
+
+void cam_ring_release(cam_ring_t *ring, cam_frame_t *frame) {
+    pthread_mutex_lock(&ring->lock);
+    --frame->refs;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static double cam_ring_metric_frames(void *arg) {
+    return ((cam_ring_t *)arg)->count;
+}
+
+static double cam_ring_metric_readers(void *arg) {
+    return ((cam_ring_t *)arg)->readers;
+}
+
+static double cam_ring_metric_captured(void *arg) {
+    return ((cam_ring_t *)arg)->captured;
+}
+
+static double cam_ring_metric_dropped(void *arg) {
+    return ((cam_ring_t *)arg)->dropped;
+}
+
+void cam_ring_register_metrics(cam_ring_t *ring) {
+    metrics_register_value("cam_ring_frames", "Frames queued in the ring",
+                           METRIC_TYPE_GAUGE, cam_ring_metric_frames, ring);
+    metrics_register_value("cam_ring_readers", "Attached stream readers",
+                           METRIC_TYPE_GAUGE, cam_ring_metric_readers, ring);
+    metrics_register_value("cam_ring_captured_total", "Frames captured",
+                           METRIC_TYPE_COUNTER, cam_ring_metric_captured,
+                           ring);
+    metrics_register_value("cam_ring_dropped_total",
+                           "Captured frames dropped with every slot busy",
+                           METRIC_TYPE_COUNTER, cam_ring_metric_dropped, ring);
+}
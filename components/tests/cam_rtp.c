@@ -0,0 +1,355 @@
+#include "cam_rtp.h"
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <string.h>
+
+#define RTP_TAG "CAM_RTP"
+
+#define RTP_HEADER_SIZE 12
+#define RTP_JPEG_HEADER_SIZE 8
+#define RTP_RESTART_HEADER_SIZE 4
+#define RTP_QTABLE_HEADER_SIZE 4
+#define RTP_QTABLE_SIZE 64
+
+#define RTP_JPEG_TYPE_422 0
+#define RTP_JPEG_TYPE_420 1
+#define RTP_JPEG_TYPE_RESTART 64  // added when a DRI marker is present
+#define RTP_JPEG_Q_INBAND 255
+
+/* what RFC 2435 needs from the JPEG headers */
+typedef struct _cam_rtp_jpeg_t {
+    uint8_t type;
+    uint16_t width;
+    uint16_t height;
+    uint16_t restart_interval;
+    const uint8_t *qt[2];  // luma and chroma tables, zigzag order
+    const uint8_t *scan;   // entropy coded data without EOI
+    size_t scan_len;
+} cam_rtp_jpeg_t;
+
+static int cam_rtp_parse(const uint8_t *buf, size_t len, cam_rtp_jpeg_t *jpg) {
+    memset(jpg, 0, sizeof(cam_rtp_jpeg_t));
+    if (len < 4 || buf[0] != 0xff || buf[1] != 0xd8) {
+        return -1;
+    }
+
+    size_t i = 2;
+    while (i + 4 <= len) {
+        if (buf[i] != 0xff) {
+            return -1;
+        }
+        uint8_t marker = buf[i + 1];
+        if (marker == 0xff) {
+            ++i;  // fill byte
+            continue;
+        }
+
+        size_t n = ((buf[i + 2] << 8) | buf[i + 3]) - 2;
+        const uint8_t *seg = buf + i + 4;
+        if (i + 4 + n > len) {
+            return -1;
+        }
+
+        if (marker == 0xdb) {  // DQT, may hold several tables
+            for (size_t p = 0; p + 1 + RTP_QTABLE_SIZE <= n;
+                 p += 1 + RTP_QTABLE_SIZE) {
+                if (seg[p] >> 4) {
+                    return -1;  // 16 bit tables
+                }
+                if ((seg[p] & 0x0f) < 2) {
+                    jpg->qt[seg[p] & 0x0f] = seg + p + 1;
+                }
+            }
+        } else if (marker == 0xc0) {  // SOF0, baseline only
+            if (n < 15 || seg[5] != 3) {
+                return -1;
+            }
+            jpg->height = (seg[1] << 8) | seg[2];
+            jpg->width = (seg[3] << 8) | seg[4];
+            if (seg[7] == 0x21) {
+                jpg->type = RTP_JPEG_TYPE_422;
+            } else if (seg[7] == 0x22) {
+                jpg->type = RTP_JPEG_TYPE_420;
+            } else {
+                return -1;
+            }
+        } else if (marker == 0xdd && n >= 2) {  // DRI
+            jpg->restart_interval = (seg[0] << 8) | seg[1];
+        } else if (marker == 0xda) {  // SOS, the scan runs to EOI
+            jpg->scan = seg + n;
+            jpg->scan_len = len - (i + 4 + n);
+            while (jpg->scan_len >= 2 &&
+                   !(jpg->scan[jpg->scan_len - 2] == 0xff &&
+                     jpg->scan[jpg->scan_len - 1] == 0xd9)) {
+                --jpg->scan_len;  // driver padding after EOI
+            }
+            if (jpg->scan_len < 2) {
+                return -1;
+            }
+            jpg->scan_len -= 2;
+            break;
+        } else if (marker >= 0xc1 && marker <= 0xcf && marker != 0xc4 &&
+                   marker != 0xc8 && marker != 0xcc) {
+            return -1;  // progressive, lossless, arithmetic
+        }
+        i += 4 + n;
+    }
+
+    if (jpg->scan == NULL || jpg->width == 0 || jpg->qt[0] == NULL ||
+        jpg->qt[1] == NULL || jpg->width > 2040 || jpg->height > 2040) {
+        return -1;
+    }
+    return 0;
+}
+
+static inline uint8_t *cam_rtp_put16(uint8_t *p, uint16_t v) {
+    *p++ = v >> 8;
+    *p++ = v;
+    return p;
+}
+
+static inline uint8_t *cam_rtp_put32(uint8_t *p, uint32_t v) {
+    p = cam_rtp_put16(p, v >> 16);
+    return cam_rtp_put16(p, v);
+}
+
+static void cam_rtp_on_pace(void *arg) {
+    xTaskNotifyGive(((cam_rtp_t *)arg)->task);
+}
+
+// a tick is 10ms, too coarse for 1ms per packet, an esp_timer wakes us
+static void cam_rtp_pace(cam_rtp_t *rtp, size_t len) {
+    int64_t now = esp_timer_get_time();
+    int64_t wait = rtp->pace_next_us - now;
+    if (wait >= CAM_RTP_PACE_MIN_WAIT_US &&
+        esp_timer_start_once(rtp->pace_timer, wait) == ESP_OK) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    } else if (wait < 0) {
+        rtp->pace_next_us = now;  // idle time is not saved up for a burst
+    }
+    rtp->pace_next_us += (int64_t)len * 8000 / CAM_RTP_PACE_KBPS;
+}
+
+// returns the packets sent, -1 if sendto failed
+static int cam_rtp_send_frame(cam_rtp_t *rtp, const struct sockaddr_in *dest,
+                              const cam_rtp_jpeg_t *jpg, int64_t capture_us) {
+    uint32_t timestamp = capture_us * (CAM_RTP_CLOCK_HZ / 1000) / 1000;
+    uint8_t type = jpg->type;
+    if (jpg->restart_interval) {
+        type += RTP_JPEG_TYPE_RESTART;
+    }
+
+    int packets = 0;
+    size_t offset = 0;
+    while (offset < jpg->scan_len) {
+        uint8_t *p = rtp->packet;
+        size_t room = CAM_RTP_MTU - RTP_HEADER_SIZE - RTP_JPEG_HEADER_SIZE;
+
+        p += RTP_HEADER_SIZE;  // filled once the marker bit is known
+        *p++ = 0;              // type specific
+        *p++ = offset >> 16;
+        p = cam_rtp_put16(p, offset);
+        *p++ = type;
+        *p++ = RTP_JPEG_Q_INBAND;
+        *p++ = jpg->width / 8;
+        *p++ = jpg->height / 8;
+
+        if (jpg->restart_interval) {
+            p = cam_rtp_put16(p, jpg->restart_interval);
+            p = cam_rtp_put16(p, 0xffff);  // F=1 L=1, count 0x3fff
+            room -= RTP_RESTART_HEADER_SIZE;
+        }
+
+        if (offset == 0) {
+            *p++ = 0;  // MBZ
+            *p++ = 0;  // 8 bit tables
+            p = cam_rtp_put16(p, RTP_QTABLE_SIZE * 2);
+            memcpy(p, jpg->qt[0], RTP_QTABLE_SIZE);
+            memcpy(p + RTP_QTABLE_SIZE, jpg->qt[1], RTP_QTABLE_SIZE);
+            p += RTP_QTABLE_SIZE * 2;
+            room -= RTP_QTABLE_HEADER_SIZE + RTP_QTABLE_SIZE * 2;
+        }
+
+        size_t chunk = jpg->scan_len - offset;
+        if (chunk > room) {
+            chunk = room;
+        }
+        memcpy(p, jpg->scan + offset, chunk);
+        p += chunk;
+        offset += chunk;
+
+        uint8_t *h = rtp->packet;
+        *h++ = 0x80;  // V=2
+        *h++ = CAM_RTP_PAYLOAD_TYPE |
+               (offset == jpg->scan_len ? 0x80 : 0);  // marker on last
+        h = cam_rtp_put16(h, rtp->seq++);
+        h = cam_rtp_put32(h, timestamp);
+        cam_rtp_put32(h, rtp->ssrc);
+
+        size_t len = p - rtp->packet;
+        cam_rtp_pace(rtp, len);
+        if (sendto(rtp->sock, rtp->packet, len, 0,
+                   (const struct sockaddr *)dest, sizeof(*dest)) < 0) {
+            ESP_LOGW(RTP_TAG, "sendto failed, errno(%d)", errno);
+            return -1;
+        }
+        ++packets;
+    }
+
+    return packets;
+}
+
+static int cam_rtp_enabled(cam_rtp_t *rtp, struct sockaddr_in *dest) {
+    pthread_mutex_lock(&rtp->lock);
+    int enabled = rtp->enabled;
+    *dest = rtp->dest;
+    pthread_mutex_unlock(&rtp->lock);
+    return enabled;
+}
+
+static void cam_rtp_serve(cam_rtp_t *rtp) {
+    cam_stream_pipeline_t *p = &rtp->pipeline;
+    struct sockaddr_in dest;
+
+    cam_ring_attach(p->ring);
+    uint32_t seq = cam_ring_latest_seq(p->ring);
+    uint32_t sent = 0;
+    uint32_t sent_seq = 0;
+
+    while (cam_rtp_enabled(rtp, &dest)) {
+        cam_frame_t *frame =
+            cam_ring_acquire(p->ring, seq, CAM_FRAME_TIMEOUT_MS);
+        if (!frame) {
+            continue;  // nobody waits on the other end of UDP
+        }
+        seq = frame->seq;
+
+        if (sent > 0 && !cam_frame_changed_since(frame, sent_seq)) {
+            cam_ring_release(p->ring, frame);
+            continue;
+        }
+        ++sent;
+        sent_seq = seq;
+
+        int64_t send_begin = esp_timer_get_time();
+        camera_fb_t *fb = frame->fb;
+        cam_jpg_buf_t *jpg = NULL;
+        const uint8_t *buf = fb->buf;
+        size_t len = fb->len;
+        if (fb->format != PIXFORMAT_JPEG) {
+            jpg = cam_jpg_encode(p->jpg_pool, fb, CAM_JPG_QUALITY);
+            if (jpg) {
+                buf = jpg->buf;
+                len = jpg->len;
+            } else {
+                len = 0;
+            }
+        }
+
+        cam_rtp_jpeg_t parsed;
+        int packets = -2;
+        if (len > 0 && cam_rtp_parse(buf, len, &parsed) == 0) {
+            packets = cam_rtp_send_frame(rtp, &dest, &parsed,
+                                         frame->capture_us);
+        }
+        if (jpg) {
+            cam_jpg_release(p->jpg_pool, jpg);
+        }
+        cam_ring_release(p->ring, frame);
+        int64_t send_us = esp_timer_get_time() - send_begin;
+
+        pthread_mutex_lock(&rtp->lock);
+        if (packets == -2) {
+            ++rtp->unsupported;
+        } else if (packets < 0) {
+            ++rtp->errors;
+        } else {
+            ++rtp->frames;
+            rtp->packets += packets;
+            rtp->bytes += len;
+            rtp->send_us += send_us;
+            rtp->last_send_us = send_us;
+        }
+        pthread_mutex_unlock(&rtp->lock);
+    }
+
+    cam_ring_detach(p->ring);
+}
+
+static void cam_rtp_task(void *params) {
+    cam_rtp_t *rtp = (cam_rtp_t *)params;
+    metrics_register_task();
+
+    pthread_mutex_lock(&rtp->lock);
+    while (true) {
+        if (!rtp->enabled) {
+            pthread_cond_wait(&rtp->cond, &rtp->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&rtp->lock);
+
+        ESP_LOGI(RTP_TAG, "sending to %s:%u", inet_ntoa(rtp->dest.sin_addr),
+                 ntohs(rtp->dest.sin_port));
+        cam_rtp_serve(rtp);
+        ESP_LOGI(RTP_TAG, "stopped");
+
+        pthread_mutex_lock(&rtp->lock);
+    }
+}
+
+esp_err_t cam_rtp_init(cam_rtp_t *rtp, const cam_stream_pipeline_t *pipeline) {
+    memset(rtp, 0, sizeof(cam_rtp_t));
+    pthread_mutex_init(&rtp->lock, NULL);
+    pthread_cond_init(&rtp->cond, NULL);
+    rtp->pipeline = *pipeline;
+    rtp->ssrc = esp_random();
+    rtp->seq = esp_random();
+
+    rtp->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (rtp->sock < 0) {
+        ESP_LOGE(RTP_TAG, "create socket failed, errno(%d)", errno);
+        return ESP_FAIL;
+    }
+
+    esp_timer_create_args_t args = {
+        .callback = cam_rtp_on_pace,
+        .arg = rtp,
+        .name = "cam_rtp_pace",
+    };
+    if (esp_timer_create(&args, &rtp->pace_timer) != ESP_OK) {
+        ESP_LOGE(RTP_TAG, "create pacing timer failed");
+        close(rtp->sock);
+        return ESP_FAIL;
+    }
+
+    if (xTaskCreate(cam_rtp_task, "cam_rtp", CAM_RTP_TASK_STACK, rtp,
+                    CAM_RTP_TASK_PRIO, &rtp->task) != pdPASS) {
+        ESP_LOGE(RTP_TAG, "create sender task failed");
+        esp_timer_delete(rtp->pace_timer);
+        close(rtp->sock);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void cam_rtp_start(cam_rtp_t *rtp, uint32_t addr, uint16_t port) {
+    pthread_mutex_lock(&rtp->lock);
+    rtp->dest.sin_family = AF_INET;
+    rtp->dest.sin_addr.s_addr = addr;
+    rtp->dest.sin_port = htons(port);
+    rtp->enabled = 1;
+    pthread_cond_broadcast(&rtp->cond);
+    pthread_mutex_unlock(&rtp->lock);
+}
+
+void cam_rtp_stop(cam_rtp_t *rtp) {
+    pthread_mutex_lock(&rtp->lock);
+    rtp->enabled = 0;
+    pthread_mutex_unlock(&rtp->lock);
+}
@@ -0,0 +1,283 @@
+#include "cam_scale.h"
+
+#include "esp_http_server.h"
+#include "esp_jpg_decode.h"
+#include "esp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCALE_TAG "CAM_SCALE"
+
+typedef struct _cam_scale_jpg_t {
+    cam_scaler_t *scaler;
+    const uint8_t *buf;
+    size_t len;
+} cam_scale_jpg_t;
+
+static inline uint8_t clamp_u8(int v) {
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+int cam_view_parse(cam_view_t *view, const char *query) {
+    char value[32];
+    memset(view, 0, sizeof(cam_view_t));
+    if (query == NULL) {
+        return 0;
+    }
+
+    if (httpd_query_key_value(query, "scale", value, sizeof(value)) ==
+        ESP_OK) {
+        const char *d = strchr(value, '/');
+        int den = atoi(d ? d + 1 : value);
+        if (d && atoi(value) != 1) {
+            return -1;
+        }
+        if (den == 1) {
+            view->shift = 0;
+        } else if (den == 2) {
+            view->shift = 1;
+        } else if (den == 4) {
+            view->shift = 2;
+        } else if (den == 8) {
+            view->shift = 3;
+        } else {
+            return -1;
+        }
+    }
+
+    if (httpd_query_key_value(query, "roi", value, sizeof(value)) == ESP_OK) {
+        unsigned int x, y, w, h;
+        if (sscanf(value, "%u,%u,%u,%u", &x, &y, &w, &h) != 4 || w == 0 ||
+            h == 0 || x > 0xffff || y > 0xffff || w > 0xffff || h > 0xffff) {
+            return -1;
+        }
+        view->roi_x = x;
+        view->roi_y = y;
+        view->roi_w = w;
+        view->roi_h = h;
+    }
+
+    return 0;
+}
+
+int cam_view_is_full(const cam_view_t *view) {
+    return view->shift == 0 && view->roi_w == 0;
+}
+
+void cam_scale_scratch_init(cam_scale_scratch_t *scratch) {
+    pthread_mutex_init(&scratch->lock, NULL);
+    scratch->rgb = NULL;
+    scratch->cap = 0;
+}
+
+void cam_scaler_init(cam_scaler_t *scaler, cam_scale_scratch_t *scratch) {
+    memset(scaler, 0, sizeof(cam_scaler_t));
+    scaler->scratch = scratch;
+}
+
+void cam_scaler_uninit(cam_scaler_t *scaler) {
+    memset(scaler, 0, sizeof(cam_scaler_t));
+}
+
+// clip the roi to the frame and pick the output size, the scale is raised
+// until the result fits CAM_SCALE_MAX_PIXELS
+static int cam_scale_plan(cam_scaler_t *scaler, const cam_view_t *view,
+                          camera_fb_t *fb, uint16_t roi[4], int bpp) {
+    roi[0] = view->roi_x;
+    roi[1] = view->roi_y;
+    roi[2] = view->roi_w ? view->roi_w : fb->width;
+    roi[3] = view->roi_h ? view->roi_h : fb->height;
+    if (roi[0] >= fb->width || roi[1] >= fb->height) {
+        return -1;
+    }
+    if (roi[2] > fb->width - roi[0]) roi[2] = fb->width - roi[0];
+    if (roi[3] > fb->height - roi[1]) roi[3] = fb->height - roi[1];
+
+    int shift = view->shift;
+    while (shift < CAM_SCALE_MAX_SHIFT &&
+           (uint32_t)(roi[2] >> shift) * (roi[3] >> shift) >
+               CAM_SCALE_MAX_PIXELS) {
+        ++shift;
+    }
+    if (shift != view->shift && scaler->shift != shift) {
+        ESP_LOGW(SCALE_TAG, "view %ux%u too big at 1/%d, using 1/%d", roi[2],
+                 roi[3], 1 << view->shift, 1 << shift);
+    }
+
+    scaler->shift = shift;
+    scaler->out_w = roi[2] >> shift;
+    scaler->out_h = roi[3] >> shift;
+    scaler->crop_x = roi[0] >> shift;
+    scaler->crop_y = roi[1] >> shift;
+    size_t pixels = (size_t)scaler->out_w * scaler->out_h;
+    if (pixels == 0 || pixels > CAM_SCALE_MAX_PIXELS) {
+        return -1;
+    }
+
+    // grow-only, up to the biggest view of any stream
+    cam_scale_scratch_t *scratch = scaler->scratch;
+    if (pixels * bpp > scratch->cap) {
+        uint8_t *rgb = (uint8_t *)realloc(scratch->rgb, pixels * bpp);
+        if (rgb == NULL) {
+            ESP_LOGE(SCALE_TAG, "alloc %u bytes for scaled frame failed",
+                     pixels * bpp);
+            return -1;
+        }
+        scratch->rgb = rgb;
+        scratch->cap = pixels * bpp;
+    }
+    scaler->rgb = scratch->rgb;
+    return 0;
+}
+
+static size_t cam_scale_jpg_read(void *arg, size_t index, uint8_t *buf,
+                                 size_t len) {
+    cam_scale_jpg_t *jpg = (cam_scale_jpg_t *)arg;
+    if (index + len > jpg->len) {
+        len = jpg->len - index;
+    }
+    if (buf) {
+        memcpy(buf, jpg->buf + index, len);
+    }
+    return len;
+}
+
+static bool cam_scale_jpg_write(void *arg, uint16_t x, uint16_t y, uint16_t w,
+                                uint16_t h, uint8_t *data) {
+    cam_scaler_t *s = ((cam_scale_jpg_t *)arg)->scaler;
+    if (!data) {
+        if (x == 0 && y == 0) {
+            // start, w/h is the decoded size which may round down
+            if (s->crop_x >= w || s->crop_y >= h) {
+                return false;
+            }
+            if (s->out_w > w - s->crop_x) s->out_w = w - s->crop_x;
+            if (s->out_h > h - s->crop_y) s->out_h = h - s->crop_y;
+        }
+        return true;
+    }
+
+    // copy the part of the block that falls inside the crop window
+    int x0 = x > s->crop_x ? x : s->crop_x;
+    int x1 = x + w < s->crop_x + s->out_w ? x + w : s->crop_x + s->out_w;
+    int y0 = y > s->crop_y ? y : s->crop_y;
+    int y1 = y + h < s->crop_y + s->out_h ? y + h : s->crop_y + s->out_h;
+    for (int iy = y0; iy < y1; ++iy) {
+        const uint8_t *src = data + ((iy - y) * w + (x0 - x)) * 3;
+        uint8_t *dst =
+            s->rgb + ((iy - s->crop_y) * s->out_w + (x0 - s->crop_x)) * 3;
+        for (int ix = x0; ix < x1; ++ix, src += 3, dst += 3) {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+        }
+    }
+    return true;
+}
+
+// average (1 << shift)^2 source pixels per output pixel, YUV is averaged
+// before the conversion so it runs once per output pixel
+static void cam_scale_box(cam_scaler_t *s, camera_fb_t *fb,
+                          const uint16_t roi[4]) {
+    const int n = 1 << s->shift;
+    const int area_shift = s->shift * 2;
+    uint8_t *dst = s->rgb;
+
+    for (int oy = 0; oy < s->out_h; ++oy) {
+        int sy = roi[1] + (oy << s->shift);
+        for (int ox = 0; ox < s->out_w; ++ox) {
+            int sx = roi[0] + (ox << s->shift);
+            uint32_t a = 0, b = 0, c = 0;
+            for (int dy = 0; dy < n; ++dy) {
+                size_t i = (size_t)(sy + dy) * fb->width + sx;
+                for (int dx = 0; dx < n; ++dx, ++i) {
+                    if (fb->format == PIXFORMAT_GRAYSCALE) {
+                        a += fb->buf[i];
+                    } else if (fb->format == PIXFORMAT_YUV422) {
+                        const uint8_t *p = fb->buf + (i & ~(size_t)1) * 2;
+                        a += fb->buf[i * 2];  // YUYV
+                        b += p[1];
+                        c += p[3];
+                    } else {
+                        uint16_t p = (fb->buf[i * 2] << 8) | fb->buf[i * 2 + 1];
+                        a += (p >> 8) & 0xf8;
+                        b += (p >> 3) & 0xfc;
+                        c += (p << 3) & 0xf8;
+                    }
+                }
+            }
+            a >>= area_shift;
+            b >>= area_shift;
+            c >>= area_shift;
+
+            if (fb->format == PIXFORMAT_GRAYSCALE) {
+                *dst++ = a;
+            } else if (fb->format == PIXFORMAT_YUV422) {
+                int u = (int)b - 128, v = (int)c - 128;
+                *dst++ = clamp_u8(a + ((454 * u) >> 8));
+                *dst++ = clamp_u8(a - ((88 * u + 183 * v) >> 8));
+                *dst++ = clamp_u8(a + ((359 * v) >> 8));
+            } else {
+                *dst++ = c;
+                *dst++ = b;
+                *dst++ = a;
+            }
+        }
+    }
+}
+
+static cam_jpg_buf_t *cam_scale_frame_locked(cam_scaler_t *scaler,
+                                            camera_fb_t *fb,
+                                            const cam_view_t *view,
+                                            cam_jpg_pool_t *pool,
+                                            int quality) {
+    uint16_t roi[4];
+    pixformat_t format = PIXFORMAT_RGB888;
+    int bpp = 3;
+
+    if (fb->format == PIXFORMAT_GRAYSCALE) {
+        format = PIXFORMAT_GRAYSCALE;
+        bpp = 1;
+    } else if (fb->format != PIXFORMAT_JPEG &&
+               fb->format != PIXFORMAT_YUV422 &&
+               fb->format != PIXFORMAT_RGB565) {
+        ESP_LOGE(SCALE_TAG, "can not scale pixel format %d", fb->format);
+        return NULL;
+    }
+
+    if (cam_scale_plan(scaler, view, fb, roi, bpp) != 0) {
+        ESP_LOGE(SCALE_TAG, "view %u,%u,%u,%u outside of %ux%u frame",
+                 view->roi_x, view->roi_y, view->roi_w, view->roi_h,
+                 fb->width, fb->height);
+        return NULL;
+    }
+
+    if (fb->format == PIXFORMAT_JPEG) {
+        cam_scale_jpg_t jpg = {.scaler = scaler, .buf = fb->buf,
+                               .len = fb->len};
+        if (esp_jpg_decode(fb->len, (jpg_scale_t)scaler->shift,
+                           cam_scale_jpg_read, cam_scale_jpg_write,
+                           &jpg) != ESP_OK) {
+            ESP_LOGE(SCALE_TAG, "JPEG decode failed");
+            return NULL;
+        }
+    } else {
+        cam_scale_box(scaler, fb, roi);
+    }
+
+    return cam_jpg_encode_fmt(pool, scaler->rgb,
+                              (size_t)scaler->out_w * scaler->out_h * bpp,
+                              scaler->out_w, scaler->out_h, format, quality);
+}
+
+cam_jpg_buf_t *cam_scale_frame(cam_scaler_t *scaler, camera_fb_t *fb,
+                               const cam_view_t *view, cam_jpg_pool_t *pool,
+                               int quality) {
+    pthread_mutex_lock(&scaler->scratch->lock);
+    cam_jpg_buf_t *jpg = cam_scale_frame_locked(scaler, fb, view, pool,
+                                                quality);
+    pthread_mutex_unlock(&scaler->scratch->lock);
+    return jpg;
+}
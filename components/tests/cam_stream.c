@@ -0,0 +1,681 @@
+#include "cam_stream.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+
+#define STREAM_TAG "CAM_STREAM"
+
+#if CAM_JPG_POOL_SIZE < CAM_STREAM_WORKERS + 2
+#error "every stream worker, RTP and /snapshot need a JPEG buffer"
+#endif
+
+static const char *_STREAM_RESP_HEAD =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace;boundary=" PART_BOUNDARY "\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+static const char *_STREAM_PART_HEAD =
+    "\r\n--" PART_BOUNDARY "\r\n"
+    "Content-Type: image/jpeg\r\nContent-Length: %u\r\n"
+    "X-Timestamp: %ld.%06ld\r\nX-Frame-Seq: %u\r\nX-Scale: 1/%d\r\n"
+    "\r\n";
+
+#define WS_FIN 0x80
+
+// runs on the httpd task, the only send left to it is closing the session
+static void cam_stream_close_work(void *arg) {
+    cam_stream_t *stream = (cam_stream_t *)arg;
+    if (!__atomic_exchange_n(&stream->close_queued, 0, __ATOMIC_ACQ_REL)) {
+        return;  // the worker stopped waiting for it
+    }
+    if (!__atomic_load_n(&stream->closed, __ATOMIC_ACQUIRE)) {
+        httpd_sess_trigger_close(stream->pool->server, stream->fd);
+    }
+    xSemaphoreGive(stream->done);
+}
+
+static void cam_stream_close(cam_stream_t *stream) {
+    if (__atomic_load_n(&stream->closed, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&stream->close_queued, 1, __ATOMIC_RELEASE);
+    if (httpd_queue_work(stream->pool->server, cam_stream_close_work,
+                         stream) != ESP_OK) {
+        __atomic_store_n(&stream->close_queued, 0, __ATOMIC_RELEASE);
+        ESP_LOGW(STREAM_TAG, "close of socket(%d) not queued", stream->fd);
+        return;
+    }
+    if (xSemaphoreTake(stream->done,
+                       pdMS_TO_TICKS(CAM_STREAM_CLOSE_WAIT_MS)) == pdTRUE) {
+        return;
+    }
+    if (__atomic_exchange_n(&stream->close_queued, 0, __ATOMIC_ACQ_REL)) {
+        // httpd is stuck or stopped, the session goes whenever it does
+        ESP_LOGW(STREAM_TAG, "close of socket(%d) timed out", stream->fd);
+        return;
+    }
+    // the work got there first and gives done right away
+    xSemaphoreTake(stream->done, portMAX_DELAY);
+}
+
+static void cam_stream_put(cam_stream_t *stream) {
+    if (__atomic_sub_fetch(&stream->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        int fd = stream->fd;
+        __atomic_store_n(&stream->fd, -1, __ATOMIC_RELEASE);
+        close(fd);
+    }
+}
+
+void cam_stream_sess_close(cam_stream_pool_t *pool, int sockfd) {
+    for (int i = 0; i < CAM_STREAM_WORKERS; ++i) {
+        cam_stream_t *stream = &pool->streams[i];
+        if (__atomic_load_n(&stream->fd, __ATOMIC_ACQUIRE) == sockfd &&
+            !__atomic_load_n(&stream->closed, __ATOMIC_ACQUIRE)) {
+            // wakes a worker waiting in poll, the number stays taken
+            __atomic_store_n(&stream->closed, 1, __ATOMIC_RELEASE);
+            shutdown(sockfd, SHUT_RDWR);
+            cam_stream_put(stream);
+            return;
+        }
+    }
+    close(sockfd);
+}
+
+// the worker owns the socket after the response head, a client that does
+// not drain it costs this worker the deadline and nobody else anything
+static esp_err_t cam_stream_sendv(cam_stream_t *stream, struct iovec *iov,
+                                  int cnt, int64_t deadline) {
+    struct msghdr msg;
+
+    while (cnt > 0) {
+        if (__atomic_load_n(&stream->closed, __ATOMIC_ACQUIRE)) {
+            return ESP_FAIL;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        ssize_t n = sendmsg(stream->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        metrics_add(METRIC_CAM_STREAM_SEND_CALLS, 1);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                ESP_LOGW(STREAM_TAG, "send on socket(%d) failed, errno %d",
+                         stream->fd, errno);
+                return ESP_FAIL;
+            }
+            int left = (deadline - esp_timer_get_time()) / 1000;
+            if (left <= 0) {
+                ESP_LOGW(STREAM_TAG, "send on socket(%d) timed out",
+                         stream->fd);
+                return ESP_FAIL;
+            }
+            struct pollfd pfd = {.fd = stream->fd, .events = POLLOUT};
+            poll(&pfd, 1, left);
+            continue;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --cnt;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return ESP_OK;
+}
+
+// head and payload of a frame, within one deadline
+static esp_err_t cam_stream_send_frame(cam_stream_t *stream,
+                                       struct iovec *iov) {
+    int64_t deadline =
+        esp_timer_get_time() + CAM_STREAM_SEND_TIMEOUT_MS * 1000LL;
+#if CAM_STREAM_WRITEV
+    return cam_stream_sendv(stream, iov, 2, deadline);
+#else
+    if (cam_stream_sendv(stream, iov, 1, deadline) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    return cam_stream_sendv(stream, iov + 1, 1, deadline);
+#endif
+}
+
+// RFC 6455 server frame header, unmasked, returns its length
+static size_t cam_stream_ws_head(uint8_t *p, uint8_t opcode, uint64_t len) {
+    p[0] = WS_FIN | opcode;
+    if (len < 126) {
+        p[1] = len;
+        return 2;
+    }
+    if (len <= 0xffff) {
+        p[1] = 126;
+        p[2] = len >> 8;
+        p[3] = len;
+        return 4;
+    }
+    p[1] = 127;
+    for (int i = 0; i < 8; ++i) {
+        p[2 + i] = len >> ((7 - i) * 8);
+    }
+    return 10;
+}
+
+static esp_err_t cam_stream_ws_control(cam_stream_t *stream, uint8_t opcode,
+                                       const uint8_t *payload, size_t len) {
+    uint8_t head[2];
+    struct iovec iov[2] = {
+        {.iov_base = head, .iov_len = cam_stream_ws_head(head, opcode, len)},
+        {.iov_base = (void *)payload, .iov_len = len},
+    };
+    return cam_stream_send_frame(stream, iov);
+}
+
+// between frames, the worker answers what the handler took in for it
+static esp_err_t cam_stream_ws_poll(cam_stream_t *stream) {
+    if (__atomic_load_n(&stream->peer_closed, __ATOMIC_ACQUIRE)) {
+        uint8_t code[] = {0x03, 0xe8};  // 1000, normal closure
+        cam_stream_ws_control(stream, HTTPD_WS_TYPE_CLOSE, code,
+                              sizeof(code));
+        return ESP_FAIL;
+    }
+    int len = __atomic_load_n(&stream->pong_len, __ATOMIC_ACQUIRE);
+    if (len < 0) {
+        return ESP_OK;
+    }
+    esp_err_t res =
+        cam_stream_ws_control(stream, HTTPD_WS_TYPE_PONG, stream->pong, len);
+    __atomic_store_n(&stream->pong_len, -1, __ATOMIC_RELEASE);
+    return res;
+}
+
+esp_err_t cam_stream_begin(cam_stream_t *stream, httpd_req_t *req) {
+    stream->fd = httpd_req_to_sockfd(req);
+    if (stream->fd < 0) {
+        return ESP_FAIL;
+    }
+
+    // the handler runs on the httpd task, it may send directly
+    int len = strlen(_STREAM_RESP_HEAD);
+    return httpd_send(req, _STREAM_RESP_HEAD, len) == len ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t cam_stream_send_part(cam_stream_t *stream, uint32_t seq,
+                               const struct timeval *timestamp, int shift,
+                               const uint8_t *buf, size_t len) {
+    int hlen = snprintf(stream->head, sizeof(stream->head), _STREAM_PART_HEAD,
+                        len, (long)timestamp->tv_sec, (long)timestamp->tv_usec,
+                        seq, 1 << shift);
+    struct iovec iov[2] = {
+        {.iov_base = stream->head, .iov_len = hlen},
+        {.iov_base = (void *)buf, .iov_len = len},
+    };
+    return cam_stream_send_frame(stream, iov);
+}
+
+static uint8_t *cam_stream_put_be(uint8_t *p, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i) {
+        *p++ = v >> (i * 8);
+    }
+    return p;
+}
+
+esp_err_t cam_stream_send_message(cam_stream_t *stream, uint32_t seq,
+                                  int64_t capture_us, uint8_t flags,
+                                  int shift, const uint8_t *buf, size_t len) {
+    // frame header, message header and JPEG leave in one write
+    uint8_t *head = (uint8_t *)stream->head;
+    size_t hlen = cam_stream_ws_head(head, HTTPD_WS_TYPE_BINARY,
+                                     CAM_WS_HEADER_SIZE + len);
+    uint8_t *p = head + hlen;
+    *p++ = CAM_WS_VERSION;
+    *p++ = flags;
+    *p++ = shift;
+    *p++ = 0;
+    p = cam_stream_put_be(p, seq, 4);
+    p = cam_stream_put_be(p, capture_us, 8);
+    p = cam_stream_put_be(p, len, 4);
+
+    struct iovec iov[2] = {
+        {.iov_base = head, .iov_len = p - head},
+        {.iov_base = (void *)buf, .iov_len = len},
+    };
+    return cam_stream_send_frame(stream, iov);
+}
+
+static int cam_stream_bucket_allow(cam_stream_t *stream, int64_t now) {
+    if (stream->rate == 0) {
+        return 1;
+    }
+
+    stream->tokens += (now - stream->refill_us) * stream->rate / 1000000;
+    stream->refill_us = now;
+    if (stream->tokens > stream->burst) {
+        stream->tokens = stream->burst;
+    }
+    return stream->tokens >= 0;
+}
+
+static void cam_stream_serve(cam_stream_pool_t *pool, cam_stream_t *stream) {
+    cam_stream_pipeline_t *p = &pool->pipeline;
+    const cam_view_t *view = &stream->view;
+    cam_scaler_t scaler;
+    cam_frame_t *frame = NULL;
+    camera_fb_t *fb = NULL;
+    cam_jpg_buf_t *jpg = NULL;
+    esp_err_t res = ESP_OK;
+    size_t _jpg_buf_len;
+    uint8_t *_jpg_buf;
+    int64_t last_frame = esp_timer_get_time();
+
+    cam_ring_attach(p->ring);
+    uint32_t seq = cam_ring_latest_seq(p->ring);
+    uint32_t skipped = 0;
+    uint32_t sent = 0;
+    uint32_t sent_seq = 0;
+
+    cam_scaler_init(&scaler, &pool->scratch);
+    while (!__atomic_load_n(&stream->closed, __ATOMIC_ACQUIRE)) {
+        if (stream->ws && cam_stream_ws_poll(stream) != ESP_OK) {
+            break;
+        }
+        frame = cam_ring_acquire(p->ring, seq, CAM_FRAME_TIMEOUT_MS);
+        if (!frame) {
+            ESP_LOGE(STREAM_TAG, "Camera capture failed");
+            break;
+        }
+        skipped += frame->seq - seq - 1;
+        seq = frame->seq;
+        fb = frame->fb;
+
+        if (sent > 0 && !cam_frame_changed_since(frame, sent_seq)) {
+            // static scene, the client keeps showing the previous frame
+            metrics_add(METRIC_CAM_MOTION_SUPPRESSED, 1);
+            if (fb->format == PIXFORMAT_JPEG) {
+                metrics_add(METRIC_CAM_MOTION_BYTES_SAVED, fb->len);
+            }
+            cam_rate_on_static(p->rate);
+            cam_ring_release(p->ring, frame);
+            continue;
+        }
+
+        if (!cam_stream_bucket_allow(stream, esp_timer_get_time())) {
+            // over its rate, this client skips the frame, nobody waits
+            metrics_add(METRIC_CAM_STREAM_SHAPED_DROPS, 1);
+            __atomic_fetch_add(&stream->dropped, 1, __ATOMIC_RELAXED);
+            cam_ring_release(p->ring, frame);
+            continue;
+        }
+
+        if (stream->ws &&
+            __atomic_load_n(&stream->credits, __ATOMIC_ACQUIRE) <= 0) {
+            // the client is behind, drop here rather than in socket buffers
+            metrics_add(METRIC_CAM_WS_CREDIT_DROPS, 1);
+            __atomic_fetch_add(&stream->dropped, 1, __ATOMIC_RELAXED);
+            cam_ring_release(p->ring, frame);
+            continue;
+        }
+        ++sent;
+        sent_seq = seq;
+
+        int64_t send_begin = esp_timer_get_time();
+        int shift = 0;
+        if (!cam_view_is_full(view) || fb->format != PIXFORMAT_JPEG) {
+            jpg = cam_view_is_full(view)
+                      ? cam_jpg_encode(p->jpg_pool, fb, CAM_JPG_QUALITY)
+                      : cam_scale_frame(&scaler, fb, view, p->jpg_pool,
+                                        CAM_JPG_QUALITY);
+            if (!jpg) {
+                ESP_LOGE(STREAM_TAG, "JPEG compression failed");
+                cam_ring_release(p->ring, frame);
+                break;
+            }
+            // raised past the query when the view is too big, see
+            // CAM_SCALE_MAX_PIXELS
+            shift = cam_view_is_full(view) ? 0 : scaler.shift;
+            _jpg_buf_len = jpg->len;
+            _jpg_buf = jpg->buf;
+        } else {
+            _jpg_buf_len = fb->len;
+            _jpg_buf = fb->buf;
+        }
+
+        int64_t capture_time = frame->capture_us;
+        if (stream->ws) {
+            __atomic_fetch_sub(&stream->credits, 1, __ATOMIC_ACQ_REL);
+            res = cam_stream_send_message(
+                stream, seq, capture_time,
+                cam_view_is_full(view) ? 0 : CAM_WS_FLAG_SCALED, shift,
+                _jpg_buf, _jpg_buf_len);
+        } else {
+            res = cam_stream_send_part(stream, seq, &fb->timestamp, shift,
+                                       _jpg_buf, _jpg_buf_len);
+        }
+        if (jpg) {
+            cam_jpg_release(p->jpg_pool, jpg);
+            jpg = NULL;
+        }
+        cam_ring_release(p->ring, frame);
+        if (res != ESP_OK) {
+            break;
+        }
+        if (stream->rate) {
+            stream->tokens -= _jpg_buf_len;
+        }
+        __atomic_fetch_add(&stream->sent, 1, __ATOMIC_RELAXED);
+        int64_t fr_end = esp_timer_get_time();
+        cam_rate_on_frame(p->rate, seq, _jpg_buf_len, fr_end - send_begin);
+        int64_t frame_time = fr_end - last_frame;
+        last_frame = fr_end;
+        frame_time /= 1000;
+
+        metrics_add(METRIC_CAM_FRAMES_SENT, 1);
+        metrics_add(METRIC_CAM_BYTES_SENT, _jpg_buf_len);
+        metrics_observe(METRIC_CAM_FRAME_BYTES, _jpg_buf_len);
+        metrics_observe(METRIC_CAM_FRAME_INTERVAL_MS, frame_time);
+        metrics_observe(METRIC_CAM_SEND_MS, (fr_end - send_begin) / 1000);
+        metrics_observe(METRIC_CAM_CAPTURE_TO_SENT_MS,
+                        (fr_end - capture_time) / 1000);
+        ESP_LOGI(STREAM_TAG,
+                 "MJPG(%d): %uKB %ums (%.1ffps) seq %u skipped %u send %ums "
+                 "latency %ums",
+                 stream->fd, (uint32_t)(_jpg_buf_len / 1024),
+                 (uint32_t)frame_time, 1000.0 / (uint32_t)frame_time, seq,
+                 skipped, (uint32_t)((fr_end - send_begin) / 1000),
+                 (uint32_t)((fr_end - capture_time) / 1000));
+    }
+
+    cam_ring_detach(p->ring);
+    cam_scaler_uninit(&scaler);
+}
+
+// the session close frame for a WebSocket that can not be served
+static void cam_stream_ws_refuse(httpd_req_t *req) {
+    uint8_t code[] = {0x03, 0xf5};  // 1013, try again later
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_CLOSE,
+        .payload = code,
+        .len = sizeof(code),
+    };
+    httpd_ws_send_frame(req, &frame);
+}
+
+static void cam_stream_worker(void *params) {
+    cam_stream_pool_t *pool = (cam_stream_pool_t *)params;
+    cam_stream_t *stream;
+
+    metrics_register_task();
+    while (true) {
+        if (xQueueReceive(pool->queue, &stream, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        int fd = stream->fd;
+        ESP_LOGI(STREAM_TAG, "stream(%d) started%s", fd,
+                 stream->ws ? ", websocket" : "");
+        cam_stream_serve(pool, stream);
+        ESP_LOGI(STREAM_TAG, "stream(%d) finished, sent %u dropped %u", fd,
+                 stream->sent, stream->dropped);
+
+        // unless the client went first, httpd closes the session, the
+        // socket and the slot are let go once it is done with it as well
+        cam_stream_close(stream);
+        cam_stream_put(stream);
+    }
+}
+
+static int cam_stream_metric_sent(void *arg, int index, double *value) {
+    cam_stream_t *stream = &((cam_stream_pool_t *)arg)->streams[index];
+    if (__atomic_load_n(&stream->fd, __ATOMIC_ACQUIRE) == -1) {
+        return -1;
+    }
+    *value = __atomic_load_n(&stream->sent, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int cam_stream_metric_dropped(void *arg, int index, double *value) {
+    cam_stream_t *stream = &((cam_stream_pool_t *)arg)->streams[index];
+    if (__atomic_load_n(&stream->fd, __ATOMIC_ACQUIRE) == -1) {
+        return -1;
+    }
+    *value = __atomic_load_n(&stream->dropped, __ATOMIC_RELAXED);
+    return 0;
+}
+
+esp_err_t cam_stream_pool_start(cam_stream_pool_t *pool,
+                                httpd_handle_t server,
+                                const cam_stream_pipeline_t *pipeline) {
+    pool->server = server;
+    pool->pipeline = *pipeline;
+    cam_scale_scratch_init(&pool->scratch);
+    for (int i = 0; i < CAM_STREAM_WORKERS; ++i) {
+        pool->streams[i].pool = pool;
+        pool->streams[i].fd = -1;
+        pool->streams[i].done = xSemaphoreCreateBinary();
+        if (pool->streams[i].done == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    pool->queue = xQueueCreate(CAM_STREAM_WORKERS, sizeof(cam_stream_t *));
+    if (pool->queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < CAM_STREAM_WORKERS; ++i) {
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf(name, sizeof(name), "cam_stream%d", i);
+        if (xTaskCreate(cam_stream_worker, name, CAM_STREAM_TASK_STACK, pool,
+                        CAM_STREAM_TASK_PRIO, NULL) != pdPASS) {
+            ESP_LOGE(STREAM_TAG, "create stream worker %d failed", i);
+            return ESP_FAIL;
+        }
+    }
+
+    metrics_register_family("cam_stream_client_frames_sent",
+                            "Frames sent to the client of a stream slot",
+                            METRIC_TYPE_GAUGE, "stream", CAM_STREAM_WORKERS,
+                            cam_stream_metric_sent, pool);
+    metrics_register_family("cam_stream_client_frames_dropped",
+                            "Frames the client of a stream slot skipped",
+                            METRIC_TYPE_GAUGE, "stream", CAM_STREAM_WORKERS,
+                            cam_stream_metric_dropped, pool);
+    return ESP_OK;
+}
+
+// slots are taken on the httpd task only, given back by the last ref
+static cam_stream_t *cam_stream_claim(cam_stream_pool_t *pool, int fd) {
+    for (int i = 0; i < CAM_STREAM_WORKERS; ++i) {
+        cam_stream_t *stream = &pool->streams[i];
+        if (__atomic_load_n(&stream->fd, __ATOMIC_ACQUIRE) == -1) {
+            stream->fd = fd;
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+typedef struct _cam_stream_opts_t {
+    cam_view_t view;
+    uint32_t kbps;
+    uint32_t burst_kb;
+} cam_stream_opts_t;
+
+static int cam_stream_parse_query(httpd_req_t *req, cam_stream_opts_t *opts) {
+    char query[96];
+    char value[16];
+
+    opts->kbps = CAM_STREAM_DEFAULT_KBPS;
+    opts->burst_kb = CAM_STREAM_DEFAULT_BURST_KB;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+        query[0] = '\0';
+    }
+    if (query[0]) {
+        if (httpd_query_key_value(query, "kbps", value, sizeof(value)) ==
+            ESP_OK) {
+            opts->kbps = strtoul(value, NULL, 10);
+        }
+        if (httpd_query_key_value(query, "burst", value, sizeof(value)) ==
+            ESP_OK) {
+            opts->burst_kb = strtoul(value, NULL, 10);
+            if (opts->burst_kb == 0) {
+                return -1;
+            }
+        }
+    }
+    return cam_view_parse(&opts->view, query);
+}
+
+static void cam_stream_setup(cam_stream_t *stream,
+                             const cam_stream_opts_t *opts, int ws) {
+    stream->ws = ws;
+    stream->view = opts->view;
+    stream->rate = opts->kbps * 1000 / 8;
+    stream->burst = opts->burst_kb * 1024;
+    stream->tokens = stream->burst;
+    stream->refill_us = esp_timer_get_time();
+    stream->sent = 0;
+    stream->dropped = 0;
+    stream->closed = 0;
+    stream->close_queued = 0;
+    stream->peer_closed = 0;
+    stream->pong_len = -1;
+    stream->refs = 2;
+}
+
+// the slot outlives the session, its ref is put in cam_stream_sess_close
+static void cam_stream_sess_free(void *ctx) {}
+
+// the session holds its ref until httpd closes it, whoever ends the stream
+static void cam_stream_hand_over(cam_stream_pool_t *pool, cam_stream_t *stream,
+                                 httpd_req_t *req) {
+    req->sess_ctx = stream;
+    req->free_ctx = cam_stream_sess_free;
+    // a worker is free, so the queue has room
+    xQueueSend(pool->queue, &stream, 0);
+}
+
+esp_err_t cam_stream_submit(cam_stream_pool_t *pool, httpd_req_t *req) {
+    cam_stream_opts_t opts;
+    if (cam_stream_parse_query(req, &opts) != 0) {
+        httpd_resp_set_status(req, "400 Bad Request");
+        return httpd_resp_send(req, "bad scale, roi or burst",
+                               HTTPD_RESP_USE_STRLEN);
+    }
+
+    int fd = httpd_req_to_sockfd(req);
+    cam_stream_t *stream = fd < 0 ? NULL : cam_stream_claim(pool, fd);
+    if (stream == NULL) {
+        ESP_LOGW(STREAM_TAG, "all stream workers are busy");
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, "too many streams", HTTPD_RESP_USE_STRLEN);
+    }
+
+    cam_stream_setup(stream, &opts, 0);
+    if (cam_stream_begin(stream, req) != ESP_OK) {
+        __atomic_store_n(&stream->fd, -1, __ATOMIC_RELEASE);
+        return ESP_FAIL;
+    }
+
+    cam_stream_hand_over(pool, stream, req);
+    return ESP_OK;
+}
+
+static esp_err_t cam_stream_ws_start(cam_stream_pool_t *pool,
+                                     httpd_req_t *req) {
+    int fd = httpd_req_to_sockfd(req);
+    cam_stream_opts_t opts;
+
+    // httpd already answered the handshake, refuse with a close frame
+    if (cam_stream_parse_query(req, &opts) != 0) {
+        cam_stream_ws_refuse(req);
+        return ESP_FAIL;
+    }
+    cam_stream_t *stream = fd < 0 ? NULL : cam_stream_claim(pool, fd);
+    if (stream == NULL) {
+        ESP_LOGW(STREAM_TAG, "all stream workers are busy");
+        cam_stream_ws_refuse(req);
+        return ESP_FAIL;
+    }
+
+    cam_stream_setup(stream, &opts, 1);
+    __atomic_store_n(&stream->credits, CAM_WS_INITIAL_CREDITS,
+                     __ATOMIC_RELEASE);
+    cam_stream_hand_over(pool, stream, req);
+    return ESP_OK;
+}
+
+esp_err_t cam_stream_ws_handler(cam_stream_pool_t *pool, httpd_req_t *req) {
+    if (req->method == HTTP_GET) {
+        return cam_stream_ws_start(pool, req);
+    }
+
+    uint8_t buf[CAM_WS_CONTROL_MAX + 1];
+    httpd_ws_frame_t msg;
+    memset(&msg, 0, sizeof(msg));
+    if (httpd_ws_recv_frame(req, &msg, 0) != ESP_OK ||
+        msg.len >= sizeof(buf)) {
+        return ESP_FAIL;
+    }
+    msg.payload = buf;
+    if (httpd_ws_recv_frame(req, &msg, sizeof(buf) - 1) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    // set by cam_stream_ws_start, valid until httpd closes the session
+    cam_stream_t *stream = (cam_stream_t *)req->sess_ctx;
+    int credits = 0;
+    switch (msg.type) {
+    case HTTPD_WS_TYPE_TEXT:
+        buf[msg.len] = '\0';
+        credits = atoi((const char *)buf);
+        break;
+    case HTTPD_WS_TYPE_BINARY:
+        if (msg.len == 4) {
+            // big endian, a count above INT_MAX comes out negative, dropped
+            credits = (int)((uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+                            (uint32_t)buf[2] << 8 | (uint32_t)buf[3]);
+        }
+        break;
+    case HTTPD_WS_TYPE_PING:
+        // the worker writes the socket, it sends the PONG between frames,
+        // a PING arriving while one is due is covered by that one
+        if (stream == NULL) {
+            msg.type = HTTPD_WS_TYPE_PONG;
+            return httpd_ws_send_frame(req, &msg);
+        }
+        if (__atomic_load_n(&stream->pong_len, __ATOMIC_ACQUIRE) < 0) {
+            memcpy(stream->pong, buf, msg.len);
+            __atomic_store_n(&stream->pong_len, msg.len, __ATOMIC_RELEASE);
+        }
+        return ESP_OK;
+    case HTTPD_WS_TYPE_CLOSE:
+        if (stream == NULL) {
+            return ESP_FAIL;
+        }
+        // the worker answers and ends the session
+        __atomic_store_n(&stream->peer_closed, 1, __ATOMIC_RELEASE);
+        return ESP_OK;
+    default:
+        break;
+    }
+    if (stream == NULL || credits <= 0) {
+        return ESP_OK;
+    }
+
+    int now = __atomic_add_fetch(&stream->credits, credits, __ATOMIC_ACQ_REL);
+    if (now > CAM_WS_MAX_CREDITS) {
+        __atomic_fetch_sub(&stream->credits, now - CAM_WS_MAX_CREDITS,
+                           __ATOMIC_ACQ_REL);
+    }
+    return ESP_OK;
+}
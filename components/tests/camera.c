@@ -1,3 +1,12 @@
+#include "cam_encode.h"
+#include "cam_fake.h"
+#include "cam_rate.h"
+#include "cam_ring.h"
+#include "cam_rtp.h"
+#include "cam_stream.h"
+#include "metrics.h"
+#include "task_prof.h"
+#include "www.h"
 #include "esp_camera.h"
 #include "esp_http_server.h"
 #include "esp_log.h"
@@ -8,6 +17,8 @@
 #include "freertos/task.h"
 
 #include <nvs_flash.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
 
@@ -32,12 +43,8 @@
 
 #define CAM_TAG "CAMERA"
 
-#define PART_BOUNDARY "123456789000000000000987654321"
-static const char *_STREAM_CONTENT_TYPE =
-    "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
-static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-static const char *_STREAM_PART =
-    "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
+// /snapshot serves the newest frame without a capture while it is this fresh
+#define CAM_SNAPSHOT_MAX_AGE_MS 2000
 
 static camera_config_t camera_config = {
     .pin_pwdn = CAM_PIN_PWDN,
@@ -68,11 +75,33 @@ static camera_config_t camera_config = {
         FRAMESIZE_UXGA,  // QQVGA-QXGA Do not use sizes above QVGA when not JPEG
 
     .jpeg_quality = 12,  // 0-63 lower number means higher quality
-    .fb_count =
-        1  // if more than one, i2s runs in continuous mode. Use only with JPEG
+    .fb_count = 1  // sized by cam_ring_plan_fb_count in camera_init, if more
+                   // than one, i2s runs in continuous mode. Use only with JPEG
 };
 
-esp_err_t camera_init() {
+static cam_ring_t _cam_ring;
+static cam_rate_t _cam_rate;
+static cam_jpg_pool_t _cam_jpg_pool;
+static cam_stream_pool_t _cam_streams;
+#if CAM_FAKE_SOURCE
+static cam_fake_t _cam_fake;
+#endif
+static cam_rtp_t _cam_rtp;
+static uint32_t _cam_epoch;  // keeps ETags unique across reboots
+// camera_init runs at boot and again when Wi-Fi comes up
+static pthread_mutex_t _cam_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static int _cam_ready;
+
+static esp_err_t camera_init_locked() {
+#if CAM_FAKE_SOURCE
+    camera_config.frame_size = CAM_FAKE_FRAMESIZE;
+    camera_config.fb_count = CAM_RING_DEPTH + 1;
+    esp_err_t err = cam_fake_init(&_cam_fake, CAM_FAKE_FRAMESIZE, CAM_FAKE_FPS);
+    if (err != ESP_OK) {
+        ESP_LOGE(CAM_TAG, "Fake Camera Init Failed");
+        return err;
+    }
+#else
     // power up the camera if PWDN pin is defined
     if (CAM_PIN_PWDN != -1) {
         gpio_pad_select_gpio(CAM_PIN_PWDN);
@@ -80,16 +109,60 @@ esp_err_t camera_init() {
         gpio_set_level(CAM_PIN_PWDN, 0);
     }
 
+    // capture frame N+1 while frame N is on the wire
+    camera_config.fb_count =
+        cam_ring_plan_fb_count(&camera_config, CAM_RING_DEPTH);
+
     // initialize the camera
     esp_err_t err = esp_camera_init(&camera_config);
     if (err != ESP_OK) {
         ESP_LOGE(CAM_TAG, "Camera Init Failed");
         return err;
     }
+#endif
+
+    cam_rate_init(&_cam_rate, &camera_config);
+    cam_jpg_pool_init(&_cam_jpg_pool);
+    _cam_epoch = esp_random();
+
+    err = cam_ring_init(&_cam_ring, camera_config.fb_count);
+    if (err != ESP_OK) {
+        ESP_LOGE(CAM_TAG, "Camera Ring Init Failed");
+        return err;
+    }
+#if CAM_FAKE_SOURCE
+    cam_source_t source;
+    cam_fake_source(&_cam_fake, &source);
+    cam_ring_set_source(&_cam_ring, &source);
+#endif
+
+    if (xTaskCreatePinnedToCore(cam_capture_task, "cam_capture",
+                                CAM_CAPTURE_TASK_STACK, &_cam_ring,
+                                CAM_CAPTURE_TASK_PRIO, NULL,
+                                CAM_CAPTURE_TASK_CORE) != pdPASS) {
+        ESP_LOGE(CAM_TAG, "Camera Capture Task Create Failed");
+        return ESP_FAIL;
+    }
 
+    cam_ring_register_metrics(&_cam_ring);
+    cam_rate_register_metrics(&_cam_rate);
+    cam_jpg_register_metrics(&_cam_jpg_pool);
+
+    ESP_LOGI(CAM_TAG, "Camera ring depth %d, %d frame buffers",
+             _cam_ring.depth, _cam_ring.fb_count);
     return ESP_OK;
 }
 
+esp_err_t camera_init() {
+    pthread_mutex_lock(&_cam_init_lock);
+    esp_err_t err = _cam_ready ? ESP_OK : camera_init_locked();
+    if (err == ESP_OK) {
+        _cam_ready = 1;
+    }
+    pthread_mutex_unlock(&_cam_init_lock);
+    return err;
+}
+
 esp_err_t camera_capture() {
     // acquire a frame
     camera_fb_t *fb = esp_camera_fb_get();
@@ -106,71 +179,127 @@ esp_err_t camera_capture() {
 }
 
 esp_err_t jpg_stream_httpd_handler(httpd_req_t *req) {
-    camera_fb_t *fb = NULL;
-    esp_err_t res = ESP_OK;
-    size_t _jpg_buf_len;
-    uint8_t *_jpg_buf;
-    char *part_buf[64];
-    static int64_t last_frame = 0;
-    if (!last_frame) {
-        last_frame = esp_timer_get_time();
-    }
+    return cam_stream_submit(&_cam_streams, req);
+}
 
-    res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-    if (res != ESP_OK) {
-        return res;
-    }
+esp_err_t ws_stream_httpd_handler(httpd_req_t *req) {
+    return cam_stream_ws_handler(&_cam_streams, req);
+}
 
-    while (true) {
-        fb = esp_camera_fb_get();
-        if (!fb) {
-            ESP_LOGE(CAM_TAG, "Camera capture failed");
-            res = ESP_FAIL;
-            break;
-        }
-        if (fb->format != PIXFORMAT_JPEG) {
-            bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-            if (!jpeg_converted) {
-                ESP_LOGE(CAM_TAG, "JPEG compression failed");
-                esp_camera_fb_return(fb);
-                res = ESP_FAIL;
-            }
-        } else {
-            _jpg_buf_len = fb->len;
-            _jpg_buf = fb->buf;
-        }
+static void stream_httpd_close(httpd_handle_t hd, int sockfd) {
+    cam_stream_sess_close(&_cam_streams, sockfd);
+}
 
-        if (res == ESP_OK) {
-            res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY,
-                                        strlen(_STREAM_BOUNDARY));
+static esp_err_t rtp_send_stats(httpd_req_t *req) {
+    char resp[320];
+    pthread_mutex_lock(&_cam_rtp.lock);
+    snprintf(resp, sizeof(resp),
+             "{\"enabled\":%d,\"host\":\"%s\",\"port\":%u,\"frames\":%u,"
+             "\"packets\":%u,\"bytes\":%llu,\"unsupported\":%u,"
+             "\"errors\":%u,\"send_ms\":%.1f,\"last_send_ms\":%.1f}",
+             _cam_rtp.enabled, inet_ntoa(_cam_rtp.dest.sin_addr),
+             ntohs(_cam_rtp.dest.sin_port), _cam_rtp.frames, _cam_rtp.packets,
+             _cam_rtp.bytes, _cam_rtp.unsupported, _cam_rtp.errors,
+             _cam_rtp.frames ? _cam_rtp.send_us / 1000.0 / _cam_rtp.frames
+                             : 0.0,
+             _cam_rtp.last_send_us / 1000.0);
+    pthread_mutex_unlock(&_cam_rtp.lock);
+
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t rtp_httpd_handler(httpd_req_t *req) {
+    char query[64] = {0};
+    char value[32];
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "stop", value, sizeof(value)) ==
+            ESP_OK) {
+            cam_rtp_stop(&_cam_rtp);
+            return rtp_send_stats(req);
         }
-        if (res == ESP_OK) {
-            size_t hlen =
-                snprintf((char *)part_buf, 64, _STREAM_PART, _jpg_buf_len);
 
-            res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
+        struct in_addr addr;
+        int port = CAM_RTP_DEFAULT_PORT;
+        if (httpd_query_key_value(query, "host", value, sizeof(value)) !=
+                ESP_OK ||
+            inet_aton(value, &addr) == 0) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad host");
+            return ESP_FAIL;
         }
-        if (res == ESP_OK) {
-            res = httpd_resp_send_chunk(req, (const char *)_jpg_buf,
-                                        _jpg_buf_len);
+        if (httpd_query_key_value(query, "port", value, sizeof(value)) ==
+            ESP_OK) {
+            port = atoi(value);
         }
-        if (fb->format != PIXFORMAT_JPEG) {
-            free(_jpg_buf);
+        if (port <= 0 || port > 0xffff) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad port");
+            return ESP_FAIL;
         }
-        esp_camera_fb_return(fb);
-        if (res != ESP_OK) {
-            break;
+        cam_rtp_start(&_cam_rtp, addr.s_addr, port);
+    }
+
+    return rtp_send_stats(req);
+}
+
+esp_err_t rtp_stats_httpd_handler(httpd_req_t *req) {
+    return rtp_send_stats(req);
+}
+
+esp_err_t snapshot_httpd_handler(httpd_req_t *req) {
+    cam_frame_t *frame = cam_ring_acquire_latest(
+        &_cam_ring, CAM_SNAPSHOT_MAX_AGE_MS, CAM_FRAME_TIMEOUT_MS);
+    if (!frame) {
+        ESP_LOGE(CAM_TAG, "Camera capture failed");
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                            "capture failed");
+        return ESP_FAIL;
+    }
+
+    char etag[24];
+    char cache_control[24];
+    char if_none_match[24];
+    snprintf(etag, sizeof(etag), "\"%08x-%u\"", _cam_epoch, frame->seq);
+
+    int64_t age_ms = (esp_timer_get_time() - frame->capture_us) / 1000;
+    int fresh_s = age_ms < CAM_SNAPSHOT_MAX_AGE_MS
+                      ? (CAM_SNAPSHOT_MAX_AGE_MS - age_ms) / 1000
+                      : 0;
+    snprintf(cache_control, sizeof(cache_control), "max-age=%d", fresh_s);
+
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", cache_control);
+
+    esp_err_t res = ESP_OK;
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match,
+                                    sizeof(if_none_match)) == ESP_OK &&
+        strcmp(if_none_match, etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        res = httpd_resp_send(req, NULL, 0);
+    } else if (frame->fb->format != PIXFORMAT_JPEG) {
+        // the httpd task does not wait for a buffer, it has other requests
+        cam_jpg_buf_t *jpg = cam_jpg_lease(&_cam_jpg_pool, 0);
+        if (!jpg) {
+            httpd_resp_set_status(req, "503 Service Unavailable");
+            res = httpd_resp_send(req, "encoder busy", HTTPD_RESP_USE_STRLEN);
+        } else if (!(jpg = cam_jpg_encode_leased(&_cam_jpg_pool, jpg,
+                                                 frame->fb, CAM_JPG_QUALITY))) {
+            ESP_LOGE(CAM_TAG, "JPEG compression failed");
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                                "jpeg compression failed");
+            res = ESP_FAIL;
+        } else {
+            httpd_resp_set_type(req, "image/jpeg");
+            res = httpd_resp_send(req, (const char *)jpg->buf, jpg->len);
+            cam_jpg_release(&_cam_jpg_pool, jpg);
         }
-        int64_t fr_end = esp_timer_get_time();
-        int64_t frame_time = fr_end - last_frame;
-        last_frame = fr_end;
-        frame_time /= 1000;
-        ESP_LOGI(CAM_TAG, "MJPG: %uKB %ums (%.1ffps)",
-                 (uint32_t)(_jpg_buf_len / 1024), (uint32_t)frame_time,
-                 1000.0 / (uint32_t)frame_time);
+    } else {
+        httpd_resp_set_type(req, "image/jpeg");
+        res = httpd_resp_send(req, (const char *)frame->fb->buf,
+                              frame->fb->len);
     }
 
-    last_frame = 0;
+    cam_ring_release(&_cam_ring, frame);
     return res;
 }
 
@@ -182,6 +311,54 @@ esp_err_t get_handler(httpd_req_t *req) {
     return ESP_OK;
 }
 
+/* GET /camera/rate?mode=fps|kbps|off&target=N */
+esp_err_t rate_httpd_handler(httpd_req_t *req) {
+    char query[64] = {0};
+    char value[16];
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        int mode, target;
+        cam_rate_get_target(&_cam_rate, &mode, &target);
+        if (httpd_query_key_value(query, "mode", value, sizeof(value)) ==
+            ESP_OK) {
+            if (strcmp(value, "fps") == 0) {
+                mode = CAM_RATE_FPS;
+            } else if (strcmp(value, "kbps") == 0) {
+                mode = CAM_RATE_KBPS;
+            } else if (strcmp(value, "off") == 0) {
+                mode = CAM_RATE_OFF;
+            } else {
+                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad mode");
+                return ESP_FAIL;
+            }
+        }
+        if (httpd_query_key_value(query, "target", value, sizeof(value)) ==
+            ESP_OK) {
+            target = atoi(value);
+        }
+        if (mode != CAM_RATE_OFF && target <= 0) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad target");
+            return ESP_FAIL;
+        }
+        cam_rate_set_target(&_cam_rate, mode, target);
+    }
+
+    char resp[256];
+    pthread_mutex_lock(&_cam_rate.lock);
+    snprintf(resp, sizeof(resp),
+             "{\"mode\":%d,\"target\":%d,\"quality\":%d,\"framesize\":%d,"
+             "\"fps\":%.1f,\"kbps\":%.0f,\"send_ms\":%.1f,\"decision\":%d,"
+             "\"steps_up\":%u,\"steps_down\":%u}",
+             _cam_rate.mode, _cam_rate.target, _cam_rate.quality,
+             cam_rate_framesize(&_cam_rate), _cam_rate.fps, _cam_rate.kbps,
+             _cam_rate.send_ms, _cam_rate.last_decision, _cam_rate.steps_up,
+             _cam_rate.steps_down);
+    pthread_mutex_unlock(&_cam_rate.lock);
+
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
+}
+
 /* URI handler structure for GET /uri */
 httpd_uri_t uri_version = {.uri = "/version",
                            .method = HTTP_GET,
@@ -194,19 +371,84 @@ httpd_uri_t uri_camera = {.uri = "/camera",
                           .handler = jpg_stream_httpd_handler,
                           .user_ctx = NULL};
 
+httpd_uri_t uri_camera_ws = {.uri = "/camera/ws",
+                             .method = HTTP_GET,
+                             .handler = ws_stream_httpd_handler,
+                             .user_ctx = NULL,
+                             .is_websocket = true,
+                             .handle_ws_control_frames = true};
+
+httpd_uri_t uri_rtp = {.uri = "/rtp",
+                       .method = HTTP_GET,
+                       .handler = rtp_httpd_handler,
+                       .user_ctx = NULL};
+
+httpd_uri_t uri_rtp_stats = {.uri = "/rtp/stats",
+                             .method = HTTP_GET,
+                             .handler = rtp_stats_httpd_handler,
+                             .user_ctx = NULL};
+
+// everything else is looked up in the packed www/ assets
+httpd_uri_t uri_www = {.uri = "/*",
+                       .method = HTTP_GET,
+                       .handler = www_httpd_handler,
+                       .user_ctx = NULL};
+
+httpd_uri_t uri_camera_rate = {.uri = "/camera/rate",
+                               .method = HTTP_GET,
+                               .handler = rate_httpd_handler,
+                               .user_ctx = NULL};
+
+httpd_uri_t uri_snapshot = {.uri = "/snapshot",
+                            .method = HTTP_GET,
+                            .handler = snapshot_httpd_handler,
+                            .user_ctx = NULL};
+
+httpd_uri_t uri_metrics = {.uri = "/metrics",
+                           .method = HTTP_GET,
+                           .handler = metrics_httpd_handler,
+                           .user_ctx = NULL};
+
+httpd_uri_t uri_tasks = {.uri = "/tasks",
+                         .method = HTTP_GET,
+                         .handler = task_prof_httpd_handler,
+                         .user_ctx = NULL};
+
 /* Function for starting the webserver */
 httpd_handle_t start_webserver(void) {
     /* Generate default configuration */
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.max_uri_handlers = 12;
+    config.uri_match_fn = httpd_uri_match_wildcard;
+    config.close_fn = stream_httpd_close;
 
     /* Empty handle to esp_http_server */
     httpd_handle_t server = NULL;
 
     /* Start the httpd server */
     if (httpd_start(&server, &config) == ESP_OK) {
+        cam_stream_pipeline_t pipeline = {.ring = &_cam_ring,
+                                          .rate = &_cam_rate,
+                                          .jpg_pool = &_cam_jpg_pool};
+        if (cam_stream_pool_start(&_cam_streams, server, &pipeline) !=
+            ESP_OK) {
+            ESP_LOGE(CAM_TAG, "Start stream workers failed");
+        }
+        if (cam_rtp_init(&_cam_rtp, &pipeline) != ESP_OK) {
+            ESP_LOGE(CAM_TAG, "Start RTP sender failed");
+        }
+
         /* Register URI handlers */
         httpd_register_uri_handler(server, &uri_version);
         httpd_register_uri_handler(server, &uri_camera);
+        httpd_register_uri_handler(server, &uri_camera_ws);
+        httpd_register_uri_handler(server, &uri_camera_rate);
+        httpd_register_uri_handler(server, &uri_snapshot);
+        httpd_register_uri_handler(server, &uri_metrics);
+        httpd_register_uri_handler(server, &uri_tasks);
+        httpd_register_uri_handler(server, &uri_rtp);
+        httpd_register_uri_handler(server, &uri_rtp_stats);
+        httpd_register_uri_handler(server, &uri_www);  // must stay last
     }
     /* If server failed to start, handle will be NULL */
     return server;
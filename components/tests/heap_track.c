@@ -0,0 +1,286 @@
+#include "heap_track.h"
+
+#if HEAP_TRACK
+
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#define TRACK_TAG "HEAP_TRACK"
+
+#define HEAP_TRACK_MAGIC 0x4854
+#define HEAP_TRACK_DEAD 0xdead
+
+// in front of every tracked block, keeps the 8 byte alignment of the heap
+typedef struct _heap_track_hdr_t {
+    uint32_t size;
+    uint16_t tag;
+    uint16_t magic;
+} heap_track_hdr_t;
+
+static const char *_tag_names[HEAP_TAG_MAX] = {
+#define HEAP_TRACK_NAME(id, name) name,
+    HEAP_TRACK_TAG_LIST(HEAP_TRACK_NAME)
+#undef HEAP_TRACK_NAME
+};
+
+// counters are only touched with atomics, the allocation path takes no lock
+static heap_tag_stats_t _tags[HEAP_TAG_MAX];
+static uint32_t _classes[HEAP_TRACK_CLASSES];
+
+static pthread_mutex_t _sample_lock = PTHREAD_MUTEX_INITIALIZER;
+static heap_sample_t _samples[HEAP_TRACK_SAMPLES];
+static uint32_t _sample_written = 0;
+static esp_timer_handle_t _sample_timer = NULL;
+
+static int heap_track_class(size_t size) {
+    int cls = 0;
+    size_t limit = HEAP_TRACK_FIRST_CLASS;
+    while (size > limit && cls < HEAP_TRACK_CLASSES - 1) {
+        limit <<= 1;
+        ++cls;
+    }
+    return cls;
+}
+
+static void heap_track_add(heap_tag_stats_t *s, uint32_t size) {
+    uint32_t live =
+        __atomic_add_fetch(&s->live_bytes, size, __ATOMIC_RELAXED);
+    uint32_t peak = __atomic_load_n(&s->peak_bytes, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&s->peak_bytes, &peak, live, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void heap_track_count(heap_tag_stats_t *s, size_t size) {
+    __atomic_fetch_add(&s->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&_classes[heap_track_class(size)], 1,
+                       __ATOMIC_RELAXED);
+}
+
+void *heap_track_malloc(heap_tag_t tag, size_t size) {
+    if ((unsigned)tag >= HEAP_TAG_MAX) {
+        tag = HEAP_TAG_OTHER;
+    }
+    heap_tag_stats_t *s = &_tags[tag];
+
+    heap_track_hdr_t *hdr = NULL;
+    if (size <= UINT32_MAX - sizeof(heap_track_hdr_t)) {
+        hdr = (heap_track_hdr_t *)rc_malloc(sizeof(heap_track_hdr_t) + size);
+    }
+    if (hdr == NULL) {
+        __atomic_fetch_add(&s->fails, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    hdr->size = size;
+    hdr->tag = tag;
+    hdr->magic = HEAP_TRACK_MAGIC;
+
+    heap_track_add(s, size);
+    __atomic_fetch_add(&s->live_blocks, 1, __ATOMIC_RELAXED);
+    heap_track_count(s, size);
+    return hdr + 1;
+}
+
+void heap_track_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    heap_track_hdr_t *hdr = (heap_track_hdr_t *)ptr - 1;
+    if (hdr->magic != HEAP_TRACK_MAGIC || hdr->tag >= HEAP_TAG_MAX) {
+        // a leak shows up in the counters, a bad free corrupts the heap
+        LOGE(TRACK_TAG, "free of untracked or freed block %p", ptr);
+        return;
+    }
+    hdr->magic = HEAP_TRACK_DEAD;
+
+    heap_tag_stats_t *s = &_tags[hdr->tag];
+    __atomic_fetch_sub(&s->live_bytes, hdr->size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&s->live_blocks, 1, __ATOMIC_RELAXED);
+    rc_free(hdr);
+}
+
+void heap_track_resize(heap_tag_t tag, size_t old_size, size_t new_size) {
+    if ((unsigned)tag >= HEAP_TAG_MAX || old_size == new_size) {
+        return;
+    }
+    heap_tag_stats_t *s = &_tags[tag];
+
+    if (new_size > old_size) {
+        heap_track_add(s, new_size - old_size);
+        heap_track_count(s, new_size);  // a grow is a new block
+    } else {
+        __atomic_fetch_sub(&s->live_bytes, old_size - new_size,
+                           __ATOMIC_RELAXED);
+    }
+    if (old_size == 0) {
+        __atomic_fetch_add(&s->live_blocks, 1, __ATOMIC_RELAXED);
+    } else if (new_size == 0) {
+        __atomic_fetch_sub(&s->live_blocks, 1, __ATOMIC_RELAXED);
+    }
+}
+
+const char *heap_track_tag_name(heap_tag_t tag) {
+    return (unsigned)tag < HEAP_TAG_MAX ? _tag_names[tag] : "unknown";
+}
+
+void heap_track_stats(heap_tag_t tag, heap_tag_stats_t *stats) {
+    memset(stats, 0, sizeof(heap_tag_stats_t));
+    if ((unsigned)tag >= HEAP_TAG_MAX) {
+        return;
+    }
+    heap_tag_stats_t *s = &_tags[tag];
+    stats->live_bytes = __atomic_load_n(&s->live_bytes, __ATOMIC_RELAXED);
+    stats->live_blocks = __atomic_load_n(&s->live_blocks, __ATOMIC_RELAXED);
+    stats->peak_bytes = __atomic_load_n(&s->peak_bytes, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&s->allocs, __ATOMIC_RELAXED);
+    stats->fails = __atomic_load_n(&s->fails, __ATOMIC_RELAXED);
+}
+
+uint32_t heap_track_class_allocs(int cls) {
+    if (cls < 0 || cls >= HEAP_TRACK_CLASSES) {
+        return 0;
+    }
+    return __atomic_load_n(&_classes[cls], __ATOMIC_RELAXED);
+}
+
+void heap_track_sample(void) {
+    heap_sample_t sample;
+    sample.time_us = esp_timer_get_time();
+    sample.free_bytes = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    sample.largest_free = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+    pthread_mutex_lock(&_sample_lock);
+    _samples[_sample_written % HEAP_TRACK_SAMPLES] = sample;
+    ++_sample_written;
+    pthread_mutex_unlock(&_sample_lock);
+}
+
+int heap_track_samples(heap_sample_t *out, int count) {
+    pthread_mutex_lock(&_sample_lock);
+    uint32_t n = _sample_written < HEAP_TRACK_SAMPLES ? _sample_written
+                                                      : HEAP_TRACK_SAMPLES;
+    if (count < 0) {
+        count = 0;
+    }
+    if (n > (uint32_t)count) {
+        n = count;
+    }
+    // the newest n, oldest first
+    for (uint32_t i = 0; i < n; ++i) {
+        out[i] = _samples[(_sample_written - n + i) % HEAP_TRACK_SAMPLES];
+    }
+    pthread_mutex_unlock(&_sample_lock);
+    return n;
+}
+
+static void heap_track_on_timer(void *arg) { heap_track_sample(); }
+
+static int heap_track_metric_tag(void *arg, int index, double *value) {
+    const uint32_t *field =
+        (const uint32_t *)((const char *)&_tags[index] + (size_t)arg);
+    *value = __atomic_load_n(field, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int heap_track_metric_class(void *arg, int index, double *value) {
+    *value = heap_track_class_allocs(index);
+    return 0;
+}
+
+static double heap_track_metric_largest(void *arg) {
+    return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+}
+
+static double heap_track_metric_largest_min(void *arg) {
+    heap_sample_t samples[HEAP_TRACK_SAMPLES];
+    int n = heap_track_samples(samples, HEAP_TRACK_SAMPLES);
+    uint32_t low = n > 0 ? samples[0].largest_free : 0;
+    for (int i = 1; i < n; ++i) {
+        if (samples[i].largest_free < low) {
+            low = samples[i].largest_free;
+        }
+    }
+    return low;
+}
+
+// change of the largest free block per hour, negative while it fragments
+static double heap_track_metric_trend(void *arg) {
+    heap_sample_t samples[HEAP_TRACK_SAMPLES];
+    int n = heap_track_samples(samples, HEAP_TRACK_SAMPLES);
+    if (n < 2 || samples[n - 1].time_us <= samples[0].time_us) {
+        return 0;
+    }
+
+    // least squares slope, one sample off does not swing it
+    double mean_t = 0, mean_v = 0;
+    for (int i = 0; i < n; ++i) {
+        mean_t += (samples[i].time_us - samples[0].time_us) / 1e6;
+        mean_v += samples[i].largest_free;
+    }
+    mean_t /= n;
+    mean_v /= n;
+
+    double num = 0, den = 0;
+    for (int i = 0; i < n; ++i) {
+        double t = (samples[i].time_us - samples[0].time_us) / 1e6 - mean_t;
+        num += t * (samples[i].largest_free - mean_v);
+        den += t * t;
+    }
+    return den > 0 ? num / den * 3600 : 0;
+}
+
+void heap_track_init(void) {
+    static int inited = 0;
+    if (__atomic_exchange_n(&inited, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    metrics_register_family(
+        "heap_live_bytes", "Bytes held by tracked blocks, by heap_track tag",
+        METRIC_TYPE_GAUGE, "tag", HEAP_TAG_MAX, heap_track_metric_tag,
+        (void *)offsetof(heap_tag_stats_t, live_bytes));
+    metrics_register_family(
+        "heap_peak_bytes", "Most bytes a tag has held at once",
+        METRIC_TYPE_GAUGE, "tag", HEAP_TAG_MAX, heap_track_metric_tag,
+        (void *)offsetof(heap_tag_stats_t, peak_bytes));
+    metrics_register_family(
+        "heap_allocs_total", "Tracked allocations and grows, by tag",
+        METRIC_TYPE_COUNTER, "tag", HEAP_TAG_MAX, heap_track_metric_tag,
+        (void *)offsetof(heap_tag_stats_t, allocs));
+    metrics_register_family("heap_class_allocs_total",
+                            "Tracked allocations of up to 16 << class bytes",
+                            METRIC_TYPE_COUNTER, "class", HEAP_TRACK_CLASSES,
+                            heap_track_metric_class, NULL);
+    metrics_register_value("heap_largest_free_bytes",
+                           "Largest free block of the 8 bit heap",
+                           METRIC_TYPE_GAUGE, heap_track_metric_largest,
+                           NULL);
+    metrics_register_value("heap_largest_free_min_bytes",
+                           "Smallest largest free block of the samples",
+                           METRIC_TYPE_GAUGE, heap_track_metric_largest_min,
+                           NULL);
+    metrics_register_value("heap_largest_free_trend_bytes_per_hour",
+                           "Slope of the largest free block over the samples",
+                           METRIC_TYPE_GAUGE, heap_track_metric_trend, NULL);
+
+    heap_track_sample();
+    esp_timer_create_args_t args = {
+        .callback = heap_track_on_timer,
+        .name = "heap_track",
+    };
+    if (esp_timer_create(&args, &_sample_timer) != ESP_OK ||
+        esp_timer_start_periodic(_sample_timer,
+                                 HEAP_TRACK_SAMPLE_MS * 1000LL) != ESP_OK) {
+        LOGE(TRACK_TAG, "start heap sampling timer failed");
+    }
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef _DEMO_BT_DEVTAB_H_
+#define _DEMO_BT_DEVTAB_H_
+
+#include <stdint.h>
+
+#include "esp_gap_bt_api.h"
+
+// devices kept per scan, the index grows up to twice this
+#define BT_DEVTAB_MAX_DEVICES 128
+// entries are allocated in chunks that never move
+#define BT_DEVTAB_CHUNK 16
+#define BT_DEVTAB_MIN_SLOTS 32
+
+#define BT_DEVTAB_NAME_ARENA 2048
+#define BT_DEVTAB_NAME_MAX 64  // longer names are cut
+
+#define BT_DEVTAB_RSSI_INVALID -129
+#define BT_DEVTAB_TX_POWER_UNKNOWN 127
+
+// expiry timer wheel, one slot per second, must exceed any ttl
+#define BT_DEVTAB_WHEEL_SLOTS 128
+
+typedef struct _bt_device_t {
+    esp_bd_addr_t bda;
+    char bda_str[18];  // formatted once when the device is added
+    const char *name;  // in the name arena, "" until one is seen
+    uint32_t name_hash;  // bt_eir_name_hash of name, 0 while unnamed
+    int32_t rssi;
+    int32_t rssi_avg;  // dBm * 16, averaged over the inquiry responses
+    uint16_t seen;     // inquiry responses with rssi
+    int8_t tx_power;   // from EIR, BT_DEVTAB_TX_POWER_UNKNOWN if never sent
+    uint8_t eir;       // BT_EIR_* bits of the last EIR seen
+    uint32_t cod;
+    uint32_t last_seen;  // tick of the last discovery result
+} bt_device_t;
+
+/**
+ * Devices found by discovery, keyed by the 48 bit address as an integer.
+ * The index is open addressed (linear probing) and only holds entry
+ * numbers, so growing it does not move the entries that callers point to.
+ * Expiry does, the last entry fills the hole, so pointers are only good
+ * until the next bt_devtab_expire.
+ *
+ * With a ttl every entry sits on the wheel slot of the tick it expires at,
+ * being seen again moves it, and each tick only looks at its own slot.
+ */
+typedef struct _bt_devtab_t {
+    bt_device_t *chunks[BT_DEVTAB_MAX_DEVICES / BT_DEVTAB_CHUNK];
+    int count;
+    int max_devices;
+
+    uint64_t *keys;  // per entry, compared while probing
+    uint16_t *slots;  // entry + 1, 0 is empty
+    int slot_bits;
+
+    char *names;
+    int names_used;
+    int names_dead;  // bytes of names no entry points to any more
+
+    uint32_t ttl;  // ticks, 0 keeps devices until cleared
+    uint32_t now;
+    uint16_t wheel[BT_DEVTAB_WHEEL_SLOTS];  // entry + 1 of the list head
+    uint16_t *wheel_next;                   // per entry, entry + 1
+    uint16_t *wheel_prev;
+
+    uint32_t rejected;  // new devices while the table was full
+    uint32_t probes;    // total probe steps, for tuning the load factor
+    uint32_t expired;
+} bt_devtab_t;
+
+/* copy of the table, names included, owned by the caller */
+typedef struct _bt_devtab_snapshot_t {
+    uint32_t now;
+    int count;
+    bt_device_t *devices;
+} bt_devtab_snapshot_t;
+
+int bt_devtab_init(bt_devtab_t *tab, int max_devices);
+
+void bt_devtab_uninit(bt_devtab_t *tab);
+
+/* forget every device, memory is kept for the next scan */
+void bt_devtab_clear(bt_devtab_t *tab);
+
+/* set before the first upsert, at most BT_DEVTAB_WHEEL_SLOTS - 1 */
+void bt_devtab_set_ttl(bt_devtab_t *tab, uint32_t ttl);
+
+/* advance to tick now, drop devices not seen for ttl, returns how many */
+int bt_devtab_expire(bt_devtab_t *tab, uint32_t now);
+
+bt_device_t *bt_devtab_find(bt_devtab_t *tab, const uint8_t *bda);
+
+/**
+ * find or add, *created tells which, NULL when the table is full. Either
+ * way the device counts as seen at the current tick.
+ */
+bt_device_t *bt_devtab_upsert(bt_devtab_t *tab, const uint8_t *bda,
+                              int *created);
+
+/**
+ * copy name into the arena unless hash says the device already has it, the
+ * device keeps its old name if the arena is full
+ */
+const char *bt_devtab_set_name(bt_devtab_t *tab, bt_device_t *device,
+                               const char *name, int len, uint32_t hash);
+
+/* one allocation, release it with bt_devtab_snapshot_free */
+bt_devtab_snapshot_t *bt_devtab_snapshot(bt_devtab_t *tab);
+
+void bt_devtab_snapshot_free(bt_devtab_snapshot_t *snap);
+
+static inline bt_device_t *bt_devtab_at(bt_devtab_t *tab, int index) {
+    return &tab->chunks[index / BT_DEVTAB_CHUNK][index % BT_DEVTAB_CHUNK];
+}
+
+#endif
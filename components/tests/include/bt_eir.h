@@ -0,0 +1,40 @@
+#ifndef _DEMO_BT_EIR_H_
+#define _DEMO_BT_EIR_H_
+
+#include <stdint.h>
+
+// 16 bit service UUIDs kept per result, the rest are only counted
+#define BT_EIR_MAX_UUID16 8
+
+#define BT_EIR_UUID_AUDIO_SINK 0x110B
+
+#define BT_EIR_HAS_NAME 0x01
+#define BT_EIR_NAME_COMPLETE 0x02
+#define BT_EIR_HAS_FLAGS 0x04
+#define BT_EIR_HAS_TX_POWER 0x08
+#define BT_EIR_AUDIO_SINK 0x10  // Audio Sink UUID listed
+#define BT_EIR_MALFORMED 0x80   // a field ran past the data, rest ignored
+
+/* fields of one EIR block, the name points into the parsed data */
+typedef struct _bt_eir_t {
+    uint8_t present;  // BT_EIR_*
+    uint8_t flags;    // AD flags field
+    int8_t tx_power;
+    uint8_t name_len;
+    const char *name;  // not NUL terminated
+    uint32_t name_hash;
+    uint8_t uuid16_count;
+    uint8_t uuid_other;  // 32 and 128 bit UUIDs
+    uint16_t uuid16[BT_EIR_MAX_UUID16];
+} bt_eir_t;
+
+/**
+ * Walk the length/type/value fields once. A complete name wins over a
+ * shortened one whatever their order. Returns the BT_EIR_* bits.
+ */
+int bt_eir_parse(const uint8_t *data, int len, bt_eir_t *eir);
+
+/* FNV-1a, to tell a repeated name from a changed one without comparing */
+uint32_t bt_eir_name_hash(const char *name, int len);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _DEMO_BT_GAP_QUEUE_H_
+#define _DEMO_BT_GAP_QUEUE_H_
+
+#include <stdint.h>
+
+#include "bt_devtab.h"
+#include "esp_gap_bt_api.h"
+
+// power of two, one slot is about 330 bytes
+#define BT_GAP_QUEUE_DEPTH 8
+
+#define BT_GAP_DISC_COD 0x01
+#define BT_GAP_DISC_RSSI 0x02
+#define BT_GAP_DISC_NAME 0x04
+#define BT_GAP_DISC_EIR 0x08
+
+/* a discovery result copied out of the Bluedroid callback */
+typedef struct _bt_gap_disc_t {
+    esp_bd_addr_t bda;
+    uint8_t flags;
+    int8_t rssi;
+    uint32_t cod;
+    uint8_t name_len;
+    uint8_t eir_len;
+    char name[BT_DEVTAB_NAME_MAX];
+    uint8_t eir[ESP_BT_GAP_EIR_DATA_LEN];
+} bt_gap_disc_t;
+
+/**
+ * Single producer (the Bluedroid callback task) single consumer queue, the
+ * producer never blocks and drops the result when the queue is full.
+ */
+typedef struct _bt_gap_queue_t {
+    bt_gap_disc_t items[BT_GAP_QUEUE_DEPTH];
+    uint32_t head;  // written by the consumer
+    uint32_t tail;  // written by the producer
+    uint32_t drops;
+    uint32_t peak;
+} bt_gap_queue_t;
+
+void bt_gap_queue_init(bt_gap_queue_t *q);
+
+/* producer side, 0 on success, -1 if the result was dropped */
+int bt_gap_queue_push(bt_gap_queue_t *q, const esp_bd_addr_t bda,
+                      int num_prop, const esp_bt_gap_dev_prop_t *prop);
+
+/* consumer side, the item stays valid until the next pop */
+bt_gap_disc_t *bt_gap_queue_peek(bt_gap_queue_t *q);
+
+void bt_gap_queue_pop(bt_gap_queue_t *q);
+
+uint32_t bt_gap_queue_depth(bt_gap_queue_t *q);
+
+void bt_gap_queue_register_metrics(bt_gap_queue_t *q);
+
+#endif
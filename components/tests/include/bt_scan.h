@@ -0,0 +1,24 @@
+#ifndef _DEMO_BT_SCAN_H_
+#define _DEMO_BT_SCAN_H_
+
+#include "bt_devtab.h"
+
+// until a sink connects discovery keeps running at a low duty cycle, the
+// first inquiry is BT_SINK_SCAN_WINDOW long, later ones this long (1.28s
+// units) once per period
+#define BT_SCAN_IDLE_WINDOW 0x04
+#define BT_SCAN_IDLE_PERIOD_MS (30 * 1000)
+
+// a device missing from this many seconds of results is dropped
+#define BT_SCAN_DEVICE_TTL_S 90
+
+int bt_init();
+
+int bt_uninit();
+
+void bt_scan_test(void *pvParameters);
+
+/* devices of the running scan, NULL if there is none */
+bt_devtab_snapshot_t *bt_scan_snapshot(void);
+
+#endif
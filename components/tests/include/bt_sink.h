@@ -0,0 +1,105 @@
+#ifndef _DEMO_BT_SINK_H_
+#define _DEMO_BT_SINK_H_
+
+#include <stdint.h>
+
+#include "bt_devtab.h"
+#include "esp_gap_bt_api.h"
+
+#define BT_SINK_NVS_NAMESPACE "btsink"
+#define BT_SINK_NVS_KEY "stats"
+#define BT_SINK_NVS_RECENT_KEY "recent"
+#define BT_SINK_MAX_KNOWN 8
+// sinks tried at boot without inquiry, most recently connected first
+#define BT_SINK_MAX_RECENT 3
+// a known sink that does not answer the page in time is skipped
+#define BT_SINK_CONNECT_TIMEOUT_MS 6000
+
+// inquiry length in 1.28s units, the whole window is scanned and the best
+// candidate is picked afterwards
+#define BT_SINK_SCAN_WINDOW 0x08
+// a sink that connected before and scores this well ends the scan early
+#define BT_SINK_GOOD_SCORE 80
+
+// rssi average, a new sample weighs 1/4
+#define BT_SINK_RSSI_EWMA_SHIFT 2
+#define BT_SINK_RSSI_FLOOR -95
+#define BT_SINK_RSSI_CEIL -45
+
+// score weights in percent
+#define BT_SINK_WEIGHT_RSSI 50
+#define BT_SINK_WEIGHT_SUCCESS 30
+#define BT_SINK_WEIGHT_UNDERRUN 20
+// score points lost per underrun per minute of playback
+#define BT_SINK_UNDERRUN_PENALTY 10
+
+/* what we remember about a sink across reboots */
+typedef struct _bt_sink_stats_t {
+    esp_bd_addr_t bda;
+    uint16_t attempts;
+    uint16_t successes;
+    uint32_t underruns;
+    uint32_t play_seconds;
+    uint32_t last_used;  // generation, the oldest entry is replaced
+} bt_sink_stats_t;
+
+typedef enum {
+    BT_SINK_PATH_KNOWN = 0,  // connected to a remembered sink, no inquiry
+    BT_SINK_PATH_INQUIRY,
+    BT_SINK_PATH_MAX
+} bt_sink_path_t;
+
+/* read the persisted stats, NVS must be initialized */
+void bt_sink_load(void);
+
+/* sinks that connected before, most recent first, returns the count */
+int bt_sink_recent(esp_bd_addr_t *bda, int max);
+
+/* how the next connection was found, for the boot latency metrics */
+void bt_sink_set_path(bt_sink_path_t path);
+
+/**
+ * 0 once the A2DP link to bda is up, -1 after timeout_ms. A link to any
+ * other sink does not count, the attempt is written to NVS on timeout.
+ */
+int bt_sink_wait_connected(const uint8_t *bda, int timeout_ms);
+
+/* fold an inquiry rssi sample into the device average */
+void bt_sink_observe_rssi(bt_device_t *device, int8_t rssi);
+
+/* 0..100, from average rssi, connect success rate and underrun rate */
+int bt_sink_score(const bt_device_t *device);
+
+/* rendering service in the COD or Audio Sink UUID in the EIR */
+int bt_sink_is_candidate(const bt_device_t *device);
+
+/**
+ * 1 if the inquiry can stop for this device, only a candidate with a
+ * successful connection on record qualifies, never one seen for the first
+ * time however strong its signal
+ */
+int bt_sink_ends_scan(const bt_device_t *device);
+
+/* best rendering device of the snapshot, NULL if there is none */
+const bt_device_t *bt_sink_pick(const bt_devtab_snapshot_t *snap);
+
+/* counted in memory, persisted with the outcome of the attempt */
+void bt_sink_on_attempt(const uint8_t *bda);
+
+/**
+ * 0 if bda is the sink being attempted, -1 for a link nobody waits for,
+ * such as a late answer to an attempt that timed out. The caller drops
+ * that link, it is not recorded.
+ */
+int bt_sink_on_connected(const uint8_t *bda);
+
+/* ignored unless bda is the connected sink */
+void bt_sink_on_disconnected(const uint8_t *bda);
+
+/* called from the A2DP data callback, must stay cheap */
+void bt_sink_on_underrun(void);
+
+/* move the running session into the stats and persist them */
+void bt_sink_checkpoint(void);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _DEMO_CAM_ENCODE_H_
+#define _DEMO_CAM_ENCODE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_camera.h"
+
+// a buffer for each stream worker, RTP and /snapshot, checked in
+// cam_stream.c, so leases only wait for a release in progress
+#define CAM_JPG_POOL_SIZE 5
+#define CAM_JPG_LEASE_TIMEOUT_MS 2000
+#define CAM_JPG_QUALITY 80
+// buffers grow in these steps so a slightly bigger frame does not realloc
+#define CAM_JPG_GROW_ALIGN 4096
+
+typedef struct _cam_jpg_buf_t {
+    uint8_t *buf;
+    size_t cap;
+    size_t len;
+    int in_use;
+} cam_jpg_buf_t;
+
+/**
+ * persistent, grow-only output buffers for frame2jpg, so converting raw
+ * frames does not malloc/free a JPEG per frame
+ */
+typedef struct _cam_jpg_pool_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    cam_jpg_buf_t bufs[CAM_JPG_POOL_SIZE];
+
+    size_t peak;  // biggest JPEG produced so far
+    uint32_t allocs;
+    uint32_t encodes;
+} cam_jpg_pool_t;
+
+void cam_jpg_pool_init(cam_jpg_pool_t *pool);
+
+/* frees the buffers, none may be leased any more */
+void cam_jpg_pool_uninit(cam_jpg_pool_t *pool);
+
+/* a free buffer, NULL if none is released within timeout_ms */
+cam_jpg_buf_t *cam_jpg_lease(cam_jpg_pool_t *pool, int timeout_ms);
+
+/* encode fb into out, leased from pool, out is released on failure */
+cam_jpg_buf_t *cam_jpg_encode_leased(cam_jpg_pool_t *pool, cam_jpg_buf_t *out,
+                                     camera_fb_t *fb, int quality);
+
+/**
+ * encode fb into a buffer leased within CAM_JPG_LEASE_TIMEOUT_MS, NULL if
+ * none came free or the encoder failed
+ */
+cam_jpg_buf_t *cam_jpg_encode(cam_jpg_pool_t *pool, camera_fb_t *fb,
+                              int quality);
+
+/* same as cam_jpg_encode for a pixel buffer that is not a driver frame */
+cam_jpg_buf_t *cam_jpg_encode_fmt(cam_jpg_pool_t *pool, uint8_t *src,
+                                  size_t len, uint16_t width, uint16_t height,
+                                  pixformat_t format, int quality);
+
+void cam_jpg_release(cam_jpg_pool_t *pool, cam_jpg_buf_t *buf);
+
+void cam_jpg_register_metrics(cam_jpg_pool_t *pool);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _DEMO_CAM_FAKE_H_
+#define _DEMO_CAM_FAKE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cam_ring.h"
+#include "esp_camera.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+// replace the OV2640 by canned frames, for boards without a sensor
+#ifndef CAM_FAKE_SOURCE
+#define CAM_FAKE_SOURCE 0
+#endif
+
+#ifndef CAM_FAKE_FPS
+#define CAM_FAKE_FPS 15
+#endif
+#define CAM_FAKE_FRAMES 8
+// generated as YUV422 so the JPEGs are YCbCr like the sensor ones, RTP
+// needs that, the whole frame is held while it is encoded
+#define CAM_FAKE_FRAMESIZE FRAMESIZE_QVGA
+#define CAM_FAKE_QUALITY 60  // fmt2jpg scale, 0-100
+
+/**
+ * Replays CAM_FAKE_FRAMES test pattern JPEGs, encoded once at init, at a
+ * fixed rate. A vertical bar moves across the frames so the motion gate
+ * and the rate controller see a changing scene.
+ */
+typedef struct _cam_fake_t {
+    uint8_t *jpg[CAM_FAKE_FRAMES];
+    size_t len[CAM_FAKE_FRAMES];
+    uint16_t width;
+    uint16_t height;
+    int next;
+
+    TickType_t period;
+    TickType_t last_wake;
+
+    // handed to the ring, get and put both run on the capture task
+    camera_fb_t fbs[CAM_RING_MAX_DEPTH + 1];
+    uint32_t free_mask;
+} cam_fake_t;
+
+esp_err_t cam_fake_init(cam_fake_t *fake, framesize_t size, int fps);
+
+void cam_fake_uninit(cam_fake_t *fake);
+
+void cam_fake_source(cam_fake_t *fake, cam_source_t *source);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _DEMO_CAM_MOTION_H_
+#define _DEMO_CAM_MOTION_H_
+
+#include <stdint.h>
+
+#include "esp_camera.h"
+#include "esp_err.h"
+
+#define CAM_MOTION_GATE 1
+
+// luma signature of a frame, one average per grid cell
+#define CAM_MOTION_GRID_W 16
+#define CAM_MOTION_GRID_H 12
+#define CAM_MOTION_CELLS (CAM_MOTION_GRID_W * CAM_MOTION_GRID_H)
+
+// a cell changed when its average moved more than this
+#define CAM_MOTION_CELL_DIFF 12
+// the scene changed when this many cells changed
+#define CAM_MOTION_MIN_CELLS 3
+// forward a frame at least this often even if nothing moves
+#define CAM_MOTION_KEYFRAME_MS 5000
+
+typedef struct _cam_motion_sig_t {
+    uint8_t luma[CAM_MOTION_CELLS];
+} cam_motion_sig_t;
+
+typedef struct _cam_motion_gate_t {
+    cam_motion_sig_t ref;  // signature of the last forwarded frame
+    int has_ref;
+    int64_t ref_us;
+
+    // scratch for cam_motion_signature
+    uint32_t sum[CAM_MOTION_CELLS];
+    uint16_t count[CAM_MOTION_CELLS];
+    uint16_t width;
+    uint16_t height;
+} cam_motion_gate_t;
+
+void cam_motion_init(cam_motion_gate_t *gate);
+
+/**
+ * Build the signature from JPEG DC coefficients (1/8 scale decode) or from
+ * decimated luma of raw frames.
+ */
+esp_err_t cam_motion_signature(cam_motion_gate_t *gate, camera_fb_t *fb,
+                               cam_motion_sig_t *sig);
+
+/* 1 if the frame should be forwarded, it then becomes the reference */
+int cam_motion_update(cam_motion_gate_t *gate, const cam_motion_sig_t *sig,
+                      int64_t now);
+
+#endif
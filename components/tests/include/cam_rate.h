@@ -0,0 +1,79 @@
+#ifndef _DEMO_CAM_RATE_H_
+#define _DEMO_CAM_RATE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "esp_camera.h"
+
+#define CAM_RATE_OFF 0
+#define CAM_RATE_FPS 1
+#define CAM_RATE_KBPS 2
+
+// off until /camera/rate asks for it, the targets are what it starts from
+#define CAM_RATE_DEFAULT_MODE CAM_RATE_OFF
+#define CAM_RATE_DEFAULT_FPS 8
+#define CAM_RATE_DEFAULT_KBPS 4000
+
+// measure window, a step needs CAM_RATE_HOLD_WINDOWS windows out of band
+#define CAM_RATE_WINDOW_MS 1000
+#define CAM_RATE_HOLD_WINDOWS 3
+// band around the target in percent where nothing changes
+#define CAM_RATE_HYSTERESIS 15
+
+#define CAM_RATE_QUALITY_MIN 10  // best quality the controller will use
+#define CAM_RATE_QUALITY_MAX 40
+#define CAM_RATE_QUALITY_STEP 5
+
+#define CAM_RATE_DECISION_HOLD 0
+#define CAM_RATE_DECISION_UP 1    // better quality / bigger frame
+#define CAM_RATE_DECISION_DOWN 2  // cheaper frames
+
+typedef struct _cam_rate_t {
+    pthread_mutex_t lock;
+
+    int mode;
+    int target;  // fps or kbps, depends on mode
+
+    int quality;
+    int level;      // index in the framesize ladder, stored atomically
+    int max_level;  // the driver buffers are sized for this one
+
+    // current window
+    int64_t window_begin_us;
+    uint32_t window_frames;
+    uint32_t window_bytes;
+    int64_t window_send_us;
+    int window_static;  // a frame was held back as static, measures run low
+    uint32_t last_seq;
+
+    // last window result
+    float fps;
+    float kbps;
+    float send_ms;
+
+    int out_of_band;  // consecutive windows, <0 below band, >0 above
+    int last_decision;
+    uint32_t steps_up;
+    uint32_t steps_down;
+} cam_rate_t;
+
+void cam_rate_init(cam_rate_t *ctl, const camera_config_t *config);
+
+void cam_rate_set_target(cam_rate_t *ctl, int mode, int target);
+
+void cam_rate_get_target(cam_rate_t *ctl, int *mode, int *target);
+
+/* report a sent frame, duplicate seq from other streams are ignored */
+void cam_rate_on_frame(cam_rate_t *ctl, uint32_t seq, size_t bytes,
+                       int64_t send_us);
+
+/* a frame not sent for lack of motion, its window makes no decision */
+void cam_rate_on_static(cam_rate_t *ctl);
+
+/* the framesize in use, safe with or without the lock held */
+framesize_t cam_rate_framesize(cam_rate_t *ctl);
+
+void cam_rate_register_metrics(cam_rate_t *ctl);
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef _DEMO_CAM_RING_H_
+#define _DEMO_CAM_RING_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "cam_motion.h"
+#include "esp_camera.h"
+#include "esp_err.h"
+
+// frames kept in the ring, the driver gets one more buffer to capture into
+#define CAM_RING_DEPTH 2
+#define CAM_RING_MAX_DEPTH 4
+
+// DRAM kept free for wifi/bt/httpd when sizing the ring
+#define CAM_RING_DRAM_RESERVE (96 * 1024)
+
+// longest wait of a reader for the next frame
+#define CAM_FRAME_TIMEOUT_MS 3000
+
+#define CAM_CAPTURE_TASK_STACK 4096
+#define CAM_CAPTURE_TASK_PRIO 5
+#define CAM_CAPTURE_TASK_CORE 1
+
+/* where the capture task takes frames from, the camera driver by default */
+typedef struct _cam_source_t {
+    camera_fb_t *(*get)(void *ctx);
+    void (*put)(void *ctx, camera_fb_t *fb);
+    void *ctx;
+} cam_source_t;
+
+typedef struct _cam_frame_t {
+    camera_fb_t *fb;
+    uint32_t seq;
+    int64_t capture_us;   // esp_timer time when the driver handed the frame
+    int motion;           // differs from the last forwarded frame
+    uint32_t motion_seq;  // newest frame up to this one with motion
+    int refs;
+} cam_frame_t;
+
+typedef struct _cam_ring_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    int depth;     // usable slots, <= CAM_RING_MAX_DEPTH
+    int fb_count;  // buffers owned by the camera driver
+    int count;     // frames currently in the ring
+    int readers;   // attached stream consumers
+    int requests;  // one shot captures wanted by snapshot readers
+    int running;
+
+    cam_source_t source;
+    uint32_t seq;  // sequence of the newest frame
+    uint32_t motion_seq;
+    int motion_lost;  // a frame with motion was dropped, the next carries it
+    cam_frame_t slots[CAM_RING_MAX_DEPTH];
+
+#if CAM_MOTION_GATE
+    cam_motion_gate_t motion;  // used by the capture task only
+#endif
+
+    uint32_t captured;
+    uint32_t dropped;
+    int64_t last_capture_us;
+    int64_t capture_interval_us;
+} cam_ring_t;
+
+/**
+ * whether the scene changed after the frame seq a reader sent last, also
+ * through frames it skipped or never got, so a reader that missed the one
+ * frame with motion sends the next one
+ */
+static inline int cam_frame_changed_since(const cam_frame_t *frame,
+                                          uint32_t seq) {
+    return (int32_t)(frame->motion_seq - seq) > 0;
+}
+
+/**
+ * Pick the driver buffer count for the configured frame size so the ring
+ * fits in the DRAM that is currently free. Must be called before
+ * esp_camera_init.
+ */
+int cam_ring_plan_fb_count(const camera_config_t *config, int depth);
+
+esp_err_t cam_ring_init(cam_ring_t *ring, int fb_count);
+
+/* replace the camera driver, only before the capture task is started */
+void cam_ring_set_source(cam_ring_t *ring, const cam_source_t *source);
+
+/* ask the capture task to return all frames to the driver and exit */
+void cam_ring_stop(cam_ring_t *ring);
+
+/* FreeRTOS capture task, params is the cam_ring_t */
+void cam_capture_task(void *params);
+
+void cam_ring_attach(cam_ring_t *ring);
+
+void cam_ring_detach(cam_ring_t *ring);
+
+/* sequence of the newest frame, consumers start reading after it */
+uint32_t cam_ring_latest_seq(cam_ring_t *ring);
+
+/**
+ * Take a reference to the oldest frame newer than after_seq, waiting up to
+ * timeout_ms for the producer. Returns NULL on timeout.
+ */
+cam_frame_t *cam_ring_acquire(cam_ring_t *ring, uint32_t after_seq,
+                              int timeout_ms);
+
+/**
+ * Take a reference to the newest frame if it was captured less than
+ * max_age_ms ago, otherwise wake the sensor for one capture and wait up to
+ * timeout_ms for it.
+ */
+cam_frame_t *cam_ring_acquire_latest(cam_ring_t *ring, int max_age_ms,
+                                     int timeout_ms);
+
+void cam_ring_release(cam_ring_t *ring, cam_frame_t *frame);
+
+void cam_ring_register_metrics(cam_ring_t *ring);
+
+#endif
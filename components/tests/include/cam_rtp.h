@@ -0,0 +1,71 @@
+#ifndef _DEMO_CAM_RTP_H_
+#define _DEMO_CAM_RTP_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cam_stream.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+#define CAM_RTP_DEFAULT_PORT 5004
+#define CAM_RTP_PAYLOAD_TYPE 26  // JPEG, RFC 3551
+#define CAM_RTP_CLOCK_HZ 90000
+// whole datagram, stays below the wifi MTU without IP fragmentation
+#define CAM_RTP_MTU 1400
+
+// every packet gets its share of this rate before the next one leaves, a
+// frame does not burst into the wifi TX queue
+#define CAM_RTP_PACE_KBPS 12000
+// a shorter wait is not worth a timer, the packet goes at once and the
+// next deadline still counts it
+#define CAM_RTP_PACE_MIN_WAIT_US 100
+
+#define CAM_RTP_TASK_STACK 4096
+#define CAM_RTP_TASK_PRIO 5
+
+/**
+ * RTP/JPEG (RFC 2435) sender to one UDP unicast receiver. Frames come from
+ * the capture ring like a stream worker, baseline 4:2:2 and 4:2:0 JPEGs are
+ * sent as type 0/1 with in-band quantization tables (Q=255).
+ */
+typedef struct _cam_rtp_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    cam_stream_pipeline_t pipeline;
+
+    int enabled;
+    struct sockaddr_in dest;
+    int sock;
+
+    uint16_t seq;
+    uint32_t ssrc;
+    uint8_t packet[CAM_RTP_MTU];
+
+    // pacing, owned by the sender task, the timer wakes it
+    TaskHandle_t task;
+    esp_timer_handle_t pace_timer;
+    int64_t pace_next_us;  // earliest start of the next packet
+
+    uint32_t frames;
+    uint32_t packets;
+    uint64_t bytes;
+    uint32_t unsupported;  // frames that are not baseline YCbCr JPEG
+    uint32_t errors;       // frames cut short by a failed sendto
+    int64_t send_us;       // total time spent sending frames
+    uint32_t last_send_us;
+} cam_rtp_t;
+
+/* create the socket and the sender task, nothing is sent until start */
+esp_err_t cam_rtp_init(cam_rtp_t *rtp, const cam_stream_pipeline_t *pipeline);
+
+/* send to addr:port, addr in network order, retargets a running sender */
+void cam_rtp_start(cam_rtp_t *rtp, uint32_t addr, uint16_t port);
+
+void cam_rtp_stop(cam_rtp_t *rtp);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _DEMO_CAM_SCALE_H_
+#define _DEMO_CAM_SCALE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cam_encode.h"
+#include "esp_camera.h"
+
+#include <pthread.h>
+
+// biggest reduced frame, the RGB888 scratch is 3 bytes per pixel
+#define CAM_SCALE_MAX_PIXELS (200 * 150)
+#define CAM_SCALE_MAX_SHIFT 3  // 1/8, the smallest JPEG DCT scaling
+
+/* /camera?scale=1/2|1/4|1/8&roi=x,y,w,h, roi is in full frame pixels */
+typedef struct _cam_view_t {
+    int shift;
+    uint16_t roi_x;
+    uint16_t roi_y;
+    uint16_t roi_w;  // 0 means the whole frame
+    uint16_t roi_h;
+} cam_view_t;
+
+/**
+ * the work buffer of every scaler, one frame is reduced at a time so the
+ * streams need no more than CAM_SCALE_MAX_PIXELS * 3 bytes between them
+ */
+typedef struct _cam_scale_scratch_t {
+    pthread_mutex_t lock;
+    uint8_t *rgb;  // grow-only
+    size_t cap;
+} cam_scale_scratch_t;
+
+typedef struct _cam_scaler_t {
+    cam_scale_scratch_t *scratch;
+    uint8_t *rgb;  // BGR888 of scratch, the order jpg2rgb888 produces
+    uint16_t out_w;
+    uint16_t out_h;
+    int shift;
+
+    // decoder output window, in scaled pixels
+    uint16_t crop_x;
+    uint16_t crop_y;
+} cam_scaler_t;
+
+/* returns 0 on success, -1 on a malformed query */
+int cam_view_parse(cam_view_t *view, const char *query);
+
+int cam_view_is_full(const cam_view_t *view);
+
+void cam_scale_scratch_init(cam_scale_scratch_t *scratch);
+
+void cam_scaler_init(cam_scaler_t *scaler, cam_scale_scratch_t *scratch);
+
+void cam_scaler_uninit(cam_scaler_t *scaler);
+
+/**
+ * Reduce fb to the view and encode it into a buffer leased from pool.
+ * JPEG frames are scaled in the DCT domain while decoding, raw frames with
+ * an integer box filter. Holds the scratch until the encode is done.
+ */
+cam_jpg_buf_t *cam_scale_frame(cam_scaler_t *scaler, camera_fb_t *fb,
+                               const cam_view_t *view, cam_jpg_pool_t *pool,
+                               int quality);
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef _DEMO_CAM_STREAM_H_
+#define _DEMO_CAM_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "cam_encode.h"
+#include "cam_rate.h"
+#include "cam_ring.h"
+#include "cam_scale.h"
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#define PART_BOUNDARY "123456789000000000000987654321"
+
+#define CAM_STREAM_HEAD_SIZE 192
+
+// streams are served off the httpd task, one worker per open stream
+#define CAM_STREAM_WORKERS 3
+#define CAM_STREAM_TASK_STACK 4096
+#define CAM_STREAM_TASK_PRIO 5
+
+// a frame has this long to drain into the socket of a slow client, the
+// worker then gives up on it, nobody else waits meanwhile
+#define CAM_STREAM_SEND_TIMEOUT_MS 5000
+// for httpd to run the queued session close
+#define CAM_STREAM_CLOSE_WAIT_MS 2000
+// 0 writes the head and the JPEG of a frame separately, the host build
+// compares both, see cam_stream_send_calls_total
+#ifndef CAM_STREAM_WRITEV
+#define CAM_STREAM_WRITEV 1
+#endif
+
+// a PING payload is at most this long, the PONG echoes it
+#define CAM_WS_CONTROL_MAX 125
+
+// binary message header of /camera/ws, all fields in network order:
+// version(1) flags(1) shift(1) reserved(1) seq(4) capture_us(8) size(4),
+// shift is the scale actually applied, 1/(1 << shift)
+#define CAM_WS_VERSION 1
+#define CAM_WS_HEADER_SIZE 20
+#define CAM_WS_FLAG_SCALED 0x01  // frame is a reduced view, see cam_scale.h
+
+// frames a WebSocket client may receive before it sends credits
+#define CAM_WS_INITIAL_CREDITS 2
+#define CAM_WS_MAX_CREDITS 16
+
+// per client shaping, ?kbps=&burst= (KB) override, 0 kbps is unshaped
+#define CAM_STREAM_DEFAULT_KBPS 0
+#define CAM_STREAM_DEFAULT_BURST_KB 64
+
+struct _cam_stream_pool_t;
+
+/**
+ * writer on the request session, either multipart/x-mixed-replace without
+ * chunked transfer encoding or one WebSocket binary message per frame.
+ * After the response head the worker is the only writer of the socket, it
+ * sends without blocking, so a stalled client holds its worker only. The
+ * socket stays open until the worker let go of it as well, see
+ * cam_stream_sess_close, and httpd leaves the control frames of /camera/ws
+ * to the stream.
+ */
+typedef struct _cam_stream_t {
+    struct _cam_stream_pool_t *pool;
+    int fd;  // -1 while the slot is free
+    int ws;
+
+    // the session and the worker each hold a ref, the last one closes the
+    // socket and frees the slot. closed is set on the httpd task as the
+    // session goes
+    int refs;
+    int closed;
+    int close_queued;        // the close work is queued and has not run
+    SemaphoreHandle_t done;  // the close work ran
+    int peer_closed;         // ws only, the client sent CLOSE
+    int pong_len;            // ws only, -1 unless a PONG is due
+    uint8_t pong[CAM_WS_CONTROL_MAX];
+    int credits;  // ws only, granted by the client
+    cam_view_t view;
+
+    // token bucket in bytes, a frame is sent while the bucket is not in
+    // debt and then charged in full, so frames above the burst still pass
+    uint32_t rate;  // bytes per second, 0 is unshaped
+    uint32_t burst;
+    int64_t tokens;
+    int64_t refill_us;
+
+    // this client only, reset when the slot is taken
+    uint32_t sent;
+    uint32_t dropped;
+
+    char head[CAM_STREAM_HEAD_SIZE];
+} cam_stream_t;
+
+/* what the workers read frames from */
+typedef struct _cam_stream_pipeline_t {
+    cam_ring_t *ring;
+    cam_rate_t *rate;
+    cam_jpg_pool_t *jpg_pool;
+} cam_stream_pipeline_t;
+
+typedef struct _cam_stream_pool_t {
+    httpd_handle_t server;
+    cam_stream_pipeline_t pipeline;
+    QueueHandle_t queue;
+    cam_scale_scratch_t scratch;  // shared by the scalers of the workers
+    cam_stream_t streams[CAM_STREAM_WORKERS];  // one per open stream
+} cam_stream_pool_t;
+
+/* write the response status and headers on the session of req */
+esp_err_t cam_stream_begin(cam_stream_t *stream, httpd_req_t *req);
+
+/**
+ * boundary, part headers and payload of one frame. X-Timestamp is the
+ * driver capture time, X-Frame-Seq the ring sequence, a gap means frames
+ * the client did not get. X-Scale is 1/(1 << shift).
+ */
+esp_err_t cam_stream_send_part(cam_stream_t *stream, uint32_t seq,
+                               const struct timeval *timestamp, int shift,
+                               const uint8_t *buf, size_t len);
+
+/* frame header followed by the JPEG as one binary message */
+esp_err_t cam_stream_send_message(cam_stream_t *stream, uint32_t seq,
+                                  int64_t capture_us, uint8_t flags,
+                                  int shift, const uint8_t *buf, size_t len);
+
+esp_err_t cam_stream_pool_start(cam_stream_pool_t *pool,
+                                httpd_handle_t server,
+                                const cam_stream_pipeline_t *pipeline);
+
+/**
+ * hand the request session to a stream worker and return at once, httpd
+ * keeps serving other URIs while the stream runs. ?scale=1/N&roi=x,y,w,h
+ * makes the worker send a reduced view of every frame, ?kbps=&burst=
+ * shapes it. A view above CAM_SCALE_MAX_PIXELS is scaled further, down to
+ * 1/8; the scale applied is in the X-Scale header of each part (1/1 for
+ * the full frame) and in the shift of each WebSocket message.
+ */
+esp_err_t cam_stream_submit(cam_stream_pool_t *pool, httpd_req_t *req);
+
+/**
+ * /camera/ws handler, registered with handle_ws_control_frames. The
+ * handshake starts a stream like cam_stream_submit, later text ("4") or
+ * 4 byte binary messages from the client add credits. A frame is dropped
+ * instead of queued while the client has none. The worker answers PING and
+ * CLOSE between frames.
+ */
+esp_err_t cam_stream_ws_handler(cam_stream_pool_t *pool, httpd_req_t *req);
+
+/**
+ * for httpd_config_t.close_fn, httpd is done with the session of sockfd.
+ * The socket of a stream is shut down and closed by whoever lets go of it
+ * last, so its number is not reused while the worker still writes. Any
+ * other socket is closed at once.
+ */
+void cam_stream_sess_close(cam_stream_pool_t *pool, int sockfd);
+
+#endif
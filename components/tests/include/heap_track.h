@@ -0,0 +1,91 @@
+#ifndef _DEMO_HEAP_TRACK_H_
+#define _DEMO_HEAP_TRACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "quark/quark.h"
+
+// count the blocks of the tagged call sites, 8 bytes more per block
+#ifndef HEAP_TRACK
+#define HEAP_TRACK 0
+#endif
+
+/* X(id, name), the index of a tag is its label on /metrics */
+#define HEAP_TRACK_TAG_LIST(X)                                             \
+    X(OTHER, "other")                                                      \
+    X(PLAYER, "player")                                                    \
+    X(BT_SCAN, "bt_scan")                                                  \
+    X(BT_DEVTAB, "bt_devtab")                                              \
+    X(CAM_JPG, "cam_jpg")
+
+// size classes double from the first one, the last takes everything bigger
+#define HEAP_TRACK_FIRST_CLASS 16
+#define HEAP_TRACK_CLASSES 12
+
+// largest free block trend, a sample every period
+#define HEAP_TRACK_SAMPLES 32
+#define HEAP_TRACK_SAMPLE_MS (10 * 1000)
+
+typedef enum {
+#define HEAP_TRACK_ENUM(id, name) HEAP_TAG_##id,
+    HEAP_TRACK_TAG_LIST(HEAP_TRACK_ENUM)
+#undef HEAP_TRACK_ENUM
+    HEAP_TAG_MAX
+} heap_tag_t;
+
+typedef struct _heap_tag_stats_t {
+    uint32_t live_bytes;
+    uint32_t live_blocks;
+    uint32_t peak_bytes;  // highest live_bytes so far
+    uint32_t allocs;
+    uint32_t fails;
+} heap_tag_stats_t;
+
+typedef struct _heap_sample_t {
+    int64_t time_us;
+    uint32_t free_bytes;
+    uint32_t largest_free;
+} heap_sample_t;
+
+#if HEAP_TRACK
+
+/* registers the metrics and starts the sampling timer */
+void heap_track_init(void);
+
+void *heap_track_malloc(heap_tag_t tag, size_t size);
+
+/* only for blocks of heap_track_malloc */
+void heap_track_free(void *ptr);
+
+/* for buffers that know their size and are not allocated here */
+void heap_track_resize(heap_tag_t tag, size_t old_size, size_t new_size);
+
+const char *heap_track_tag_name(heap_tag_t tag);
+
+void heap_track_stats(heap_tag_t tag, heap_tag_stats_t *stats);
+
+/* allocations that fell in the size class */
+uint32_t heap_track_class_allocs(int cls);
+
+/* takes a sample now, besides the timer */
+void heap_track_sample(void);
+
+/* copies up to count samples, oldest first, returns how many */
+int heap_track_samples(heap_sample_t *out, int count);
+
+#define HEAP_MALLOC(tag, size) heap_track_malloc(HEAP_TAG_##tag, size)
+#define HEAP_FREE(ptr) heap_track_free(ptr)
+#define HEAP_RESIZE(tag, old_size, new_size)                               \
+    heap_track_resize(HEAP_TAG_##tag, old_size, new_size)
+
+#else
+
+#define heap_track_init()
+#define HEAP_MALLOC(tag, size) rc_malloc(size)
+#define HEAP_FREE(ptr) rc_free(ptr)
+#define HEAP_RESIZE(tag, old_size, new_size)
+
+#endif
+
+#endif
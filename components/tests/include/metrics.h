@@ -0,0 +1,90 @@
+#ifndef _DEMO_METRICS_H_
+#define _DEMO_METRICS_H_
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+/* X(id, name, help) */
+#define METRICS_COUNTER_LIST(X)                                            \
+    X(CAM_FRAMES_SENT, "cam_frames_sent_total",                            \
+      "Frames written to camera streams")                                  \
+    X(CAM_BYTES_SENT, "cam_bytes_sent_total",                              \
+      "JPEG bytes written to camera streams")                              \
+    X(CAM_MOTION_SUPPRESSED, "cam_motion_suppressed_total",                \
+      "Frames not sent because the scene did not change")                  \
+    X(CAM_MOTION_BYTES_SAVED, "cam_motion_bytes_saved_total",              \
+      "JPEG bytes of suppressed frames")                                   \
+    X(CAM_STREAM_SHAPED_DROPS, "cam_stream_shaped_drops_total",            \
+      "Frames dropped because a client was over its bandwidth")            \
+    X(CAM_WS_CREDIT_DROPS, "cam_ws_credit_drops_total",                    \
+      "Frames dropped because a WebSocket client had no credits")          \
+    X(CAM_STREAM_SEND_CALLS, "cam_stream_send_calls_total",                \
+      "Socket writes of camera streams, retries included")                 \
+    X(A2DP_UNDERRUNS, "a2dp_underruns_total",                              \
+      "A2DP data callbacks filled with silence for lack of audio")         \
+    X(METRICS_DROPPED, "metrics_registrations_dropped_total",              \
+      "Values and tasks not registered because their table was full")
+
+/* X(id, name, help, first bucket), buckets double up to METRICS_BUCKETS */
+#define METRICS_HISTOGRAM_LIST(X)                                          \
+    X(CAM_FRAME_BYTES, "cam_frame_bytes", "Size of sent frames", 4096)     \
+    X(CAM_FRAME_INTERVAL_MS, "cam_frame_interval_ms",                      \
+      "Time between two frames of one stream", 10)                         \
+    X(CAM_SEND_MS, "cam_send_ms", "Time to write one frame", 5)            \
+    X(CAM_CAPTURE_TO_SENT_MS, "cam_capture_to_sent_ms",                    \
+      "Time from capture to the last byte of a frame written", 10)         \
+    X(BT_GAP_CALLBACK_US, "bt_gap_callback_us",                            \
+      "Time spent in the GAP callback per discovery result", 8)
+
+#define METRICS_BUCKETS 8
+// about 30 values and 11 tasks register with camera, BT, task_prof and
+// heap_track all running, what does not fit is counted in
+// metrics_registrations_dropped_total
+#define METRICS_MAX_VALUES 48
+#define METRICS_MAX_TASKS 16
+
+typedef enum {
+#define METRICS_ENUM(id, name, help) METRIC_##id,
+    METRICS_COUNTER_LIST(METRICS_ENUM)
+#undef METRICS_ENUM
+    METRIC_COUNTER_MAX
+} metric_counter_id_t;
+
+typedef enum {
+#define METRICS_ENUM(id, name, help, first) METRIC_##id,
+    METRICS_HISTOGRAM_LIST(METRICS_ENUM)
+#undef METRICS_ENUM
+    METRIC_HISTOGRAM_MAX
+} metric_histogram_id_t;
+
+#define METRIC_TYPE_GAUGE 0
+#define METRIC_TYPE_COUNTER 1
+
+typedef double (*metric_value_fn)(void *arg);
+/* value of one member of a family, non zero if it is absent right now */
+typedef int (*metric_item_fn)(void *arg, int index, double *value);
+
+void metrics_add(metric_counter_id_t id, uint64_t n);
+
+void metrics_observe(metric_histogram_id_t id, uint32_t value);
+
+/* values owned by other modules, read when /metrics is rendered */
+int metrics_register_value(const char *name, const char *help, int type,
+                           metric_value_fn fn, void *arg);
+
+/* count values of one metric told apart by label="index" */
+int metrics_register_family(const char *name, const char *help, int type,
+                            const char *label, int count, metric_item_fn item,
+                            void *arg);
+
+/* report the stack high-water mark of the calling task */
+void metrics_register_task(void);
+
+void metrics_unregister_task(void);
+
+/* GET /metrics, Prometheus text format, rendered without heap */
+esp_err_t metrics_httpd_handler(httpd_req_t *req);
+
+#endif
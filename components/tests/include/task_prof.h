@@ -0,0 +1,43 @@
+#ifndef _DEMO_TASK_PROF_H_
+#define _DEMO_TASK_PROF_H_
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+
+// needs CONFIG_FREERTOS_USE_TRACE_FACILITY and GENERATE_RUN_TIME_STATS
+#define TASK_PROF_MAX_TASKS 24
+#define TASK_PROF_SNAPSHOTS 6
+#define TASK_PROF_PERIOD_MS 2000
+// the sampler stops when nobody asked for this long
+#define TASK_PROF_IDLE_MS (60 * 1000)
+
+#define TASK_PROF_TASK_STACK 3072
+#define TASK_PROF_TASK_PRIO 2
+
+typedef struct _task_prof_entry_t {
+    char name[configMAX_TASK_NAME_LEN];
+    int8_t core;  // pinned core, -1 if the task may run on either
+    uint8_t prio;
+    uint8_t state;
+    uint16_t cpu_permille;  // of all cores over the last period
+    uint32_t stack_free;    // high-water mark in bytes
+} task_prof_entry_t;
+
+typedef struct _task_prof_snapshot_t {
+    int64_t time_us;
+    uint32_t period_us;
+    int count;
+    task_prof_entry_t tasks[TASK_PROF_MAX_TASKS];
+} task_prof_snapshot_t;
+
+/**
+ * GET /tasks, the ring of snapshots as JSON, oldest first, ?last=1 for the
+ * newest only. The first request starts the sampler and waits for its first
+ * period, the sampler exits again TASK_PROF_IDLE_MS after the last request.
+ */
+esp_err_t task_prof_httpd_handler(httpd_req_t *req);
+
+#endif
@@ -31,6 +31,9 @@
 #include "SoundData.h"
 #endif
 
+/* probe the sensor and start capturing, later calls return at once */
+esp_err_t camera_init();
+
 void *test_camera(void *params);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,36 @@
+#ifndef _DEMO_WWW_H_
+#define _DEMO_WWW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#define WWW_INDEX "/index.html"
+// html is revalidated every time, the rest may be cached for a while
+#define WWW_CACHE_CONTROL "max-age=3600"
+
+/* one file of www/, gzipped by tools/pack_www.py, const so it stays in flash */
+typedef struct _www_asset_t {
+    const char *path;
+    const char *type;
+    const char *etag;
+    const uint8_t *data;
+    size_t len;
+} www_asset_t;
+
+// generated table
+extern const www_asset_t www_assets[];
+extern const size_t www_asset_count;
+extern const uint32_t www_hash_seed;
+extern const size_t www_hash_size;
+extern const uint16_t www_hash_slots[];
+
+/* perfect hash lookup, NULL if path is not packed */
+const www_asset_t *www_find(const char *path, size_t len);
+
+// GET /*, register it last with httpd_uri_match_wildcard
+esp_err_t www_httpd_handler(httpd_req_t *req);
+
+#endif
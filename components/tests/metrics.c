@@ -0,0 +1,270 @@
+#include "metrics.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define METRICS_TAG "METRICS"
+
+#define METRICS_RENDER_BUF 512
+
+typedef struct _metric_desc_t {
+    const char *name;
+    const char *help;
+    uint32_t first;
+} metric_desc_t;
+
+typedef struct _metric_value_t {
+    const char *name;
+    const char *help;
+    int type;
+    metric_value_fn fn;
+    const char *label;  // set for families, see metrics_register_family
+    int count;
+    metric_item_fn item;
+    void *arg;
+    int ready;
+} metric_value_t;
+
+typedef struct _metric_histogram_t {
+    uint32_t buckets[METRICS_BUCKETS + 1];  // the last one is +Inf
+    uint64_t sum;
+} metric_histogram_t;
+
+static const metric_desc_t _counter_desc[METRIC_COUNTER_MAX] = {
+#define METRICS_DESC(id, name, help) {name, help, 0},
+    METRICS_COUNTER_LIST(METRICS_DESC)
+#undef METRICS_DESC
+};
+
+static const metric_desc_t _histogram_desc[METRIC_HISTOGRAM_MAX] = {
+#define METRICS_DESC(id, name, help, first) {name, help, first},
+    METRICS_HISTOGRAM_LIST(METRICS_DESC)
+#undef METRICS_DESC
+};
+
+static uint64_t _counters[METRIC_COUNTER_MAX];
+static metric_histogram_t _histograms[METRIC_HISTOGRAM_MAX];
+
+static metric_value_t _values[METRICS_MAX_VALUES];
+static int _value_count;
+
+static TaskHandle_t _tasks[METRICS_MAX_TASKS];
+
+void metrics_add(metric_counter_id_t id, uint64_t n) {
+    __atomic_fetch_add(&_counters[id], n, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(metric_histogram_id_t id, uint32_t value) {
+    metric_histogram_t *h = &_histograms[id];
+    uint32_t bound = _histogram_desc[id].first;
+    int i = 0;
+    while (i < METRICS_BUCKETS && value > bound) {
+        bound <<= 1;
+        ++i;
+    }
+
+    __atomic_fetch_add(&h->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+}
+
+static metric_value_t *metrics_alloc_value(const char *name) {
+    int i = __atomic_fetch_add(&_value_count, 1, __ATOMIC_RELAXED);
+    if (i >= METRICS_MAX_VALUES) {
+        ESP_LOGW(METRICS_TAG, "too many values, drop %s", name);
+        metrics_add(METRIC_METRICS_DROPPED, 1);
+        return NULL;
+    }
+    return &_values[i];
+}
+
+int metrics_register_value(const char *name, const char *help, int type,
+                           metric_value_fn fn, void *arg) {
+    metric_value_t *v = metrics_alloc_value(name);
+    if (v == NULL) {
+        return -1;
+    }
+
+    v->name = name;
+    v->help = help;
+    v->type = type;
+    v->fn = fn;
+    v->arg = arg;
+    __atomic_store_n(&v->ready, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int metrics_register_family(const char *name, const char *help, int type,
+                            const char *label, int count, metric_item_fn item,
+                            void *arg) {
+    metric_value_t *v = metrics_alloc_value(name);
+    if (v == NULL) {
+        return -1;
+    }
+
+    v->name = name;
+    v->help = help;
+    v->type = type;
+    v->label = label;
+    v->count = count;
+    v->item = item;
+    v->arg = arg;
+    __atomic_store_n(&v->ready, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void metrics_register_task(void) {
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < METRICS_MAX_TASKS; ++i) {
+        TaskHandle_t expected = NULL;
+        if (_tasks[i] == self ||
+            __atomic_compare_exchange_n(&_tasks[i], &expected, self, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+    // counted on every attempt, httpd registers itself once per scrape
+    metrics_add(METRIC_METRICS_DROPPED, 1);
+}
+
+void metrics_unregister_task(void) {
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < METRICS_MAX_TASKS; ++i) {
+        TaskHandle_t expected = self;
+        __atomic_compare_exchange_n(&_tasks[i], &expected, NULL, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+typedef struct _metrics_writer_t {
+    httpd_req_t *req;
+    esp_err_t res;
+    int len;
+    char buf[METRICS_RENDER_BUF];
+} metrics_writer_t;
+
+static void metrics_flush(metrics_writer_t *w) {
+    if (w->res == ESP_OK && w->len > 0) {
+        w->res = httpd_resp_send_chunk(w->req, w->buf, w->len);
+    }
+    w->len = 0;
+}
+
+static void metrics_printf(metrics_writer_t *w, const char *fmt, ...) {
+    for (int retry = 0; retry < 2; ++retry) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(w->buf + w->len, sizeof(w->buf) - w->len, fmt, ap);
+        va_end(ap);
+
+        if (n >= 0 && n < (int)sizeof(w->buf) - w->len) {
+            w->len += n;
+            return;
+        }
+        // does not fit behind what is buffered, send that and retry
+        metrics_flush(w);
+    }
+    ESP_LOGW(METRICS_TAG, "metric line is too long");
+}
+
+static void metrics_head(metrics_writer_t *w, const char *name,
+                         const char *help, const char *type) {
+    metrics_printf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_render_histogram(metrics_writer_t *w,
+                                     metric_histogram_id_t id) {
+    const metric_desc_t *desc = &_histogram_desc[id];
+    metric_histogram_t *h = &_histograms[id];
+
+    metrics_head(w, desc->name, desc->help, "histogram");
+
+    uint64_t total = 0;
+    uint32_t bound = desc->first;
+    for (int i = 0; i < METRICS_BUCKETS; ++i) {
+        total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        metrics_printf(w, "%s_bucket{le=\"%u\"} %llu\n", desc->name, bound,
+                       total);
+        bound <<= 1;
+    }
+    total += __atomic_load_n(&h->buckets[METRICS_BUCKETS], __ATOMIC_RELAXED);
+    metrics_printf(w, "%s_bucket{le=\"+Inf\"} %llu\n", desc->name, total);
+    metrics_printf(w, "%s_sum %llu\n%s_count %llu\n", desc->name,
+                   __atomic_load_n(&h->sum, __ATOMIC_RELAXED), desc->name,
+                   total);
+}
+
+static void metrics_render_system(metrics_writer_t *w) {
+    metrics_head(w, "heap_free_bytes", "Free heap", "gauge");
+    metrics_printf(w, "heap_free_bytes %u\n", esp_get_free_heap_size());
+    metrics_head(w, "heap_min_free_bytes", "Lowest free heap since boot",
+                 "gauge");
+    metrics_printf(w, "heap_min_free_bytes %u\n",
+                   esp_get_minimum_free_heap_size());
+    metrics_head(w, "heap_largest_free_block_bytes",
+                 "Largest allocatable 8bit block", "gauge");
+    metrics_printf(w, "heap_largest_free_block_bytes %u\n",
+                   heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+    metrics_head(w, "task_stack_high_water_bytes",
+                 "Lowest free stack of a task", "gauge");
+    for (int i = 0; i < METRICS_MAX_TASKS; ++i) {
+        TaskHandle_t task = __atomic_load_n(&_tasks[i], __ATOMIC_ACQUIRE);
+        if (task == NULL) continue;
+        metrics_printf(w, "task_stack_high_water_bytes{task=\"%s\"} %u\n",
+                       pcTaskGetTaskName(task),
+                       uxTaskGetStackHighWaterMark(task));
+    }
+}
+
+esp_err_t metrics_httpd_handler(httpd_req_t *req) {
+    metrics_writer_t w = {.req = req, .res = ESP_OK, .len = 0};
+
+    metrics_register_task();  // httpd itself
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+    for (int i = 0; i < METRIC_COUNTER_MAX; ++i) {
+        metrics_head(&w, _counter_desc[i].name, _counter_desc[i].help,
+                     "counter");
+        metrics_printf(&w, "%s %llu\n", _counter_desc[i].name,
+                       __atomic_load_n(&_counters[i], __ATOMIC_RELAXED));
+    }
+
+    for (int i = 0; i < METRIC_HISTOGRAM_MAX; ++i) {
+        metrics_render_histogram(&w, i);
+    }
+
+    int count = __atomic_load_n(&_value_count, __ATOMIC_RELAXED);
+    for (int i = 0; i < count && i < METRICS_MAX_VALUES; ++i) {
+        metric_value_t *v = &_values[i];
+        if (!__atomic_load_n(&v->ready, __ATOMIC_ACQUIRE)) continue;
+        metrics_head(&w, v->name, v->help,
+                     v->type == METRIC_TYPE_COUNTER ? "counter" : "gauge");
+        if (v->item == NULL) {
+            metrics_printf(&w, "%s %.10g\n", v->name, v->fn(v->arg));
+            continue;
+        }
+        for (int j = 0; j < v->count; ++j) {
+            double value;
+            if (v->item(v->arg, j, &value) == 0) {
+                metrics_printf(&w, "%s{%s=\"%d\"} %.10g\n", v->name, v->label,
+                               j, value);
+            }
+        }
+    }
+
+    metrics_render_system(&w);
+
+    metrics_flush(&w);
+    if (w.res == ESP_OK) {
+        w.res = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return w.res;
+}
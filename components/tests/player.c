@@ -16,6 +16,9 @@
 #include "nvs_flash.h"
 #include "quark/driver/http/rc_http_manager.h"
 #include "quark/driver/http/rc_http_request.h"
+#include "bt_sink.h"
+#include "heap_track.h"
+#include "metrics.h"
 #include "test.h"
 
 #define WAV_SWAP_SIZE 4096
@@ -65,12 +68,17 @@ void bt_app_a2d_cb(esp_a2d_cb_event_t event, esp_a2d_cb_param_t* param) {
         esp_a2d_cb_param_t* a2d = (esp_a2d_cb_param_t*)(param);
         if (a2d->conn_stat.state == ESP_A2D_CONNECTION_STATE_CONNECTED) {
             LOGI(BT_TAG, "a2dp connected");
+            if (bt_sink_on_connected(a2d->conn_stat.remote_bda) != 0) {
+                esp_a2d_source_disconnect(a2d->conn_stat.remote_bda);
+                break;
+            }
             esp_bt_gap_set_scan_mode(ESP_BT_NON_CONNECTABLE,
                                      ESP_BT_NON_DISCOVERABLE);
             esp_a2d_media_ctrl(ESP_A2D_MEDIA_CTRL_CHECK_SRC_RDY);
         } else if (a2d->conn_stat.state ==
                    ESP_A2D_CONNECTION_STATE_DISCONNECTED) {
             LOGI(BT_TAG, "a2dp disconnected");
+            bt_sink_on_disconnected(a2d->conn_stat.remote_bda);
         }
         break;
     }
@@ -177,6 +185,8 @@ int32_t bt_wav_data_cb_online_one_swap(uint8_t* data, int32_t len) {
             rc_buf_queue_pop(player->buf_queue, player->local_buffer,
                              WAV_SWAP_SIZE, 0);
         }
+        metrics_add(METRIC_A2DP_UNDERRUNS, 1);
+        bt_sink_on_underrun();
         rc_sleep(500);
         memset(data, 0, len);
     }
@@ -190,6 +200,7 @@ void* swap_buffer_thread(void* param) {
     bt_box_player_t* player = param;
 
     static char swap_buffer[WAV_SWAP_SIZE];
+    metrics_register_task();
     while (!player->media_stoped) {
         if (player->in_swap != NULL) {
             rc_sleep(30);
@@ -221,6 +232,7 @@ void* swap_buffer_thread(void* param) {
     }
 
     LOGI(BT_TAG, "swap_buffer_thread stoped");
+    metrics_unregister_task();
     return NULL;
 }
 
@@ -245,6 +257,8 @@ int32_t bt_wav_data_cb_online_two_swap(uint8_t* data, int32_t len) {
              WAV_SWAP_SIZE - buf_offset);
     } else {
         LOGI(BT_TAG, "no buffer found");
+        metrics_add(METRIC_A2DP_UNDERRUNS, 1);
+        bt_sink_on_underrun();
         rc_sleep(100);
         memset(data, 0, len);
     }
@@ -312,6 +326,7 @@ void* download_thread(void* param) {
     bt_box_player_t* player = (bt_box_player_t*)param;
 
     const char* url = "http://82.157.138.167/test-esp32.wav";
+    metrics_register_task();
 
     LOGI(BT_TAG, "try to query url %s", url);
 
@@ -322,6 +337,7 @@ void* download_thread(void* param) {
 
     if (downloader == NULL) {
         LOGI(BT_TAG, "create download failed");
+        metrics_unregister_task();
         return NULL;
     }
 
@@ -333,6 +349,7 @@ void* download_thread(void* param) {
     player->finish_download = 1;
 
     LOGI(BT_TAG, "download_thread stoped");
+    metrics_unregister_task();
     return NULL;
 }
 
@@ -409,13 +426,30 @@ int play_local_music() {
     return 0;
 }
 
+static double player_metric_queue_bytes(void* arg) {
+    bt_box_player_t* player = _player;
+    if (player == NULL || player->buf_queue == NULL) {
+        return 0;
+    }
+    return rc_buf_queue_get_size(player->buf_queue);
+}
+
 int connect_to_bt_player(esp_bd_addr_t bda) {
     bt_box_player_t* player =
-        (bt_box_player_t*)rc_malloc(sizeof(bt_box_player_t));
+        (bt_box_player_t*)HEAP_MALLOC(PLAYER, sizeof(bt_box_player_t));
     memset(player, 0, sizeof(bt_box_player_t));
     _player = player;
 
+    bt_sink_on_attempt(bda);
     esp_a2d_source_connect(bda);
+    if (bt_sink_wait_connected(bda, BT_SINK_CONNECT_TIMEOUT_MS) != 0) {
+        LOGW(BT_TAG, "a2dp not connected in %dms",
+             BT_SINK_CONNECT_TIMEOUT_MS);
+        esp_a2d_source_disconnect(bda);
+        _player = NULL;
+        HEAP_FREE(player);
+        return -1;
+    }
 
     // wait for wifi connected
     while (true) {
@@ -431,6 +465,9 @@ int connect_to_bt_player(esp_bd_addr_t bda) {
     }
 
     player->buf_queue = rc_buf_queue_init(WAV_SWAP_SIZE, 3, WAV_HEADER_BYTES);
+    metrics_register_value("a2dp_queue_bytes",
+                           "Downloaded audio waiting for the A2DP source",
+                           METRIC_TYPE_GAUGE, player_metric_queue_bytes, NULL);
 
     while (true) {
 #if (USE_WAV_TYPE == WAV_TYPE_LOCAL)
@@ -444,6 +481,7 @@ int connect_to_bt_player(esp_bd_addr_t bda) {
         rc_sleep(10 * 1000);
         esp_a2d_media_ctrl(ESP_A2D_MEDIA_CTRL_STOP);
 #endif
+        bt_sink_checkpoint();  // play time and underruns survive a reboot
         rc_sleep(120 * 1000);
     }
 
@@ -451,7 +489,7 @@ int connect_to_bt_player(esp_bd_addr_t bda) {
 
     rc_buf_queue_uninit(player->buf_queue);
 
-    rc_free(player);
+    HEAP_FREE(player);
     _player = NULL;
 
     return 0;
@@ -0,0 +1,267 @@
+#include "task_prof.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PROF_TAG "TASK_PROF"
+
+#define TASK_PROF_RENDER_BUF 512
+
+// run time counters of the previous sample, matched by task number
+typedef struct _task_prof_prev_t {
+    UBaseType_t number;
+    uint32_t runtime;
+} task_prof_prev_t;
+
+typedef struct _task_prof_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // a snapshot was added
+    int running;
+    int64_t last_query_us;
+
+    // allocated by the first request, kept afterwards
+    task_prof_snapshot_t *ring;
+    uint32_t written;  // snapshots since the sampler started
+
+    // sampler only
+    TaskStatus_t status[TASK_PROF_MAX_TASKS];
+    task_prof_prev_t prev[TASK_PROF_MAX_TASKS];
+    int prev_count;
+    uint32_t prev_total;
+} task_prof_t;
+
+static task_prof_t _prof = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                            .cond = PTHREAD_COND_INITIALIZER};
+
+static uint32_t task_prof_prev_runtime(UBaseType_t number, uint32_t now) {
+    for (int i = 0; i < _prof.prev_count; ++i) {
+        if (_prof.prev[i].number == number) {
+            return _prof.prev[i].runtime;
+        }
+    }
+    return now;  // a new task, it only counts from the next period
+}
+
+// one sample, a snapshot once there is a previous one to diff against
+static void task_prof_sample(void) {
+    uint32_t total = 0;
+    int count = uxTaskGetSystemState(_prof.status, TASK_PROF_MAX_TASKS, &total);
+    if (count == 0) {
+        ESP_LOGW(PROF_TAG, "more than %d tasks", TASK_PROF_MAX_TASKS);
+        return;
+    }
+
+    if (_prof.prev_total != 0) {
+        // the total is wall time, every core ran some task during it
+        uint64_t window = (uint64_t)(total - _prof.prev_total) *
+                          portNUM_PROCESSORS;
+
+        // the slot may be the oldest one a request is copying
+        pthread_mutex_lock(&_prof.lock);
+        task_prof_snapshot_t *snap =
+            &_prof.ring[_prof.written % TASK_PROF_SNAPSHOTS];
+        snap->time_us = esp_timer_get_time();
+        snap->period_us = total - _prof.prev_total;
+        snap->count = count;
+        for (int i = 0; i < count; ++i) {
+            TaskStatus_t *status = &_prof.status[i];
+            task_prof_entry_t *entry = &snap->tasks[i];
+            uint32_t used = status->ulRunTimeCounter -
+                            task_prof_prev_runtime(status->xTaskNumber,
+                                                   status->ulRunTimeCounter);
+
+            strncpy(entry->name, status->pcTaskName, sizeof(entry->name) - 1);
+            entry->name[sizeof(entry->name) - 1] = '\0';
+            BaseType_t core = xTaskGetAffinity(status->xHandle);
+            entry->core = core == tskNO_AFFINITY ? -1 : core;
+            entry->prio = status->uxCurrentPriority;
+            entry->state = status->eCurrentState;
+            entry->cpu_permille = window ? used * 1000ull / window : 0;
+            entry->stack_free = status->usStackHighWaterMark;
+        }
+
+        ++_prof.written;
+        pthread_cond_broadcast(&_prof.cond);
+        pthread_mutex_unlock(&_prof.lock);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        _prof.prev[i].number = _prof.status[i].xTaskNumber;
+        _prof.prev[i].runtime = _prof.status[i].ulRunTimeCounter;
+    }
+    _prof.prev_count = count;
+    _prof.prev_total = total;
+}
+
+static void task_prof_task(void *params) {
+    metrics_register_task();
+    TickType_t wake = xTaskGetTickCount();
+
+    while (true) {
+        task_prof_sample();
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(TASK_PROF_PERIOD_MS));
+
+        pthread_mutex_lock(&_prof.lock);
+        int idle = esp_timer_get_time() - _prof.last_query_us >
+                   TASK_PROF_IDLE_MS * 1000LL;
+        if (idle) {
+            _prof.running = 0;  // a request after this starts a new sampler
+        }
+        pthread_mutex_unlock(&_prof.lock);
+        if (idle) break;
+    }
+
+    ESP_LOGI(PROF_TAG, "sampler stoped, no requests");
+    metrics_unregister_task();
+    vTaskDelete(NULL);
+}
+
+// start the sampler if needed and wait for a first snapshot
+static int task_prof_touch(void) {
+    pthread_mutex_lock(&_prof.lock);
+    _prof.last_query_us = esp_timer_get_time();
+    if (_prof.ring == NULL) {
+        _prof.ring = (task_prof_snapshot_t *)calloc(
+            TASK_PROF_SNAPSHOTS, sizeof(task_prof_snapshot_t));
+    }
+    if (_prof.ring != NULL && !_prof.running) {
+        // counters of a stopped sampler are stale, begin a new series
+        _prof.written = 0;
+        _prof.prev_total = 0;
+        _prof.running =
+            xTaskCreate(task_prof_task, "task_prof", TASK_PROF_TASK_STACK,
+                        NULL, TASK_PROF_TASK_PRIO, NULL) == pdPASS;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TASK_PROF_PERIOD_MS / 1000 + 1;
+    while (_prof.running && _prof.written == 0) {
+        if (pthread_cond_timedwait(&_prof.cond, &_prof.lock, &deadline) != 0) {
+            break;
+        }
+    }
+    int ready = _prof.written > 0;
+    pthread_mutex_unlock(&_prof.lock);
+    return ready;
+}
+
+typedef struct _task_prof_writer_t {
+    httpd_req_t *req;
+    esp_err_t res;
+    int len;
+    char buf[TASK_PROF_RENDER_BUF];
+} task_prof_writer_t;
+
+static void task_prof_flush(task_prof_writer_t *w) {
+    if (w->res == ESP_OK && w->len > 0) {
+        w->res = httpd_resp_send_chunk(w->req, w->buf, w->len);
+    }
+    w->len = 0;
+}
+
+static void task_prof_printf(task_prof_writer_t *w, const char *fmt, ...) {
+    for (int retry = 0; retry < 2; ++retry) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(w->buf + w->len, sizeof(w->buf) - w->len, fmt, ap);
+        va_end(ap);
+
+        if (n >= 0 && n < (int)sizeof(w->buf) - w->len) {
+            w->len += n;
+            return;
+        }
+        task_prof_flush(w);
+    }
+}
+
+static void task_prof_render(task_prof_writer_t *w,
+                             const task_prof_snapshot_t *snap) {
+    task_prof_printf(w, "{\"time_ms\":%lld,\"period_ms\":%u,\"tasks\":[",
+                     snap->time_us / 1000, snap->period_us / 1000);
+    for (int i = 0; i < snap->count; ++i) {
+        const task_prof_entry_t *entry = &snap->tasks[i];
+        task_prof_printf(w,
+                         "%s{\"name\":\"%s\",\"core\":%d,\"prio\":%u,"
+                         "\"state\":%u,\"cpu\":%u.%u,\"stack_free\":%u}",
+                         i == 0 ? "" : ",", entry->name, entry->core,
+                         entry->prio, entry->state, entry->cpu_permille / 10,
+                         entry->cpu_permille % 10, entry->stack_free);
+    }
+    task_prof_printf(w, "]}");
+}
+
+esp_err_t task_prof_httpd_handler(httpd_req_t *req) {
+    char query[32];
+    char value[8];
+    int last_only = httpd_req_get_url_query_str(req, query, sizeof(query)) ==
+                        ESP_OK &&
+                    httpd_query_key_value(query, "last", value,
+                                          sizeof(value)) == ESP_OK &&
+                    atoi(value) != 0;
+
+    if (!task_prof_touch()) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                            "no task snapshot");
+        return ESP_FAIL;
+    }
+
+    task_prof_writer_t *w =
+        (task_prof_writer_t *)malloc(sizeof(task_prof_writer_t));
+    task_prof_snapshot_t *snap =
+        (task_prof_snapshot_t *)malloc(sizeof(task_prof_snapshot_t));
+    if (w == NULL || snap == NULL) {
+        free(w);
+        free(snap);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                            "out of memory");
+        return ESP_FAIL;
+    }
+    w->req = req;
+    w->res = ESP_OK;
+    w->len = 0;
+
+    httpd_resp_set_type(req, "application/json");
+    task_prof_printf(w, "{\"cores\":%d,\"snapshots\":[", portNUM_PROCESSORS);
+
+    // copy one at a time, skip what the sampler overwrote meanwhile
+    pthread_mutex_lock(&_prof.lock);
+    uint32_t end = _prof.written;
+    uint32_t seq = end > TASK_PROF_SNAPSHOTS ? end - TASK_PROF_SNAPSHOTS : 0;
+    pthread_mutex_unlock(&_prof.lock);
+    if (last_only) {
+        seq = end - 1;
+    }
+    for (int first = 1; seq != end; ++seq) {
+        pthread_mutex_lock(&_prof.lock);
+        int valid = _prof.written - seq <= TASK_PROF_SNAPSHOTS;
+        if (valid) {
+            *snap = _prof.ring[seq % TASK_PROF_SNAPSHOTS];
+        }
+        pthread_mutex_unlock(&_prof.lock);
+        if (!valid) continue;
+
+        task_prof_printf(w, first ? "" : ",");
+        task_prof_render(w, snap);
+        first = 0;
+    }
+    task_prof_printf(w, "]}");
+    task_prof_flush(w);
+
+    esp_err_t res = w->res;
+    free(w);
+    free(snap);
+    if (res == ESP_OK) {
+        res = httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return res;
+}
@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+"""Pack a directory of web assets into a C table for www.c.
+
+Every file is gzipped at build time and emitted as a const array, so it
+stays in memory-mapped flash. Paths are looked up through a perfect hash:
+a seed is searched so that FNV-1a(seed, path) puts every path in its own
+slot. The hash must match www_hash() in www.c.
+"""
+
+import gzip
+import hashlib
+import os
+import sys
+
+MIME_TYPES = {
+    ".html": "text/html",
+    ".htm": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".jpg": "image/jpeg",
+    ".ico": "image/x-icon",
+    ".txt": "text/plain",
+}
+
+FNV_PRIME = 16777619
+MAX_SEED_TRIES = 1 << 20
+
+
+def fnv1a(seed, data):
+    h = seed
+    for b in data:
+        h ^= b
+        h = (h * FNV_PRIME) & 0xFFFFFFFF
+    return h
+
+
+def find_seed(paths, size):
+    for seed in range(2166136261, 2166136261 + MAX_SEED_TRIES):
+        slots = set()
+        for p in paths:
+            slot = fnv1a(seed, p.encode()) & (size - 1)
+            if slot in slots:
+                break
+            slots.add(slot)
+        else:
+            return seed
+    raise RuntimeError("no perfect hash seed for %d paths" % len(paths))
+
+
+def c_bytes(data):
+    lines = []
+    for i in range(0, len(data), 16):
+        lines.append("    " + ", ".join("0x%02x" % b for b in data[i:i + 16]) + ",")
+    return "\n".join(lines)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: pack_www.py <www dir> <output.c>")
+    root, out = sys.argv[1], sys.argv[2]
+
+    assets = []
+    for dirpath, _, files in os.walk(root):
+        for name in sorted(files):
+            full = os.path.join(dirpath, name)
+            path = "/" + os.path.relpath(full, root).replace(os.sep, "/")
+            ext = os.path.splitext(name)[1].lower()
+            with open(full, "rb") as f:
+                data = gzip.compress(f.read(), 9, mtime=0)
+            etag = hashlib.sha1(data).hexdigest()[:16]
+            assets.append((path, MIME_TYPES.get(ext, "application/octet-stream"),
+                           data, etag))
+    assets.sort()
+
+    size = 1
+    while size < len(assets) * 2:
+        size <<= 1
+    seed = find_seed([a[0] for a in assets], size) if assets else 2166136261
+    slots = [0xFFFF] * size
+    for i, a in enumerate(assets):
+        slots[fnv1a(seed, a[0].encode()) & (size - 1)] = i
+
+    with open(out, "w") as f:
+        f.write("// generated by pack_www.py, do not edit\n")
+        f.write('#include "www.h"\n\n')
+        for i, (path, _, data, _) in enumerate(assets):
+            f.write("// %s, %d bytes gzipped\n" % (path, len(data)))
+            f.write("static const uint8_t _www_data_%d[] = {\n%s\n};\n\n" %
+                    (i, c_bytes(data)))
+        f.write("const www_asset_t www_assets[] = {\n")
+        for i, (path, mime, data, etag) in enumerate(assets):
+            f.write('    {"%s", "%s", "\\"%s\\"", _www_data_%d, %d},\n' %
+                    (path, mime, etag, i, len(data)))
+        f.write("};\n")
+        f.write("const size_t www_asset_count = %d;\n\n" % len(assets))
+        f.write("const uint32_t www_hash_seed = %uu;\n" % seed)
+        f.write("const size_t www_hash_size = %d;\n" % size)
+        f.write("const uint16_t www_hash_slots[] = {%s};\n" %
+                ", ".join(str(s) for s in slots))
+
+
+if __name__ == "__main__":
+    main()
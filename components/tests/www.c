@@ -0,0 +1,107 @@
+#include "www.h"
+
+#include "esp_log.h"
+
+#include <string.h>
+#include <strings.h>
+
+#define WWW_TAG "WWW"
+
+#define WWW_HASH_PRIME 16777619u
+#define WWW_SLOT_EMPTY 0xffff
+
+// FNV-1a with the seed as offset basis, same as pack_www.py
+static uint32_t www_hash(uint32_t seed, const char *path, size_t len) {
+    uint32_t h = seed;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (uint8_t)path[i];
+        h *= WWW_HASH_PRIME;
+    }
+    return h;
+}
+
+const www_asset_t *www_find(const char *path, size_t len) {
+    if (www_hash_size == 0) {
+        return NULL;
+    }
+
+    uint16_t slot = www_hash_slots[www_hash(www_hash_seed, path, len) &
+                                   (www_hash_size - 1)];
+    if (slot == WWW_SLOT_EMPTY) {
+        return NULL;
+    }
+
+    // a path that was not packed can still land on a used slot
+    const www_asset_t *asset = &www_assets[slot];
+    if (strncmp(asset->path, path, len) != 0 || asset->path[len] != '\0') {
+        return NULL;
+    }
+    return asset;
+}
+
+// gzip or * in Accept-Encoding without q=0, no header at all accepts any
+static int www_accepts_gzip(httpd_req_t *req) {
+    char accept[128];
+    esp_err_t err = httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept,
+                                                sizeof(accept));
+    if (err == ESP_ERR_NOT_FOUND) {
+        return 1;
+    } else if (err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC) {
+        return 0;
+    }
+
+    for (char *p = accept; *p;) {
+        p += strspn(p, " \t,");
+        size_t item = strcspn(p, ",");
+        size_t name = strcspn(p, " \t;,");
+        if ((name == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+            (name == 1 && *p == '*')) {
+            // only q=0, q=0.0... refuse, any other weight accepts
+            const char *q = p + name;
+            q += strspn(q, " \t;");
+            if (strncasecmp(q, "q=", 2) != 0 ||
+                strspn(q + 2, "0.") < strcspn(q + 2, " \t,")) {
+                return 1;
+            }
+        }
+        p += item;
+    }
+    return 0;
+}
+
+esp_err_t www_httpd_handler(httpd_req_t *req) {
+    size_t len = strcspn(req->uri, "?#");
+    const www_asset_t *asset = len == 1 && req->uri[0] == '/'
+                                   ? www_find(WWW_INDEX, strlen(WWW_INDEX))
+                                   : www_find(req->uri, len);
+    if (asset == NULL) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "not found");
+    }
+    // only the gzipped copy is in flash
+    if (!www_accepts_gzip(req)) {
+        httpd_resp_set_status(req, "406 Not Acceptable");
+        httpd_resp_set_type(req, "text/plain");
+        httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+        return httpd_resp_send(req, "gzip only", HTTPD_RESP_USE_STRLEN);
+    }
+
+    httpd_resp_set_hdr(req, "ETag", asset->etag);
+    httpd_resp_set_hdr(req, "Cache-Control",
+                       strcmp(asset->type, "text/html") == 0
+                           ? "no-cache"
+                           : WWW_CACHE_CONTROL);
+
+    char etag[32];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", etag,
+                                    sizeof(etag)) == ESP_OK &&
+        strcmp(etag, asset->etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    // straight from mapped flash, lwip copies it into its segments
+    httpd_resp_set_type(req, asset->type);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    return httpd_resp_send(req, (const char *)asset->data, asset->len);
+}
@@ -0,0 +1,25 @@
+(function () {
+  var view = document.getElementById("view");
+  var form = document.getElementById("controls");
+
+  function stream() {
+    var q = [];
+    if (form.scale.value !== "1") q.push("scale=" + form.scale.value);
+    if (+form.kbps.value > 0) q.push("kbps=" + form.kbps.value);
+    // a new src closes the old stream and frees its worker
+    view.src = "/camera" + (q.length ? "?" + q.join("&") : "");
+  }
+
+  function rate() {
+    fetch("/camera/rate").then(function (r) { return r.json(); })
+      .then(function (j) {
+        document.getElementById("rate").textContent = JSON.stringify(j, null, 1);
+      }).catch(function () {});
+  }
+
+  form.addEventListener("submit", function (e) { e.preventDefault(); stream(); });
+  fetch("/version").then(function (r) { return r.text(); })
+    .then(function (t) { document.getElementById("version").textContent = t; });
+  stream();
+  setInterval(rate, 2000);
+})();
@@ -0,0 +1,144 @@
+#include "boot.h"
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include "quark/quark.h"
+
+#include <stdio.h>
+
+#define BOOT_TAG "boot"
+
+#define BOOT_DONE_BITS(mask) (mask)
+#define BOOT_FAILED_BITS(mask) ((mask) << BOOT_MAX_STAGES)
+
+// a stage task only touches its own copy, the caller's table may be gone
+// once boot_run timed out
+typedef struct _boot_task_t {
+    boot_stage_t stage;
+    int index;
+    EventGroupHandle_t events;
+} boot_task_t;
+
+static void boot_stage_task(void *params) {
+    boot_task_t *task = (boot_task_t *)params;
+    boot_stage_t *stage = &task->stage;
+
+    if (stage->deps != 0) {
+        xEventGroupWaitBits(task->events, BOOT_DONE_BITS(stage->deps), pdFALSE,
+                            pdTRUE, portMAX_DELAY);
+    }
+
+    stage->ran_core = xPortGetCoreID();
+    stage->start_us = esp_timer_get_time();
+    if (xEventGroupGetBits(task->events) & BOOT_FAILED_BITS(stage->deps)) {
+        stage->result = BOOT_SKIPPED;
+    } else {
+        stage->result = stage->fn(stage->arg);
+    }
+    stage->end_us = esp_timer_get_time();
+
+    if (stage->result != 0) {
+        LOGW(BOOT_TAG, "stage %s failed with %d", stage->name, stage->result);
+        xEventGroupSetBits(task->events, BOOT_FAILED_BITS(1u << task->index));
+    }
+    xEventGroupSetBits(task->events, BOOT_DONE_BITS(1u << task->index));
+    vTaskDelete(NULL);
+}
+
+int boot_run(boot_stage_t *stages, int count, int timeout_ms) {
+    if (count > BOOT_MAX_STAGES) {
+        LOGE(BOOT_TAG, "%d boot stages, at most %d", count, BOOT_MAX_STAGES);
+        return -1;
+    }
+
+    EventGroupHandle_t events = xEventGroupCreate();
+    if (events == NULL) {
+        return -1;
+    }
+
+    // stays alive until every stage is done, or forever after a timeout
+    boot_task_t *tasks = (boot_task_t *)rc_malloc(sizeof(boot_task_t) * count);
+    if (tasks == NULL) {
+        vEventGroupDelete(events);
+        return -1;
+    }
+
+    uint32_t all = 0;
+    for (int i = 0; i < count; ++i) {
+        boot_stage_t *stage = &tasks[i].stage;
+        *stage = stages[i];
+        stage->start_us = stage->end_us = 0;
+        stage->result = BOOT_SKIPPED;
+        stage->ran_core = -1;
+
+        tasks[i].index = i;
+        tasks[i].events = events;
+        all |= 1u << i;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        BaseType_t core =
+            stages[i].core == BOOT_ANY_CORE ? tskNO_AFFINITY : stages[i].core;
+        if (xTaskCreatePinnedToCore(boot_stage_task, stages[i].name,
+                                    BOOT_STAGE_STACK, &tasks[i],
+                                    BOOT_STAGE_PRIO, NULL, core) != pdPASS) {
+            LOGE(BOOT_TAG, "create task of stage %s failed", stages[i].name);
+            xEventGroupSetBits(events, BOOT_FAILED_BITS(1u << i) |
+                                           BOOT_DONE_BITS(1u << i));
+        }
+    }
+
+    EventBits_t bits =
+        xEventGroupWaitBits(events, BOOT_DONE_BITS(all), pdFALSE, pdTRUE,
+                            pdMS_TO_TICKS(timeout_ms));
+
+    // the done bit is set after the task wrote its copy for the last time
+    for (int i = 0; i < count; ++i) {
+        if (bits & BOOT_DONE_BITS(1u << i)) {
+            stages[i] = tasks[i].stage;
+        } else {
+            stages[i].result = BOOT_TIMEOUT;
+        }
+    }
+
+    if ((bits & BOOT_DONE_BITS(all)) != BOOT_DONE_BITS(all)) {
+        LOGE(BOOT_TAG, "boot stages not done in %dms", timeout_ms);
+        return -1;  // late stages still use tasks and events, both leak
+    }
+
+    rc_free(tasks);
+    vEventGroupDelete(events);
+    return (bits & BOOT_FAILED_BITS(all)) ? -1 : 0;
+}
+
+int boot_trace_json(const boot_stage_t *stages, int count, char *buf,
+                    size_t size) {
+    size_t n = 0;
+#define BOOT_TRACE_PRINT(...)                                                  \
+    do {                                                                       \
+        if (n < size) n += snprintf(buf + n, size - n, __VA_ARGS__);           \
+    } while (0)
+
+    BOOT_TRACE_PRINT("{\"traceEvents\":[");
+    for (int core = 0; core < portNUM_PROCESSORS; ++core) {
+        BOOT_TRACE_PRINT("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                         "\"tid\":%d,\"args\":{\"name\":\"core %d\"}},",
+                         core, core);
+    }
+    for (int i = 0; i < count; ++i) {
+        const boot_stage_t *stage = &stages[i];
+        BOOT_TRACE_PRINT("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                         "\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+                         "\"args\":{\"result\":%d}}",
+                         i == 0 ? "" : ",", stage->name,
+                         stage->ran_core < 0 ? 0 : stage->ran_core,
+                         stage->start_us, stage->end_us - stage->start_us,
+                         stage->result);
+    }
+    BOOT_TRACE_PRINT("],\"displayTimeUnit\":\"ms\"}");
+#undef BOOT_TRACE_PRINT
+
+    return n < size ? (int)n : -1;
+}
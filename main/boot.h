@@ -0,0 +1,46 @@
+#ifndef _DEMO_BOOT_H_
+#define _DEMO_BOOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the event group holds a done and a failed bit per stage
+#define BOOT_MAX_STAGES 8
+#define BOOT_STAGE_STACK 4096
+#define BOOT_STAGE_PRIO 5
+
+#define BOOT_ANY_CORE -1
+#define BOOT_DEP(index) (1u << (index))
+#define BOOT_SKIPPED -1000  // result of a stage whose dependency failed
+#define BOOT_TIMEOUT -1001  // result of a stage still running at the timeout
+
+typedef int (*boot_stage_fn)(void *arg);
+
+typedef struct _boot_stage_t {
+    const char *name;
+    boot_stage_fn fn;  // 0 on success
+    void *arg;
+    uint32_t deps;  // BOOT_DEP() of the stages that must succeed first
+    int core;       // 0, 1 or BOOT_ANY_CORE
+
+    // filled in by boot_run, microseconds since power on
+    int64_t start_us;
+    int64_t end_us;
+    int result;
+    int ran_core;
+} boot_stage_t;
+
+/**
+ * Start every stage in its own task as soon as its dependencies are done,
+ * so independent stages overlap on both cores. Returns 0 when all stages
+ * succeeded, -1 if one failed, was skipped or did not end in timeout_ms.
+ * The tasks run on a copy of stages, which may live on the caller's stack,
+ * results are copied back before boot_run returns.
+ */
+int boot_run(boot_stage_t *stages, int count, int timeout_ms);
+
+/* the timeline as Chrome trace JSON (chrome://tracing), -1 if truncated */
+int boot_trace_json(const boot_stage_t *stages, int count, char *buf,
+                    size_t size);
+
+#endif
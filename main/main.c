@@ -1,18 +1,32 @@
 
 #include <stdio.h>
 
+#include "boot.h"
+#include "bt_scan.h"
 #include "esp_event.h"
 #include "esp_spi_flash.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "heap_track.h"
 #include "nvs_flash.h"
 #include "quark/quark.h"
 #include "test.h"
+#include "wifi_fast.h"
 
 #define DM_TAG "demo"
 
+// bring the BT controller up during boot, only needed for the A2DP demos
+#define DEMO_BOOT_BT 0
+
+#define DEMO_BOOT_TIMEOUT_MS (30 * 1000)
+#define DEMO_BOOT_TRACE_SIZE 1536
+
+#define DEMO_WIFI_SSID "kog_2.4G"
+#define DEMO_WIFI_PASSWORD "huxiaolong@2018"
+
 #define DEMO_EXCEPT_SUCCESS(expr)                                              \
     {                                                                          \
         int __err = (expr);                                                    \
@@ -24,9 +38,8 @@
 
 int demo_on_wifi_status_change(int connected) {
     static int access = 0;
-    if (connected && !access) {  // wifi status connected
-        access = 1;
-
+    // the sdk and demo_boot_sdk may both report the first connection
+    if (connected && !__atomic_exchange_n(&access, 1, __ATOMIC_ACQ_REL)) {
         char ip[16] = {0};
         rc_get_wifi_local_ip(ip);
         LOGI(DM_TAG, "Local Ip: %s", ip);
@@ -37,6 +50,97 @@ int demo_on_wifi_status_change(int connected) {
     return 0;
 }
 
+enum {
+    DEMO_STAGE_NVS,
+    DEMO_STAGE_NETIF,
+    DEMO_STAGE_WIFI,
+    DEMO_STAGE_SDK,
+    DEMO_STAGE_CAMERA,
+#if DEMO_BOOT_BT
+    DEMO_STAGE_BT,
+#endif
+    DEMO_STAGE_COUNT
+};
+
+static int demo_boot_nvs(void *arg) { return nvs_flash_init(); }
+
+static int demo_boot_netif(void *arg) {
+    esp_err_t err = esp_netif_init();
+    if (err == ESP_OK) {
+        err = esp_event_loop_create_default();
+    }
+    return err;
+}
+
+static int demo_boot_wifi(void *arg) {
+    esp_netif_create_default_wifi_sta();
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    return esp_wifi_init(&cfg);
+}
+
+static int demo_boot_sdk(void *arg) {
+    rc_settings_t *settings = (rc_settings_t *)arg;
+
+    LOGI(DM_TAG, "quark sdk version: %s", rc_sdk_version());
+    int err = rc_sdk_init("test", 1, settings);
+    if (err != 0) {
+        return err;
+    }
+
+    // the AP of the last boot first, on its channel, then a full scan.
+    // whichever path connects owns the reconnects: on the fast one the sdk
+    // does not get the credentials, so it neither reassociates nor retries
+    // next to wifi_fast, and it never reports the connection itself
+    if (wifi_fast_init() == 0 &&
+        wifi_fast_connect(DEMO_WIFI_SSID, DEMO_WIFI_PASSWORD) == 0) {
+        settings->wifi_status_callback(1);
+        return 0;
+    }
+    wifi_fast_begin_scan();
+    return rc_set_wifi(DEMO_WIFI_SSID, DEMO_WIFI_PASSWORD);
+}
+
+static int demo_boot_camera(void *arg) { return camera_init(); }
+
+#if DEMO_BOOT_BT
+static int demo_boot_bt(void *arg) { return bt_init(); }
+#endif
+
+static void demo_boot(rc_settings_t *settings) {
+    // the camera sizes its frame buffers from the free heap, so it starts
+    // once the Wi-Fi driver has taken its share, not before
+    boot_stage_t stages[DEMO_STAGE_COUNT] = {
+        [DEMO_STAGE_NVS] = {"nvs", demo_boot_nvs, NULL, 0, 0},
+        [DEMO_STAGE_NETIF] = {"netif", demo_boot_netif, NULL, 0, 1},
+        [DEMO_STAGE_WIFI] = {"wifi", demo_boot_wifi, NULL,
+                             BOOT_DEP(DEMO_STAGE_NVS) |
+                                 BOOT_DEP(DEMO_STAGE_NETIF),
+                             0},
+        [DEMO_STAGE_SDK] = {"sdk", demo_boot_sdk, settings,
+                            BOOT_DEP(DEMO_STAGE_WIFI), 0},
+        [DEMO_STAGE_CAMERA] = {"camera", demo_boot_camera, NULL,
+                               BOOT_DEP(DEMO_STAGE_WIFI), 1},
+#if DEMO_BOOT_BT
+        [DEMO_STAGE_BT] = {"bt", demo_boot_bt, NULL, BOOT_DEP(DEMO_STAGE_NVS),
+                           1},
+#endif
+    };
+
+    int64_t begin = esp_timer_get_time();
+    int err = boot_run(stages, DEMO_STAGE_COUNT, DEMO_BOOT_TIMEOUT_MS);
+    LOGI(DM_TAG, "boot stages %s in %lldms", err == 0 ? "done" : "failed",
+         (esp_timer_get_time() - begin) / 1000);
+
+    char *trace = (char *)rc_malloc(DEMO_BOOT_TRACE_SIZE);
+    if (trace != NULL) {
+        if (boot_trace_json(stages, DEMO_STAGE_COUNT, trace,
+                            DEMO_BOOT_TRACE_SIZE) > 0) {
+            printf("boot trace: %s\n", trace);
+        }
+        rc_free(trace);
+    }
+}
+
 void app_main(void) {
     int i = 0;
 
@@ -52,19 +156,8 @@ void app_main(void) {
     printf("%dMB %s flash\n", spi_flash_get_chip_size() / (1024 * 1024),
            (chip_info.features & CHIP_FEATURE_EMB_FLASH) ? "embedded"
                                                          : "external");
-    rc_sleep(1000);
-
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(nvs_flash_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
     rc_settings_t settings;
-
-    LOGI(DM_TAG, "quark sdk version: %s", rc_sdk_version());
-
     rc_settings_init(&settings);
     settings.wifi_status_callback = demo_on_wifi_status_change;
     settings.app_id = "test";
@@ -74,17 +167,10 @@ void app_main(void) {
     settings.iot_platform = RC_IOT_QUARK;
     settings.service_url = "http://192.168.3.24:8080/api";
 
-    // init sdk
-    DEMO_EXCEPT_SUCCESS(rc_sdk_init("test", 1, &settings));
-
-    // get wifi status, if is not connected, do connect
-    for (i = 5; i >= 0; i--) {
-        LOGI(DM_TAG, "Start to connect to wifi in %d seconds...", i);
-
-        rc_sleep(1000);
-    }
+    heap_track_init();  // no-op unless HEAP_TRACK is set
 
-    DEMO_EXCEPT_SUCCESS(rc_set_wifi("kog_2.4G", "huxiaolong@2018"));
+    // nvs, wifi, sdk and camera, the stages overlap where they can
+    demo_boot(&settings);
 
     // entry working thread
     for (i = 10; i < 60 * 60; ++i) {
@@ -99,4 +185,4 @@ void app_main(void) {
     printf("Restarting now.\n");
     fflush(stdout);
     esp_restart();
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,233 @@
+#include "wifi_fast.h"
+
+#include "esp_event.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "nvs.h"
+#include "quark/quark.h"
+
+#include <string.h>
+
+#define WIFI_FAST_TAG "wifi_fast"
+
+#define WIFI_FAST_GOT_IP 0x01
+#define WIFI_FAST_DISCONNECTED 0x02
+
+typedef struct _wifi_fast_t {
+    EventGroupHandle_t events;
+    wifi_fast_ap_t cached;
+    int has_cached;
+
+    // current attempt, for the timing log
+    const char *path;
+    int64_t connect_us;
+    int64_t assoc_us;
+
+    // set once the fast path got an address, wifi_fast then owns the
+    // reconnects, from the esp_timer task
+    int reconnect;
+    int retries;
+    esp_timer_handle_t retry_timer;
+} wifi_fast_t;
+
+static wifi_fast_t _wifi_fast;
+
+static void wifi_fast_save(const wifi_fast_ap_t *ap) {
+    if (_wifi_fast.has_cached && memcmp(ap, &_wifi_fast.cached,
+                                        sizeof(wifi_fast_ap_t)) == 0) {
+        return;  // same AP as last time, spare the flash
+    }
+
+    nvs_handle_t nvs;
+    if (nvs_open(WIFI_FAST_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        LOGW(WIFI_FAST_TAG, "open nvs %s failed", WIFI_FAST_NVS_NAMESPACE);
+        return;
+    }
+    if (nvs_set_blob(nvs, WIFI_FAST_NVS_KEY, ap, sizeof(wifi_fast_ap_t)) !=
+            ESP_OK ||
+        nvs_commit(nvs) != ESP_OK) {
+        LOGW(WIFI_FAST_TAG, "save ap failed");
+    }
+    nvs_close(nvs);
+
+    _wifi_fast.cached = *ap;
+    _wifi_fast.has_cached = 1;
+}
+
+static void wifi_fast_on_retry(void *arg) {
+    if (!__atomic_load_n(&_wifi_fast.reconnect, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    if (++_wifi_fast.retries == WIFI_FAST_RETRY_CACHED + 1) {
+        // the AP may have moved channel or gone, let any AP of the ssid do
+        wifi_config_t config;
+        if (esp_wifi_get_config(WIFI_IF_STA, &config) == ESP_OK &&
+            config.sta.bssid_set) {
+            config.sta.bssid_set = 0;
+            config.sta.channel = 0;
+            esp_wifi_set_config(WIFI_IF_STA, &config);
+        }
+    }
+
+    LOGI(WIFI_FAST_TAG, "reconnect, retry %d", _wifi_fast.retries);
+    if (esp_wifi_connect() != ESP_OK) {
+        LOGW(WIFI_FAST_TAG, "reconnect failed");
+    }
+}
+
+static void wifi_fast_retry_later(int reason) {
+    int delay_ms = WIFI_FAST_RETRY_MIN_MS;
+    for (int i = 0; i < _wifi_fast.retries && delay_ms < WIFI_FAST_RETRY_MAX_MS;
+         ++i) {
+        delay_ms <<= 1;
+    }
+    if (delay_ms > WIFI_FAST_RETRY_MAX_MS) {
+        delay_ms = WIFI_FAST_RETRY_MAX_MS;
+    }
+
+    LOGW(WIFI_FAST_TAG, "disconnected, reason %d, retry in %dms", reason,
+         delay_ms);
+    esp_timer_stop(_wifi_fast.retry_timer);  // fails when it is not armed
+    esp_timer_start_once(_wifi_fast.retry_timer, delay_ms * 1000LL);
+}
+
+static void wifi_fast_on_event(void *arg, esp_event_base_t base, int32_t id,
+                               void *data) {
+    int64_t now = esp_timer_get_time();
+
+    if (base == WIFI_EVENT && id == WIFI_EVENT_STA_CONNECTED) {
+        wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *)data;
+        wifi_fast_ap_t ap;
+        memset(&ap, 0, sizeof(ap));
+        memcpy(ap.ssid, event->ssid, event->ssid_len);
+        memcpy(ap.bssid, event->bssid, sizeof(ap.bssid));
+        ap.channel = event->channel;
+        wifi_fast_save(&ap);
+
+        _wifi_fast.assoc_us = now;
+        if (_wifi_fast.connect_us != 0) {
+            LOGI(WIFI_FAST_TAG, "%s: associated in %lldms, channel %d",
+                 _wifi_fast.path, (now - _wifi_fast.connect_us) / 1000,
+                 ap.channel);
+        }
+    } else if (base == WIFI_EVENT && id == WIFI_EVENT_STA_DISCONNECTED) {
+        wifi_event_sta_disconnected_t *event =
+            (wifi_event_sta_disconnected_t *)data;
+        xEventGroupSetBits(_wifi_fast.events, WIFI_FAST_DISCONNECTED);
+        // ASSOC_LEAVE is our own esp_wifi_disconnect
+        if (__atomic_load_n(&_wifi_fast.reconnect, __ATOMIC_ACQUIRE) &&
+            event->reason != WIFI_REASON_ASSOC_LEAVE) {
+            wifi_fast_retry_later(event->reason);
+        }
+    } else if (base == IP_EVENT && id == IP_EVENT_STA_GOT_IP) {
+        if (_wifi_fast.connect_us != 0 && _wifi_fast.assoc_us != 0) {
+            LOGI(WIFI_FAST_TAG, "%s: ip in %lldms, %lldms since connect",
+                 _wifi_fast.path, (now - _wifi_fast.assoc_us) / 1000,
+                 (now - _wifi_fast.connect_us) / 1000);
+        }
+        _wifi_fast.connect_us = 0;  // reconnects are not timed
+        _wifi_fast.retries = 0;
+        xEventGroupSetBits(_wifi_fast.events, WIFI_FAST_GOT_IP);
+    }
+}
+
+int wifi_fast_init(void) {
+    memset(&_wifi_fast, 0, sizeof(_wifi_fast));
+    _wifi_fast.events = xEventGroupCreate();
+    if (_wifi_fast.events == NULL) {
+        return -1;
+    }
+
+    nvs_handle_t nvs;
+    size_t size = sizeof(wifi_fast_ap_t);
+    if (nvs_open(WIFI_FAST_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        _wifi_fast.has_cached =
+            nvs_get_blob(nvs, WIFI_FAST_NVS_KEY, &_wifi_fast.cached, &size) ==
+                ESP_OK &&
+            size == sizeof(wifi_fast_ap_t);
+        nvs_close(nvs);
+    }
+
+    esp_timer_create_args_t args = {
+        .callback = wifi_fast_on_retry,
+        .name = "wifi_fast",
+    };
+    if (esp_timer_create(&args, &_wifi_fast.retry_timer) != ESP_OK) {
+        return -1;
+    }
+
+    esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED,
+                               wifi_fast_on_event, NULL);
+    esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED,
+                               wifi_fast_on_event, NULL);
+    esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
+                               wifi_fast_on_event, NULL);
+    return 0;
+}
+
+int wifi_fast_connect(const char *ssid, const char *password) {
+    wifi_fast_ap_t *ap = &_wifi_fast.cached;
+    if (!_wifi_fast.has_cached || strcmp(ap->ssid, ssid) != 0) {
+        LOGI(WIFI_FAST_TAG, "no cached ap for %s", ssid);
+        return -1;
+    }
+
+    wifi_config_t config;
+    memset(&config, 0, sizeof(config));
+    strncpy((char *)config.sta.ssid, ssid, sizeof(config.sta.ssid));
+    strncpy((char *)config.sta.password, password,
+            sizeof(config.sta.password));
+    config.sta.bssid_set = 1;
+    memcpy(config.sta.bssid, ap->bssid, sizeof(config.sta.bssid));
+    config.sta.channel = ap->channel;  // probe this channel only
+    config.sta.scan_method = WIFI_FAST_SCAN;
+
+    LOGI(WIFI_FAST_TAG, "connect %s %02x:%02x:%02x:%02x:%02x:%02x channel %d",
+         ssid, ap->bssid[0], ap->bssid[1], ap->bssid[2], ap->bssid[3],
+         ap->bssid[4], ap->bssid[5], ap->channel);
+
+    __atomic_store_n(&_wifi_fast.reconnect, 0, __ATOMIC_RELEASE);
+    xEventGroupClearBits(_wifi_fast.events,
+                         WIFI_FAST_GOT_IP | WIFI_FAST_DISCONNECTED);
+    _wifi_fast.path = "cached ap";
+    _wifi_fast.assoc_us = 0;
+    _wifi_fast.connect_us = esp_timer_get_time();
+
+    if (esp_wifi_set_mode(WIFI_MODE_STA) != ESP_OK ||
+        esp_wifi_set_config(WIFI_IF_STA, &config) != ESP_OK ||
+        esp_wifi_start() != ESP_OK || esp_wifi_connect() != ESP_OK) {
+        LOGW(WIFI_FAST_TAG, "start station failed");
+        return -1;
+    }
+
+    EventBits_t bits = xEventGroupWaitBits(
+        _wifi_fast.events, WIFI_FAST_GOT_IP | WIFI_FAST_DISCONNECTED, pdFALSE,
+        pdFALSE, pdMS_TO_TICKS(WIFI_FAST_TIMEOUT_MS));
+    if (bits & WIFI_FAST_GOT_IP) {
+        __atomic_store_n(&_wifi_fast.reconnect, 1, __ATOMIC_RELEASE);
+        // a loss right after the address came up was not retried yet
+        if (xEventGroupGetBits(_wifi_fast.events) & WIFI_FAST_DISCONNECTED) {
+            wifi_fast_retry_later(0);
+        }
+        return 0;
+    }
+
+    LOGW(WIFI_FAST_TAG, "cached ap %s, fall back to a scan",
+         (bits & WIFI_FAST_DISCONNECTED) ? "refused" : "timed out");
+    esp_wifi_disconnect();
+    config.sta.bssid_set = 0;
+    config.sta.channel = 0;
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+    return -1;
+}
+
+void wifi_fast_begin_scan(void) {
+    __atomic_store_n(&_wifi_fast.reconnect, 0, __ATOMIC_RELEASE);
+    esp_timer_stop(_wifi_fast.retry_timer);  // fails when it is not armed
+    _wifi_fast.path = "full scan";
+    _wifi_fast.assoc_us = 0;
+    _wifi_fast.connect_us = esp_timer_get_time();
+}
@@ -0,0 +1,43 @@
+#ifndef _DEMO_WIFI_FAST_H_
+#define _DEMO_WIFI_FAST_H_
+
+#include <stdint.h>
+
+#define WIFI_FAST_NVS_NAMESPACE "wififast"
+#define WIFI_FAST_NVS_KEY "ap"
+
+// the cached AP gets this long to associate and hand out an address
+#define WIFI_FAST_TIMEOUT_MS 4000
+
+// a lost connection is retried with a doubling delay between these
+#define WIFI_FAST_RETRY_MIN_MS 500
+#define WIFI_FAST_RETRY_MAX_MS (30 * 1000)
+// retries that stay on the AP of the last association before a full scan
+#define WIFI_FAST_RETRY_CACHED 2
+
+/* the AP of the last association, saved when it changes */
+typedef struct _wifi_fast_ap_t {
+    char ssid[33];
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_fast_ap_t;
+
+/* load the cached AP and watch association and IP events */
+int wifi_fast_init(void);
+
+/**
+ * associate to the cached AP of ssid on its channel, without a scan.
+ * 0 once an address is up, wifi_fast then retries a lost connection
+ * itself, whoever else has the credentials must not. -1 if nothing is
+ * cached for ssid or the AP did not answer in time, the station is then
+ * disconnected for a full scan.
+ */
+int wifi_fast_connect(const char *ssid, const char *password);
+
+/**
+ * the next connection comes from a full scan by someone else, who also
+ * owns its reconnects. Only the timing log is kept.
+ */
+void wifi_fast_begin_scan(void);
+
+#endif
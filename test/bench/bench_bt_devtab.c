@@ -0,0 +1,408 @@
+/**
+ * bt_devtab under synthetic discovery traffic: a population of devices,
+ * some of them chatty, answering inquiries with EIR blocks, one tick per
+ * -r results, expiry every tick. Each result goes the way on_found_device
+ * takes it: upsert, bt_eir_parse, the name stored only when its hash
+ * changed. Compared with what the table replaced, the address printed to
+ * a string and looked up in a string keyed map of ten entries with names
+ * in a 1 KB pad.
+ *
+ * A second, untimed pass checks the table against a plain model of which
+ * devices should be in it, so the ctest run is a correctness test too.
+ *   bench_bt_devtab [-e events] [-d devices] [-t ttl] [-r per_tick]
+ */
+
+#include "bt_devtab.h"
+#include "bt_eir.h"
+#include "esp_gap_bt_api.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_HOT_DEVICES 16  // half of the results come from these
+#define BENCH_OLD_DEVICES 10
+#define BENCH_OLD_PAD 1024
+#define BENCH_OLD_BUCKETS 16
+
+typedef struct _bench_device_t {
+    esp_bd_addr_t bda;
+    uint8_t eir[ESP_BT_GAP_EIR_DATA_LEN];
+    uint8_t eir_len;
+    char name[BT_DEVTAB_NAME_MAX];
+    int renamed;  // the name changes every so often
+} bench_device_t;
+
+typedef struct _bench_event_t {
+    uint16_t device;
+    int8_t rssi;
+} bench_event_t;
+
+typedef struct _bench_opts_t {
+    int events;
+    int devices;
+    uint32_t ttl;
+    int per_tick;
+    unsigned int seed;
+} bench_opts_t;
+
+/* the replaced path, a string keyed chained map and a fixed array */
+typedef struct _bench_old_entry_t {
+    char key[18];
+    int next;  // entry + 1 in the bucket chain
+    const char *name;
+    int rssi;
+} bench_old_entry_t;
+
+typedef struct _bench_old_t {
+    bench_old_entry_t devices[BENCH_OLD_DEVICES];
+    int count;
+    int buckets[BENCH_OLD_BUCKETS];
+    char pad[BENCH_OLD_PAD];
+    int pad_used;
+    uint32_t dropped;
+} bench_old_t;
+
+static int64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint8_t *bench_put_field(uint8_t *p, uint8_t type, const void *value,
+                                int len) {
+    *p++ = len + 1;
+    *p++ = type;
+    memcpy(p, value, len);
+    return p + len;
+}
+
+static void bench_make_eir(bench_device_t *d, int index, unsigned int *seed) {
+    uint8_t *p = d->eir;
+    uint8_t flags = 0x06;
+    p = bench_put_field(p, ESP_BT_EIR_TYPE_FLAGS, &flags, 1);
+    if (index % 4 != 3) {  // a quarter never sends a name
+        snprintf(d->name, sizeof(d->name), "%s-%04d-rev%d",
+                 index % 3 ? "Speaker" : "Headset", index, d->renamed);
+        p = bench_put_field(p,
+                            index % 5 ? ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME
+                                      : ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME,
+                            d->name, strlen(d->name));
+    } else {
+        d->name[0] = '\0';
+    }
+    if (index % 2) {
+        int8_t tx = -(rand_r(seed) % 20);
+        p = bench_put_field(p, ESP_BT_EIR_TYPE_TX_POWER_LEVEL, &tx, 1);
+    }
+    uint8_t uuids[] = {0x0b, 0x11, 0x0e, 0x11, 0x1e, 0x11};
+    p = bench_put_field(p, ESP_BT_EIR_TYPE_CMPL_16BITS_UUID, uuids,
+                        index % 3 ? 6 : 2);
+    d->eir_len = p - d->eir;
+}
+
+static bench_device_t *bench_population(const bench_opts_t *opts) {
+    bench_device_t *devices =
+        (bench_device_t *)calloc(opts->devices, sizeof(bench_device_t));
+    if (devices == NULL) {
+        return NULL;
+    }
+    unsigned int seed = opts->seed;
+    for (int i = 0; i < opts->devices; ++i) {
+        bench_device_t *d = &devices[i];
+        do {
+            for (int b = 0; b < ESP_BD_ADDR_LEN; ++b) {
+                d->bda[b] = rand_r(&seed);
+            }
+            // a clash would merge two devices, draw again
+            for (int j = 0; j < i; ++j) {
+                if (memcmp(devices[j].bda, d->bda, ESP_BD_ADDR_LEN) == 0) {
+                    d->bda[0] = 0;
+                    d->bda[1] = 0;
+                    break;
+                }
+            }
+        } while (d->bda[0] == 0 && d->bda[1] == 0);
+        bench_make_eir(d, i, &seed);
+    }
+    return devices;
+}
+
+static bench_event_t *bench_events(const bench_opts_t *opts) {
+    bench_event_t *events =
+        (bench_event_t *)malloc(sizeof(bench_event_t) * opts->events);
+    if (events == NULL) {
+        return NULL;
+    }
+    unsigned int seed = opts->seed ^ 0x5bd1e995;
+    int hot = opts->devices < BENCH_HOT_DEVICES ? opts->devices
+                                                : BENCH_HOT_DEVICES;
+    for (int i = 0; i < opts->events; ++i) {
+        int r = rand_r(&seed);
+        events[i].device = r & 1 ? (r >> 1) % hot : (r >> 1) % opts->devices;
+        events[i].rssi = -40 - (rand_r(&seed) % 50);
+    }
+    return events;
+}
+
+// the body of on_found_device without the logging
+static bt_device_t *bench_found(bt_devtab_t *tab, const bench_device_t *d,
+                                int8_t rssi) {
+    int created;
+    bt_device_t *device = bt_devtab_upsert(tab, d->bda, &created);
+    if (device == NULL) {
+        return NULL;
+    }
+    device->rssi = rssi;
+    bt_eir_t eir;
+    device->eir = bt_eir_parse(d->eir, d->eir_len, &eir);
+    if (eir.present & BT_EIR_HAS_TX_POWER) {
+        device->tx_power = eir.tx_power;
+    }
+    if ((eir.present & BT_EIR_HAS_NAME) &&
+        eir.name_hash != device->name_hash) {
+        bt_devtab_set_name(tab, device, eir.name, eir.name_len,
+                           eir.name_hash);
+    }
+    return device;
+}
+
+static uint32_t bench_old_hash(const char *key) {
+    uint32_t h = 5381;
+    while (*key) {
+        h = h * 33 + (uint8_t)*key++;
+    }
+    return h % BENCH_OLD_BUCKETS;
+}
+
+static void bench_old_found(bench_old_t *old, const bench_device_t *d,
+                            int8_t rssi) {
+    char key[18];
+    snprintf(key, sizeof(key), "%02x:%02x:%02x:%02x:%02x:%02x", d->bda[0],
+             d->bda[1], d->bda[2], d->bda[3], d->bda[4], d->bda[5]);
+    uint32_t b = bench_old_hash(key);
+    int index = old->buckets[b] - 1;
+    while (index >= 0 && strcmp(old->devices[index].key, key) != 0) {
+        index = old->devices[index].next - 1;
+    }
+    if (index < 0) {
+        if (old->count == BENCH_OLD_DEVICES) {
+            ++old->dropped;
+            return;
+        }
+        index = old->count++;
+        bench_old_entry_t *e = &old->devices[index];
+        memcpy(e->key, key, sizeof(key));
+        e->next = old->buckets[b];
+        e->name = "";
+        old->buckets[b] = index + 1;
+    }
+    bench_old_entry_t *e = &old->devices[index];
+    e->rssi = rssi;
+
+    // the EIR was walked on every result, the name kept once seen
+    bt_eir_t eir;
+    bt_eir_parse(d->eir, d->eir_len, &eir);
+    if ((eir.present & BT_EIR_HAS_NAME) && e->name[0] == '\0' &&
+        old->pad_used + eir.name_len + 1 <= BENCH_OLD_PAD) {
+        char *p = old->pad + old->pad_used;
+        memcpy(p, eir.name, eir.name_len);
+        p[eir.name_len] = '\0';
+        e->name = p;
+        old->pad_used += eir.name_len + 1;
+    }
+}
+
+static int64_t bench_run_devtab(const bench_opts_t *opts,
+                                bench_device_t *devices,
+                                const bench_event_t *events,
+                                bt_devtab_t *tab) {
+    int64_t t0 = bench_now_ns();
+    uint32_t tick = 0;
+    for (int i = 0; i < opts->events; ++i) {
+        if (i % opts->per_tick == 0) {
+            bt_devtab_expire(tab, ++tick);
+        }
+        bench_found(tab, &devices[events[i].device], events[i].rssi);
+    }
+    return bench_now_ns() - t0;
+}
+
+static int64_t bench_run_old(const bench_opts_t *opts,
+                             bench_device_t *devices,
+                             const bench_event_t *events, bench_old_t *old) {
+    int64_t t0 = bench_now_ns();
+    for (int i = 0; i < opts->events; ++i) {
+        bench_old_found(old, &devices[events[i].device], events[i].rssi);
+    }
+    return bench_now_ns() - t0;
+}
+
+/**
+ * The same events with a model next to the table: a device is in it from
+ * its first result until ttl ticks without one, unless the table was full
+ * when it first showed up.
+ */
+static int bench_verify(const bench_opts_t *opts, bench_device_t *devices,
+                        const bench_event_t *events, int max_devices) {
+    bt_devtab_t tab;
+    if (bt_devtab_init(&tab, max_devices) != 0) {
+        return -1;
+    }
+    bt_devtab_set_ttl(&tab, opts->ttl);
+    int32_t *last_seen = (int32_t *)malloc(sizeof(int32_t) * opts->devices);
+    if (last_seen == NULL) {
+        bt_devtab_uninit(&tab);
+        return -1;
+    }
+    for (int d = 0; d < opts->devices; ++d) {
+        last_seen[d] = -1;  // not in the table
+    }
+
+    int errors = 0, count = 0;
+    uint32_t tick = 0;
+    for (int i = 0; i < opts->events && errors < 10; ++i) {
+        if (i % opts->per_tick == 0) {
+            bt_devtab_expire(&tab, ++tick);
+            for (int d = 0; d < opts->devices; ++d) {
+                if (opts->ttl && last_seen[d] >= 0 &&
+                    tick >= last_seen[d] + opts->ttl) {
+                    last_seen[d] = -1;
+                    --count;
+                }
+            }
+            if (tab.count != count) {
+                printf("tick %u: %d devices, expected %d\n", tick, tab.count,
+                       count);
+                ++errors;
+            }
+        }
+
+        int d = events[i].device;
+        int full = last_seen[d] < 0 && count >= tab.max_devices;
+        bt_device_t *device = bench_found(&tab, &devices[d], events[i].rssi);
+        if (full) {
+            if (device != NULL) {
+                printf("event %d: added to a full table\n", i);
+                ++errors;
+            }
+            continue;
+        }
+        if (device == NULL ||
+            memcmp(device->bda, devices[d].bda, ESP_BD_ADDR_LEN) != 0) {
+            printf("event %d: device %d not stored\n", i, d);
+            ++errors;
+            continue;
+        }
+        if (last_seen[d] < 0) {
+            ++count;
+        }
+        last_seen[d] = tick;
+        if (devices[d].name[0] != '\0' &&
+            strncmp(device->name, devices[d].name, BT_DEVTAB_NAME_MAX) != 0) {
+            printf("event %d: device %d named \"%s\", expected \"%s\"\n", i,
+                   d, device->name, devices[d].name);
+            ++errors;
+        }
+    }
+
+    // every device the model holds can be found, nothing else can
+    for (int d = 0; d < opts->devices && errors < 10; ++d) {
+        bt_device_t *device = bt_devtab_find(&tab, devices[d].bda);
+        if ((device != NULL) != (last_seen[d] >= 0)) {
+            printf("device %d: %s\n", d,
+                   device ? "in the table after expiry" : "lost");
+            ++errors;
+        }
+    }
+
+    free(last_seen);
+    bt_devtab_uninit(&tab);
+    return errors;
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-e events] [-d devices] [-t ttl] [-r per_tick] "
+            "[-s seed]\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    bench_opts_t opts = {
+        .events = 50000,
+        .devices = 300,
+        .ttl = 20,
+        .per_tick = 100,
+        .seed = 1,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:d:t:r:s:")) != -1) {
+        switch (opt) {
+        case 'e': opts.events = atoi(optarg); break;
+        case 'd': opts.devices = atoi(optarg); break;
+        case 't': opts.ttl = atoi(optarg); break;
+        case 'r': opts.per_tick = atoi(optarg); break;
+        case 's': opts.seed = strtoul(optarg, NULL, 0); break;
+        default: bench_usage(argv[0]); return 2;
+        }
+    }
+    if (opts.events < 1 || opts.devices < 1 || opts.devices > 0xffff ||
+        opts.per_tick < 1 || opts.ttl >= BT_DEVTAB_WHEEL_SLOTS) {
+        bench_usage(argv[0]);
+        return 2;
+    }
+
+    bench_device_t *devices = bench_population(&opts);
+    bench_event_t *events = bench_events(&opts);
+    if (devices == NULL || events == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    // with expiry, then keeping everything as one long inquiry would
+    printf("%d results from %d devices, %d per tick, ttl %u\n", opts.events,
+           opts.devices, opts.per_tick, opts.ttl);
+    printf("                     ns/result  devices  rejected  expired  "
+           "probes/lookup  name bytes\n");
+    uint32_t ttls[] = {opts.ttl, 0};
+    for (int i = 0; i < 2; ++i) {
+        bt_devtab_t tab;
+        if (bt_devtab_init(&tab, BT_DEVTAB_MAX_DEVICES) != 0) {
+            return 1;
+        }
+        bt_devtab_set_ttl(&tab, ttls[i]);
+        int64_t ns = bench_run_devtab(&opts, devices, events, &tab);
+        char label[32];
+        snprintf(label, sizeof(label), "devtab ttl %u", ttls[i]);
+        printf("%-20s %10.1f %8d %9u %8u %14.2f %11d\n", label,
+               ns / (double)opts.events, tab.count, tab.rejected,
+               tab.expired, tab.probes / (double)opts.events,
+               tab.names_used);
+        bt_devtab_uninit(&tab);
+    }
+
+    bench_old_t *old = (bench_old_t *)calloc(1, sizeof(bench_old_t));
+    if (old == NULL) {
+        return 1;
+    }
+    int64_t ns = bench_run_old(&opts, devices, events, old);
+    printf("%-20s %10.1f %8d %9u %8s %14s %11d\n", "string map, 10",
+           ns / (double)opts.events, old->count, old->dropped, "-", "-",
+           old->pad_used);
+    free(old);
+
+    int errors = bench_verify(&opts, devices, events, BT_DEVTAB_MAX_DEVICES);
+    // a small table, so being full and rejecting is covered too
+    if (errors == 0) {
+        errors = bench_verify(&opts, devices, events, BT_DEVTAB_MAX_DEVICES / 8);
+    }
+    printf("%s\n", errors == 0 ? "model check ok" : "model check FAILED");
+
+    free(events);
+    free(devices);
+    return errors == 0 ? 0 : 1;
+}
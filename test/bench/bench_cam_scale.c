@@ -0,0 +1,321 @@
+/**
+ * cam_scale_frame against the naive way to serve a reduced view: decode or
+ * convert the whole frame to RGB888, box filter it down, encode. Both run
+ * the same host decoder and encoder, so the ratio is what the DCT domain
+ * scaling and the raw box filter on the source format save. Grayscale has
+ * nothing to convert, both sides do the same work there.
+ *   bench_cam_scale [-i iterations]
+ */
+
+#include "cam_encode.h"
+#include "cam_scale.h"
+#include "esp_jpg_decode.h"
+#include "img_converters.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_QUALITY 80
+
+typedef struct _bench_naive_t {
+    uint8_t *rgb;  // whole frame, BGR888 as the encoder takes it, gray
+                   // stays one byte per pixel as the scaler keeps it
+    uint16_t width;
+    uint16_t height;
+    const uint8_t *jpg;
+    size_t jpg_len;
+} bench_naive_t;
+
+static int64_t bench_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static inline uint8_t bench_clamp(int v) {
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// a colour scene with edges, so the JPEG is not trivially small
+static void bench_draw(uint8_t *bgr, int width, int height) {
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x, bgr += 3) {
+            int in_box = x > width / 4 && x < width / 2 && y > height / 3 &&
+                         y < height * 2 / 3;
+            bgr[0] = in_box ? 30 : (x * 255 / width);
+            bgr[1] = in_box ? 200 : (y * 255 / height);
+            bgr[2] = ((x / 16 + y / 16) & 1) ? 220 : 40;
+        }
+    }
+}
+
+static void bench_to_format(const uint8_t *bgr, int width, int height,
+                            pixformat_t format, uint8_t *out) {
+    for (int i = 0; i < width * height; ++i, bgr += 3) {
+        int b = bgr[0], g = bgr[1], r = bgr[2];
+        int luma = (77 * r + 150 * g + 29 * b) >> 8;
+        if (format == PIXFORMAT_GRAYSCALE) {
+            out[i] = luma;
+        } else if (format == PIXFORMAT_RGB565) {
+            uint16_t p = ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+            out[i * 2] = p >> 8;
+            out[i * 2 + 1] = p & 0xff;
+        } else {  // YUYV, chroma of the even pixel
+            out[i * 2] = luma;
+            if ((i & 1) == 0) {
+                out[i * 2 + 1] = bench_clamp(((b - luma) * 144 >> 8) + 128);
+            } else {
+                const uint8_t *even = bgr - 3;
+                int l = (77 * even[2] + 150 * even[1] + 29 * even[0]) >> 8;
+                out[i * 2 + 1] =
+                    bench_clamp(((even[2] - l) * 183 >> 8) + 128);
+            }
+        }
+    }
+}
+
+static size_t bench_jpg_read(void *arg, size_t index, uint8_t *buf,
+                             size_t len) {
+    bench_naive_t *n = (bench_naive_t *)arg;
+    if (index + len > n->jpg_len) {
+        len = n->jpg_len - index;
+    }
+    if (buf) {
+        memcpy(buf, n->jpg + index, len);
+    }
+    return len;
+}
+
+static bool bench_jpg_write(void *arg, uint16_t x, uint16_t y, uint16_t w,
+                            uint16_t h, uint8_t *data) {
+    bench_naive_t *n = (bench_naive_t *)arg;
+    if (!data) {
+        return true;
+    }
+    for (int iy = 0; iy < h; ++iy) {
+        const uint8_t *src = data + iy * w * 3;
+        uint8_t *dst = n->rgb + ((y + iy) * n->width + x) * 3;
+        for (int ix = 0; ix < w; ++ix, src += 3, dst += 3) {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+        }
+    }
+    return true;
+}
+
+// the whole frame to BGR888, the step the scaler avoids
+static int bench_full_rgb(bench_naive_t *n, camera_fb_t *fb) {
+    if (fb->format == PIXFORMAT_GRAYSCALE) {
+        memcpy(n->rgb, fb->buf, fb->width * fb->height);
+        return 0;
+    }
+    if (fb->format == PIXFORMAT_JPEG) {
+        n->jpg = fb->buf;
+        n->jpg_len = fb->len;
+        return esp_jpg_decode(fb->len, JPG_SCALE_NONE, bench_jpg_read,
+                              bench_jpg_write, n) == ESP_OK
+                   ? 0
+                   : -1;
+    }
+    uint8_t *dst = n->rgb;
+    for (size_t i = 0; i < fb->width * fb->height; ++i, dst += 3) {
+        int r, g, b;
+        if (fb->format == PIXFORMAT_RGB565) {
+            uint16_t p = (fb->buf[i * 2] << 8) | fb->buf[i * 2 + 1];
+            r = (p >> 8) & 0xf8;
+            g = (p >> 3) & 0xfc;
+            b = (p << 3) & 0xf8;
+        } else {
+            const uint8_t *p = fb->buf + (i & ~(size_t)1) * 2;
+            int y = fb->buf[i * 2], u = p[1] - 128, v = p[3] - 128;
+            r = bench_clamp(y + ((359 * v) >> 8));
+            g = bench_clamp(y - ((88 * u + 183 * v) >> 8));
+            b = bench_clamp(y + ((454 * u) >> 8));
+        }
+        dst[0] = b;
+        dst[1] = g;
+        dst[2] = r;
+    }
+    return 0;
+}
+
+static int bench_naive(bench_naive_t *n, camera_fb_t *fb, int shift,
+                       uint16_t out_w, uint16_t out_h, uint8_t *out,
+                       size_t *jpg_len) {
+    if (bench_full_rgb(n, fb) != 0) {
+        return -1;
+    }
+    int gray = fb->format == PIXFORMAT_GRAYSCALE;
+    int bpp = gray ? 1 : 3;
+    int s = 1 << shift;
+    uint8_t *dst = out;
+    for (int oy = 0; oy < out_h; ++oy) {
+        for (int ox = 0; ox < out_w; ++ox) {
+            for (int c = 0; c < bpp; ++c) {
+                uint32_t sum = 0;
+                for (int dy = 0; dy < s; ++dy) {
+                    const uint8_t *p = n->rgb +
+                                       ((oy * s + dy) * n->width + ox * s) *
+                                           bpp +
+                                       c;
+                    for (int dx = 0; dx < s; ++dx, p += bpp) {
+                        sum += *p;
+                    }
+                }
+                *dst++ = sum >> (2 * shift);
+            }
+        }
+    }
+    uint8_t *jpg = NULL;
+    if (!fmt2jpg(out, (size_t)out_w * out_h * bpp, out_w, out_h,
+                 gray ? PIXFORMAT_GRAYSCALE : PIXFORMAT_RGB888, BENCH_QUALITY,
+                 &jpg, jpg_len)) {
+        return -1;
+    }
+    free(jpg);
+    return 0;
+}
+
+static const char *bench_format_name(pixformat_t format) {
+    switch (format) {
+    case PIXFORMAT_JPEG: return "jpeg";
+    case PIXFORMAT_RGB565: return "rgb565";
+    case PIXFORMAT_YUV422: return "yuv422";
+    case PIXFORMAT_GRAYSCALE: return "gray";
+    default: return "?";
+    }
+}
+
+static int bench_case(framesize_t size, pixformat_t format, int shift,
+                      int iterations, cam_jpg_pool_t *pool,
+                      cam_scale_scratch_t *scratch) {
+    int width = resolution[size].width, height = resolution[size].height;
+    size_t pixels = (size_t)width * height;
+    uint8_t *bgr = (uint8_t *)malloc(pixels * 3);
+    uint8_t *raw = (uint8_t *)malloc(pixels * 2);
+    bench_naive_t naive = {
+        .rgb = (uint8_t *)malloc(pixels * 3),
+        .width = width,
+        .height = height,
+    };
+    uint8_t *out = (uint8_t *)malloc(pixels * 3);
+    int ok = bgr && raw && naive.rgb && out;
+
+    camera_fb_t fb = {.width = width, .height = height, .format = format};
+    uint8_t *jpg = NULL;
+    if (ok) {
+        bench_draw(bgr, width, height);
+        if (format == PIXFORMAT_JPEG) {
+            ok = fmt2jpg(bgr, pixels * 3, width, height, PIXFORMAT_RGB888,
+                         BENCH_QUALITY, &jpg, &fb.len);
+            fb.buf = jpg;
+        } else {
+            bench_to_format(bgr, width, height, format, raw);
+            fb.buf = raw;
+            fb.len = pixels * (format == PIXFORMAT_GRAYSCALE ? 1 : 2);
+        }
+    }
+
+    cam_scaler_t scaler;
+    cam_scaler_init(&scaler, scratch);
+    cam_view_t view = {.shift = shift};
+    int64_t scaled_us = 0, naive_us = 0;
+    size_t scaled_len = 0, naive_len = 0;
+    for (int i = 0; ok && i < iterations; ++i) {
+        int64_t t0 = bench_now_us();
+        cam_jpg_buf_t *buf = cam_scale_frame(&scaler, &fb, &view, pool,
+                                             BENCH_QUALITY);
+        int64_t t1 = bench_now_us();
+        if (buf == NULL) {
+            ok = 0;
+            break;
+        }
+        scaled_len = buf->len;
+        cam_jpg_release(pool, buf);
+
+        // the same output size, the scaler may have raised the shift
+        if (bench_naive(&naive, &fb, scaler.shift, scaler.out_w,
+                        scaler.out_h, out, &naive_len) != 0) {
+            ok = 0;
+            break;
+        }
+        int64_t t2 = bench_now_us();
+        scaled_us += t1 - t0;
+        naive_us += t2 - t1;
+    }
+
+    if (ok) {
+        double scaled_ms = scaled_us / 1000.0 / iterations;
+        double naive_ms = naive_us / 1000.0 / iterations;
+        printf("%-7s %4dx%-4d 1/%d  %4ux%-4u %8.3f %8.3f %6.1fx %7zu %7zu\n",
+               bench_format_name(format), width, height, 1 << scaler.shift,
+               scaler.out_w, scaler.out_h, scaled_ms, naive_ms,
+               scaled_ms > 0 ? naive_ms / scaled_ms : 0.0, scaled_len,
+               naive_len);
+    } else {
+        printf("%-7s %4dx%-4d 1/%d  failed\n", bench_format_name(format),
+               width, height, 1 << shift);
+    }
+
+    cam_scaler_uninit(&scaler);
+    free(jpg);
+    free(out);
+    free(naive.rgb);
+    free(raw);
+    free(bgr);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int iterations = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+        switch (opt) {
+        case 'i': iterations = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-i iterations]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    static const framesize_t sizes[] = {FRAMESIZE_QVGA, FRAMESIZE_VGA,
+                                        FRAMESIZE_SVGA};
+    static const pixformat_t formats[] = {PIXFORMAT_JPEG, PIXFORMAT_RGB565,
+                                          PIXFORMAT_YUV422,
+                                          PIXFORMAT_GRAYSCALE};
+
+    cam_jpg_pool_t pool;
+    cam_jpg_pool_init(&pool);
+    cam_scale_scratch_t scratch;
+    cam_scale_scratch_init(&scratch);
+
+    printf("format  source    view out        scaled    naive  ratio  "
+           "scaled   naive\n");
+    printf("                                    ms/frame ms/frame        "
+           "bytes   bytes\n");
+    int failed = 0;
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            for (int shift = 1; shift <= CAM_SCALE_MAX_SHIFT; ++shift) {
+                // the scaler raises these to the next shift, measured there
+                if ((uint32_t)(resolution[sizes[s]].width >> shift) *
+                        (resolution[sizes[s]].height >> shift) >
+                    CAM_SCALE_MAX_PIXELS) {
+                    continue;
+                }
+                failed |= bench_case(sizes[s], formats[f], shift, iterations,
+                                     &pool, &scratch);
+            }
+        }
+    }
+    free(scratch.rgb);
+    cam_jpg_pool_uninit(&pool);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+# Runs cam_loadgen over multipart and over WebSocket against fresh servers
+# and prints the two side by side. Fails when the WebSocket path serves
+# fewer frames than MIN_RATIO of the multipart one or costs more than
+# MAX_CPU_RATIO times the server CPU per frame.
+#   cmake -DLOADGEN=... -DSERVER=... [-DARGS="-n;3;-t;3"] -P compare_modes.cmake
+if(NOT LOADGEN OR NOT SERVER)
+    message(FATAL_ERROR "LOADGEN and SERVER are required")
+endif()
+if(NOT DEFINED ARGS)
+    set(ARGS -n 3 -t 3)
+endif()
+if(NOT DEFINED MIN_RATIO)
+    set(MIN_RATIO 0.9)
+endif()
+if(NOT DEFINED MAX_CPU_RATIO)
+    set(MAX_CPU_RATIO 3)
+endif()
+
+set(keys fps p50_ms p99_ms kbps cpu_ms_per_frame sends_per_frame)
+
+foreach(mode multipart ws)
+    set(mode_args)
+    if(mode STREQUAL "ws")
+        set(mode_args -w)
+    endif()
+    execute_process(COMMAND ${LOADGEN} -s ${SERVER} ${ARGS} ${mode_args}
+                    OUTPUT_VARIABLE out
+                    RESULT_VARIABLE rc)
+    message("${out}")
+    if(NOT rc EQUAL 0)
+        message(FATAL_ERROR "${mode} run failed with ${rc}")
+    endif()
+    string(REGEX MATCH "RESULT [^\n]*" result "${out}")
+    foreach(key ${keys})
+        string(REGEX MATCH " ${key}=([-0-9.]+)" _ "${result}")
+        set(${mode}_${key} ${CMAKE_MATCH_1})
+    endforeach()
+endforeach()
+
+message("                  multipart   websocket")
+foreach(key ${keys})
+    set(row "${key}")
+    foreach(column 18:${multipart_${key}} 30:${ws_${key}})
+        string(REGEX REPLACE ":.*" "" width "${column}")
+        string(REGEX REPLACE "^[0-9]+:" "" value "${column}")
+        string(LENGTH "${row}" len)
+        math(EXPR pad "${width} - ${len}")
+        string(REPEAT " " ${pad} spaces)
+        string(APPEND row "${spaces}${value}")
+    endforeach()
+    message("${row}")
+endforeach()
+
+# math() has no fractions, compare in thousandths
+macro(milli out value)
+    string(REGEX MATCH "^([0-9]+)\\.?([0-9]*)" _ "${value}")
+    set(_frac "${CMAKE_MATCH_2}000")
+    string(SUBSTRING "${_frac}" 0 3 _frac)
+    math(EXPR ${out} "${CMAKE_MATCH_1} * 1000 + 1${_frac} - 1000")
+endmacro()
+
+milli(mp_fps ${multipart_fps})
+milli(ws_fps ${ws_fps})
+milli(min_ratio ${MIN_RATIO})
+math(EXPR ws_scaled "${ws_fps} * 1000")
+math(EXPR mp_scaled "${mp_fps} * ${min_ratio}")
+if(ws_scaled LESS mp_scaled)
+    message(FATAL_ERROR "websocket ${ws_fps} fps below ${MIN_RATIO} of "
+                        "multipart ${multipart_fps}")
+endif()
+
+# -1 when the CPU time could not be read
+if(NOT multipart_cpu_ms_per_frame MATCHES "^-" AND
+   NOT ws_cpu_ms_per_frame MATCHES "^-")
+    milli(mp_cpu ${multipart_cpu_ms_per_frame})
+    milli(ws_cpu ${ws_cpu_ms_per_frame})
+    milli(max_cpu ${MAX_CPU_RATIO})
+    math(EXPR ws_scaled "${ws_cpu} * 1000")
+    math(EXPR mp_scaled "(${mp_cpu} + 1) * ${max_cpu}")
+    if(ws_scaled GREATER mp_scaled)
+        message(FATAL_ERROR "websocket ${ws_cpu_ms_per_frame}ms per frame, "
+                            "over ${MAX_CPU_RATIO}x multipart "
+                            "${multipart_cpu_ms_per_frame}ms")
+    endif()
+endif()
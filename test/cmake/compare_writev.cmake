@@ -0,0 +1,79 @@
+# Runs cam_loadgen against a server writing each frame with one sendmsg and
+# against one built with CAM_STREAM_WRITEV=0, in both stream modes, and
+# prints the server CPU time and the socket writes per frame. Fails when
+# the vectored server does not make fewer writes per frame.
+#   cmake -DLOADGEN=... -DSERVER=... -DSPLIT_SERVER=... [-DARGS="-n;3;-t;3"]
+#         -P compare_writev.cmake
+if(NOT LOADGEN OR NOT SERVER OR NOT SPLIT_SERVER)
+    message(FATAL_ERROR "LOADGEN, SERVER and SPLIT_SERVER are required")
+endif()
+if(NOT DEFINED ARGS)
+    set(ARGS -n 3 -t 3)
+endif()
+
+set(keys fps cpu_ms_per_frame sends_per_frame)
+
+foreach(mode multipart ws)
+    set(mode_args)
+    if(mode STREQUAL "ws")
+        set(mode_args -w)
+    endif()
+    foreach(build writev split)
+        if(build STREQUAL "writev")
+            set(server ${SERVER})
+        else()
+            set(server ${SPLIT_SERVER})
+        endif()
+        execute_process(COMMAND ${LOADGEN} -s ${server} ${ARGS} ${mode_args}
+                        OUTPUT_VARIABLE out
+                        RESULT_VARIABLE rc)
+        message("${out}")
+        if(NOT rc EQUAL 0)
+            message(FATAL_ERROR "${mode} run of ${build} failed with ${rc}")
+        endif()
+        string(REGEX MATCH "RESULT [^\n]*" result "${out}")
+        foreach(key ${keys})
+            string(REGEX MATCH " ${key}=([-0-9.]+)" _ "${result}")
+            set(${mode}_${build}_${key} ${CMAKE_MATCH_1})
+        endforeach()
+    endforeach()
+endforeach()
+
+message("                              writev      split")
+foreach(mode multipart ws)
+    foreach(key ${keys})
+        set(row "${mode} ${key}")
+        foreach(column 30:${${mode}_writev_${key}} 42:${${mode}_split_${key}})
+            string(REGEX REPLACE ":.*" "" width "${column}")
+            string(REGEX REPLACE "^[0-9]+:" "" value "${column}")
+            string(LENGTH "${row}" len)
+            math(EXPR pad "${width} - ${len}")
+            string(REPEAT " " ${pad} spaces)
+            string(APPEND row "${spaces}${value}")
+        endforeach()
+        message("${row}")
+    endforeach()
+endforeach()
+
+# math() has no fractions, compare in thousandths
+macro(milli out value)
+    string(REGEX MATCH "^([0-9]+)\\.?([0-9]*)" _ "${value}")
+    set(_frac "${CMAKE_MATCH_2}000")
+    string(SUBSTRING "${_frac}" 0 3 _frac)
+    math(EXPR ${out} "${CMAKE_MATCH_1} * 1000 + 1${_frac} - 1000")
+endmacro()
+
+# the CPU time is only reported, on a loaded host it is too noisy to gate
+foreach(mode multipart ws)
+    set(writev ${${mode}_writev_sends_per_frame})
+    set(split ${${mode}_split_sends_per_frame})
+    if(NOT writev OR NOT split OR writev MATCHES "^-" OR split MATCHES "^-")
+        message(FATAL_ERROR "${mode} writes per frame not reported")
+    endif()
+    milli(writev_milli ${writev})
+    milli(split_milli ${split})
+    if(NOT writev_milli LESS split_milli)
+        message(FATAL_ERROR "${mode} ${writev} writes per frame with "
+                            "sendmsg, ${split} without")
+    endif()
+endforeach()
@@ -0,0 +1,54 @@
+#include "esp_camera.h"
+
+#include <stddef.h>
+
+const resolution_info_t resolution[FRAMESIZE_INVALID] = {
+    {96, 96},    // 96x96
+    {160, 120},  // QQVGA
+    {176, 144},  // QCIF
+    {240, 176},  // HQVGA
+    {240, 240},  // 240x240
+    {320, 240},  // QVGA
+    {400, 296},  // CIF
+    {480, 320},  // HVGA
+    {640, 480},  // VGA
+    {800, 600},  // SVGA
+    {1024, 768},  // XGA
+    {1280, 720},  // HD
+    {1280, 1024},  // SXGA
+    {1600, 1200},  // UXGA
+};
+
+static int esp_camera_set_framesize(sensor_t *sensor, framesize_t framesize) {
+    if ((unsigned)framesize >= FRAMESIZE_INVALID) {
+        return -1;
+    }
+    sensor->status.framesize = framesize;
+    return 0;
+}
+
+static int esp_camera_set_quality(sensor_t *sensor, int quality) {
+    if (quality < 0 || quality > 63) {
+        return -1;
+    }
+    sensor->status.quality = quality;
+    return 0;
+}
+
+static sensor_t _sensor = {
+    .status = {.framesize = FRAMESIZE_QVGA, .quality = 12},
+    .set_framesize = esp_camera_set_framesize,
+    .set_quality = esp_camera_set_quality,
+};
+
+esp_err_t esp_camera_init(const camera_config_t *config) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_camera_deinit(void) { return ESP_OK; }
+
+camera_fb_t *esp_camera_fb_get(void) { return NULL; }
+
+void esp_camera_fb_return(camera_fb_t *fb) {}
+
+sensor_t *esp_camera_sensor_get(void) { return &_sensor; }
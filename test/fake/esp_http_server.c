@@ -0,0 +1,1088 @@
+#include "esp_http_server.h"
+
+#include "esp_log.h"
+#include "freertos/semphr.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define HTTPD_TAG "httpd"
+
+// a request head or a client WebSocket frame has to fit
+#define HTTPD_RECV_BUF 2048
+#define HTTPD_MAX_RESP_HEADERS 16
+#define HTTPD_HEAD_SIZE 1024
+
+#define HTTPD_WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define HTTPD_WS_FIN 0x80
+#define HTTPD_WS_MASK 0x80
+
+typedef struct httpd_sess {
+    int fd;  // -1 while free
+    void *ctx;
+    httpd_free_ctx_fn_t free_ctx;
+    int ws_handler;  // index of the WebSocket URI after the handshake, or -1
+    size_t skip;     // request body bytes still to drop
+    size_t len;
+    char buf[HTTPD_RECV_BUF + 1];
+} httpd_sess_t;
+
+typedef struct httpd_work {
+    httpd_work_fn_t fn;
+    void *arg;
+} httpd_work_t;
+
+typedef struct httpd_data {
+    httpd_config_t config;
+    int listen_fd;
+    int ctrl[2];  // work items, written by any thread
+    int stop;
+    SemaphoreHandle_t stopped;
+    httpd_uri_t *handlers;
+    int handler_count;
+    httpd_sess_t *sessions;
+} httpd_data_t;
+
+// req->aux, lives for one request or one WebSocket frame
+typedef struct httpd_req_aux {
+    httpd_sess_t *sess;
+    const char *hdrs;  // the header lines of the request
+    const char *hdrs_end;
+
+    const char *status;
+    const char *type;
+    const char *fields[HTTPD_MAX_RESP_HEADERS];
+    const char *values[HTTPD_MAX_RESP_HEADERS];
+    int field_count;
+    int chunked;  // the head of a chunked response is out
+
+    httpd_ws_type_t ws_type;
+    int ws_final;
+    uint8_t *ws_payload;
+    size_t ws_len;
+} httpd_req_aux_t;
+
+typedef struct httpd_close_work {
+    httpd_data_t *hd;
+    int fd;
+} httpd_close_work_t;
+
+/* ------------------------------------------------------------------ */
+/* SHA-1 and base64, only for Sec-WebSocket-Accept                     */
+
+#define SHA1_ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void httpd_sha1_block(uint32_t h[5], const uint8_t *p) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+               (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; ++i) {
+        w[i] = SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = SHA1_ROL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = SHA1_ROL(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+static void httpd_sha1(const uint8_t *data, size_t len, uint8_t out[20]) {
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                     0xc3d2e1f0};
+    size_t done = 0;
+    for (; len - done >= 64; done += 64) {
+        httpd_sha1_block(h, data + done);
+    }
+
+    uint8_t tail[128] = {0};
+    size_t rest = len - done;
+    memcpy(tail, data + done, rest);
+    tail[rest] = 0x80;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; ++i) {
+        tail[tail_len - 1 - i] = bits >> (i * 8);
+    }
+    for (size_t i = 0; i < tail_len; i += 64) {
+        httpd_sha1_block(h, tail + i);
+    }
+
+    for (int i = 0; i < 5; ++i) {
+        out[i * 4] = h[i] >> 24;
+        out[i * 4 + 1] = h[i] >> 16;
+        out[i * 4 + 2] = h[i] >> 8;
+        out[i * 4 + 3] = h[i];
+    }
+}
+
+static void httpd_base64(const uint8_t *in, size_t len, char *out) {
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = in[i] << 16;
+        if (i + 1 < len) v |= in[i + 1] << 8;
+        if (i + 2 < len) v |= in[i + 2];
+        *out++ = digits[(v >> 18) & 0x3f];
+        *out++ = digits[(v >> 12) & 0x3f];
+        *out++ = i + 1 < len ? digits[(v >> 6) & 0x3f] : '=';
+        *out++ = i + 2 < len ? digits[v & 0x3f] : '=';
+    }
+    *out = '\0';
+}
+
+/* ------------------------------------------------------------------ */
+/* sockets and sessions                                                */
+
+static int httpd_send_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void httpd_sess_close(httpd_data_t *hd, httpd_sess_t *sess) {
+    if (sess->fd < 0) {
+        return;
+    }
+    // the IDF order, close_fn still finds the context of the session
+    if (hd->config.close_fn) {
+        hd->config.close_fn(hd, sess->fd);
+    } else {
+        close(sess->fd);
+    }
+    if (sess->ctx) {
+        if (sess->free_ctx) {
+            sess->free_ctx(sess->ctx);
+        } else {
+            free(sess->ctx);
+        }
+    }
+    sess->fd = -1;
+    sess->ctx = NULL;
+    sess->free_ctx = NULL;
+    sess->ws_handler = -1;
+    sess->skip = 0;
+    sess->len = 0;
+}
+
+static httpd_sess_t *httpd_sess_find(httpd_data_t *hd, int fd) {
+    for (int i = 0; i < hd->config.max_open_sockets; ++i) {
+        if (hd->sessions[i].fd == fd) {
+            return &hd->sessions[i];
+        }
+    }
+    return NULL;
+}
+
+static int httpd_sess_count(httpd_data_t *hd) {
+    int n = 0;
+    for (int i = 0; i < hd->config.max_open_sockets; ++i) {
+        n += hd->sessions[i].fd >= 0;
+    }
+    return n;
+}
+
+static void httpd_accept(httpd_data_t *hd) {
+    int fd = accept(hd->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    httpd_sess_t *sess = httpd_sess_find(hd, -1);
+    if (sess == NULL) {
+        close(fd);
+        return;
+    }
+
+    struct timeval tv = {.tv_sec = hd->config.send_wait_timeout};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    memset(sess, 0, sizeof(httpd_sess_t));
+    sess->fd = fd;
+    sess->ws_handler = -1;
+    ESP_LOGD(HTTPD_TAG, "new session %d", fd);
+}
+
+/* ------------------------------------------------------------------ */
+/* requests                                                            */
+
+static httpd_req_aux_t *httpd_aux(httpd_req_t *r) {
+    return (httpd_req_aux_t *)r->aux;
+}
+
+static const char *httpd_find_hdr(httpd_req_t *r, const char *field,
+                                  size_t *len) {
+    httpd_req_aux_t *aux = httpd_aux(r);
+    size_t field_len = strlen(field);
+    const char *line = aux->hdrs;
+    while (line && line < aux->hdrs_end) {
+        const char *eol = strstr(line, "\r\n");
+        if (eol == NULL || eol > aux->hdrs_end) {
+            eol = aux->hdrs_end;
+        }
+        if ((size_t)(eol - line) > field_len && line[field_len] == ':' &&
+            strncasecmp(line, field, field_len) == 0) {
+            const char *v = line + field_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) {
+                ++v;
+            }
+            const char *end = eol;
+            while (end > v && (end[-1] == ' ' || end[-1] == '\t')) {
+                --end;
+            }
+            *len = end - v;
+            return v;
+        }
+        line = eol + 2;
+    }
+    return NULL;
+}
+
+static int httpd_hdr_has(httpd_req_t *r, const char *field,
+                         const char *token) {
+    size_t len;
+    const char *v = httpd_find_hdr(r, field, &len);
+    size_t token_len = strlen(token);
+    for (size_t i = 0; v && i + token_len <= len; ++i) {
+        if (strncasecmp(v + i, token, token_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int httpd_ws_handshake(httpd_req_t *r) {
+    size_t key_len;
+    const char *key = httpd_find_hdr(r, "Sec-WebSocket-Key", &key_len);
+    if (key == NULL || key_len > 64) {
+        return -1;
+    }
+
+    char src[64 + sizeof(HTTPD_WS_GUID)];
+    memcpy(src, key, key_len);
+    memcpy(src + key_len, HTTPD_WS_GUID, sizeof(HTTPD_WS_GUID));
+    uint8_t digest[20];
+    httpd_sha1((const uint8_t *)src, key_len + sizeof(HTTPD_WS_GUID) - 1,
+               digest);
+    char accept[32];
+    httpd_base64(digest, sizeof(digest), accept);
+
+    char head[256];
+    int len = snprintf(head, sizeof(head),
+                       "HTTP/1.1 101 Switching Protocols\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: %s\r\n\r\n",
+                       accept);
+    return httpd_send_all(httpd_aux(r)->sess->fd, head, len);
+}
+
+static int httpd_uri_matches(httpd_data_t *hd, const char *tpl,
+                             const char *uri, size_t len) {
+    if (hd->config.uri_match_fn) {
+        return hd->config.uri_match_fn(tpl, uri, len);
+    }
+    return strlen(tpl) == len && strncmp(tpl, uri, len) == 0;
+}
+
+static int httpd_method_of(const char *name, size_t len) {
+    static const char *names[] = {"DELETE", "GET", "HEAD", "POST", "PUT"};
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); ++i) {
+        if (strlen(names[i]) == len && strncmp(names[i], name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static esp_err_t httpd_call(httpd_data_t *hd, httpd_sess_t *sess,
+                            httpd_req_t *req, const httpd_uri_t *uri) {
+    req->handle = hd;
+    req->user_ctx = uri->user_ctx;
+    req->sess_ctx = sess->ctx;
+    req->free_ctx = sess->free_ctx;
+    esp_err_t ret = uri->handler(req);
+    sess->ctx = req->sess_ctx;
+    sess->free_ctx = req->free_ctx;
+    return ret;
+}
+
+// returns -1 when the session has to be closed
+static int httpd_dispatch(httpd_data_t *hd, httpd_sess_t *sess,
+                          const char *head, size_t head_len) {
+    const char *sp1 = memchr(head, ' ', head_len);
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', head + head_len - sp1 - 1)
+                          : NULL;
+    const char *eol = strstr(head, "\r\n");
+    if (sp1 == NULL || sp2 == NULL || eol == NULL || sp2 > eol) {
+        return -1;
+    }
+
+    httpd_req_t req;
+    httpd_req_aux_t aux;
+    memset(&req, 0, sizeof(req));
+    memset(&aux, 0, sizeof(aux));
+    req.aux = &aux;
+    aux.sess = sess;
+    aux.hdrs = eol + 2;
+    aux.hdrs_end = head + head_len;
+
+    size_t uri_len = sp2 - sp1 - 1;
+    if (uri_len > HTTPD_MAX_URI_LEN) {
+        httpd_resp_send_err(&req, HTTPD_414_URI_TOO_LONG, NULL);
+        return -1;
+    }
+    memcpy((char *)req.uri, sp1 + 1, uri_len);
+    req.method = httpd_method_of(head, sp1 - head);
+
+    size_t len;
+    const char *v = httpd_find_hdr(&req, "Content-Length", &len);
+    req.content_len = v ? strtoul(v, NULL, 10) : 0;
+    sess->skip = req.content_len;
+
+    const char *query = strchr(req.uri, '?');
+    size_t path_len = query ? (size_t)(query - req.uri) : uri_len;
+    int index = -1;
+    int other_method = 0;
+    for (int i = 0; i < hd->handler_count; ++i) {
+        if (httpd_uri_matches(hd, hd->handlers[i].uri, req.uri, path_len)) {
+            if ((int)hd->handlers[i].method == req.method) {
+                index = i;
+                break;
+            }
+            other_method = 1;
+        }
+    }
+    if (index < 0) {
+        httpd_resp_send_err(&req,
+                            other_method ? HTTPD_405_METHOD_NOT_ALLOWED
+                                         : HTTPD_404_NOT_FOUND,
+                            NULL);
+        return 0;
+    }
+
+    const httpd_uri_t *uri = &hd->handlers[index];
+    if (uri->is_websocket) {
+        if (!httpd_hdr_has(&req, "Upgrade", "websocket") ||
+            httpd_ws_handshake(&req) != 0) {
+            httpd_resp_send_err(&req, HTTPD_400_BAD_REQUEST, NULL);
+            return -1;
+        }
+        sess->ws_handler = index;
+    }
+
+    if (httpd_call(hd, sess, &req, uri) != ESP_OK) {
+        ESP_LOGD(HTTPD_TAG, "handler of %s failed, closing %d", uri->uri,
+                 sess->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int httpd_ws_control(httpd_sess_t *sess, httpd_ws_type_t type,
+                            uint8_t *payload, size_t len) {
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = type == HTTPD_WS_TYPE_PING ? HTTPD_WS_TYPE_PONG
+                                           : HTTPD_WS_TYPE_CLOSE,
+        .payload = payload,
+        .len = len,
+    };
+    if (type == HTTPD_WS_TYPE_PONG) {
+        return 1;
+    }
+    httpd_ws_send_frame_async(NULL, sess->fd, &frame);
+    return type == HTTPD_WS_TYPE_CLOSE ? -1 : 1;
+}
+
+// 1 when a client frame was consumed, 0 if it is not all in yet, -1 to
+// close the session
+static int httpd_ws_frame(httpd_data_t *hd, httpd_sess_t *sess,
+                          size_t *used) {
+    uint8_t *p = (uint8_t *)sess->buf;
+    if (sess->len < 2) {
+        return 0;
+    }
+    if (!(p[1] & HTTPD_WS_MASK)) {
+        return -1;  // client frames are always masked
+    }
+
+    size_t hlen = 2;
+    uint64_t len = p[1] & 0x7f;
+    if (len == 126) {
+        hlen += 2;
+        if (sess->len < hlen) return 0;
+        len = (uint64_t)p[2] << 8 | p[3];
+    } else if (len == 127) {
+        hlen += 8;
+        if (sess->len < hlen) return 0;
+        len = 0;
+        for (int i = 0; i < 8; ++i) {
+            len = len << 8 | p[2 + i];
+        }
+    }
+    if (len > HTTPD_RECV_BUF - hlen - 4) {
+        ESP_LOGW(HTTPD_TAG, "WebSocket frame of %llu bytes on %d too big",
+                 (unsigned long long)len, sess->fd);
+        return -1;
+    }
+    if (sess->len < hlen + 4 + len) {
+        return 0;
+    }
+
+    uint8_t *mask = p + hlen;
+    uint8_t *payload = mask + 4;
+    for (size_t i = 0; i < len; ++i) {
+        payload[i] ^= mask[i & 3];
+    }
+    *used = hlen + 4 + len;
+
+    httpd_ws_type_t type = (httpd_ws_type_t)(p[0] & 0x0f);
+    const httpd_uri_t *uri = &hd->handlers[sess->ws_handler];
+    if (type & 0x08 && !uri->handle_ws_control_frames) {
+        return httpd_ws_control(sess, type, payload, len);
+    }
+
+    httpd_req_t req;
+    httpd_req_aux_t aux;
+    memset(&req, 0, sizeof(req));
+    memset(&aux, 0, sizeof(aux));
+    req.aux = &aux;
+    req.method = 0;
+    strncpy((char *)req.uri, uri->uri, HTTPD_MAX_URI_LEN);
+    aux.sess = sess;
+    aux.ws_type = type;
+    aux.ws_final = p[0] & HTTPD_WS_FIN ? 1 : 0;
+    aux.ws_payload = payload;
+    aux.ws_len = len;
+    return httpd_call(hd, sess, &req, uri) == ESP_OK ? 1 : -1;
+}
+
+// returns -1 when the session has to be closed
+static int httpd_sess_process(httpd_data_t *hd, httpd_sess_t *sess) {
+    while (sess->fd >= 0 && sess->len > 0) {
+        size_t used = 0;
+        if (sess->skip) {
+            used = sess->skip < sess->len ? sess->skip : sess->len;
+            sess->skip -= used;
+        } else if (sess->ws_handler >= 0) {
+            int ret = httpd_ws_frame(hd, sess, &used);
+            if (ret <= 0) {
+                return ret;
+            }
+        } else {
+            sess->buf[sess->len] = '\0';
+            char *end = strstr(sess->buf, "\r\n\r\n");
+            if (end == NULL) {
+                return sess->len < HTTPD_RECV_BUF ? 0 : -1;
+            }
+            used = end + 4 - sess->buf;
+            end[2] = '\0';  // the header lines keep their last CRLF
+            if (httpd_dispatch(hd, sess, sess->buf, used - 2) != 0) {
+                return -1;
+            }
+            if (sess->skip) {
+                // dispatch took the body length, drop it after the head
+                size_t body = sess->len - used;
+                size_t drop = sess->skip < body ? sess->skip : body;
+                sess->skip -= drop;
+                used += drop;
+            }
+        }
+        memmove(sess->buf, sess->buf + used, sess->len - used);
+        sess->len -= used;
+    }
+    return 0;
+}
+
+static void httpd_sess_recv(httpd_data_t *hd, httpd_sess_t *sess) {
+    ssize_t n = recv(sess->fd, sess->buf + sess->len,
+                     HTTPD_RECV_BUF - sess->len, 0);
+    if (n < 0 && errno == EINTR) {
+        return;
+    }
+    if (n <= 0) {
+        ESP_LOGD(HTTPD_TAG, "session %d closed by the client", sess->fd);
+        httpd_sess_close(hd, sess);
+        return;
+    }
+    sess->len += n;
+    if (httpd_sess_process(hd, sess) < 0) {
+        httpd_sess_close(hd, sess);
+    }
+}
+
+static void httpd_run_work(httpd_data_t *hd) {
+    httpd_work_t work[16];
+    ssize_t n;
+    while ((n = read(hd->ctrl[0], work, sizeof(work))) > 0) {
+        for (size_t i = 0; i < n / sizeof(httpd_work_t); ++i) {
+            if (work[i].fn) {
+                work[i].fn(work[i].arg);
+            }
+        }
+    }
+}
+
+static void httpd_thread(void *arg) {
+    httpd_data_t *hd = (httpd_data_t *)arg;
+
+    while (!hd->stop) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(hd->ctrl[0], &fds);
+        int max_fd = hd->ctrl[0];
+        // at the limit new clients wait in the backlog, as with lwip
+        if (httpd_sess_count(hd) < hd->config.max_open_sockets) {
+            FD_SET(hd->listen_fd, &fds);
+            max_fd = max_fd > hd->listen_fd ? max_fd : hd->listen_fd;
+        }
+        for (int i = 0; i < hd->config.max_open_sockets; ++i) {
+            int fd = hd->sessions[i].fd;
+            if (fd >= 0) {
+                FD_SET(fd, &fds);
+                max_fd = max_fd > fd ? max_fd : fd;
+            }
+        }
+
+        if (select(max_fd + 1, &fds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ESP_LOGE(HTTPD_TAG, "select failed: %s", strerror(errno));
+            break;
+        }
+
+        if (FD_ISSET(hd->ctrl[0], &fds)) {
+            httpd_run_work(hd);
+        }
+        for (int i = 0; i < hd->config.max_open_sockets; ++i) {
+            httpd_sess_t *sess = &hd->sessions[i];
+            if (sess->fd >= 0 && FD_ISSET(sess->fd, &fds)) {
+                httpd_sess_recv(hd, sess);
+            }
+        }
+        if (FD_ISSET(hd->listen_fd, &fds)) {
+            httpd_accept(hd);
+        }
+    }
+
+    for (int i = 0; i < hd->config.max_open_sockets; ++i) {
+        httpd_sess_close(hd, &hd->sessions[i]);
+    }
+    xSemaphoreGive(hd->stopped);
+    vTaskDelete(NULL);
+}
+
+/* ------------------------------------------------------------------ */
+/* API                                                                 */
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config) {
+    if (handle == NULL || config == NULL || config->max_open_sockets == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    httpd_data_t *hd = (httpd_data_t *)calloc(1, sizeof(httpd_data_t));
+    if (hd == NULL) {
+        return ESP_ERR_HTTPD_ALLOC_MEM;
+    }
+    hd->config = *config;
+    const char *port = getenv("DEMO_HTTPD_PORT");
+    if (port && *port) {
+        hd->config.server_port = atoi(port);
+    }
+    hd->handlers =
+        (httpd_uri_t *)calloc(config->max_uri_handlers, sizeof(httpd_uri_t));
+    hd->sessions = (httpd_sess_t *)calloc(config->max_open_sockets,
+                                          sizeof(httpd_sess_t));
+    hd->stopped = xSemaphoreCreateBinary();
+    if (hd->handlers == NULL || hd->sessions == NULL || hd->stopped == NULL) {
+        goto fail;
+    }
+    for (int i = 0; i < config->max_open_sockets; ++i) {
+        hd->sessions[i].fd = -1;
+        hd->sessions[i].ws_handler = -1;
+    }
+
+    hd->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(hd->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(hd->config.server_port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (hd->listen_fd < 0 ||
+        bind(hd->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(hd->listen_fd, config->backlog_conn) != 0) {
+        ESP_LOGE(HTTPD_TAG, "listen on port %u failed: %s",
+                 hd->config.server_port, strerror(errno));
+        goto fail;
+    }
+    if (pipe(hd->ctrl) != 0) {
+        goto fail;
+    }
+    fcntl(hd->ctrl[0], F_SETFL, O_NONBLOCK);
+
+    if (xTaskCreatePinnedToCore(httpd_thread, "httpd", config->stack_size,
+                                hd, config->task_priority, NULL,
+                                config->core_id) != pdPASS) {
+        goto fail;
+    }
+    ESP_LOGI(HTTPD_TAG, "listening on port %u", hd->config.server_port);
+    *handle = hd;
+    return ESP_OK;
+
+fail:
+    if (hd->listen_fd > 0) {
+        close(hd->listen_fd);
+    }
+    free(hd->handlers);
+    free(hd->sessions);
+    free(hd);
+    return ESP_ERR_HTTPD_TASK;
+}
+
+static void httpd_stop_work(void *arg) { ((httpd_data_t *)arg)->stop = 1; }
+
+esp_err_t httpd_stop(httpd_handle_t handle) {
+    httpd_data_t *hd = (httpd_data_t *)handle;
+    if (hd == NULL || httpd_queue_work(hd, httpd_stop_work, hd) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(hd->stopped, portMAX_DELAY);
+
+    close(hd->listen_fd);
+    close(hd->ctrl[0]);
+    close(hd->ctrl[1]);
+    vSemaphoreDelete(hd->stopped);
+    free(hd->handlers);
+    free(hd->sessions);
+    free(hd);
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle,
+                                     const httpd_uri_t *uri_handler) {
+    httpd_data_t *hd = (httpd_data_t *)handle;
+    if (hd == NULL || uri_handler == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < hd->handler_count; ++i) {
+        if (hd->handlers[i].method == uri_handler->method &&
+            strcmp(hd->handlers[i].uri, uri_handler->uri) == 0) {
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+        }
+    }
+    if (hd->handler_count == hd->config.max_uri_handlers) {
+        ESP_LOGW(HTTPD_TAG, "no slot left for URI handler %s",
+                 uri_handler->uri);
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+    }
+    // only read on the httpd task, registration happens before clients
+    hd->handlers[hd->handler_count++] = *uri_handler;
+    return ESP_OK;
+}
+
+bool httpd_uri_match_wildcard(const char *uri_template, const char *uri_to_match,
+                              size_t match_upto) {
+    size_t tpl_len = strlen(uri_template);
+    size_t exact = tpl_len;
+    bool asterisk = tpl_len > 0 && uri_template[tpl_len - 1] == '*';
+    if (asterisk) {
+        --exact;
+    }
+    bool quest = exact > 0 && uri_template[exact - 1] == '?';
+    if (quest) {
+        --exact;
+    }
+
+    if (asterisk) {
+        // "/path/*" also takes "/path", "/path?*" also "/path/"
+        size_t prefix = exact;
+        if (!quest && prefix > 0 && uri_template[prefix - 1] == '/' &&
+            match_upto == prefix - 1) {
+            return strncmp(uri_template, uri_to_match, match_upto) == 0;
+        }
+        return match_upto >= prefix &&
+               strncmp(uri_template, uri_to_match, prefix) == 0;
+    }
+    if (quest) {
+        // the character before '?' is optional
+        return (match_upto == exact &&
+                strncmp(uri_template, uri_to_match, exact) == 0) ||
+               (match_upto + 1 == exact &&
+                strncmp(uri_template, uri_to_match, match_upto) == 0);
+    }
+    return match_upto == tpl_len &&
+           strncmp(uri_template, uri_to_match, tpl_len) == 0;
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work,
+                           void *arg) {
+    httpd_data_t *hd = (httpd_data_t *)handle;
+    if (hd == NULL || work == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // below PIPE_BUF, writes of concurrent callers do not interleave
+    httpd_work_t item = {.fn = work, .arg = arg};
+    return write(hd->ctrl[1], &item, sizeof(item)) == sizeof(item)
+               ? ESP_OK
+               : ESP_FAIL;
+}
+
+static void httpd_close_work(void *arg) {
+    httpd_close_work_t *work = (httpd_close_work_t *)arg;
+    httpd_sess_t *sess = httpd_sess_find(work->hd, work->fd);
+    if (sess) {
+        httpd_sess_close(work->hd, sess);
+    }
+    free(work);
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd) {
+    httpd_close_work_t *work =
+        (httpd_close_work_t *)malloc(sizeof(httpd_close_work_t));
+    if (work == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    work->hd = (httpd_data_t *)handle;
+    work->fd = sockfd;
+    if (httpd_queue_work(handle, httpd_close_work, work) != ESP_OK) {
+        free(work);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r) {
+    return r && r->aux ? httpd_aux(r)->sess->fd : -1;
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r) {
+    const char *query = strchr(r->uri, '?');
+    return query ? strlen(query + 1) : 0;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf,
+                                      size_t buf_len) {
+    const char *query = strchr(r->uri, '?');
+    if (query == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (buf_len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    snprintf(buf, buf_len, "%s", query + 1);
+    return strlen(query + 1) < buf_len ? ESP_OK : ESP_ERR_HTTPD_RESULT_TRUNC;
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val,
+                                size_t val_size) {
+    if (qry == NULL || key == NULL || val == NULL || val_size == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t key_len = strlen(key);
+    const char *pair = qry;
+    while (*pair) {
+        const char *end = strchr(pair, '&');
+        if (end == NULL) {
+            end = pair + strlen(pair);
+        }
+        const char *eq = memchr(pair, '=', end - pair);
+        if (eq && (size_t)(eq - pair) == key_len &&
+            strncmp(pair, key, key_len) == 0) {
+            size_t len = end - eq - 1;
+            size_t copy = len < val_size - 1 ? len : val_size - 1;
+            memcpy(val, eq + 1, copy);
+            val[copy] = '\0';
+            return copy == len ? ESP_OK : ESP_ERR_HTTPD_RESULT_TRUNC;
+        }
+        pair = *end ? end + 1 : end;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field) {
+    size_t len = 0;
+    return httpd_find_hdr(r, field, &len) ? len : 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field,
+                                      char *val, size_t val_size) {
+    size_t len;
+    const char *v = httpd_find_hdr(r, field, &len);
+    if (v == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (val_size == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t copy = len < val_size - 1 ? len : val_size - 1;
+    memcpy(val, v, copy);
+    val[copy] = '\0';
+    return copy == len ? ESP_OK : ESP_ERR_HTTPD_RESULT_TRUNC;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status) {
+    httpd_aux(r)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type) {
+    httpd_aux(r)->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field,
+                             const char *value) {
+    httpd_req_aux_t *aux = httpd_aux(r);
+    httpd_data_t *hd = (httpd_data_t *)r->handle;
+    int max = hd && hd->config.max_resp_headers < HTTPD_MAX_RESP_HEADERS
+                  ? hd->config.max_resp_headers
+                  : HTTPD_MAX_RESP_HEADERS;
+    if (aux->field_count >= max) {
+        return ESP_ERR_HTTPD_RESP_HDR;
+    }
+    aux->fields[aux->field_count] = field;
+    aux->values[aux->field_count] = value;
+    ++aux->field_count;
+    return ESP_OK;
+}
+
+// status line and headers, with Content-Length or chunked
+static int httpd_send_head(httpd_req_t *r, ssize_t content_len) {
+    httpd_req_aux_t *aux = httpd_aux(r);
+    char head[HTTPD_HEAD_SIZE];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\n",
+                       aux->status ? aux->status : "200 OK",
+                       aux->type ? aux->type : "text/html");
+    if (content_len < 0) {
+        len += snprintf(head + len, sizeof(head) - len,
+                        "Transfer-Encoding: chunked\r\n");
+    } else {
+        len += snprintf(head + len, sizeof(head) - len,
+                        "Content-Length: %zd\r\n", content_len);
+    }
+    for (int i = 0; i < aux->field_count && len < (int)sizeof(head); ++i) {
+        len += snprintf(head + len, sizeof(head) - len, "%s: %s\r\n",
+                        aux->fields[i], aux->values[i]);
+    }
+    if (len + 2 >= (int)sizeof(head)) {
+        return -1;
+    }
+    memcpy(head + len, "\r\n", 2);
+    return httpd_send_all(aux->sess->fd, head, len + 2);
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+    if (buf_len == HTTPD_RESP_USE_STRLEN) {
+        buf_len = buf ? strlen(buf) : 0;
+    }
+    if (httpd_send_head(r, buf_len) != 0 ||
+        (buf_len > 0 &&
+         httpd_send_all(httpd_aux(r)->sess->fd, buf, buf_len) != 0)) {
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf,
+                                ssize_t buf_len) {
+    httpd_req_aux_t *aux = httpd_aux(r);
+    if (buf_len == HTTPD_RESP_USE_STRLEN) {
+        buf_len = buf ? strlen(buf) : 0;
+    }
+    if (!aux->chunked) {
+        if (httpd_send_head(r, -1) != 0) {
+            return ESP_ERR_HTTPD_RESP_SEND;
+        }
+        aux->chunked = 1;
+    }
+
+    char size[16];
+    int len = snprintf(size, sizeof(size), "%zx\r\n", buf_len);
+    int fd = aux->sess->fd;
+    if (httpd_send_all(fd, size, len) != 0 ||
+        (buf_len > 0 && httpd_send_all(fd, buf, buf_len) != 0) ||
+        httpd_send_all(fd, "\r\n", 2) != 0) {
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error,
+                              const char *msg) {
+    static const struct {
+        const char *status;
+        const char *msg;
+    } errors[HTTPD_ERR_CODE_MAX] = {
+        [HTTPD_500_INTERNAL_SERVER_ERROR] = {"500 Internal Server Error",
+                                             "Server has encountered an "
+                                             "unexpected error"},
+        [HTTPD_501_METHOD_NOT_IMPLEMENTED] = {"501 Method Not Implemented",
+                                              "Request method is not "
+                                              "supported by server"},
+        [HTTPD_505_VERSION_NOT_SUPPORTED] = {"505 Version Not Supported",
+                                             "HTTP version not supported by "
+                                             "server"},
+        [HTTPD_400_BAD_REQUEST] = {"400 Bad Request",
+                                   "Server unable to understand request due "
+                                   "to invalid syntax"},
+        [HTTPD_401_UNAUTHORIZED] = {"401 Unauthorized",
+                                    "Server known the client's identify and "
+                                    "it must authenticate itself to get he "
+                                    "requested resource"},
+        [HTTPD_403_FORBIDDEN] = {"403 Forbidden",
+                                 "Server is refusing to give requested "
+                                 "resource to client"},
+        [HTTPD_404_NOT_FOUND] = {"404 Not Found",
+                                 "This URI does not exist"},
+        [HTTPD_405_METHOD_NOT_ALLOWED] = {"405 Method Not Allowed",
+                                          "Request method for this URI is "
+                                          "not handled by server"},
+        [HTTPD_408_REQ_TIMEOUT] = {"408 Request Timeout",
+                                   "Server closed this connection"},
+        [HTTPD_411_LENGTH_REQUIRED] = {"411 Length Required",
+                                       "Chunked encoding not supported by "
+                                       "server"},
+        [HTTPD_414_URI_TOO_LONG] = {"414 URI Too Long",
+                                    "URI is too long"},
+        [HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE] = {"431 Request Header Fields "
+                                                "Too Large",
+                                                "Header fields are too "
+                                                "long"},
+    };
+    if ((unsigned)error >= HTTPD_ERR_CODE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    httpd_resp_set_status(req, errors[error].status);
+    httpd_resp_set_type(req, "text/html");
+    return httpd_resp_send(req, msg ? msg : errors[error].msg,
+                           HTTPD_RESP_USE_STRLEN);
+}
+
+int httpd_socket_send(httpd_handle_t hd, int sockfd, const char *buf,
+                      size_t buf_len, int flags) {
+    if (sockfd < 0 || (buf == NULL && buf_len > 0)) {
+        return HTTPD_SOCK_ERR_INVALID;
+    }
+    ssize_t n = send(sockfd, buf, buf_len, flags | MSG_NOSIGNAL);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK
+                   ? HTTPD_SOCK_ERR_TIMEOUT
+                   : HTTPD_SOCK_ERR_FAIL;
+    }
+    return n;
+}
+
+int httpd_send(httpd_req_t *r, const char *buf, size_t buf_len) {
+    return httpd_socket_send(r->handle, httpd_req_to_sockfd(r), buf, buf_len,
+                             0);
+}
+
+esp_err_t httpd_ws_recv_frame(httpd_req_t *req, httpd_ws_frame_t *pkt,
+                              size_t max_len) {
+    httpd_req_aux_t *aux = httpd_aux(req);
+    if (pkt == NULL || aux->sess->ws_handler < 0 ||
+        aux->ws_payload == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    pkt->type = aux->ws_type;
+    pkt->final = aux->ws_final;
+    pkt->fragmented = false;
+    pkt->len = aux->ws_len;
+    if (max_len == 0) {
+        return ESP_OK;
+    }
+    if (pkt->payload == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (aux->ws_len > max_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(pkt->payload, aux->ws_payload, aux->ws_len);
+    return ESP_OK;
+}
+
+esp_err_t httpd_ws_send_frame(httpd_req_t *req, httpd_ws_frame_t *pkt) {
+    return httpd_ws_send_frame_async(req->handle, httpd_req_to_sockfd(req),
+                                     pkt);
+}
+
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd,
+                                    httpd_ws_frame_t *frame) {
+    if (frame == NULL || fd < 0 || (frame->len && frame->payload == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint8_t head[10];
+    size_t hlen = 2;
+    head[0] = (!frame->fragmented || frame->final ? HTTPD_WS_FIN : 0) |
+              frame->type;
+    if (frame->len < 126) {
+        head[1] = frame->len;
+    } else if (frame->len < 0x10000) {
+        head[1] = 126;
+        head[2] = frame->len >> 8;
+        head[3] = frame->len;
+        hlen = 4;
+    } else {
+        head[1] = 127;
+        for (int i = 0; i < 8; ++i) {
+            head[2 + i] = (uint64_t)frame->len >> ((7 - i) * 8);
+        }
+        hlen = 10;
+    }
+
+    if (httpd_send_all(fd, head, hlen) != 0 ||
+        (frame->len && httpd_send_all(fd, frame->payload, frame->len) != 0)) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
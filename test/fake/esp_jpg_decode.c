@@ -0,0 +1,91 @@
+#include "esp_jpg_decode.h"
+
+#include <stdio.h>  // before jpeglib.h, which uses FILE
+#include <jpeglib.h>
+#include <setjmp.h>
+#include <stdlib.h>
+
+#define JPG_IN_CHUNK 1024
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} jpg_error_t;
+
+static void jpg_error_exit(j_common_ptr cinfo) {
+    longjmp(((jpg_error_t *)cinfo->err)->jump, 1);
+}
+
+static void jpg_error_silent(j_common_ptr cinfo) {}
+
+esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader,
+                         jpg_writer_cb writer, void *arg) {
+    if ((unsigned)scale > JPG_SCALE_MAX || len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // pulled through the reader in pieces, as tjpgd does
+    uint8_t *jpg = (uint8_t *)malloc(len);
+    if (jpg == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    size_t got = 0;
+    while (got < len) {
+        size_t want = len - got < JPG_IN_CHUNK ? len - got : JPG_IN_CHUNK;
+        size_t n = reader(arg, got, jpg + got, want);
+        if (n == 0) {
+            break;
+        }
+        got += n;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    jpg_error_t err;
+    JSAMPLE *row = NULL;
+    esp_err_t res = ESP_FAIL;
+
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jpg_error_exit;
+    err.pub.output_message = jpg_error_silent;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(row);
+        free(jpg);
+        return ESP_FAIL;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, jpg, got);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1 << scale;
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    uint16_t w = cinfo.output_width;
+    uint16_t h = cinfo.output_height;
+    row = (JSAMPLE *)malloc((size_t)w * 3);
+    if (row == NULL) {
+        jpeg_destroy_decompress(&cinfo);
+        free(jpg);
+        return ESP_ERR_NO_MEM;
+    }
+
+    writer(arg, 0, 0, w, h, NULL);  // the driver ignores this answer too
+    int stopped = 0;
+    while (!stopped && cinfo.output_scanline < h) {
+        uint16_t y = cinfo.output_scanline;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        stopped = !writer(arg, 0, y, w, 1, row);
+    }
+    if (!stopped) {
+        jpeg_finish_decompress(&cinfo);
+        writer(arg, w, h, w, h, NULL);
+        res = ESP_OK;
+    } else {
+        jpeg_abort_decompress(&cinfo);
+    }
+    jpeg_destroy_decompress(&cinfo);
+    free(row);
+    free(jpg);
+    return res;
+}
@@ -0,0 +1,65 @@
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static pthread_once_t _log_once = PTHREAD_ONCE_INIT;
+static esp_log_level_t _log_level = ESP_LOG_INFO;
+
+static void esp_log_init(void) {
+    const char *env = getenv("DEMO_LOG_LEVEL");
+    if (env == NULL) {
+        return;
+    }
+    switch (env[0]) {
+    case 'N': _log_level = ESP_LOG_NONE; break;
+    case 'E': _log_level = ESP_LOG_ERROR; break;
+    case 'W': _log_level = ESP_LOG_WARN; break;
+    case 'I': _log_level = ESP_LOG_INFO; break;
+    case 'D': _log_level = ESP_LOG_DEBUG; break;
+    case 'V': _log_level = ESP_LOG_VERBOSE; break;
+    }
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format,
+                   ...) {
+    static const char letters[] = "NEWIDV";
+    pthread_once(&_log_once, esp_log_init);
+    if (level > _log_level) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // one fprintf per line, lines of several threads do not mix
+    char line[512];
+    int n = snprintf(line, sizeof(line), "%c (%ld.%03ld) %s: ", letters[level],
+                     (long)now.tv_sec, now.tv_nsec / 1000000, tag);
+    va_list args;
+    va_start(args, format);
+    if (n >= 0 && n < (int)sizeof(line)) {
+        vsnprintf(line + n, sizeof(line) - n, format, args);
+    }
+    va_end(args);
+    fprintf(stderr, "%s\n", line);
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+    }
+    return "UNKNOWN ERROR";
+}
@@ -0,0 +1,44 @@
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "quark/quark.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_mutex_t _random_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t _random_state = 0;
+
+uint32_t esp_random(void) {
+    pthread_mutex_lock(&_random_lock);
+    if (_random_state == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        _random_state = (uint64_t)now.tv_nsec << 20 ^ now.tv_sec ^ getpid();
+        _random_state |= 1;
+    }
+    // xorshift64*, good enough for sequence numbers and SSRCs
+    _random_state ^= _random_state >> 12;
+    _random_state ^= _random_state << 25;
+    _random_state ^= _random_state >> 27;
+    uint32_t value = (_random_state * 0x2545f4914f6cdd1dull) >> 32;
+    pthread_mutex_unlock(&_random_lock);
+    return value;
+}
+
+uint32_t esp_get_free_heap_size(void) { return HOST_HEAP_FREE_BYTES; }
+
+uint32_t esp_get_minimum_free_heap_size(void) { return HOST_HEAP_FREE_BYTES; }
+
+void esp_restart(void) { exit(0); }
+
+size_t heap_caps_get_free_size(uint32_t caps) { return HOST_HEAP_FREE_BYTES; }
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return HOST_HEAP_FREE_BYTES;
+}
+
+void *rc_malloc(size_t size) { return malloc(size); }
+
+void rc_free(void *ptr) { free(ptr); }
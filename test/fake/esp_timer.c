@@ -0,0 +1,139 @@
+#include "esp_timer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct esp_timer {
+    esp_timer_create_args_t args;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    int armed;
+    int deleted;
+    int64_t deadline_us;
+    uint64_t period_us;  // 0 for a one shot
+};
+
+int64_t esp_timer_get_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void *esp_timer_main(void *arg) {
+    esp_timer_handle_t timer = (esp_timer_handle_t)arg;
+
+    pthread_mutex_lock(&timer->lock);
+    while (!timer->deleted) {
+        if (!timer->armed) {
+            pthread_cond_wait(&timer->cond, &timer->lock);
+            continue;
+        }
+
+        struct timespec deadline = {
+            .tv_sec = timer->deadline_us / 1000000,
+            .tv_nsec = (timer->deadline_us % 1000000) * 1000,
+        };
+        if (pthread_cond_timedwait(&timer->cond, &timer->lock, &deadline) !=
+                ETIMEDOUT ||
+            !timer->armed || esp_timer_get_time() < timer->deadline_us) {
+            continue;  // stopped, restarted or woken early
+        }
+
+        if (timer->period_us) {
+            timer->deadline_us += timer->period_us;
+        } else {
+            timer->armed = 0;
+        }
+        pthread_mutex_unlock(&timer->lock);
+        timer->args.callback(timer->args.arg);
+        pthread_mutex_lock(&timer->lock);
+    }
+    pthread_mutex_unlock(&timer->lock);
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                           esp_timer_handle_t *out_handle) {
+    if (args == NULL || args->callback == NULL || out_handle == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_timer_handle_t timer =
+        (esp_timer_handle_t)calloc(1, sizeof(struct esp_timer));
+    if (timer == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    timer->args = *args;
+    pthread_mutex_init(&timer->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&timer->thread, NULL, esp_timer_main, timer) != 0) {
+        free(timer);
+        return ESP_ERR_NO_MEM;
+    }
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+static esp_err_t esp_timer_arm(esp_timer_handle_t timer, uint64_t timeout_us,
+                               uint64_t period_us) {
+    pthread_mutex_lock(&timer->lock);
+    if (timer->armed) {
+        pthread_mutex_unlock(&timer->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->armed = 1;
+    timer->deadline_us = esp_timer_get_time() + timeout_us;
+    timer->period_us = period_us;
+    pthread_cond_signal(&timer->cond);
+    pthread_mutex_unlock(&timer->lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    return esp_timer_arm(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer,
+                                   uint64_t period_us) {
+    return period_us == 0 ? ESP_ERR_INVALID_ARG
+                          : esp_timer_arm(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    pthread_mutex_lock(&timer->lock);
+    int armed = timer->armed;
+    timer->armed = 0;
+    pthread_cond_signal(&timer->cond);
+    pthread_mutex_unlock(&timer->lock);
+    return armed ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    pthread_mutex_lock(&timer->lock);
+    if (timer->armed) {
+        pthread_mutex_unlock(&timer->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->deleted = 1;
+    pthread_cond_signal(&timer->cond);
+    pthread_mutex_unlock(&timer->lock);
+
+    if (!pthread_equal(pthread_self(), timer->thread)) {
+        pthread_join(timer->thread, NULL);
+    } else {
+        pthread_detach(timer->thread);
+        return ESP_OK;  // from its own callback, the thread frees nothing
+    }
+    pthread_mutex_destroy(&timer->lock);
+    pthread_cond_destroy(&timer->cond);
+    free(timer);
+    return ESP_OK;
+}
@@ -0,0 +1,394 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_timer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct tskTaskControlBlock {
+    pthread_t thread;
+    clockid_t cpu_clock;
+    char name[configMAX_TASK_NAME_LEN];
+    UBaseType_t number;
+    UBaseType_t priority;
+    BaseType_t core;
+    uint32_t stack_depth;
+    int alive;
+
+    TaskFunction_t fn;
+    void *params;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notify;
+
+    struct tskTaskControlBlock *next;
+};
+
+struct QueueDefinition {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t count;
+    UBaseType_t head;
+    uint8_t *items;
+};
+
+// handles are never freed, a deleted task may still be looked up
+static pthread_mutex_t _tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tskTaskControlBlock *_tasks = NULL;
+static UBaseType_t _task_number = 0;
+static __thread struct tskTaskControlBlock *_self = NULL;
+
+static pthread_once_t _origin_once = PTHREAD_ONCE_INIT;
+static int64_t _origin_us;
+
+static void rtos_origin_init(void) { _origin_us = esp_timer_get_time(); }
+
+static void rtos_cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// 0 once woken, ETIMEDOUT after ticks, portMAX_DELAY waits for good
+static int rtos_wait(pthread_cond_t *cond, pthread_mutex_t *lock,
+                     const struct timespec *deadline) {
+    if (deadline == NULL) {
+        return pthread_cond_wait(cond, lock);
+    }
+    return pthread_cond_timedwait(cond, lock, deadline);
+}
+
+static const struct timespec *rtos_deadline(TickType_t ticks,
+                                            struct timespec *ts) {
+    if (ticks == portMAX_DELAY) {
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    uint64_t ns = (uint64_t)ticks * (1000000000ull / configTICK_RATE_HZ) +
+                  ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000ull;
+    ts->tv_nsec = ns % 1000000000ull;
+    return ts;
+}
+
+static struct tskTaskControlBlock *rtos_task_new(const char *name,
+                                                 UBaseType_t priority,
+                                                 BaseType_t core) {
+    struct tskTaskControlBlock *task =
+        (struct tskTaskControlBlock *)calloc(1, sizeof(*task));
+    if (task == NULL) {
+        return NULL;
+    }
+    strncpy(task->name, name, sizeof(task->name) - 1);
+    task->priority = priority;
+    task->core = core;
+    pthread_mutex_init(&task->lock, NULL);
+    rtos_cond_init(&task->cond);
+    return task;
+}
+
+static void rtos_task_register(struct tskTaskControlBlock *task) {
+    task->thread = pthread_self();
+    pthread_getcpuclockid(task->thread, &task->cpu_clock);
+    _self = task;
+
+    pthread_mutex_lock(&_tasks_lock);
+    task->number = ++_task_number;
+    task->alive = 1;
+    task->next = _tasks;
+    _tasks = task;
+    pthread_mutex_unlock(&_tasks_lock);
+}
+
+static void *rtos_task_main(void *arg) {
+    struct tskTaskControlBlock *task = (struct tskTaskControlBlock *)arg;
+    rtos_task_register(task);
+    task->fn(task->params);
+    // returning from a task function is a bug on the target, end quietly
+    vTaskDelete(NULL);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+                                   uint32_t stack_depth, void *params,
+                                   UBaseType_t priority, TaskHandle_t *handle,
+                                   BaseType_t core) {
+    pthread_once(&_origin_once, rtos_origin_init);
+    struct tskTaskControlBlock *task = rtos_task_new(name, priority, core);
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    task->fn = fn;
+    task->params = params;
+    task->stack_depth = stack_depth;
+    if (handle != NULL) {
+        *handle = task;
+    }
+
+    // host code needs more stack than the target, keep the default
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, rtos_task_main, task);
+    pthread_attr_destroy(&attr);
+    return err == 0 ? pdPASS : pdFAIL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name,
+                       uint32_t stack_depth, void *params,
+                       UBaseType_t priority, TaskHandle_t *handle) {
+    return xTaskCreatePinnedToCore(fn, name, stack_depth, params, priority,
+                                   handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    struct tskTaskControlBlock *self = xTaskGetCurrentTaskHandle();
+    if (task != NULL && task != self) {
+        abort();  // the demo only ever deletes itself
+    }
+    pthread_mutex_lock(&_tasks_lock);
+    self->alive = 0;
+    pthread_mutex_unlock(&_tasks_lock);
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec ts;
+    ts.tv_sec = ticks / configTICK_RATE_HZ;
+    ts.tv_nsec = (long)(ticks % configTICK_RATE_HZ) *
+                 (1000000000L / configTICK_RATE_HZ);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+void vTaskDelayUntil(TickType_t *previous_wake, TickType_t period) {
+    TickType_t wake = *previous_wake + period;
+    TickType_t now = xTaskGetTickCount();
+    if ((int32_t)(wake - now) > 0) {
+        vTaskDelay(wake - now);
+    }
+    *previous_wake = wake;
+}
+
+TickType_t xTaskGetTickCount(void) {
+    pthread_once(&_origin_once, rtos_origin_init);
+    return (esp_timer_get_time() - _origin_us) /
+           (1000000 / configTICK_RATE_HZ);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    if (_self == NULL) {
+        pthread_once(&_origin_once, rtos_origin_init);
+        struct tskTaskControlBlock *task =
+            rtos_task_new("pthread", 1, tskNO_AFFINITY);
+        if (task == NULL) {
+            abort();
+        }
+        rtos_task_register(task);
+    }
+    return _self;
+}
+
+char *pcTaskGetTaskName(TaskHandle_t task) {
+    if (task == NULL) {
+        task = xTaskGetCurrentTaskHandle();
+    }
+    return task->name;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    if (task == NULL) {
+        task = xTaskGetCurrentTaskHandle();
+    }
+    return task->stack_depth;  // pthread stacks are not watched
+}
+
+BaseType_t xTaskGetAffinity(TaskHandle_t task) {
+    if (task == NULL) {
+        task = xTaskGetCurrentTaskHandle();
+    }
+    return task->core;
+}
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *status, UBaseType_t size,
+                                 uint32_t *total_run_time) {
+    pthread_once(&_origin_once, rtos_origin_init);
+    UBaseType_t count = 0;
+
+    pthread_mutex_lock(&_tasks_lock);
+    for (struct tskTaskControlBlock *task = _tasks; task != NULL;
+         task = task->next) {
+        if (!task->alive) {
+            continue;
+        }
+        if (count == size) {
+            count = 0;  // as FreeRTOS, nothing if the array is short
+            break;
+        }
+
+        struct timespec cpu = {0, 0};
+        clock_gettime(task->cpu_clock, &cpu);
+        TaskStatus_t *s = &status[count++];
+        memset(s, 0, sizeof(TaskStatus_t));
+        s->xHandle = task;
+        s->pcTaskName = task->name;
+        s->xTaskNumber = task->number;
+        s->eCurrentState = task == _self ? eRunning : eBlocked;
+        s->uxCurrentPriority = task->priority;
+        s->uxBasePriority = task->priority;
+        s->ulRunTimeCounter = cpu.tv_sec * 1000000ull + cpu.tv_nsec / 1000;
+        s->usStackHighWaterMark = task->stack_depth;
+        s->xCoreID = task->core;
+    }
+    pthread_mutex_unlock(&_tasks_lock);
+
+    if (total_run_time != NULL) {
+        *total_run_time = esp_timer_get_time() - _origin_us;
+    }
+    return count;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task->lock);
+    ++task->notify;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks) {
+    struct tskTaskControlBlock *self = xTaskGetCurrentTaskHandle();
+    struct timespec ts;
+    const struct timespec *deadline = rtos_deadline(ticks, &ts);
+
+    pthread_mutex_lock(&self->lock);
+    while (self->notify == 0 &&
+           rtos_wait(&self->cond, &self->lock, deadline) != ETIMEDOUT) {
+    }
+    uint32_t value = self->notify;
+    if (value != 0) {
+        self->notify = clear_on_exit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return value;
+}
+
+static QueueHandle_t rtos_queue_new(UBaseType_t length, UBaseType_t item_size,
+                                    UBaseType_t count) {
+    QueueHandle_t queue = (QueueHandle_t)calloc(1, sizeof(*queue));
+    if (queue == NULL) {
+        return NULL;
+    }
+    if (item_size > 0) {
+        queue->items = (uint8_t *)malloc((size_t)length * item_size);
+        if (queue->items == NULL) {
+            free(queue);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    rtos_cond_init(&queue->not_empty);
+    rtos_cond_init(&queue->not_full);
+    queue->length = length;
+    queue->item_size = item_size;
+    queue->count = count;
+    return queue;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    return length == 0 ? NULL : rtos_queue_new(length, item_size, 0);
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->items);
+    free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item,
+                      TickType_t ticks) {
+    struct timespec ts;
+    const struct timespec *deadline = rtos_deadline(ticks, &ts);
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length) {
+        if (ticks == 0 || rtos_wait(&queue->not_full, &queue->lock,
+                                    deadline) == ETIMEDOUT) {
+            if (queue->count < queue->length) {
+                break;
+            }
+            pthread_mutex_unlock(&queue->lock);
+            return pdFAIL;
+        }
+    }
+    if (queue->item_size > 0) {
+        UBaseType_t tail = (queue->head + queue->count) % queue->length;
+        memcpy(queue->items + (size_t)tail * queue->item_size, item,
+               queue->item_size);
+    }
+    ++queue->count;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+    struct timespec ts;
+    const struct timespec *deadline = rtos_deadline(ticks, &ts);
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        if (ticks == 0 || rtos_wait(&queue->not_empty, &queue->lock,
+                                    deadline) == ETIMEDOUT) {
+            if (queue->count > 0) {
+                break;
+            }
+            pthread_mutex_unlock(&queue->lock);
+            return pdFAIL;
+        }
+    }
+    if (queue->item_size > 0) {
+        memcpy(item, queue->items + (size_t)queue->head * queue->item_size,
+               queue->item_size);
+    }
+    queue->head = (queue->head + 1) % queue->length;
+    --queue->count;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return rtos_queue_new(1, 0, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return rtos_queue_new(1, 0, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max,
+                                           UBaseType_t initial) {
+    return max == 0 || initial > max ? NULL : rtos_queue_new(max, 0, initial);
+}
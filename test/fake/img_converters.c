@@ -0,0 +1,189 @@
+#include "img_converters.h"
+
+#include <stdio.h>  // before jpeglib.h, which uses FILE
+#include <jpeglib.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JPG_OUT_CHUNK 1024
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} jpg_error_t;
+
+typedef struct {
+    struct jpeg_destination_mgr pub;
+    jpg_out_cb cb;
+    void *arg;
+    size_t index;
+    int failed;
+    JOCTET buf[JPG_OUT_CHUNK];
+} jpg_dest_t;
+
+static void jpg_error_exit(j_common_ptr cinfo) {
+    longjmp(((jpg_error_t *)cinfo->err)->jump, 1);
+}
+
+static void jpg_dest_init(j_compress_ptr cinfo) {
+    jpg_dest_t *dest = (jpg_dest_t *)cinfo->dest;
+    dest->pub.next_output_byte = dest->buf;
+    dest->pub.free_in_buffer = JPG_OUT_CHUNK;
+}
+
+static void jpg_dest_flush(jpg_dest_t *dest, size_t len) {
+    if (!dest->failed && len > 0 &&
+        dest->cb(dest->arg, dest->index, dest->buf, len) != len) {
+        dest->failed = 1;
+    }
+    dest->index += len;
+}
+
+static boolean jpg_dest_empty(j_compress_ptr cinfo) {
+    jpg_dest_t *dest = (jpg_dest_t *)cinfo->dest;
+    jpg_dest_flush(dest, JPG_OUT_CHUNK);
+    jpg_dest_init(cinfo);
+    return TRUE;
+}
+
+static void jpg_dest_term(j_compress_ptr cinfo) {
+    jpg_dest_t *dest = (jpg_dest_t *)cinfo->dest;
+    jpg_dest_flush(dest, JPG_OUT_CHUNK - dest->pub.free_in_buffer);
+}
+
+// one source row into the layout libjpeg was set up for
+static void jpg_convert_row(const uint8_t *src, uint16_t width,
+                            pixformat_t format, JSAMPLE *row) {
+    if (format == PIXFORMAT_RGB565) {
+        for (int x = 0; x < width; ++x) {
+            uint16_t p = (src[x * 2] << 8) | src[x * 2 + 1];
+            row[x * 3] = (p >> 8) & 0xf8;
+            row[x * 3 + 1] = (p >> 3) & 0xfc;
+            row[x * 3 + 2] = (p << 3) & 0xf8;
+        }
+    } else {  // YUYV to YCbCr
+        for (int x = 0; x < width; ++x) {
+            const uint8_t *pair = src + (x & ~1) * 2;
+            row[x * 3] = src[x * 2];
+            row[x * 3 + 1] = pair[1];
+            row[x * 3 + 2] = pair[3];
+        }
+    }
+}
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width,
+                uint16_t height, pixformat_t format, uint8_t quality,
+                jpg_out_cb cb, void *arg) {
+    int bpp;
+    J_COLOR_SPACE space;
+    switch (format) {
+    case PIXFORMAT_GRAYSCALE: bpp = 1; space = JCS_GRAYSCALE; break;
+    case PIXFORMAT_RGB888: bpp = 3; space = JCS_EXT_BGR; break;
+    case PIXFORMAT_RGB565: bpp = 2; space = JCS_RGB; break;
+    case PIXFORMAT_YUV422: bpp = 2; space = JCS_YCbCr; break;
+    default: return false;
+    }
+    if (width == 0 || height == 0 || src_len < (size_t)width * height * bpp) {
+        return false;
+    }
+
+    struct jpeg_compress_struct cinfo;
+    jpg_error_t err;
+    jpg_dest_t dest = {.cb = cb, .arg = arg};
+    JSAMPLE *row = NULL;
+
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jpg_error_exit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        free(row);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    dest.pub.init_destination = jpg_dest_init;
+    dest.pub.empty_output_buffer = jpg_dest_empty;
+    dest.pub.term_destination = jpg_dest_term;
+    cinfo.dest = &dest.pub;
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = space == JCS_GRAYSCALE ? 1 : 3;
+    cinfo.in_color_space = space;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    if (bpp == 2) {
+        row = (JSAMPLE *)malloc((size_t)width * 3);
+        if (row == NULL) {
+            jpeg_destroy_compress(&cinfo);
+            return false;
+        }
+    }
+    while (cinfo.next_scanline < height) {
+        uint8_t *line = src + (size_t)cinfo.next_scanline * width * bpp;
+        JSAMPROW rows[1] = {line};
+        if (row) {
+            jpg_convert_row(line, width, format, row);
+            rows[0] = row;
+        }
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+    return !dest.failed;
+}
+
+bool frame2jpg_cb(camera_fb_t *fb, uint8_t quality, jpg_out_cb cb,
+                  void *arg) {
+    return fmt2jpg_cb(fb->buf, fb->len, fb->width, fb->height, fb->format,
+                      quality, cb, arg);
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+} jpg_mem_t;
+
+static size_t jpg_mem_write(void *arg, size_t index, const void *data,
+                            size_t len) {
+    jpg_mem_t *mem = (jpg_mem_t *)arg;
+    if (index + len > mem->cap) {
+        size_t cap = mem->cap ? mem->cap * 2 : 16 * 1024;
+        while (cap < index + len) {
+            cap *= 2;
+        }
+        uint8_t *buf = (uint8_t *)realloc(mem->buf, cap);
+        if (buf == NULL) {
+            return 0;
+        }
+        mem->buf = buf;
+        mem->cap = cap;
+    }
+    memcpy(mem->buf + index, data, len);
+    mem->len = index + len;
+    return len;
+}
+
+bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height,
+             pixformat_t format, uint8_t quality, uint8_t **out,
+             size_t *out_len) {
+    jpg_mem_t mem = {0};
+    if (!fmt2jpg_cb(src, src_len, width, height, format, quality,
+                    jpg_mem_write, &mem)) {
+        free(mem.buf);
+        return false;
+    }
+    *out = mem.buf;
+    *out_len = mem.len;
+    return true;
+}
+
+bool frame2jpg(camera_fb_t *fb, uint8_t quality, uint8_t **out,
+               size_t *out_len) {
+    return fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format,
+                   quality, out, out_len);
+}
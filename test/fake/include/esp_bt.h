@@ -0,0 +1,7 @@
+#ifndef _HOST_ESP_BT_H_
+#define _HOST_ESP_BT_H_
+
+// test.h includes it for esp_err_t, nothing else of it is used on the host
+#include "esp_err.h"
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_ESP_BT_DEVICE_H_
+#define _HOST_ESP_BT_DEVICE_H_
+
+#include "esp_bt_defs.h"
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_ESP_BT_MAIN_H_
+#define _HOST_ESP_BT_MAIN_H_
+
+// test.h includes it, nothing of it is used on the host
+
+#endif
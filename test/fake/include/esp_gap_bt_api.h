@@ -0,0 +1,22 @@
+#ifndef _HOST_ESP_GAP_BT_API_H_
+#define _HOST_ESP_GAP_BT_API_H_
+
+// the address type and EIR field types, for bt_devtab.c and bt_eir.c
+
+#include "esp_bt_defs.h"
+
+#define ESP_BT_GAP_EIR_DATA_LEN 240
+
+#define ESP_BT_EIR_TYPE_FLAGS 0x01
+#define ESP_BT_EIR_TYPE_INCMPL_16BITS_UUID 0x02
+#define ESP_BT_EIR_TYPE_CMPL_16BITS_UUID 0x03
+#define ESP_BT_EIR_TYPE_INCMPL_32BITS_UUID 0x04
+#define ESP_BT_EIR_TYPE_CMPL_32BITS_UUID 0x05
+#define ESP_BT_EIR_TYPE_INCMPL_128BITS_UUID 0x06
+#define ESP_BT_EIR_TYPE_CMPL_128BITS_UUID 0x07
+#define ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME 0x08
+#define ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME 0x09
+#define ESP_BT_EIR_TYPE_TX_POWER_LEVEL 0x0a
+#define ESP_BT_EIR_TYPE_MANU_SPECIFIC 0xff
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _HOST_ESP_HEAP_CAPS_H_
+#define _HOST_ESP_HEAP_CAPS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+/* the ESP32 internal heap after boot, the host does not track its heap */
+#define HOST_HEAP_FREE_BYTES (300 * 1024)
+
+size_t heap_caps_get_free_size(uint32_t caps);
+
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _HOST_ESP_JPG_DECODE_H_
+#define _HOST_ESP_JPG_DECODE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef enum {
+    JPG_SCALE_NONE,
+    JPG_SCALE_2X,
+    JPG_SCALE_4X,
+    JPG_SCALE_8X,
+    JPG_SCALE_MAX = JPG_SCALE_8X
+} jpg_scale_t;
+
+typedef size_t (*jpg_reader_cb)(void *arg, size_t index, uint8_t *buf,
+                                size_t len);
+typedef bool (*jpg_writer_cb)(void *arg, uint16_t x, uint16_t y, uint16_t w,
+                              uint16_t h, uint8_t *data);
+
+/**
+ * Like the tjpgd based decoder of the driver: writer is called once with
+ * data NULL at 0,0 and the scaled size, then with RGB888 blocks (here a
+ * row at a time), and once more with data NULL at w,h to end.
+ */
+esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader,
+                         jpg_writer_cb writer, void *arg);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef _HOST_ESP_SYSTEM_H_
+#define _HOST_ESP_SYSTEM_H_
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+uint32_t esp_random(void);
+
+/* a fixed figure, there is no small heap to watch on the host */
+uint32_t esp_get_free_heap_size(void);
+
+uint32_t esp_get_minimum_free_heap_size(void);
+
+void esp_restart(void);
+
+#endif
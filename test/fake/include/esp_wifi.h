@@ -0,0 +1,6 @@
+#ifndef _HOST_ESP_WIFI_H_
+#define _HOST_ESP_WIFI_H_
+
+// camera.c includes it, nothing of it is used on the host
+
+#endif
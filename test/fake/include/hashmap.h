@@ -0,0 +1,6 @@
+#ifndef _HOST_HASHMAP_H_
+#define _HOST_HASHMAP_H_
+
+// the quark hashmap, test.h includes it, nothing of it is used on the host
+
+#endif
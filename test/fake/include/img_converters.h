@@ -0,0 +1,30 @@
+#ifndef _HOST_IMG_CONVERTERS_H_
+#define _HOST_IMG_CONVERTERS_H_
+
+// the esp32-camera converters on libjpeg, same input layouts as the
+// driver: RGB888 is BGR, RGB565 big endian, YUV422 YUYV
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_camera.h"
+
+typedef size_t (*jpg_out_cb)(void *arg, size_t index, const void *data,
+                             size_t len);
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width,
+                uint16_t height, pixformat_t format, uint8_t quality,
+                jpg_out_cb cb, void *arg);
+
+bool frame2jpg_cb(camera_fb_t *fb, uint8_t quality, jpg_out_cb cb, void *arg);
+
+/* *out is malloc'd, the caller frees it */
+bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height,
+             pixformat_t format, uint8_t quality, uint8_t **out,
+             size_t *out_len);
+
+bool frame2jpg(camera_fb_t *fb, uint8_t quality, uint8_t **out,
+               size_t *out_len);
+
+#endif
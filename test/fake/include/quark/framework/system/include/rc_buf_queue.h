@@ -0,0 +1,6 @@
+#ifndef _HOST_RC_BUF_QUEUE_H_
+#define _HOST_RC_BUF_QUEUE_H_
+
+// test.h includes it, nothing of it is used on the host
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _HOST_QUARK_H_
+#define _HOST_QUARK_H_
+
+#include <stddef.h>
+
+#include "esp_log.h"
+
+// the parts of the quark SDK the host builds use
+
+void *rc_malloc(size_t size);
+void rc_free(void *ptr);
+
+#define LOGE(tag, format, ...) ESP_LOGE(tag, format, ##__VA_ARGS__)
+#define LOGW(tag, format, ...) ESP_LOGW(tag, format, ##__VA_ARGS__)
+#define LOGI(tag, format, ...) ESP_LOGI(tag, format, ##__VA_ARGS__)
+#define LOGD(tag, format, ...) ESP_LOGD(tag, format, ##__VA_ARGS__)
+
+#endif
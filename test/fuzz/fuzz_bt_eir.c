@@ -0,0 +1,402 @@
+/**
+ * bt_eir_parse on random, generated and mutated EIR blocks. Every result
+ * is checked against a reference that first splits the block into fields
+ * and then picks from them, so the two share no code: same bits, same
+ * values, the name inside the block, MALFORMED exactly when a field runs
+ * past the end. Each input sits in a buffer of its own length so an
+ * overread shows under -fsanitize=address.
+ *
+ * Then times the parse against what on_found_device did before it,
+ * esp_bt_gap_resolve_eir_data for the complete then the short name and a
+ * copy into the name buffer on every result.
+ *   fuzz_bt_eir [-n iterations] [-b bench_iterations] [-s seed]
+ *   fuzz_bt_eir eir.bin ...   checks and prints saved blocks
+ */
+
+#include "bt_eir.h"
+#include "esp_gap_bt_api.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FUZZ_MAX_FIELDS (ESP_BT_GAP_EIR_DATA_LEN / 2)
+#define FUZZ_BENCH_BLOCKS 64
+
+typedef struct _fuzz_field_t {
+    uint8_t type;
+    const uint8_t *value;
+    int len;
+} fuzz_field_t;
+
+static unsigned int fuzz_seed = 1;
+static int fuzz_failed;
+
+static int fuzz_rand(int n) {
+    return n > 0 ? rand_r(&fuzz_seed) % n : 0;
+}
+
+static int64_t fuzz_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* the reference, split first and choose after */
+static void fuzz_reference(const uint8_t *data, int len, bt_eir_t *eir) {
+    fuzz_field_t fields[FUZZ_MAX_FIELDS];
+    int count = 0;
+    memset(eir, 0, sizeof(bt_eir_t));
+
+    int pos = 0;
+    while (pos < len && data[pos] != 0) {
+        if (pos + data[pos] >= len) {  // type and value need len bytes
+            eir->present |= BT_EIR_MALFORMED;
+            break;
+        }
+        fields[count].type = data[pos + 1];
+        fields[count].value = &data[pos + 2];
+        fields[count].len = data[pos] - 1;
+        ++count;
+        pos += 1 + data[pos];
+    }
+
+    const fuzz_field_t *shortened = NULL, *complete = NULL;
+    for (int i = 0; i < count; ++i) {
+        const fuzz_field_t *f = &fields[i];
+        switch (f->type) {
+        case ESP_BT_EIR_TYPE_FLAGS:
+            if (f->len) {
+                eir->present |= BT_EIR_HAS_FLAGS;
+                eir->flags = f->value[0];  // the last one stays
+            }
+            break;
+        case ESP_BT_EIR_TYPE_TX_POWER_LEVEL:
+            if (f->len) {
+                eir->present |= BT_EIR_HAS_TX_POWER;
+                eir->tx_power = (int8_t)f->value[0];
+            }
+            break;
+        case ESP_BT_EIR_TYPE_INCMPL_16BITS_UUID:
+        case ESP_BT_EIR_TYPE_CMPL_16BITS_UUID:
+            for (int u = 0; u + 2 <= f->len; u += 2) {
+                uint16_t uuid = f->value[u] | (f->value[u + 1] << 8);
+                if (uuid == BT_EIR_UUID_AUDIO_SINK) {
+                    eir->present |= BT_EIR_AUDIO_SINK;
+                }
+                if (eir->uuid16_count < BT_EIR_MAX_UUID16) {
+                    eir->uuid16[eir->uuid16_count++] = uuid;
+                }
+            }
+            break;
+        case ESP_BT_EIR_TYPE_INCMPL_32BITS_UUID:
+        case ESP_BT_EIR_TYPE_CMPL_32BITS_UUID:
+            eir->uuid_other += f->len / 4;
+            break;
+        case ESP_BT_EIR_TYPE_INCMPL_128BITS_UUID:
+        case ESP_BT_EIR_TYPE_CMPL_128BITS_UUID:
+            eir->uuid_other += f->len / 16;
+            break;
+        case ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME:
+            if (f->len) {
+                shortened = f;  // the last one before a complete name
+            }
+            break;
+        case ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME:
+            if (f->len && complete == NULL) {
+                complete = f;
+            }
+            break;
+        default: break;
+        }
+    }
+
+    const fuzz_field_t *name = complete ? complete : shortened;
+    if (name) {
+        eir->present |= BT_EIR_HAS_NAME;
+        eir->present |= complete ? BT_EIR_NAME_COMPLETE : 0;
+        eir->name = (const char *)name->value;
+        eir->name_len = name->len;
+        eir->name_hash = bt_eir_name_hash(eir->name, eir->name_len);
+    }
+}
+
+static void fuzz_dump(const uint8_t *data, int len) {
+    for (int i = 0; i < len; ++i) {
+        printf("%02x%s", data[i], i % 32 == 31 || i == len - 1 ? "\n" : " ");
+    }
+}
+
+static void fuzz_fail(const char *what, const uint8_t *data, int len) {
+    if (fuzz_failed++ < 5) {
+        printf("%s, %d bytes:\n", what, len);
+        fuzz_dump(data, len);
+    }
+}
+
+// returns the BT_EIR_* bits, the input is copied to a buffer of its size
+static int fuzz_check(const uint8_t *input, int len) {
+    uint8_t *data = (uint8_t *)malloc(len > 0 ? len : 1);
+    if (data == NULL) {
+        return 0;
+    }
+    memcpy(data, input, len);
+
+    bt_eir_t eir, ref;
+    int present = bt_eir_parse(data, len, &eir);
+    fuzz_reference(data, len, &ref);
+
+    if (present != eir.present) {
+        fuzz_fail("return value is not present", data, len);
+    }
+    if (eir.present & BT_EIR_HAS_NAME) {
+        const uint8_t *name = (const uint8_t *)eir.name;
+        if (name < data + 2 || name + eir.name_len > data + len ||
+            eir.name_len == 0) {
+            fuzz_fail("name outside the block", data, len);
+        }
+    } else if (eir.name != NULL || eir.name_len || eir.name_hash) {
+        fuzz_fail("name set without HAS_NAME", data, len);
+    }
+    if (eir.uuid16_count > BT_EIR_MAX_UUID16) {
+        fuzz_fail("too many uuid16", data, len);
+    }
+    if (eir.present != ref.present || eir.flags != ref.flags ||
+        eir.tx_power != ref.tx_power || eir.name != ref.name ||
+        eir.name_len != ref.name_len || eir.name_hash != ref.name_hash ||
+        eir.uuid16_count != ref.uuid16_count ||
+        eir.uuid_other != ref.uuid_other ||
+        memcmp(eir.uuid16, ref.uuid16, sizeof(eir.uuid16)) != 0) {
+        fuzz_fail("differs from the reference", data, len);
+    }
+
+    free(data);
+    return present;
+}
+
+static int fuzz_put(uint8_t *data, int pos, uint8_t type, int len) {
+    if (pos + 2 + len > ESP_BT_GAP_EIR_DATA_LEN) {
+        return pos;
+    }
+    data[pos] = len + 1;
+    data[pos + 1] = type;
+    for (int i = 0; i < len; ++i) {
+        data[pos + 2 + i] = type == ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME ||
+                                    type == ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME
+                                ? 'a' + fuzz_rand(26)
+                                : fuzz_rand(256);
+    }
+    return pos + 2 + len;
+}
+
+// well formed fields of the types the parser knows and a few it does not
+static int fuzz_generate(uint8_t *data) {
+    static const uint8_t types[] = {
+        ESP_BT_EIR_TYPE_FLAGS,
+        ESP_BT_EIR_TYPE_INCMPL_16BITS_UUID,
+        ESP_BT_EIR_TYPE_CMPL_16BITS_UUID,
+        ESP_BT_EIR_TYPE_CMPL_32BITS_UUID,
+        ESP_BT_EIR_TYPE_CMPL_128BITS_UUID,
+        ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME,
+        ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME,
+        ESP_BT_EIR_TYPE_TX_POWER_LEVEL,
+        ESP_BT_EIR_TYPE_MANU_SPECIFIC,
+        0x10,  // device id
+    };
+    int pos = 0, fields = fuzz_rand(8);
+    for (int i = 0; i < fields; ++i) {
+        uint8_t type = types[fuzz_rand(sizeof(types))];
+        int len = fuzz_rand(4) ? fuzz_rand(20) : fuzz_rand(60);
+        if (type == ESP_BT_EIR_TYPE_CMPL_16BITS_UUID && fuzz_rand(2)) {
+            len &= ~1;
+        }
+        int start = pos;
+        pos = fuzz_put(data, pos, type, len);
+        if (pos > start && type == ESP_BT_EIR_TYPE_CMPL_16BITS_UUID &&
+            len >= 2 && fuzz_rand(2)) {
+            data[start + 2] = BT_EIR_UUID_AUDIO_SINK & 0xff;
+            data[start + 3] = BT_EIR_UUID_AUDIO_SINK >> 8;
+        }
+    }
+    // the controller pads to the full size with zeros
+    if (fuzz_rand(2)) {
+        memset(data + pos, 0, ESP_BT_GAP_EIR_DATA_LEN - pos);
+        pos = ESP_BT_GAP_EIR_DATA_LEN;
+    }
+    return pos;
+}
+
+static int fuzz_mutate(uint8_t *data, int len) {
+    int edits = 1 + fuzz_rand(4);
+    for (int i = 0; i < edits && len > 0; ++i) {
+        int at = fuzz_rand(len);
+        switch (fuzz_rand(5)) {
+        case 0: data[at] ^= 1 << fuzz_rand(8); break;
+        case 1: data[at] = fuzz_rand(256); break;
+        case 2: data[at] = fuzz_rand(2) ? 0xff : len - at; break;  // lengths
+        case 3: len = at; break;
+        default:
+            if (len < ESP_BT_GAP_EIR_DATA_LEN) {
+                memmove(data + at + 1, data + at, len - at);
+                data[at] = fuzz_rand(256);
+                ++len;
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+static void fuzz_run(int iterations) {
+    uint8_t data[ESP_BT_GAP_EIR_DATA_LEN];
+    int counts[3] = {0}, malformed = 0, named = 0;
+    for (int i = 0; i < iterations; ++i) {
+        int kind = i % 3, len;
+        if (kind == 0) {
+            len = fuzz_rand(ESP_BT_GAP_EIR_DATA_LEN + 1);
+            for (int b = 0; b < len; ++b) {
+                data[b] = fuzz_rand(4) ? fuzz_rand(32) : fuzz_rand(256);
+            }
+        } else {
+            len = fuzz_generate(data);
+            if (kind == 2) {
+                len = fuzz_mutate(data, len);
+            }
+        }
+        int present = fuzz_check(data, len);
+        ++counts[kind];
+        malformed += (present & BT_EIR_MALFORMED) != 0;
+        named += (present & BT_EIR_HAS_NAME) != 0;
+    }
+    printf("%d random, %d generated, %d mutated: %d malformed, %d named\n",
+           counts[0], counts[1], counts[2], malformed, named);
+}
+
+/* esp_bt_gap_resolve_eir_data, the first field of a type */
+static const uint8_t *fuzz_resolve(const uint8_t *data, int len, uint8_t type,
+                                   uint8_t *value_len) {
+    int pos = 0;
+    while (pos < len && data[pos] != 0 && pos + data[pos] < len) {
+        if (data[pos + 1] == type) {
+            *value_len = data[pos] - 1;
+            return &data[pos + 2];
+        }
+        pos += 1 + data[pos];
+    }
+    return NULL;
+}
+
+static void fuzz_bench(int iterations) {
+    static uint8_t blocks[FUZZ_BENCH_BLOCKS][ESP_BT_GAP_EIR_DATA_LEN];
+    // what a speaker sends: flags, a name, tx power, a few services
+    for (int i = 0; i < FUZZ_BENCH_BLOCKS; ++i) {
+        uint8_t *d = blocks[i];
+        int pos = fuzz_put(d, 0, ESP_BT_EIR_TYPE_FLAGS, 1);
+        pos = fuzz_put(d, pos, ESP_BT_EIR_TYPE_CMPL_16BITS_UUID, 6);
+        if (i % 4) {
+            pos = fuzz_put(d, pos, ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME,
+                           8 + i % 16);
+        }
+        pos = fuzz_put(d, pos, ESP_BT_EIR_TYPE_TX_POWER_LEVEL, 1);
+        memset(d + pos, 0, ESP_BT_GAP_EIR_DATA_LEN - pos);
+    }
+
+    volatile uint32_t sink = 0;
+    int64_t t0 = fuzz_now_ns();
+    for (int i = 0; i < iterations; ++i) {
+        bt_eir_t eir;
+        bt_eir_parse(blocks[i % FUZZ_BENCH_BLOCKS], ESP_BT_GAP_EIR_DATA_LEN,
+                     &eir);
+        sink += eir.name_hash;
+    }
+    int64_t parse_ns = fuzz_now_ns() - t0;
+
+    char buff[ESP_BT_GAP_EIR_DATA_LEN + 1];
+    t0 = fuzz_now_ns();
+    for (int i = 0; i < iterations; ++i) {
+        const uint8_t *d = blocks[i % FUZZ_BENCH_BLOCKS];
+        uint8_t len = 0;
+        const uint8_t *name = fuzz_resolve(d, ESP_BT_GAP_EIR_DATA_LEN,
+                                           ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME,
+                                           &len);
+        if (name == NULL) {
+            name = fuzz_resolve(d, ESP_BT_GAP_EIR_DATA_LEN,
+                                ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME, &len);
+        }
+        if (name) {
+            memcpy(buff, name, len);
+            buff[len] = '\0';
+            sink += buff[0];
+        }
+    }
+    int64_t resolve_ns = fuzz_now_ns() - t0;
+
+    printf("%d blocks of %d bytes\n", iterations, ESP_BT_GAP_EIR_DATA_LEN);
+    printf("bt_eir_parse        %6.1f ns/block, every field\n",
+           parse_ns / (double)iterations);
+    printf("resolve and copy    %6.1f ns/block, the name only\n",
+           resolve_ns / (double)iterations);
+}
+
+static int fuzz_replay(int count, char **paths) {
+    for (int i = 0; i < count; ++i) {
+        FILE *f = fopen(paths[i], "rb");
+        if (f == NULL) {
+            perror(paths[i]);
+            return 1;
+        }
+        uint8_t data[ESP_BT_GAP_EIR_DATA_LEN];
+        int len = fread(data, 1, sizeof(data), f);
+        fclose(f);
+
+        bt_eir_t eir;
+        fuzz_check(data, len);
+        bt_eir_parse(data, len, &eir);
+        printf("%s: present 0x%02x flags 0x%02x tx %d uuid16 %d other %d "
+               "name \"%.*s\"\n",
+               paths[i], eir.present, eir.flags, eir.tx_power,
+               eir.uuid16_count, eir.uuid_other, eir.name_len,
+               eir.name ? eir.name : "");
+    }
+    return fuzz_failed ? 1 : 0;
+}
+
+static void fuzz_usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-n iterations] [-b bench_iterations] [-s seed]\n"
+            "       %s eir.bin ...\n",
+            prog, prog);
+}
+
+int main(int argc, char **argv) {
+    int iterations = 300000, bench_iterations = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:s:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atoi(optarg); break;
+        case 'b': bench_iterations = atoi(optarg); break;
+        case 's': fuzz_seed = strtoul(optarg, NULL, 0); break;
+        default: fuzz_usage(argv[0]); return 2;
+        }
+    }
+    if (optind < argc) {
+        return fuzz_replay(argc - optind, argv + optind);
+    }
+    if (iterations < 0 || bench_iterations < 0) {
+        fuzz_usage(argv[0]);
+        return 2;
+    }
+
+    printf("seed %u\n", fuzz_seed);
+    fuzz_run(iterations);
+    if (fuzz_failed) {
+        printf("%d blocks FAILED\n", fuzz_failed);
+        return 1;
+    }
+    if (bench_iterations) {
+        fuzz_bench(bench_iterations);
+    }
+    return 0;
+}
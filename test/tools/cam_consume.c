@@ -0,0 +1,266 @@
+/**
+ * One client on /camera (or /camera/ws with -w), the way a viewer would
+ * take the stream. Prints a line per interval and a summary of latency
+ * and dropped frames: X-Frame-Seq (or the WebSocket seq) must go up by
+ * one, every gap is frames the server skipped for this client. Latency
+ * is the local clock minus X-Timestamp, so against a board it is only as
+ * good as its SNTP sync; the WebSocket capture_us is esp_timer time and
+ * only means something against the host build. -m also prints the
+ * server's own capture to sent histogram from /metrics.
+ */
+
+#include "stream_client.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CONSUME_START_TIMEOUT_MS 10000
+#define CONSUME_FRAME_TIMEOUT_MS 2000
+#define CONSUME_METRICS_SIZE 32768
+
+// upper bounds in ms, the last bucket takes the rest
+static const int consume_buckets[] = {10, 20, 50, 100, 200, 500, 1000};
+#define CONSUME_BUCKETS (sizeof(consume_buckets) / sizeof(consume_buckets[0]))
+
+typedef struct _consume_opts_t {
+    const char *host;
+    int port;
+    int ws;
+    const char *query;
+    const char *server;
+    int seconds;
+    uint32_t max_frames;  // 0 is no limit
+    int interval;
+    int metrics;
+} consume_opts_t;
+
+typedef struct _consume_stats_t {
+    uint32_t frames;
+    uint64_t bytes;
+    uint32_t scaled;
+    int shift;         // the smallest scale the server applied
+    uint32_t dropped;  // sum of the seq gaps
+    uint32_t gaps;     // times the seq jumped
+    uint32_t longest_gap;
+    uint32_t buckets[CONSUME_BUCKETS + 1];
+    int64_t *latency_us;
+    size_t latency_cap;
+} consume_stats_t;
+
+static void consume_record(consume_stats_t *s, const stream_frame_t *frame) {
+    if (s->frames >= s->latency_cap) {
+        size_t cap = s->latency_cap ? s->latency_cap * 2 : 1024;
+        int64_t *p = (int64_t *)realloc(s->latency_us, cap * sizeof(int64_t));
+        if (p != NULL) {
+            s->latency_us = p;
+            s->latency_cap = cap;
+        }
+    }
+    if (s->frames < s->latency_cap) {
+        s->latency_us[s->frames] = frame->latency_us;
+    }
+
+    size_t b = 0;
+    while (b < CONSUME_BUCKETS &&
+           frame->latency_us >= consume_buckets[b] * 1000LL) {
+        ++b;
+    }
+    ++s->buckets[b];
+    ++s->frames;
+    s->bytes += frame->len;
+    s->scaled += frame->scaled != 0;
+    if (frame->shift > s->shift) {
+        s->shift = frame->shift;
+    }
+}
+
+static int consume_cmp(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double consume_pct_ms(const int64_t *v, size_t n, double pct) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(pct * (n - 1) + 0.5);
+    return v[i] / 1000.0;
+}
+
+// frames first..last-1 of the run, sorted in place
+static void consume_line(const char *label, consume_stats_t *s, size_t first,
+                         size_t last, double seconds, uint32_t dropped) {
+    if (last > s->latency_cap) {
+        last = s->latency_cap;
+    }
+    size_t n = last > first ? last - first : 0;
+    int64_t *v = s->latency_us + first;
+    if (n) {
+        qsort(v, n, sizeof(int64_t), consume_cmp);
+    }
+    printf("%-8s %5zu frames %5.1f fps  p50 %7.2fms p99 %7.2fms max %7.2fms"
+           "  %u dropped\n",
+           label, n, seconds > 0 ? n / seconds : 0.0,
+           consume_pct_ms(v, n, 0.50), consume_pct_ms(v, n, 0.99),
+           n ? v[n - 1] / 1000.0 : 0.0, dropped);
+}
+
+static void consume_metrics(const consume_opts_t *opts) {
+    char *body = (char *)malloc(CONSUME_METRICS_SIZE);
+    if (body == NULL) {
+        return;
+    }
+    int status = stream_http_get(opts->host, opts->port, "/metrics", body,
+                                 CONSUME_METRICS_SIZE,
+                                 CONSUME_FRAME_TIMEOUT_MS);
+    if (status != 200) {
+        printf("GET /metrics: %d\n", status);
+        free(body);
+        return;
+    }
+    printf("server:\n");
+    for (char *line = strtok(body, "\n"); line; line = strtok(NULL, "\n")) {
+        if (strncmp(line, "cam_capture_to_sent", 19) == 0) {
+            printf("  %s\n", line);
+        }
+    }
+    free(body);
+}
+
+static void consume_usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-H host] [-p port | -s server] [-w] [-q query]\n"
+            "          [-t seconds] [-n frames] [-i interval] [-m]\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    consume_opts_t opts = {
+        .host = "127.0.0.1",
+        .seconds = 10,
+        .interval = 1,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:s:wq:t:n:i:m")) != -1) {
+        switch (opt) {
+        case 'H': opts.host = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 's': opts.server = optarg; break;
+        case 'w': opts.ws = 1; break;
+        case 'q': opts.query = optarg; break;
+        case 't': opts.seconds = atoi(optarg); break;
+        case 'n': opts.max_frames = strtoul(optarg, NULL, 10); break;
+        case 'i': opts.interval = atoi(optarg); break;
+        case 'm': opts.metrics = 1; break;
+        default: consume_usage(argv[0]); return 2;
+        }
+    }
+    if (opts.seconds < 1 || opts.interval < 1 ||
+        (opts.server == NULL && opts.port == 0)) {
+        consume_usage(argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t server_pid = 0;
+    if (opts.server) {
+        server_pid = stream_server_spawn(opts.server, opts.host, &opts.port,
+                                         CONSUME_START_TIMEOUT_MS);
+        if (server_pid < 0) {
+            return 1;
+        }
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s%s", opts.ws ? "/camera/ws" : "/camera",
+             opts.query ? "?" : "", opts.query ? opts.query : "");
+    stream_client_t client;
+    if (stream_client_open(&client, opts.host, opts.port, path, opts.ws,
+                           CONSUME_FRAME_TIMEOUT_MS) != 0) {
+        fprintf(stderr, "GET %s: %d\n", path, client.status);
+        stream_client_close(&client);
+        if (server_pid > 0) {
+            stream_server_stop(server_pid);
+        }
+        return 1;
+    }
+
+    consume_stats_t stats = {0};
+    int64_t start = stream_now_us();
+    int64_t until = start + opts.seconds * 1000000LL;
+    int64_t tick = start + opts.interval * 1000000LL;
+    size_t tick_first = 0;
+    uint32_t tick_dropped = 0;
+    uint32_t last_seq = 0;
+    int have_seq = 0, ended = 0;
+    while (stream_now_us() < until &&
+           (opts.max_frames == 0 || stats.frames < opts.max_frames)) {
+        stream_frame_t frame;
+        int ret = stream_client_next(&client, &frame, CONSUME_FRAME_TIMEOUT_MS);
+        if (ret < 0) {
+            ended = 1;
+            break;
+        }
+        if (ret > 0) {
+            if (opts.ws) {
+                stream_client_credit(&client, 1);
+            }
+            if (have_seq && frame.seq > last_seq + 1) {
+                uint32_t gap = frame.seq - last_seq - 1;
+                stats.dropped += gap;
+                tick_dropped += gap;
+                ++stats.gaps;
+                if (gap > stats.longest_gap) {
+                    stats.longest_gap = gap;
+                }
+            }
+            have_seq = 1;
+            last_seq = frame.seq;
+            consume_record(&stats, &frame);
+        }
+
+        int64_t now = stream_now_us();
+        if (now >= tick) {
+            char label[16];
+            snprintf(label, sizeof(label), "%llds",
+                     (long long)((now - start) / 1000000));
+            consume_line(label, &stats, tick_first, stats.frames,
+                         opts.interval, tick_dropped);
+            tick_first = stats.frames;
+            tick_dropped = 0;
+            tick += opts.interval * 1000000LL;
+        }
+    }
+    double elapsed = (stream_now_us() - start) / 1e6;
+    stream_client_close(&client);
+
+    printf("%s %s for %.1fs%s\n", opts.ws ? "websocket" : "multipart", path,
+           elapsed, ended ? ", ended by the server" : "");
+    consume_line("total", &stats, 0, stats.frames, elapsed, stats.dropped);
+    printf("traffic  %.0f kbps, %u of the frames scaled, down to 1/%d\n",
+           stats.bytes * 8.0 / 1000 / elapsed, stats.scaled, 1 << stats.shift);
+    printf("drops    %u frames in %u gaps, longest %u\n", stats.dropped,
+           stats.gaps, stats.longest_gap);
+    printf("latency ");
+    for (size_t b = 0; b <= CONSUME_BUCKETS; ++b) {
+        if (b < CONSUME_BUCKETS) {
+            printf(" <%dms:%u", consume_buckets[b], stats.buckets[b]);
+        } else {
+            printf(" more:%u", stats.buckets[b]);
+        }
+    }
+    printf("\n");
+    if (opts.metrics) {
+        consume_metrics(&opts);
+    }
+
+    if (server_pid > 0) {
+        stream_server_stop(server_pid);
+    }
+    free(stats.latency_us);
+    return stats.frames > 0 ? 0 : 1;
+}
@@ -0,0 +1,39 @@
+/**
+ * camera.c on the host: CAM_FAKE_SOURCE frames through the capture ring,
+ * the stream workers and the POSIX httpd. Runs until it is signalled.
+ */
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define HOST_TAG "HOST"
+
+// camera.c, test.h would pull in the Bluetooth headers
+esp_err_t camera_init();
+httpd_handle_t start_webserver(void);
+
+static void on_signal(int sig) { _exit(0); }
+
+int main(int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+
+    esp_err_t err = camera_init();
+    if (err != ESP_OK) {
+        ESP_LOGE(HOST_TAG, "camera_init: %s", esp_err_to_name(err));
+        return 1;
+    }
+    if (start_webserver() == NULL) {
+        ESP_LOGE(HOST_TAG, "start_webserver failed");
+        return 1;
+    }
+    for (;;) {
+        pause();
+    }
+}
@@ -0,0 +1,429 @@
+/**
+ * Load generator for the camera streams of the host build. Opens N clients
+ * on /camera (or /camera/ws with -w), counts for -t seconds after a warm up
+ * and reports the frame rate, the capture to received latency percentiles,
+ * sequence gaps and, for a server it spawned (-s) or was pointed at (-c),
+ * the server CPU time per frame and, from /metrics, the socket writes per
+ * frame. -P probes /version while the streams
+ * run, the httpd task must keep answering it. -f, -l and -V turn it into
+ * a pass/fail check.
+ */
+
+#include "stream_client.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define LOADGEN_MAX_CLIENTS 64
+#define LOADGEN_FRAME_TIMEOUT_MS 2000
+#define LOADGEN_START_TIMEOUT_MS 10000
+#define LOADGEN_METRICS_SIZE 32768
+
+typedef struct _loadgen_opts_t {
+    const char *host;
+    int port;
+    int clients;
+    int seconds;
+    int warmup;
+    int ws;
+    const char *query;
+    const char *server;  // spawned with DEMO_HTTPD_PORT set
+    pid_t server_pid;
+    int probe_ms;  // /version period, 0 is off
+    double min_fps;  // per served client, 0 is no check
+    double max_p99_ms;
+    double max_probe_p99_ms;
+} loadgen_opts_t;
+
+typedef struct _loadgen_client_t {
+    const loadgen_opts_t *opts;
+    pthread_t thread;
+    int64_t count_from;
+    int64_t count_until;
+
+    int status;  // of the stream request
+    int served;  // got at least one frame
+    int ended;   // the server ended the stream early
+    uint32_t frames;
+    uint64_t bytes;
+    uint32_t gaps;
+    int64_t *latency_us;
+    size_t latency_cap;
+} loadgen_client_t;
+
+typedef struct _loadgen_probe_t {
+    const loadgen_opts_t *opts;
+    pthread_t thread;
+    int64_t count_from;
+    int64_t count_until;
+
+    uint32_t count;
+    uint32_t errors;
+    int64_t *latency_us;  // request sent to the body in
+    size_t latency_cap;
+} loadgen_probe_t;
+
+static int64_t loadgen_now_us(void) { return stream_now_us(); }
+
+static void loadgen_record(int64_t **latency_us, size_t *cap, uint32_t n,
+                           int64_t value) {
+    if (n >= *cap) {
+        size_t cap2 = *cap ? *cap * 2 : 256;
+        int64_t *p = (int64_t *)realloc(*latency_us, cap2 * sizeof(int64_t));
+        if (p == NULL) {
+            return;
+        }
+        *latency_us = p;
+        *cap = cap2;
+    }
+    (*latency_us)[n] = value;
+}
+
+static void *loadgen_client_main(void *arg) {
+    loadgen_client_t *c = (loadgen_client_t *)arg;
+    const loadgen_opts_t *opts = c->opts;
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s%s", opts->ws ? "/camera/ws" : "/camera",
+             opts->query ? "?" : "", opts->query ? opts->query : "");
+
+    stream_client_t client;
+    int ret = stream_client_open(&client, opts->host, opts->port, path,
+                                 opts->ws, LOADGEN_FRAME_TIMEOUT_MS);
+    c->status = client.status;
+    if (ret != 0) {
+        stream_client_close(&client);
+        return NULL;
+    }
+
+    uint32_t last_seq = 0;
+    while (loadgen_now_us() < c->count_until) {
+        stream_frame_t frame;
+        ret = stream_client_next(&client, &frame, LOADGEN_FRAME_TIMEOUT_MS);
+        if (ret < 0) {
+            c->ended = 1;
+            break;
+        }
+        if (ret == 0) {
+            continue;
+        }
+        c->served = 1;
+        if (opts->ws) {
+            stream_client_credit(&client, 1);
+        }
+        if (loadgen_now_us() >= c->count_from) {
+            if (last_seq && frame.seq > last_seq + 1) {
+                c->gaps += frame.seq - last_seq - 1;
+            }
+            loadgen_record(&c->latency_us, &c->latency_cap, c->frames,
+                           frame.latency_us);
+            ++c->frames;
+            c->bytes += frame.len;
+        }
+        last_seq = frame.seq;
+    }
+    stream_client_close(&client);
+    return NULL;
+}
+
+// a new connection per request, as a browser polling next to the stream
+static void *loadgen_probe_main(void *arg) {
+    loadgen_probe_t *probe = (loadgen_probe_t *)arg;
+    const loadgen_opts_t *opts = probe->opts;
+    int64_t next = probe->count_from;
+
+    while (next < probe->count_until) {
+        int64_t wait = next - loadgen_now_us();
+        if (wait > 0) {
+            usleep(wait);
+        }
+        next += opts->probe_ms * 1000LL;
+
+        char body[16];
+        int64_t begin = loadgen_now_us();
+        int status = stream_http_get(opts->host, opts->port, "/version", body,
+                                     sizeof(body), LOADGEN_FRAME_TIMEOUT_MS);
+        int64_t took = loadgen_now_us() - begin;
+        if (status != 200) {
+            ++probe->errors;
+            continue;
+        }
+        loadgen_record(&probe->latency_us, &probe->latency_cap, probe->count,
+                       took);
+        ++probe->count;
+    }
+    return NULL;
+}
+
+static int loadgen_cmp(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double loadgen_pct_ms(const int64_t *v, size_t n, double q) {
+    return n ? v[(size_t)(q * (n - 1) + 0.5)] / 1000.0 : 0;
+}
+
+// utime + stime of pid in ms, -1 if it can not be read
+static double loadgen_cpu_ms(pid_t pid) {
+    char path[64], stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    size_t n = fread(stat, 1, sizeof(stat) - 1, f);
+    fclose(f);
+    stat[n] = '\0';
+
+    // the name may hold spaces, the fields start after its ')'
+    const char *p = strrchr(stat, ')');
+    unsigned long utime, stime;
+    if (p == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2) {
+        return -1;
+    }
+    return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+// a counter of /metrics, -1 if it can not be read
+static double loadgen_counter(const char *metrics, const char *name) {
+    size_t len = strlen(name);
+    for (const char *line = metrics; line; line = strchr(line, '\n')) {
+        line += *line == '\n';
+        if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+            return atof(line + len + 1);
+        }
+    }
+    return -1;
+}
+
+// socket writes and frames of the streams so far, -1 without /metrics
+static void loadgen_sends(const loadgen_opts_t *opts, double *sends,
+                          double *frames) {
+    static char body[LOADGEN_METRICS_SIZE];
+    *sends = *frames = -1;
+    if (stream_http_get(opts->host, opts->port, "/metrics", body,
+                        sizeof(body), LOADGEN_FRAME_TIMEOUT_MS) != 200) {
+        return;
+    }
+    *sends = loadgen_counter(body, "cam_stream_send_calls_total");
+    *frames = loadgen_counter(body, "cam_frames_sent_total");
+}
+
+static void loadgen_usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-H host] [-p port] [-n clients] [-t seconds]\n"
+            "          [-W warmup] [-w] [-q query] [-s server | -c pid]\n"
+            "          [-P probe_ms] [-f min_fps] [-l max_p99_ms]\n"
+            "          [-V max_probe_p99_ms]\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    loadgen_opts_t opts = {
+        .host = "127.0.0.1",
+        .port = 0,
+        .clients = 3,
+        .seconds = 5,
+        .warmup = 1,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:n:t:W:wq:s:c:P:f:l:V:")) != -1) {
+        switch (opt) {
+        case 'H': opts.host = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 'n': opts.clients = atoi(optarg); break;
+        case 't': opts.seconds = atoi(optarg); break;
+        case 'W': opts.warmup = atoi(optarg); break;
+        case 'w': opts.ws = 1; break;
+        case 'q': opts.query = optarg; break;
+        case 's': opts.server = optarg; break;
+        case 'c': opts.server_pid = atoi(optarg); break;
+        case 'P': opts.probe_ms = atoi(optarg); break;
+        case 'f': opts.min_fps = atof(optarg); break;
+        case 'l': opts.max_p99_ms = atof(optarg); break;
+        case 'V': opts.max_probe_p99_ms = atof(optarg); break;
+        default: loadgen_usage(argv[0]); return 2;
+        }
+    }
+    if (opts.clients < 1 || opts.clients > LOADGEN_MAX_CLIENTS ||
+        opts.seconds < 1 || opts.warmup < 0 || opts.probe_ms < 0 ||
+        (opts.server == NULL && opts.port == 0)) {
+        loadgen_usage(argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (opts.server) {
+        opts.server_pid = stream_server_spawn(opts.server, opts.host,
+                                              &opts.port,
+                                              LOADGEN_START_TIMEOUT_MS);
+        if (opts.server_pid < 0) {
+            return 1;
+        }
+    }
+
+    static loadgen_client_t clients[LOADGEN_MAX_CLIENTS];
+    int64_t start = loadgen_now_us();
+    int64_t count_from = start + opts.warmup * 1000000LL;
+    int64_t count_until = count_from + opts.seconds * 1000000LL;
+    for (int i = 0; i < opts.clients; ++i) {
+        clients[i].opts = &opts;
+        clients[i].count_from = count_from;
+        clients[i].count_until = count_until;
+        pthread_create(&clients[i].thread, NULL, loadgen_client_main,
+                       &clients[i]);
+    }
+    loadgen_probe_t probe = {
+        .opts = &opts,
+        .count_from = count_from,
+        .count_until = count_until,
+    };
+    if (opts.probe_ms) {
+        pthread_create(&probe.thread, NULL, loadgen_probe_main, &probe);
+    }
+
+    double cpu_begin = -1, cpu_end = -1;
+    double sends_begin, sends_end, frames_begin, frames_end;
+    int64_t wait = count_from - loadgen_now_us();
+    if (wait > 0) {
+        usleep(wait);
+    }
+    if (opts.server_pid > 0) {
+        cpu_begin = loadgen_cpu_ms(opts.server_pid);
+    }
+    loadgen_sends(&opts, &sends_begin, &frames_begin);
+    wait = count_until - loadgen_now_us();
+    if (wait > 0) {
+        usleep(wait);
+    }
+    if (opts.server_pid > 0) {
+        cpu_end = loadgen_cpu_ms(opts.server_pid);
+    }
+    loadgen_sends(&opts, &sends_end, &frames_end);
+    for (int i = 0; i < opts.clients; ++i) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    if (opts.probe_ms) {
+        pthread_join(probe.thread, NULL);
+    }
+    if (opts.server) {
+        stream_server_stop(opts.server_pid);
+    }
+
+    // merge the latencies of every client
+    size_t total = 0;
+    int served = 0;
+    uint64_t bytes = 0;
+    uint32_t gaps = 0;
+    double fps_min = 0, fps_max = 0;
+    for (int i = 0; i < opts.clients; ++i) {
+        loadgen_client_t *c = &clients[i];
+        total += c->frames;
+        if (!c->served) {
+            continue;
+        }
+        double fps = c->frames / (double)opts.seconds;
+        fps_min = served == 0 || fps < fps_min ? fps : fps_min;
+        fps_max = fps > fps_max ? fps : fps_max;
+        bytes += c->bytes;
+        gaps += c->gaps;
+        ++served;
+    }
+    int64_t *all = (int64_t *)malloc((total ? total : 1) * sizeof(int64_t));
+    size_t n = 0;
+    for (int i = 0; i < opts.clients && all; ++i) {
+        if (clients[i].frames == 0) {
+            continue;
+        }
+        memcpy(all + n, clients[i].latency_us,
+               clients[i].frames * sizeof(int64_t));
+        n += clients[i].frames;
+    }
+    qsort(all, n, sizeof(int64_t), loadgen_cmp);
+    double p50 = loadgen_pct_ms(all, n, 0.50);
+    double p99 = loadgen_pct_ms(all, n, 0.99);
+
+    printf("%s, %d clients, %d served, %ds after %ds warm up\n",
+           opts.ws ? "websocket" : "multipart", opts.clients, served,
+           opts.seconds, opts.warmup);
+    for (int i = 0; i < opts.clients; ++i) {
+        loadgen_client_t *c = &clients[i];
+        printf("  client %d: status %d, %u frames, %.1f fps, %u gaps%s\n", i,
+               c->status, c->frames, c->frames / (double)opts.seconds,
+               c->gaps, c->ended ? ", ended by the server" : "");
+    }
+    printf("fps      %.1f total, %.1f-%.1f per client\n",
+           total / (double)opts.seconds, fps_min, fps_max);
+    printf("latency  p50 %.2fms p99 %.2fms max %.2fms\n", p50, p99,
+           n ? all[n - 1] / 1000.0 : 0.0);
+    printf("traffic  %.0f kbps, %u seq gaps\n",
+           bytes * 8.0 / 1000 / opts.seconds, gaps);
+    double cpu_per_frame = -1;
+    if (cpu_begin >= 0 && cpu_end >= 0) {
+        double cpu = cpu_end - cpu_begin;
+        cpu_per_frame = total ? cpu / total : 0;
+        printf("cpu      %.1f%% of a core, %.3fms per frame\n",
+               cpu / 10.0 / opts.seconds, cpu_per_frame);
+    }
+    double sends_per_frame = -1;
+    if (sends_begin >= 0 && frames_begin >= 0 && sends_end >= 0 &&
+        frames_end > frames_begin) {
+        sends_per_frame =
+            (sends_end - sends_begin) / (frames_end - frames_begin);
+        printf("sends    %.2f socket writes per frame\n", sends_per_frame);
+    }
+    double probe_p50 = 0, probe_p99 = 0;
+    if (opts.probe_ms) {
+        qsort(probe.latency_us, probe.count, sizeof(int64_t), loadgen_cmp);
+        probe_p50 = loadgen_pct_ms(probe.latency_us, probe.count, 0.50);
+        probe_p99 = loadgen_pct_ms(probe.latency_us, probe.count, 0.99);
+        printf("/version p50 %.2fms p99 %.2fms max %.2fms, %u ok %u failed\n",
+               probe_p50, probe_p99,
+               probe.count ? probe.latency_us[probe.count - 1] / 1000.0 : 0.0,
+               probe.count, probe.errors);
+    }
+    // one line for scripts
+    printf("RESULT mode=%s clients=%d served=%d fps=%.2f p50_ms=%.2f "
+           "p99_ms=%.2f kbps=%.0f cpu_ms_per_frame=%.3f version_p99_ms=%.2f "
+           "sends_per_frame=%.2f\n",
+           opts.ws ? "ws" : "multipart", opts.clients, served,
+           total / (double)opts.seconds, p50, p99,
+           bytes * 8.0 / 1000 / opts.seconds, cpu_per_frame, probe_p99,
+           sends_per_frame);
+    free(all);
+
+    int ok = served > 0;
+    if (opts.min_fps > 0 && served > 0 && fps_min < opts.min_fps) {
+        printf("FAIL: %.1f fps below %.1f\n", fps_min, opts.min_fps);
+        ok = 0;
+    }
+    if (opts.max_p99_ms > 0 && p99 > opts.max_p99_ms) {
+        printf("FAIL: p99 %.2fms above %.2fms\n", p99, opts.max_p99_ms);
+        ok = 0;
+    }
+    if (opts.probe_ms && (probe.errors || probe.count == 0)) {
+        printf("FAIL: %u /version requests failed\n", probe.errors);
+        ok = 0;
+    }
+    if (opts.max_probe_p99_ms > 0 && probe_p99 > opts.max_probe_p99_ms) {
+        printf("FAIL: /version p99 %.2fms above %.2fms\n", probe_p99,
+               opts.max_probe_p99_ms);
+        ok = 0;
+    }
+    if (served == 0) {
+        printf("FAIL: no client got a frame\n");
+    }
+    for (int i = 0; i < opts.clients; ++i) {
+        free(clients[i].latency_us);
+    }
+    free(probe.latency_us);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,543 @@
+/**
+ * Loopback receiver for /rtp. Binds a UDP port, asks the server to send
+ * there, reassembles the RFC 2435 fragments into JPEGs (headers rebuilt
+ * from the RTP/JPEG fields as in the RFC's appendix) and decodes each one.
+ * Reports frame rate, capture to last packet latency from the RTP
+ * timestamp, lost packets and frames, and the sender's /rtp stats. The
+ * 90kHz timestamp comes from esp_timer_get_time, CLOCK_MONOTONIC in the
+ * host build, so the server has to run on this host.
+ */
+
+#include "esp_jpg_decode.h"
+#include "stream_client.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define RECV_START_TIMEOUT_MS 10000
+#define RECV_HTTP_TIMEOUT_MS 2000
+#define RECV_MAX_FRAME (512 * 1024)
+#define RECV_MAX_HEADERS 1024
+
+#define RTP_HEADER_SIZE 12
+#define RTP_JPEG_HEADER_SIZE 8
+#define RTP_PAYLOAD_JPEG 26
+#define RTP_CLOCK_PER_MS 90
+
+typedef struct _recv_opts_t {
+    const char *host;
+    int port;  // of the HTTP server
+    int udp_port;
+    int seconds;
+    int warmup;
+    const char *server;
+    const char *out;  // the last whole frame is written here
+    double min_fps;
+    double max_p99_ms;
+} recv_opts_t;
+
+typedef struct _recv_frame_t {
+    uint32_t timestamp;
+    int active;
+    int broken;  // a fragment went missing, wait for the next frame
+    uint8_t type;
+    uint8_t q;
+    uint16_t width;
+    uint16_t height;
+    uint16_t restart_interval;
+    uint8_t qt[128];
+    size_t qt_len;
+    uint8_t *scan;
+    size_t len;
+} recv_frame_t;
+
+typedef struct _recv_stats_t {
+    uint32_t packets;
+    uint64_t bytes;
+    uint32_t lost_packets;
+    uint32_t late_packets;  // reordered or duplicated
+    uint32_t frames;
+    uint32_t lost_frames;
+    uint32_t bad_frames;  // whole but the decoder refused them
+    int64_t *latency_us;
+    size_t latency_cap;
+} recv_stats_t;
+
+// RFC 2435 appendix B, the tables of JPEG Annex K.3
+static const uint8_t lum_dc_codelens[16] = {0, 1, 5, 1, 1, 1, 1, 1,
+                                            1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t lum_dc_symbols[12] = {0, 1, 2, 3, 4,  5,
+                                           6, 7, 8, 9, 10, 11};
+static const uint8_t lum_ac_codelens[16] = {0, 2, 1, 3, 3, 2, 4, 3,
+                                            5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t lum_ac_symbols[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+    0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+    0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+static const uint8_t chm_dc_codelens[16] = {0, 3, 1, 1, 1, 1, 1, 1,
+                                            1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t chm_dc_symbols[12] = {0, 1, 2, 3, 4,  5,
+                                           6, 7, 8, 9, 10, 11};
+static const uint8_t chm_ac_codelens[16] = {0, 2, 1, 2, 4, 4, 3, 4,
+                                            7, 5, 4, 4, 0, 1, 2, 0x77};
+static const uint8_t chm_ac_symbols[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+    0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+    0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+    0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+    0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+static inline uint8_t *recv_put16(uint8_t *p, uint16_t v) {
+    *p++ = v >> 8;
+    *p++ = v;
+    return p;
+}
+
+static uint8_t *recv_put_huffman(uint8_t *p, const uint8_t *codelens,
+                                 const uint8_t *symbols, int nsymbols,
+                                 int table, int cls) {
+    *p++ = 0xff;
+    *p++ = 0xc4;  // DHT
+    p = recv_put16(p, 3 + 16 + nsymbols);
+    *p++ = (cls << 4) | table;
+    memcpy(p, codelens, 16);
+    p += 16;
+    memcpy(p, symbols, nsymbols);
+    return p + nsymbols;
+}
+
+// the headers the sender stripped, RFC 2435 appendix A, returns the length
+static size_t recv_make_headers(const recv_frame_t *f, uint8_t *p) {
+    uint8_t *start = p;
+    *p++ = 0xff;
+    *p++ = 0xd8;  // SOI
+
+    *p++ = 0xff;
+    *p++ = 0xdb;  // DQT, luma then chroma
+    p = recv_put16(p, 2 + 2 * 65);
+    *p++ = 0;
+    memcpy(p, f->qt, 64);
+    p += 64;
+    *p++ = 1;
+    memcpy(p, f->qt + 64, 64);
+    p += 64;
+
+    if (f->restart_interval) {
+        *p++ = 0xff;
+        *p++ = 0xdd;  // DRI
+        p = recv_put16(p, 4);
+        p = recv_put16(p, f->restart_interval);
+    }
+
+    *p++ = 0xff;
+    *p++ = 0xc0;  // SOF0
+    p = recv_put16(p, 17);
+    *p++ = 8;
+    p = recv_put16(p, f->height);
+    p = recv_put16(p, f->width);
+    *p++ = 3;
+    *p++ = 0;
+    *p++ = (f->type & 0x3f) == 0 ? 0x21 : 0x22;  // 4:2:2 or 4:2:0
+    *p++ = 0;
+    *p++ = 1;
+    *p++ = 0x11;
+    *p++ = 1;
+    *p++ = 2;
+    *p++ = 0x11;
+    *p++ = 1;
+
+    p = recv_put_huffman(p, lum_dc_codelens, lum_dc_symbols,
+                         sizeof(lum_dc_symbols), 0, 0);
+    p = recv_put_huffman(p, lum_ac_codelens, lum_ac_symbols,
+                         sizeof(lum_ac_symbols), 0, 1);
+    p = recv_put_huffman(p, chm_dc_codelens, chm_dc_symbols,
+                         sizeof(chm_dc_symbols), 1, 0);
+    p = recv_put_huffman(p, chm_ac_codelens, chm_ac_symbols,
+                         sizeof(chm_ac_symbols), 1, 1);
+
+    *p++ = 0xff;
+    *p++ = 0xda;  // SOS
+    p = recv_put16(p, 12);
+    *p++ = 3;
+    *p++ = 0;
+    *p++ = 0x00;
+    *p++ = 1;
+    *p++ = 0x11;
+    *p++ = 2;
+    *p++ = 0x11;
+    *p++ = 0;
+    *p++ = 63;
+    *p++ = 0;
+    return p - start;
+}
+
+typedef struct _recv_jpg_t {
+    const uint8_t *buf;
+    size_t len;
+    uint16_t width;
+    uint16_t height;
+} recv_jpg_t;
+
+static size_t recv_jpg_read(void *arg, size_t index, uint8_t *buf,
+                            size_t len) {
+    recv_jpg_t *jpg = (recv_jpg_t *)arg;
+    if (index + len > jpg->len) {
+        len = jpg->len - index;
+    }
+    if (buf) {
+        memcpy(buf, jpg->buf + index, len);
+    }
+    return len;
+}
+
+static bool recv_jpg_write(void *arg, uint16_t x, uint16_t y, uint16_t w,
+                           uint16_t h, uint8_t *data) {
+    recv_jpg_t *jpg = (recv_jpg_t *)arg;
+    if (!data && x == 0 && y == 0) {
+        jpg->width = w;
+        jpg->height = h;
+    }
+    return true;
+}
+
+// whole frame, rebuild the JPEG and make sure it decodes to its size
+static int recv_finish(const recv_opts_t *opts, recv_frame_t *f,
+                       uint8_t *jpg_buf) {
+    size_t n = recv_make_headers(f, jpg_buf);
+    memcpy(jpg_buf + n, f->scan, f->len);
+    n += f->len;
+    jpg_buf[n++] = 0xff;
+    jpg_buf[n++] = 0xd9;  // EOI
+
+    recv_jpg_t jpg = {.buf = jpg_buf, .len = n};
+    if (esp_jpg_decode(n, JPG_SCALE_8X, recv_jpg_read, recv_jpg_write,
+                       &jpg) != ESP_OK ||
+        jpg.width != (f->width + 7) / 8 || jpg.height != (f->height + 7) / 8) {
+        return -1;
+    }
+
+    if (opts->out) {
+        FILE *out = fopen(opts->out, "wb");
+        if (out) {
+            fwrite(jpg_buf, 1, n, out);
+            fclose(out);
+        }
+    }
+    return 0;
+}
+
+static void recv_record(recv_stats_t *stats, int64_t latency_us) {
+    if (stats->frames >= stats->latency_cap) {
+        size_t cap = stats->latency_cap ? stats->latency_cap * 2 : 256;
+        int64_t *p =
+            (int64_t *)realloc(stats->latency_us, cap * sizeof(int64_t));
+        if (p == NULL) {
+            return;
+        }
+        stats->latency_us = p;
+        stats->latency_cap = cap;
+    }
+    stats->latency_us[stats->frames] = latency_us;
+}
+
+static int recv_cmp(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double recv_pct_ms(const int64_t *v, size_t n, double pct) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(pct * (n - 1) + 0.5);
+    return v[i] / 1000.0;
+}
+
+static int recv_bind(int *port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(*port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    int rcvbuf = 1 << 20;  // a frame's worth of packets arrives at once
+    if (fd < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) != 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        perror("udp socket");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static void recv_usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-H host] [-p port] [-u udp_port] [-t seconds]\n"
+            "          [-W warmup] [-s server] [-o last.jpg] [-f min_fps]\n"
+            "          [-l max_p99_ms]\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    recv_opts_t opts = {
+        .host = "127.0.0.1",
+        .seconds = 5,
+        .warmup = 1,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:u:t:W:s:o:f:l:")) != -1) {
+        switch (opt) {
+        case 'H': opts.host = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 'u': opts.udp_port = atoi(optarg); break;
+        case 't': opts.seconds = atoi(optarg); break;
+        case 'W': opts.warmup = atoi(optarg); break;
+        case 's': opts.server = optarg; break;
+        case 'o': opts.out = optarg; break;
+        case 'f': opts.min_fps = atof(optarg); break;
+        case 'l': opts.max_p99_ms = atof(optarg); break;
+        default: recv_usage(argv[0]); return 2;
+        }
+    }
+    if (opts.seconds < 1 || opts.warmup < 0 ||
+        (opts.server == NULL && opts.port == 0)) {
+        recv_usage(argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int sock = recv_bind(&opts.udp_port);
+    if (sock < 0) {
+        return 1;
+    }
+    pid_t server_pid = 0;
+    if (opts.server) {
+        server_pid = stream_server_spawn(opts.server, opts.host, &opts.port,
+                                         RECV_START_TIMEOUT_MS);
+        if (server_pid < 0) {
+            close(sock);
+            return 1;
+        }
+    }
+
+    char path[64], body[512];
+    snprintf(path, sizeof(path), "/rtp?host=127.0.0.1&port=%d",
+             opts.udp_port);
+    int status = stream_http_get(opts.host, opts.port, path, body,
+                                 sizeof(body), RECV_HTTP_TIMEOUT_MS);
+    if (status != 200) {
+        fprintf(stderr, "GET %s: %d %s\n", path, status, body);
+        if (server_pid > 0) {
+            stream_server_stop(server_pid);
+        }
+        close(sock);
+        return 1;
+    }
+
+    recv_frame_t frame = {0};
+    recv_stats_t stats = {0};
+    frame.scan = (uint8_t *)malloc(RECV_MAX_FRAME);
+    uint8_t *jpg_buf = (uint8_t *)malloc(RECV_MAX_FRAME + RECV_MAX_HEADERS);
+    uint8_t packet[2048];
+    int have_seq = 0;
+    uint16_t next_seq = 0;
+
+    int64_t count_from = stream_now_us() + opts.warmup * 1000000LL;
+    int64_t count_until = count_from + opts.seconds * 1000000LL;
+    while (frame.scan && jpg_buf) {
+        int64_t now = stream_now_us();
+        if (now >= count_until) {
+            break;
+        }
+        struct pollfd pfd = {.fd = sock, .events = POLLIN};
+        int left = (count_until - now) / 1000 + 1;
+        if (poll(&pfd, 1, left < 100 ? left : 100) <= 0) {
+            continue;
+        }
+        ssize_t n = recv(sock, packet, sizeof(packet), 0);
+        now = stream_now_us();
+        int counting = now >= count_from;
+        if (n < RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE ||
+            (packet[0] >> 6) != 2 || (packet[1] & 0x7f) != RTP_PAYLOAD_JPEG) {
+            continue;
+        }
+
+        int marker = packet[1] >> 7;
+        uint16_t seq = (packet[2] << 8) | packet[3];
+        uint32_t timestamp = ((uint32_t)packet[4] << 24) | (packet[5] << 16) |
+                             (packet[6] << 8) | packet[7];
+        if (counting) {
+            ++stats.packets;
+            stats.bytes += n;
+        }
+        if (have_seq) {
+            uint16_t ahead = seq - next_seq;
+            if (ahead >= 0x8000) {
+                stats.late_packets += counting;
+                continue;
+            }
+            if (counting) {
+                stats.lost_packets += ahead;
+            }
+        }
+        have_seq = 1;
+        next_seq = seq + 1;
+
+        const uint8_t *p = packet + RTP_HEADER_SIZE;
+        const uint8_t *end = packet + n;
+        uint32_t offset = (p[1] << 16) | (p[2] << 8) | p[3];
+        uint8_t type = p[4];
+        uint8_t q = p[5];
+        uint16_t width = p[6] * 8, height = p[7] * 8;
+        p += RTP_JPEG_HEADER_SIZE;
+
+        if (!frame.active || frame.timestamp != timestamp) {
+            if (frame.active && counting) {
+                ++stats.lost_frames;  // its last packet never came
+            }
+            frame.active = 1;
+            frame.broken = offset != 0;
+            frame.timestamp = timestamp;
+            frame.len = 0;
+            frame.qt_len = 0;
+            frame.restart_interval = 0;
+        }
+        frame.type = type;
+        frame.q = q;
+        frame.width = width;
+        frame.height = height;
+        if (type >= 64) {  // restart marker header
+            if (end - p < 4) {
+                frame.broken = 1;
+                continue;
+            }
+            frame.restart_interval = (p[0] << 8) | p[1];
+            p += 4;
+        }
+        if (offset == 0 && q >= 128) {  // in-band tables
+            if (end - p < 4) {
+                frame.broken = 1;
+                continue;
+            }
+            size_t qt_len = (p[2] << 8) | p[3];
+            p += 4;
+            if (qt_len != sizeof(frame.qt) || end - p < (ptrdiff_t)qt_len) {
+                frame.broken = 1;  // 16 bit or a single table
+                continue;
+            }
+            memcpy(frame.qt, p, qt_len);
+            frame.qt_len = qt_len;
+            p += qt_len;
+        }
+        if (offset != frame.len || frame.len + (end - p) > RECV_MAX_FRAME) {
+            frame.broken = 1;
+        }
+        if (!frame.broken) {
+            memcpy(frame.scan + frame.len, p, end - p);
+            frame.len += end - p;
+        }
+        if (!marker) {
+            continue;
+        }
+
+        frame.active = 0;
+        if (!counting) {
+            continue;
+        }
+        if (frame.broken || frame.qt_len == 0) {
+            ++stats.lost_frames;
+            continue;
+        }
+        if (recv_finish(&opts, &frame, jpg_buf) != 0) {
+            ++stats.bad_frames;
+            continue;
+        }
+        uint32_t now_ts = (uint64_t)now * RTP_CLOCK_PER_MS / 1000;
+        int32_t ticks = (int32_t)(now_ts - timestamp);
+        recv_record(&stats, (int64_t)ticks * 1000 / RTP_CLOCK_PER_MS);
+        ++stats.frames;
+    }
+
+    status = stream_http_get(opts.host, opts.port, "/rtp?stop=1", body,
+                             sizeof(body), RECV_HTTP_TIMEOUT_MS);
+    if (server_pid > 0) {
+        stream_server_stop(server_pid);
+    }
+    close(sock);
+
+    size_t n = stats.frames < stats.latency_cap ? stats.frames
+                                                 : stats.latency_cap;
+    qsort(stats.latency_us, n, sizeof(int64_t), recv_cmp);
+    double fps = stats.frames / (double)opts.seconds;
+    double p50 = recv_pct_ms(stats.latency_us, n, 0.50);
+    double p99 = recv_pct_ms(stats.latency_us, n, 0.99);
+    printf("rtp to udp %d, %ds after %ds warm up\n", opts.udp_port,
+           opts.seconds, opts.warmup);
+    printf("frames   %u whole, %u lost, %u not decodable, %.1f fps\n",
+           stats.frames, stats.lost_frames, stats.bad_frames, fps);
+    printf("packets  %u, %u lost, %u late, %.0f kbps\n", stats.packets,
+           stats.lost_packets, stats.late_packets,
+           stats.bytes * 8.0 / 1000 / opts.seconds);
+    printf("latency  p50 %.2fms p99 %.2fms max %.2fms\n", p50, p99,
+           n ? stats.latency_us[n - 1] / 1000.0 : 0.0);
+    if (status == 200) {
+        printf("sender   %s\n", body);
+    }
+    printf("RESULT mode=rtp frames=%u lost_frames=%u bad_frames=%u "
+           "lost_packets=%u fps=%.2f p50_ms=%.2f p99_ms=%.2f\n",
+           stats.frames, stats.lost_frames, stats.bad_frames,
+           stats.lost_packets, fps, p50, p99);
+
+    int ok = stats.frames > 0 && stats.bad_frames == 0;
+    if (stats.frames == 0) {
+        printf("FAIL: no whole frame received\n");
+    }
+    if (stats.bad_frames) {
+        printf("FAIL: %u frames did not decode\n", stats.bad_frames);
+    }
+    if (opts.min_fps > 0 && fps < opts.min_fps) {
+        printf("FAIL: %.1f fps below %.1f\n", fps, opts.min_fps);
+        ok = 0;
+    }
+    if (opts.max_p99_ms > 0 && p99 > opts.max_p99_ms) {
+        printf("FAIL: p99 %.2fms above %.2fms\n", p99, opts.max_p99_ms);
+        ok = 0;
+    }
+    free(stats.latency_us);
+    free(jpg_buf);
+    free(frame.scan);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,532 @@
+#include "stream_client.h"
+
+#include "cam_stream.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STREAM_READ_CHUNK 16384
+#define STREAM_MAX_HEAD 4096
+
+int64_t stream_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+int64_t stream_wall_us(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+int stream_connect(const char *host, int port, int timeout_ms) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        struct hostent *he = gethostbyname(host);
+        if (he == NULL || he->h_addrtype != AF_INET) {
+            return -1;
+        }
+        memcpy(&addr.sin_addr, he->h_addr_list[0], sizeof(addr.sin_addr));
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret != 0 && errno == EINPROGRESS) {
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (poll(&pfd, 1, timeout_ms) == 1 &&
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+            err == 0) {
+            ret = 0;
+        }
+    }
+    if (ret != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, flags);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int stream_send_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int stream_reserve(uint8_t **buf, size_t *cap, size_t need) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t cap2 = *cap ? *cap : STREAM_READ_CHUNK;
+    while (cap2 < need) {
+        cap2 *= 2;
+    }
+    uint8_t *p = (uint8_t *)realloc(*buf, cap2);
+    if (p == NULL) {
+        return -1;
+    }
+    *buf = p;
+    *cap = cap2;
+    return 0;
+}
+
+// appends what the socket has, 1 on data, 0 on timeout, -1 on close
+static int stream_fill(stream_client_t *client, int timeout_ms) {
+    struct pollfd pfd = {.fd = client->fd, .events = POLLIN};
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret == 0) {
+        return 0;
+    }
+    if (ret < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (stream_reserve(&client->buf, &client->cap,
+                       client->len + STREAM_READ_CHUNK) != 0) {
+        return -1;
+    }
+    ssize_t n = recv(client->fd, client->buf + client->len, STREAM_READ_CHUNK,
+                     0);
+    if (n <= 0) {
+        return n < 0 && errno == EINTR ? 0 : -1;
+    }
+    client->len += n;
+    return 1;
+}
+
+static void stream_consume(stream_client_t *client, size_t n) {
+    memmove(client->buf, client->buf + n, client->len - n);
+    client->len -= n;
+}
+
+// length of the head up to and with the blank line, 0 if not all in
+static size_t stream_head_len(const stream_client_t *client) {
+    for (size_t i = 3; i < client->len; ++i) {
+        if (memcmp(client->buf + i - 3, "\r\n\r\n", 4) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// the value of a header field in a NUL terminated head, or NULL
+static const char *stream_head_field(const char *head, const char *field) {
+    size_t len = strlen(field);
+    for (const char *line = strstr(head, "\r\n"); line;
+         line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, field, len) == 0 && line[2 + len] == ':') {
+            const char *v = line + 3 + len;
+            while (*v == ' ') {
+                ++v;
+            }
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// reads the next head into a NUL terminated copy, returns its length, 0
+// on timeout or -1 when the stream ended
+static int stream_read_head(stream_client_t *client, char *head, size_t size,
+                            int timeout_ms) {
+    int64_t deadline = stream_now_us() + timeout_ms * 1000LL;
+    size_t len;
+    while ((len = stream_head_len(client)) == 0) {
+        if (client->len > STREAM_MAX_HEAD) {
+            return -1;
+        }
+        int left = (deadline - stream_now_us()) / 1000;
+        if (left <= 0) {
+            return 0;
+        }
+        if (stream_fill(client, left) < 0) {
+            return -1;
+        }
+    }
+    if (len >= size) {
+        return -1;
+    }
+    memcpy(head, client->buf, len);
+    head[len] = '\0';
+    stream_consume(client, len);
+    return len;
+}
+
+int stream_client_open(stream_client_t *client, const char *host, int port,
+                       const char *path, int ws, int timeout_ms) {
+    memset(client, 0, sizeof(stream_client_t));
+    client->ws = ws;
+    client->fd = stream_connect(host, port, timeout_ms);
+    if (client->fd < 0) {
+        return -1;
+    }
+
+    char req[512];
+    int len;
+    if (ws) {
+        len = snprintf(req, sizeof(req),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                       "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                       "Sec-WebSocket-Version: 13\r\n\r\n",
+                       path, host);
+    } else {
+        len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                       path, host);
+    }
+    char head[STREAM_MAX_HEAD + 1];
+    if (stream_send_all(client->fd, req, len) != 0 ||
+        stream_read_head(client, head, sizeof(head), timeout_ms) <= 0 ||
+        sscanf(head, "HTTP/1.1 %d", &client->status) != 1) {
+        return -1;
+    }
+    const char *length = stream_head_field(head, "Content-Length");
+    client->content_len = length ? strtol(length, NULL, 10) : -1;
+    const char *coding = stream_head_field(head, "Transfer-Encoding");
+    client->chunked = coding && strncasecmp(coding, "chunked", 7) == 0;
+    return client->status == (ws ? 101 : 200) ? 0 : -1;
+}
+
+// one multipart part, the response head is already read
+static int stream_next_part(stream_client_t *client, stream_frame_t *frame,
+                            int timeout_ms) {
+    char head[STREAM_MAX_HEAD + 1];
+    int64_t begin = stream_now_us();
+    int ret = stream_read_head(client, head, sizeof(head), timeout_ms);
+    if (ret <= 0) {
+        return ret;
+    }
+    const char *length = stream_head_field(head, "Content-Length");
+    const char *stamp = stream_head_field(head, "X-Timestamp");
+    const char *seq = stream_head_field(head, "X-Frame-Seq");
+    const char *scale = stream_head_field(head, "X-Scale");
+    if (strstr(head, "--" PART_BOUNDARY) == NULL || length == NULL) {
+        return -1;
+    }
+
+    size_t len = strtoul(length, NULL, 10);
+    while (client->len < len) {
+        int left = timeout_ms - (stream_now_us() - begin) / 1000;
+        if (left <= 0 || stream_fill(client, left) < 0) {
+            return -1;
+        }
+    }
+    stream_consume(client, len);
+
+    memset(frame, 0, sizeof(stream_frame_t));
+    frame->len = len;
+    frame->seq = seq ? strtoul(seq, NULL, 10) : 0;
+    unsigned long den = scale && strncmp(scale, "1/", 2) == 0
+                            ? strtoul(scale + 2, NULL, 10)
+                            : 1;
+    while (den > 1) {
+        ++frame->shift;
+        den >>= 1;
+    }
+    if (stamp) {
+        long sec = 0, usec = 0;
+        sscanf(stamp, "%ld.%ld", &sec, &usec);
+        frame->latency_us = stream_wall_us() - (sec * 1000000LL + usec);
+    }
+    return 1;
+}
+
+static uint64_t stream_get_be(const uint8_t *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+static int stream_ws_send(stream_client_t *client, int opcode,
+                          const uint8_t *payload, size_t len) {
+    // clients mask every frame, a zero mask leaves the payload as it is
+    uint8_t frame[2 + 4 + 125];
+    if (len > 125) {
+        return -1;
+    }
+    frame[0] = 0x80 | opcode;
+    frame[1] = 0x80 | len;
+    memset(frame + 2, 0, 4);
+    memcpy(frame + 6, payload, len);
+    return stream_send_all(client->fd, frame, 6 + len);
+}
+
+// one WebSocket frame off the buffer, 1 when one was taken
+static int stream_ws_frame(stream_client_t *client, int *opcode, int *fin,
+                           const uint8_t **payload, size_t *len) {
+    if (client->len < 2) {
+        return 0;
+    }
+    size_t hlen = 2;
+    uint64_t plen = client->buf[1] & 0x7f;
+    if (plen == 126) {
+        hlen = 4;
+        if (client->len < hlen) return 0;
+        plen = stream_get_be(client->buf + 2, 2);
+    } else if (plen == 127) {
+        hlen = 10;
+        if (client->len < hlen) return 0;
+        plen = stream_get_be(client->buf + 2, 8);
+    }
+    if (client->len < hlen + plen) {
+        return 0;
+    }
+    *opcode = client->buf[0] & 0x0f;
+    *fin = client->buf[0] & 0x80 ? 1 : 0;
+    *payload = client->buf + hlen;
+    *len = plen;
+    return 1;
+}
+
+static int stream_next_message(stream_client_t *client, stream_frame_t *frame,
+                               int timeout_ms) {
+    int64_t begin = stream_now_us();
+    for (;;) {
+        int opcode, fin;
+        const uint8_t *payload;
+        size_t len;
+        while (!stream_ws_frame(client, &opcode, &fin, &payload, &len)) {
+            int left = timeout_ms - (stream_now_us() - begin) / 1000;
+            if (left <= 0) {
+                return 0;
+            }
+            if (stream_fill(client, left) < 0) {
+                return -1;
+            }
+        }
+        size_t used = payload - client->buf + len;
+
+        if (opcode == 0x8) {
+            return -1;  // close, 1013 when all workers were busy
+        }
+        if (opcode == 0x9) {
+            stream_ws_send(client, 0xa, payload, len < 125 ? len : 125);
+        } else if (opcode == 0x1 || opcode == 0x2 || opcode == 0x0) {
+            if (opcode != 0x0) {
+                client->msg_len = 0;
+            }
+            if (stream_reserve(&client->msg, &client->msg_cap,
+                               client->msg_len + len) != 0) {
+                return -1;
+            }
+            memcpy(client->msg + client->msg_len, payload, len);
+            client->msg_len += len;
+        }
+        stream_consume(client, used);
+
+        if (fin && (opcode == 0x0 || opcode == 0x2)) {
+            const uint8_t *m = client->msg;
+            if (client->msg_len < CAM_WS_HEADER_SIZE ||
+                m[0] != CAM_WS_VERSION) {
+                return -1;
+            }
+            memset(frame, 0, sizeof(stream_frame_t));
+            frame->scaled = m[1] & CAM_WS_FLAG_SCALED ? 1 : 0;
+            frame->shift = m[2];
+            frame->seq = stream_get_be(m + 4, 4);
+            frame->len = stream_get_be(m + 16, 4);
+            frame->latency_us =
+                stream_now_us() - (int64_t)stream_get_be(m + 8, 8);
+            if (frame->len != client->msg_len - CAM_WS_HEADER_SIZE) {
+                return -1;
+            }
+            return 1;
+        }
+    }
+}
+
+int stream_client_next(stream_client_t *client, stream_frame_t *frame,
+                       int timeout_ms) {
+    if (client->fd < 0) {
+        return -1;
+    }
+    return client->ws ? stream_next_message(client, frame, timeout_ms)
+                      : stream_next_part(client, frame, timeout_ms);
+}
+
+int stream_client_credit(stream_client_t *client, uint32_t credits) {
+    uint8_t be[4] = {credits >> 24, credits >> 16, credits >> 8, credits};
+    return stream_ws_send(client, 0x2, be, sizeof(be));
+}
+
+void stream_client_close(stream_client_t *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+    }
+    free(client->buf);
+    free(client->msg);
+    memset(client, 0, sizeof(stream_client_t));
+    client->fd = -1;
+}
+
+// waits until n bytes are buffered
+static int stream_fill_to(stream_client_t *client, size_t n,
+                          int64_t deadline) {
+    while (client->len < n) {
+        int left = (deadline - stream_now_us()) / 1000;
+        if (left <= 0 || stream_fill(client, left) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// the body up to the zero length chunk, cut to fit size
+static int stream_read_chunked(stream_client_t *client, char *body,
+                               size_t size, int64_t deadline) {
+    size_t out = 0;
+    while (1) {
+        size_t line = 0;  // the size in hex up to its CRLF
+        while (1) {
+            if (line + 1 < client->len) {
+                if (memcmp(client->buf + line, "\r\n", 2) == 0) {
+                    break;
+                }
+                ++line;
+            } else if (line > 16 ||
+                       stream_fill_to(client, line + 2, deadline) != 0) {
+                return -1;
+            }
+        }
+        size_t n = strtoul((const char *)client->buf, NULL, 16);
+        stream_consume(client, line + 2);
+        if (stream_fill_to(client, n + 2, deadline) != 0) {
+            return -1;
+        }
+        size_t copy = out + n < size ? n : size - out;
+        memcpy(body + out, client->buf, copy);
+        out += copy;
+        stream_consume(client, n + 2);
+        if (n == 0) {
+            return out;
+        }
+    }
+}
+
+int stream_http_get(const char *host, int port, const char *path, char *body,
+                    size_t body_size, int timeout_ms) {
+    stream_client_t client;
+    if (stream_client_open(&client, host, port, path, 0, timeout_ms) != 0 &&
+        client.status == 0) {
+        stream_client_close(&client);
+        return -1;
+    }
+    int status = client.status;
+
+    // the answers of the demo carry a Content-Length or come in chunks
+    int64_t deadline = stream_now_us() + timeout_ms * 1000LL;
+    char none;
+    char *out = body && body_size > 0 ? body : &none;
+    size_t size = body && body_size > 0 ? body_size - 1 : 0;
+    size_t n;
+    if (client.chunked) {
+        int ret = stream_read_chunked(&client, out, size, deadline);
+        status = ret < 0 ? -1 : status;
+        n = ret < 0 ? 0 : ret;
+    } else {
+        if (client.content_len > 0 &&
+            stream_fill_to(&client, client.content_len, deadline) != 0) {
+            status = -1;
+        }
+        n = client.len < size ? client.len : size;
+        memcpy(out, client.buf, n);
+    }
+    out[n] = '\0';
+    stream_client_close(&client);
+    return status;
+}
+
+static int stream_free_port(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t len = sizeof(addr);
+    int port = -1;
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&addr, &len) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return port;
+}
+
+pid_t stream_server_spawn(const char *path, const char *host, int *port,
+                          int timeout_ms) {
+    if (*port == 0) {
+        *port = stream_free_port();
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        char value[16];
+        snprintf(value, sizeof(value), "%d", *port);
+        setenv("DEMO_HTTPD_PORT", value, 1);
+        setenv("DEMO_LOG_LEVEL", "W", 0);
+        execl(path, path, (char *)NULL);
+        perror(path);
+        _exit(127);
+    }
+    if (pid < 0) {
+        return -1;
+    }
+
+    int64_t deadline = stream_now_us() + timeout_ms * 1000LL;
+    while (stream_now_us() < deadline) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "server exited with %d\n", status);
+            return -1;
+        }
+        int fd = stream_connect(host, *port, 200);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        usleep(50 * 1000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    fprintf(stderr, "server did not listen on %d\n", *port);
+    return -1;
+}
+
+void stream_server_stop(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
@@ -0,0 +1,81 @@
+#ifndef _HOST_STREAM_CLIENT_H_
+#define _HOST_STREAM_CLIENT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Client side of /camera and /camera/ws for the host tools. Frames are
+ * read whole, the latency of a frame is taken when its last byte is in.
+ * Both ends run on one host: the multipart X-Timestamp is wall clock, the
+ * WebSocket capture_us is esp_timer_get_time, CLOCK_MONOTONIC in the host
+ * build, so either can be diffed against the local clock.
+ */
+
+typedef struct _stream_frame_t {
+    uint32_t seq;
+    size_t len;
+    int scaled;          // WebSocket only, CAM_WS_FLAG_SCALED
+    int shift;           // the scale the server applied, 1/(1 << shift)
+    int64_t latency_us;  // capture to the last byte received
+} stream_frame_t;
+
+typedef struct _stream_client_t {
+    int fd;
+    int ws;
+    int status;  // of the response, 101 or 200 once streaming
+    long content_len;  // -1 without a Content-Length
+    int chunked;       // Transfer-Encoding: chunked
+
+    uint8_t *buf;  // received, not yet parsed
+    size_t len;
+    size_t cap;
+
+    uint8_t *msg;  // WebSocket message being reassembled
+    size_t msg_len;
+    size_t msg_cap;
+} stream_client_t;
+
+/* CLOCK_MONOTONIC, the clock of esp_timer_get_time in the host build */
+int64_t stream_now_us(void);
+
+/* wall clock, the clock of X-Timestamp */
+int64_t stream_wall_us(void);
+
+/* TCP connect with a timeout, returns the socket or -1 */
+int stream_connect(const char *host, int port, int timeout_ms);
+
+/**
+ * GET path and read the response head, a WebSocket handshake if ws is set.
+ * Returns 0 when frames follow, -1 otherwise, client->status tells why.
+ */
+int stream_client_open(stream_client_t *client, const char *host, int port,
+                       const char *path, int ws, int timeout_ms);
+
+/* returns 1 with a frame, 0 on timeout, -1 when the stream ended */
+int stream_client_next(stream_client_t *client, stream_frame_t *frame,
+                       int timeout_ms);
+
+/* grant a WebSocket stream more frames */
+int stream_client_credit(stream_client_t *client, uint32_t credits);
+
+void stream_client_close(stream_client_t *client);
+
+/**
+ * a plain GET on a new connection, the body, de-chunked if need be, is cut
+ * to fit body_size. Returns the status code or -1.
+ */
+int stream_http_get(const char *host, int port, const char *path, char *body,
+                    size_t body_size, int timeout_ms);
+
+/**
+ * Run the server at path on port, a free one if *port is 0, with
+ * DEMO_HTTPD_PORT set. Returns its pid once it accepts connections or -1.
+ */
+pid_t stream_server_spawn(const char *path, const char *host, int *port,
+                          int timeout_ms);
+
+void stream_server_stop(pid_t pid);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _HOST_CHECK_H_
+#define _HOST_CHECK_H_
+
+#include <stdio.h>
+
+/**
+ * Just enough of a test framework for the host tests: a failed CHECK
+ * prints where and goes on, main returns host_check_result().
+ */
+
+static int host_check_failed;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++host_check_failed;                                           \
+        }                                                                  \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                     \
+    do {                                                                   \
+        long long _a = (long long)(a), _b = (long long)(b);                \
+        if (_a != _b) {                                                    \
+            printf("%s:%d: CHECK_EQ(%s, %s) failed, %lld != %lld\n",       \
+                   __FILE__, __LINE__, #a, #b, _a, _b);                    \
+            ++host_check_failed;                                           \
+        }                                                                  \
+    } while (0)
+
+#define RUN(test)                                                          \
+    do {                                                                   \
+        int _before = host_check_failed;                                   \
+        test();                                                            \
+        printf("%s %s\n", host_check_failed == _before ? "ok  " : "FAIL",  \
+               #test);                                                     \
+    } while (0)
+
+static inline int host_check_result(void) {
+    return host_check_failed ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,253 @@
+/**
+ * The motion gate on JPEG sequences. The scenes are drawn in grayscale and
+ * encoded with fmt2jpg, as the camera would deliver them, then fed to
+ * cam_motion_signature and cam_motion_update at 10 fps.
+ *
+ * With JPEG files as arguments it replays them instead and prints which
+ * frames the gate forwards, e.g. a sequence saved from /snapshot:
+ *   test_cam_motion snap-*.jpg
+ */
+
+#include "cam_motion.h"
+#include "host_check.h"
+#include "img_converters.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SCENE_W 320
+#define SCENE_H 240
+#define SCENE_QUALITY 60
+#define SCENE_PERIOD_US 100000LL  // 10 fps
+
+typedef struct _scene_t {
+    int noise;       // +-noise on every pixel, a new draw each frame
+    int brightness;  // added to the background
+    int square_x;    // 40x40 dark square, -1 for none
+    int square_y;
+    int blob_x;  // 8x8 bright blob, -1 for none
+    int blob_y;
+} scene_t;
+
+static uint8_t scene_gray[SCENE_W * SCENE_H];
+static unsigned int scene_seed = 1;
+
+static void scene_draw(const scene_t *scene) {
+    for (int y = 0; y < SCENE_H; ++y) {
+        for (int x = 0; x < SCENE_W; ++x) {
+            int v = 64 + (x + y) / 4 + scene->brightness;
+            if (scene->noise) {
+                v += rand_r(&scene_seed) % (2 * scene->noise + 1) -
+                     scene->noise;
+            }
+            if (scene->square_x >= 0 && x >= scene->square_x &&
+                x < scene->square_x + 40 && y >= scene->square_y &&
+                y < scene->square_y + 40) {
+                v = 20;
+            }
+            if (scene->blob_x >= 0 && x >= scene->blob_x &&
+                x < scene->blob_x + 8 && y >= scene->blob_y &&
+                y < scene->blob_y + 8) {
+                v = 250;
+            }
+            scene_gray[y * SCENE_W + x] = v < 0 ? 0 : v > 255 ? 255 : v;
+        }
+    }
+}
+
+static int motion_feed(cam_motion_gate_t *gate, uint8_t *jpg, size_t len,
+                       int64_t now) {
+    camera_fb_t fb = {
+        .buf = jpg,
+        .len = len,
+        .width = SCENE_W,
+        .height = SCENE_H,
+        .format = PIXFORMAT_JPEG,
+    };
+    cam_motion_sig_t sig;
+    esp_err_t err = cam_motion_signature(gate, &fb, &sig);
+    CHECK_EQ(err, ESP_OK);
+    return err == ESP_OK ? cam_motion_update(gate, &sig, now) : -1;
+}
+
+static int scene_feed(cam_motion_gate_t *gate, const scene_t *scene,
+                      int64_t now) {
+    scene_draw(scene);
+    uint8_t *jpg = NULL;
+    size_t len = 0;
+    if (!fmt2jpg(scene_gray, sizeof(scene_gray), SCENE_W, SCENE_H,
+                 PIXFORMAT_GRAYSCALE, SCENE_QUALITY, &jpg, &len)) {
+        CHECK(!"fmt2jpg failed");
+        return -1;
+    }
+    int forward = motion_feed(gate, jpg, len, now);
+    free(jpg);
+    return forward;
+}
+
+static const scene_t scene_still = {
+    .noise = 4,
+    .square_x = -1,
+    .blob_x = -1,
+};
+
+// sensor noise alone forwards only the first frame
+static void test_static_noise(void) {
+    cam_motion_gate_t gate;
+    cam_motion_init(&gate);
+    int forwarded = 0;
+    for (int i = 0; i < 40; ++i) {
+        forwarded += scene_feed(&gate, &scene_still, i * SCENE_PERIOD_US);
+    }
+    CHECK_EQ(forwarded, 1);
+}
+
+// a still scene still gets a frame out every CAM_MOTION_KEYFRAME_MS
+static void test_keyframe_floor(void) {
+    cam_motion_gate_t gate;
+    cam_motion_init(&gate);
+    int64_t keyframe_us = CAM_MOTION_KEYFRAME_MS * 1000LL;
+    int frames = (int)(keyframe_us * 12 / 5 / SCENE_PERIOD_US);  // 2.4 periods
+    int forwarded = 0;
+    int64_t last = -keyframe_us;
+    for (int i = 0; i < frames; ++i) {
+        int64_t now = i * SCENE_PERIOD_US;
+        if (scene_feed(&gate, &scene_still, now)) {
+            ++forwarded;
+            CHECK(now - last >= keyframe_us);
+            last = now;
+        }
+    }
+    CHECK_EQ(forwarded, 3);
+}
+
+// an object crossing several cells per frame forwards every frame
+static void test_moving_object(void) {
+    cam_motion_gate_t gate;
+    cam_motion_init(&gate);
+    scene_t scene = scene_still;
+    scene.square_y = 100;
+    int forwarded = 0;
+    for (int i = 0; i < 12; ++i) {
+        scene.square_x = i * 20;
+        forwarded += scene_feed(&gate, &scene, i * SCENE_PERIOD_US);
+    }
+    CHECK_EQ(forwarded, 12);
+}
+
+// changes confined to fewer than CAM_MOTION_MIN_CELLS cells are dropped
+static void test_small_object(void) {
+    cam_motion_gate_t gate;
+    cam_motion_init(&gate);
+    scene_t scene = scene_still;
+    scene.blob_y = 0;
+    int forwarded = 0;
+    for (int i = 0; i < 8; ++i) {
+        scene.blob_x = i * 40;  // two cells on, off one and onto another
+        forwarded += scene_feed(&gate, &scene, i * SCENE_PERIOD_US);
+    }
+    CHECK_EQ(forwarded, 1);
+}
+
+// a light switched on changes every cell once
+static void test_lighting_change(void) {
+    cam_motion_gate_t gate;
+    cam_motion_init(&gate);
+    scene_t scene = scene_still;
+    int forwarded = 0;
+    for (int i = 0; i < 20; ++i) {
+        scene.brightness = i < 10 ? 0 : 40;
+        forwarded += scene_feed(&gate, &scene, i * SCENE_PERIOD_US);
+    }
+    CHECK_EQ(forwarded, 2);
+}
+
+// DC terms of the JPEG give about the luma sampled from the raw frame.
+// The square sits on both the 8x8 block and the cell grid, the two paths
+// share out a block straddling a cell edge differently.
+static void test_jpeg_matches_raw(void) {
+    scene_t scene = scene_still;
+    scene.noise = 0;
+    scene.square_x = 160;
+    scene.square_y = 120;
+    scene_draw(&scene);
+
+    cam_motion_gate_t gate;
+    cam_motion_init(&gate);
+    camera_fb_t raw = {
+        .buf = scene_gray,
+        .len = sizeof(scene_gray),
+        .width = SCENE_W,
+        .height = SCENE_H,
+        .format = PIXFORMAT_GRAYSCALE,
+    };
+    cam_motion_sig_t from_raw, from_jpg;
+    CHECK_EQ(cam_motion_signature(&gate, &raw, &from_raw), ESP_OK);
+
+    uint8_t *jpg = NULL;
+    size_t len = 0;
+    CHECK(fmt2jpg(scene_gray, sizeof(scene_gray), SCENE_W, SCENE_H,
+                  PIXFORMAT_GRAYSCALE, SCENE_QUALITY, &jpg, &len));
+    camera_fb_t fb = {
+        .buf = jpg,
+        .len = len,
+        .width = SCENE_W,
+        .height = SCENE_H,
+        .format = PIXFORMAT_JPEG,
+    };
+    CHECK_EQ(cam_motion_signature(&gate, &fb, &from_jpg), ESP_OK);
+    free(jpg);
+
+    int worst = 0;
+    for (int i = 0; i < CAM_MOTION_CELLS; ++i) {
+        int diff = abs(from_raw.luma[i] - from_jpg.luma[i]);
+        worst = diff > worst ? diff : worst;
+    }
+    CHECK(worst <= CAM_MOTION_CELL_DIFF / 2);
+}
+
+static int replay(int count, char **paths) {
+    cam_motion_gate_t gate;
+    cam_motion_init(&gate);
+    int forwarded = 0;
+    for (int i = 0; i < count; ++i) {
+        FILE *f = fopen(paths[i], "rb");
+        if (f == NULL) {
+            perror(paths[i]);
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        long len = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        uint8_t *jpg = (uint8_t *)malloc(len > 0 ? len : 1);
+        if (jpg == NULL || fread(jpg, 1, len, f) != (size_t)len) {
+            fprintf(stderr, "%s: read failed\n", paths[i]);
+            fclose(f);
+            free(jpg);
+            return 1;
+        }
+        fclose(f);
+
+        int forward = motion_feed(&gate, jpg, len, i * SCENE_PERIOD_US);
+        free(jpg);
+        forwarded += forward > 0;
+        printf("%s %s\n",
+               forward > 0 ? "forward" : forward == 0 ? "drop   " : "error  ",
+               paths[i]);
+    }
+    printf("%d of %d forwarded\n", forwarded, count);
+    return host_check_result();
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        return replay(argc - 1, argv + 1);
+    }
+    RUN(test_static_noise);
+    RUN(test_keyframe_floor);
+    RUN(test_moving_object);
+    RUN(test_small_object);
+    RUN(test_lighting_change);
+    RUN(test_jpeg_matches_raw);
+    return host_check_result();
+}
@@ -0,0 +1,352 @@
+/**
+ * heap_track.c built with HEAP_TRACK 1 against stubs of its own: rc_malloc
+ * that can fail and can keep freed blocks readable, a heap whose free and
+ * largest block sizes the test sets, a clock it advances and a metrics
+ * registry that keeps the callbacks so the trend can be read the way
+ * /metrics reads it.
+ */
+
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "heap_track.h"
+#include "host_check.h"
+#include "metrics.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STUB_METRICS 16
+
+static int stub_malloc_fail;
+static size_t stub_malloc_size;  // of the last rc_malloc
+static int stub_keep_freed;      // rc_free leaves the block to the test
+static void *stub_kept;
+
+static size_t stub_free_bytes = 200 * 1024;
+static size_t stub_largest_free = 100 * 1024;
+static int64_t stub_now_us;
+
+static int stub_timers;
+static uint64_t stub_timer_period_us;
+
+typedef struct _stub_metric_t {
+    const char *name;
+    metric_value_fn value;
+    metric_item_fn item;
+    void *arg;
+    int count;
+} stub_metric_t;
+
+static stub_metric_t stub_metrics[STUB_METRICS];
+static int stub_metric_count;
+
+void *rc_malloc(size_t size) {
+    stub_malloc_size = size;
+    return stub_malloc_fail ? NULL : malloc(size);
+}
+
+void rc_free(void *ptr) {
+    if (stub_keep_freed) {
+        stub_kept = ptr;
+        return;
+    }
+    free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) { return stub_free_bytes; }
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return stub_largest_free;
+}
+
+int64_t esp_timer_get_time(void) { return stub_now_us; }
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                           esp_timer_handle_t *out_handle) {
+    ++stub_timers;
+    *out_handle = (esp_timer_handle_t)&stub_timers;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer,
+                                   uint64_t period_us) {
+    stub_timer_period_us = period_us;
+    return ESP_OK;
+}
+
+int metrics_register_value(const char *name, const char *help, int type,
+                           metric_value_fn fn, void *arg) {
+    if (stub_metric_count == STUB_METRICS) {
+        return -1;
+    }
+    stub_metrics[stub_metric_count++] = (stub_metric_t){
+        .name = name,
+        .value = fn,
+        .arg = arg,
+    };
+    return 0;
+}
+
+int metrics_register_family(const char *name, const char *help, int type,
+                            const char *label, int count, metric_item_fn item,
+                            void *arg) {
+    if (stub_metric_count == STUB_METRICS) {
+        return -1;
+    }
+    stub_metrics[stub_metric_count++] = (stub_metric_t){
+        .name = name,
+        .item = item,
+        .arg = arg,
+        .count = count,
+    };
+    return 0;
+}
+
+static const stub_metric_t *stub_metric(const char *name) {
+    for (int i = 0; i < stub_metric_count; ++i) {
+        if (strcmp(stub_metrics[i].name, name) == 0) {
+            return &stub_metrics[i];
+        }
+    }
+    return NULL;
+}
+
+static double metric_value(const char *name) {
+    const stub_metric_t *m = stub_metric(name);
+    CHECK(m != NULL && m->value != NULL);
+    return m && m->value ? m->value(m->arg) : -1;
+}
+
+static double metric_item(const char *name, int index) {
+    const stub_metric_t *m = stub_metric(name);
+    double value = -1;
+    CHECK(m != NULL && m->item != NULL && index < m->count);
+    if (m && m->item && index < m->count) {
+        CHECK_EQ(m->item(m->arg, index, &value), 0);
+    }
+    return value;
+}
+
+static heap_tag_stats_t tag_stats(heap_tag_t tag) {
+    heap_tag_stats_t stats;
+    heap_track_stats(tag, &stats);
+    return stats;
+}
+
+// metrics and the timer, one sample straight away
+static void test_init(void) {
+    stub_now_us = 5000000;
+    heap_track_init();
+    heap_track_init();  // a second call does nothing
+
+    CHECK_EQ(stub_timers, 1);
+    CHECK_EQ(stub_timer_period_us, HEAP_TRACK_SAMPLE_MS * 1000LL);
+    CHECK_EQ(stub_metric_count, 7);
+    CHECK(stub_metric("heap_live_bytes") != NULL);
+    CHECK_EQ(stub_metric("heap_class_allocs_total")->count,
+             HEAP_TRACK_CLASSES);
+
+    heap_sample_t samples[HEAP_TRACK_SAMPLES];
+    CHECK_EQ(heap_track_samples(samples, HEAP_TRACK_SAMPLES), 1);
+    CHECK_EQ(samples[0].time_us, 5000000);
+    CHECK_EQ(samples[0].free_bytes, stub_free_bytes);
+    CHECK_EQ(samples[0].largest_free, stub_largest_free);
+    CHECK_EQ(metric_value("heap_largest_free_trend_bytes_per_hour"), 0);
+}
+
+static void test_live_and_peak(void) {
+    void *a = HEAP_MALLOC(PLAYER, 100);
+    CHECK_EQ(stub_malloc_size, 100 + 8);  // the header in front
+    void *b = HEAP_MALLOC(PLAYER, 200);
+    CHECK(a != NULL && b != NULL);
+    CHECK_EQ((uintptr_t)a % 8, 0);
+    heap_tag_stats_t s = tag_stats(HEAP_TAG_PLAYER);
+    CHECK_EQ(s.live_bytes, 300);
+    CHECK_EQ(s.live_blocks, 2);
+    CHECK_EQ(s.peak_bytes, 300);
+    CHECK_EQ(s.allocs, 2);
+
+    HEAP_FREE(a);
+    void *c = HEAP_MALLOC(PLAYER, 50);
+    s = tag_stats(HEAP_TAG_PLAYER);
+    CHECK_EQ(s.live_bytes, 250);
+    CHECK_EQ(s.live_blocks, 2);
+    CHECK_EQ(s.peak_bytes, 300);  // the peak stays
+    CHECK_EQ(s.allocs, 3);
+    CHECK_EQ(metric_item("heap_live_bytes", HEAP_TAG_PLAYER), 250);
+    CHECK_EQ(metric_item("heap_peak_bytes", HEAP_TAG_PLAYER), 300);
+    CHECK_EQ(metric_item("heap_allocs_total", HEAP_TAG_PLAYER), 3);
+
+    HEAP_FREE(b);
+    HEAP_FREE(c);
+    HEAP_FREE(NULL);
+    s = tag_stats(HEAP_TAG_PLAYER);
+    CHECK_EQ(s.live_bytes, 0);
+    CHECK_EQ(s.live_blocks, 0);
+    CHECK_EQ(s.peak_bytes, 300);
+
+    // other tags are untouched
+    s = tag_stats(HEAP_TAG_BT_SCAN);
+    CHECK_EQ(s.allocs, 0);
+    CHECK_EQ(s.peak_bytes, 0);
+}
+
+// up to 16 bytes is class 0, each class doubles, the last takes the rest
+static void test_size_classes(void) {
+    static const struct {
+        size_t size;
+        int cls;
+    } cases[] = {
+        {1, 0},         {16, 0},   {17, 1},
+        {32, 1},        {33, 2},   {4096, 8},
+        {16 << 10, 10}, {(16 << 10) + 1, 11},
+        {1 << 20, 11},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        uint32_t before[HEAP_TRACK_CLASSES];
+        for (int c = 0; c < HEAP_TRACK_CLASSES; ++c) {
+            before[c] = heap_track_class_allocs(c);
+        }
+        HEAP_FREE(HEAP_MALLOC(OTHER, cases[i].size));
+        for (int c = 0; c < HEAP_TRACK_CLASSES; ++c) {
+            CHECK_EQ(heap_track_class_allocs(c) - before[c],
+                     c == cases[i].cls);
+        }
+    }
+    CHECK_EQ(heap_track_class_allocs(-1), 0);
+    CHECK_EQ(heap_track_class_allocs(HEAP_TRACK_CLASSES), 0);
+    CHECK_EQ(metric_item("heap_class_allocs_total", 11),
+             heap_track_class_allocs(11));
+}
+
+static void test_fails(void) {
+    heap_tag_stats_t before = tag_stats(HEAP_TAG_BT_SCAN);
+    stub_malloc_fail = 1;
+    CHECK(HEAP_MALLOC(BT_SCAN, 64) == NULL);
+    stub_malloc_fail = 0;
+
+    // too big for the header, rc_malloc is not even asked
+    stub_malloc_size = 0;
+    CHECK(HEAP_MALLOC(BT_SCAN, SIZE_MAX) == NULL);
+    CHECK_EQ(stub_malloc_size, 0);
+
+    heap_tag_stats_t s = tag_stats(HEAP_TAG_BT_SCAN);
+    CHECK_EQ(s.fails - before.fails, 2);
+    CHECK_EQ(s.allocs, before.allocs);
+    CHECK_EQ(s.live_bytes, before.live_bytes);
+    CHECK_EQ(s.live_blocks, before.live_blocks);
+}
+
+// buffers owned elsewhere, told in sizes
+static void test_resize(void) {
+    HEAP_RESIZE(CAM_JPG, 0, 1000);
+    heap_tag_stats_t s = tag_stats(HEAP_TAG_CAM_JPG);
+    CHECK_EQ(s.live_bytes, 1000);
+    CHECK_EQ(s.live_blocks, 1);
+    CHECK_EQ(s.allocs, 1);
+
+    uint32_t class_4k = heap_track_class_allocs(8);
+    HEAP_RESIZE(CAM_JPG, 1000, 4000);
+    s = tag_stats(HEAP_TAG_CAM_JPG);
+    CHECK_EQ(s.live_bytes, 4000);
+    CHECK_EQ(s.live_blocks, 1);
+    CHECK_EQ(s.peak_bytes, 4000);
+    CHECK_EQ(s.allocs, 2);  // a grow counts as an allocation
+    CHECK_EQ(heap_track_class_allocs(8) - class_4k, 1);
+
+    HEAP_RESIZE(CAM_JPG, 4000, 500);
+    HEAP_RESIZE(CAM_JPG, 500, 500);
+    s = tag_stats(HEAP_TAG_CAM_JPG);
+    CHECK_EQ(s.live_bytes, 500);
+    CHECK_EQ(s.peak_bytes, 4000);
+    CHECK_EQ(s.allocs, 2);
+
+    HEAP_RESIZE(CAM_JPG, 500, 0);
+    s = tag_stats(HEAP_TAG_CAM_JPG);
+    CHECK_EQ(s.live_bytes, 0);
+    CHECK_EQ(s.live_blocks, 0);
+}
+
+// a second free and a block from elsewhere leave the counters alone
+static void test_bad_free(void) {
+    stub_keep_freed = 1;
+    void *p = HEAP_MALLOC(BT_DEVTAB, 32);
+    HEAP_FREE(p);
+    HEAP_FREE(p);
+    stub_keep_freed = 0;
+    free(stub_kept);
+
+    uint64_t untracked[4] = {0};
+    HEAP_FREE(&untracked[1]);
+
+    heap_tag_stats_t s = tag_stats(HEAP_TAG_BT_DEVTAB);
+    CHECK_EQ(s.live_bytes, 0);
+    CHECK_EQ(s.live_blocks, 0);
+    CHECK_EQ(s.allocs, 1);
+}
+
+static void test_tags(void) {
+    CHECK(strcmp(heap_track_tag_name(HEAP_TAG_PLAYER), "player") == 0);
+    CHECK(strcmp(heap_track_tag_name(HEAP_TAG_MAX), "unknown") == 0);
+
+    heap_tag_stats_t before = tag_stats(HEAP_TAG_OTHER);
+    void *p = heap_track_malloc(HEAP_TAG_MAX, 10);  // counted as other
+    heap_tag_stats_t s = tag_stats(HEAP_TAG_OTHER);
+    CHECK_EQ(s.live_bytes - before.live_bytes, 10);
+    heap_track_free(p);
+
+    heap_track_stats(HEAP_TAG_MAX, &s);
+    CHECK_EQ(s.allocs, 0);
+}
+
+// the largest free block shrinking by 100 bytes every 10 s sample
+static void test_trend(void) {
+    int64_t period_us = HEAP_TRACK_SAMPLE_MS * 1000LL;
+    int total = HEAP_TRACK_SAMPLES + 8;
+    for (int i = 0; i < total; ++i) {
+        stub_now_us = 10000000 + i * period_us;
+        stub_largest_free = 100000 - i * 100;
+        heap_track_sample();
+    }
+
+    heap_sample_t samples[HEAP_TRACK_SAMPLES + 4];
+    int n = heap_track_samples(samples, HEAP_TRACK_SAMPLES + 4);
+    CHECK_EQ(n, HEAP_TRACK_SAMPLES);
+    int first = total - HEAP_TRACK_SAMPLES;  // the oldest still kept
+    CHECK_EQ(samples[0].time_us, 10000000 + first * period_us);
+    CHECK_EQ(samples[0].largest_free, 100000 - first * 100);
+    CHECK_EQ(samples[n - 1].largest_free, 100000 - (total - 1) * 100);
+    CHECK_EQ(heap_track_samples(samples, 3), 3);
+    CHECK_EQ(samples[2].largest_free, 100000 - (total - 1) * 100);
+    CHECK_EQ(heap_track_samples(samples, -1), 0);
+
+    double per_hour = -100.0 * 3600 / (period_us / 1e6);
+    double trend = metric_value("heap_largest_free_trend_bytes_per_hour");
+    CHECK(trend > per_hour - 0.01 && trend < per_hour + 0.01);
+    CHECK_EQ(metric_value("heap_largest_free_min_bytes"),
+             100000 - (total - 1) * 100);
+    CHECK_EQ(metric_value("heap_largest_free_bytes"), stub_largest_free);
+
+    // one low sample does not turn a steady heap into a falling one
+    for (int i = 0; i < HEAP_TRACK_SAMPLES; ++i) {
+        stub_now_us += period_us;
+        stub_largest_free = i == HEAP_TRACK_SAMPLES / 2 ? 50000 : 80000;
+        heap_track_sample();
+    }
+    trend = metric_value("heap_largest_free_trend_bytes_per_hour");
+    CHECK(trend > per_hour / 10 && trend < -per_hour / 10);
+    CHECK_EQ(metric_value("heap_largest_free_min_bytes"), 50000);
+}
+
+int main(void) {
+    RUN(test_init);
+    RUN(test_live_and_peak);
+    RUN(test_size_classes);
+    RUN(test_fails);
+    RUN(test_resize);
+    RUN(test_bad_free);
+    RUN(test_tags);
+    RUN(test_trend);
+    return host_check_result();
+}